@@ -16,6 +16,7 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "sockaddr.h"
@@ -81,15 +82,50 @@ check_useipaddr(void)
 		cache_flush();
 }
 
+static ino_t		last_inode;
+static int		last_fd = -1;
+static bool		reload_frozen;
+static struct xtab_reload_stats reload_stats;
+
+/**
+ * auth_reload_needed - check whether auth_reload() would reread etab
+ *
+ * Only looks at the file, so it is cheap enough to call before deciding
+ * whether to stop anything else using the export table.
+ */
+bool
+auth_reload_needed(void)
+{
+	struct stat		stb;
+
+	if (last_fd == -1 || stat(etab.statefn, &stb) < 0)
+		return true;
+	return stb.st_ino != last_inode;
+}
+
+/**
+ * auth_reload_freeze - keep the export table as it is
+ * @frozen: true while others may be reading the export table
+ *
+ * While frozen, auth_reload() only returns the current generation,
+ * even if etab changed.  The change is picked up once thawed.
+ */
+void
+auth_reload_freeze(bool frozen)
+{
+	reload_frozen = frozen;
+}
+
 unsigned int
 auth_reload(void)
 {
 	struct stat		stb;
-	static ino_t		last_inode;
-	static int		last_fd = -1;
+	struct timespec		start, end;
 	static unsigned int	counter;
 	int			fd;
 
+	if (reload_frozen && last_fd != -1)
+		return counter;
 	if ((fd = open(etab.statefn, O_RDONLY)) < 0) {
 		xlog(L_FATAL, "couldn't open %s", etab.statefn);
 	} else if (fstat(fd, &stb) < 0) {
@@ -114,17 +150,36 @@ auth_reload(void)
 		last_inode = stb.st_ino;
 	}
 
-	export_freeall();
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	memset(&my_client, 0, sizeof(my_client));
-	xtab_export_read();
+	xtab_export_update(&reload_stats, v4root_keep);
 	check_useipaddr();
 	v4root_set();
 
 	++counter;
 
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	reload_stats.generation = counter;
+	reload_stats.usecs = (end.tv_sec - start.tv_sec) * 1000000L +
+			     (end.tv_nsec - start.tv_nsec) / 1000;
+	xlog(D_GENERAL, "etab reload %u: %u entries, %u added, %u changed, "
+	     "%u removed in %lu usecs%s", counter, reload_stats.entries,
+	     reload_stats.added, reload_stats.changed, reload_stats.removed,
+	     reload_stats.usecs, reload_stats.image ? " from etab.bin" : "");
+
 	return counter;
 }
 
+/**
+ * auth_reload_stats - report what the last etab reload did
+ *
+ */
+const struct xtab_reload_stats *
+auth_reload_stats(void)
+{
+	return &reload_stats;
+}
+
 static char *get_client_ipaddr_name(const struct sockaddr *caller)
 {
 	char buf[INET6_ADDRSTRLEN + 1];
@@ -152,9 +207,9 @@ get_client_hostname(const struct sockaddr *caller, struct addrinfo *ai,
 	return strdup("DEFAULT");
 }
 
-bool ipaddr_client_matches(nfs_export *exp, struct addrinfo *ai)
+bool ipaddr_client_matches(nfs_export *exp, const struct client_set *clients)
 {
-	return client_check(exp->m_client, ai);
+	return client_set_member(clients, exp->m_client);
 }
 
 bool namelist_client_matches(nfs_export *exp, char *dom)
@@ -162,10 +217,11 @@ bool namelist_client_matches(nfs_export *exp, char *dom)
 	return client_member(dom, exp->m_client->m_hostname);
 }
 
-bool client_matches(nfs_export *exp, char *dom, struct addrinfo *ai)
+bool client_matches(nfs_export *exp, char *dom,
+		    const struct client_set *clients)
 {
 	if (is_ipaddr_client(dom))
-		return ipaddr_client_matches(exp, ai);
+		return ipaddr_client_matches(exp, clients);
 	return namelist_client_matches(exp, dom);
 }
 
@@ -175,6 +231,7 @@ auth_authenticate_newcache(const struct sockaddr *caller,
 			   const char *path, struct addrinfo *ai,
 			   enum auth_error *error)
 {
+	struct client_set *clients = NULL;
 	nfs_export *exp;
 	int i;
 
@@ -188,18 +245,22 @@ auth_authenticate_newcache(const struct sockaddr *caller,
 	set_addrlist(&my_client, 0, caller);
 	my_exp.m_client = &my_client;
 
+	if (is_ipaddr_client(my_client.m_hostname))
+		clients = client_match(ai);
+
 	exp = NULL;
 	for (i = 0; !exp && i < MCL_MAXTYPES; i++)
 		for (exp = exportlist[i].p_head; exp; exp = exp->m_next) {
 			if (strcmp(path, exp->m_export.e_path))
 				continue;
-			if (!client_matches(exp, my_client.m_hostname, ai))
+			if (!client_matches(exp, my_client.m_hostname, clients))
 				continue;
 			if (exp->m_export.e_flags & NFSEXP_V4ROOT)
 				/* not acceptable for v[23] export */
 				continue;
 			break;
 		}
+	client_set_free(clients);
 	*error = not_exported;
 	if (!exp)
 		return NULL;
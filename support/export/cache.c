@@ -13,9 +13,13 @@
 #include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
 #include <sys/stat.h>
 #include <sys/vfs.h>
 #include <sys/wait.h>
+#include <poll.h>
 #include <time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -23,9 +27,8 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <ctype.h>
-#include <pwd.h>
-#include <grp.h>
 #include <mntent.h>
+#include <pthread.h>
 #include "misc.h"
 #include "nfsd_path.h"
 #include "nfslib.h"
@@ -35,6 +38,7 @@
 #include "xcommon.h"
 #include "reexport.h"
 #include "fsloc.h"
+#include "workqueue.h"
 
 #ifdef USE_BLKID
 #include "blkid/blkid.h"
@@ -51,9 +55,23 @@ enum nfsd_fsid {
 	FSID_UUID16_INUM,
 };
 
+static bool mount_snapshot_contains(const char *path);
+static bool mount_snapshot_fresh(void);
+static unsigned int upcall_refresh(void);
+static void cache_warm_check(void);
+static bool cache_warm_pending(void);
+
 #undef is_mountpoint
+/*
+ * A path the mount table snapshot lists is a mountpoint, as long as the
+ * table has not changed since the snapshot was taken.  Anything else is
+ * left to check_is_mountpoint(): btrfs subvolumes and paths reached
+ * through a symlink are mountpoints the table does not name.
+ */
 static int is_mountpoint(const char *path)
 {
+	if (mount_snapshot_contains(path) && mount_snapshot_fresh())
+		return 1;
 	return check_is_mountpoint(path, nfsd_path_lstat);
 }
 
@@ -89,11 +107,9 @@ static bool path_lookup_error(int err)
  *
  */
 
-#define INITIAL_MANAGED_GROUPS 100
-
 extern int use_ipaddr;
 
-static void auth_unix_ip(int f)
+static void auth_unix_ip(int f, char *inbuf, int UNUSED(inlen))
 {
 	/* requests are
 	 *  class IP-ADDR
@@ -108,28 +124,27 @@ static void auth_unix_ip(int f)
 	struct addrinfo *ai = NULL;
 	struct addrinfo *tmp = NULL;
 	char buf[RPC_CHAN_BUF_SIZE], *bp;
+	struct cachestats_timer st;
 	int blen;
 
-	blen = read(f, buf, sizeof(buf));
-	if (blen <= 0 || buf[blen-1] != '\n') return;
-	buf[blen-1] = 0;
-
-	xlog(D_CALL, "auth_unix_ip: inbuf '%s'", buf);
+	xlog(D_CALL, "auth_unix_ip: inbuf '%s'", inbuf);
 
-	bp = buf;
+	cachestats_start(&st, CS_IP);
+	bp = inbuf;
 
 	if (qword_get(&bp, class, 20) <= 0 ||
 	    strcmp(class, "nfsd") != 0)
-		return;
+		goto failed;
 
 	if (qword_get(&bp, ipaddr, sizeof(ipaddr) - 1) <= 0)
-		return;
+		goto failed;
 
 	tmp = host_pton(ipaddr);
 	if (tmp == NULL)
-		return;
+		goto failed;
 
-	auth_reload();
+	upcall_refresh();
+	cachestats_phase(&st, CS_PARSE);
 
 	/* addr is a valid address, find the domain name... */
 	ai = client_resolve(tmp->ai_addr);
@@ -137,6 +152,7 @@ static void auth_unix_ip(int f)
 		client = client_compose(ai);
 		nfs_freeaddrinfo(ai);
 	}
+	cachestats_phase(&st, CS_CLIENT);
 	if (!client)
 		xlog(D_AUTH, "failed authentication for IP %s", ipaddr);
 	else if	(!use_ipaddr)
@@ -157,17 +173,25 @@ static void auth_unix_ip(int f)
 	} else if (client)
 		qword_add(&bp, &blen, *client?client:"DEFAULT");
 	qword_addeol(&bp, &blen);
-	if (blen <= 0 || write(f, buf, bp - buf) != bp - buf)
+	if (blen <= 0 || write(f, buf, bp - buf) != bp - buf) {
 		xlog(L_ERROR, "auth_unix_ip: error writing reply");
+		cachestats_done(&st, CS_FAILED);
+	} else {
+		cachestats_phase(&st, CS_REPLY);
+		cachestats_done(&st, client ? CS_HITS : CS_DENIED);
+	}
 
 	xlog(D_CALL, "auth_unix_ip: client %p '%s'", client, client?client: "DEFAULT");
 
 	free(client);
 	nfs_freeaddrinfo(tmp);
+	return;
 
+failed:
+	cachestats_done(&st, CS_FAILED);
 }
 
-static void auth_unix_gid(int f)
+static void auth_unix_gid(int f, char *inbuf, int UNUSED(inlen))
 {
 	/* Request are
 	 *  uid
@@ -175,63 +199,43 @@ static void auth_unix_gid(int f)
 	 *  uid expiry count list of group ids
 	 */
 	uid_t uid;
-	struct passwd *pw;
-	static gid_t *groups = NULL;
-	static int groups_len = 0;
-	gid_t *more_groups;
-	int ngroups;
-	int rv, i;
+	gid_t *groups = NULL;
+	time_t expires;
+	int ngroups, i;
 	char buf[RPC_CHAN_BUF_SIZE], *bp;
+	struct cachestats_timer st;
 	int blen;
 
-	if (groups_len == 0) {
-		groups = malloc(sizeof(gid_t) * INITIAL_MANAGED_GROUPS);
-		if (!groups)
-			return;
-
-		groups_len = INITIAL_MANAGED_GROUPS;
-	}
-
-	ngroups = groups_len;
-
-	blen = read(f, buf, sizeof(buf));
-	if (blen <= 0 || buf[blen-1] != '\n') return;
-	buf[blen-1] = 0;
+	cachestats_start(&st, CS_GID);
 
-	bp = buf;
-	if (qword_get_uint(&bp, &uid) != 0)
+	bp = inbuf;
+	if (qword_get_uint(&bp, &uid) != 0) {
+		cachestats_done(&st, CS_FAILED);
 		return;
-
-	pw = getpwuid(uid);
-	if (!pw)
-		rv = -1;
-	else {
-		rv = getgrouplist(pw->pw_name, pw->pw_gid, groups, &ngroups);
-		if (rv == -1 && ngroups >= groups_len) {
-			more_groups = realloc(groups, sizeof(gid_t)*ngroups);
-			if (!more_groups)
-				rv = -1;
-			else {
-				groups = more_groups;
-				groups_len = ngroups;
-				rv = getgrouplist(pw->pw_name, pw->pw_gid,
-						  groups, &ngroups);
-			}
-		}
 	}
+	cachestats_phase(&st, CS_PARSE);
+
+	ngroups = gidcache_lookup(uid, &groups, &expires);
+	cachestats_phase(&st, CS_MATCH);
 
 	bp = buf; blen = sizeof(buf);
 	qword_adduint(&bp, &blen, uid);
-	qword_adduint(&bp, &blen, time(0) + default_ttl);
-	if (rv >= 0) {
+	qword_adduint(&bp, &blen, expires);
+	if (ngroups >= 0) {
 		qword_adduint(&bp, &blen, ngroups);
 		for (i=0; i<ngroups; i++)
 			qword_adduint(&bp, &blen, groups[i]);
 	} else
 		qword_adduint(&bp, &blen, 0);
 	qword_addeol(&bp, &blen);
-	if (blen <= 0 || write(f, buf, bp - buf) != bp - buf)
+	if (blen <= 0 || write(f, buf, bp - buf) != bp - buf) {
 		xlog(L_ERROR, "auth_unix_gid: error writing reply");
+		cachestats_done(&st, CS_FAILED);
+	} else {
+		cachestats_phase(&st, CS_REPLY);
+		cachestats_done(&st, ngroups >= 0 ? CS_HITS : CS_DENIED);
+	}
+	free(groups);
 }
 
 static int match_crossmnt_fsidnum(uint32_t parsed_fsidnum, char *path)
@@ -245,48 +249,67 @@ static int match_crossmnt_fsidnum(uint32_t parsed_fsidnum, char *path)
 }
 
 #ifdef USE_BLKID
-static const char *get_uuid_blkdev(char *path)
+/*
+ * Returns a copy of the blkid UUID of the device holding @path, or NULL
+ * with errno set to ENOMEM if the copy could not be made.
+ */
+static char *get_uuid_blkdev(char *path)
 {
 	/* We set *safe if we know that we need the
 	 * fsid from statfs too.
 	 */
 	static blkid_cache cache = NULL;
+	static pthread_mutex_t blkid_lock = PTHREAD_MUTEX_INITIALIZER;
 	struct stat stb;
 	char *devname;
 	blkid_tag_iterate iter;
 	blkid_dev dev;
 	const char *type;
-	const char *val, *uuid = NULL;
-
-	if (cache == NULL)
-		blkid_get_cache(&cache, NULL);
+	const char *val;
+	char *uuid = NULL;
+	int err = 0;
 
 	if (nfsd_path_stat(path, &stb) != 0)
 		return NULL;
 	devname = blkid_devno_to_devname(stb.st_dev);
 	if (!devname)
 		return NULL;
+
+	/* libblkid's cache is not safe to share between threads */
+	pthread_mutex_lock(&blkid_lock);
+	if (cache == NULL)
+		blkid_get_cache(&cache, NULL);
 	dev = blkid_get_dev(cache, devname, BLKID_DEV_NORMAL);
 	free(devname);
 	if (!dev)
-		return NULL;
+		goto out;
 	iter = blkid_tag_iterate_begin(dev);
 	if (!iter)
-		return NULL;
+		goto out;
 	while (blkid_tag_next(iter, &type, &val) == 0) {
-		if (strcmp(type, "UUID") == 0)
-			uuid = val;
+		if (strcmp(type, "UUID") == 0) {
+			free(uuid);
+			uuid = strdup(val);
+			if (!uuid) {
+				err = ENOMEM;
+				break;
+			}
+		}
 		if (strcmp(type, "TYPE") == 0 &&
 		    strcmp(val, "btrfs") == 0) {
+			free(uuid);
 			uuid = NULL;
 			break;
 		}
 	}
 	blkid_tag_iterate_end(iter);
+out:
+	pthread_mutex_unlock(&blkid_lock);
+	errno = err;
 	return uuid;
 }
 #else
-#define get_uuid_blkdev(path) (NULL)
+#define get_uuid_blkdev(path) (errno = 0, (char *)NULL)
 #endif
 
 static int get_uuid(const char *val, size_t uuidlen, char *u)
@@ -340,6 +363,475 @@ static const unsigned long nonblkid_filesystems[] = {
     0        /* last */
 };
 
+/*
+ * The kernel flags /proc/self/mountinfo with POLLPRI whenever the
+ * mount table changes, and polling it clears the flag again.  Anything
+ * derived from the mount table is tagged with mount_generation and
+ * recomputed when it changes.  Only cache_refresh_mounts() moves the
+ * generation on, so it stays put while an upcall is being handled.
+ *
+ * The file is opened on first use, after cache_fork_workers(), as every
+ * open file has its own event state and workers must not share it.
+ */
+static unsigned int mount_generation;
+static bool mountinfo_changed;
+
+/* Returns true if the mount table may have changed since it was last read */
+static bool mountinfo_poll(void)
+{
+	static int mountinfo_fd = -1;
+	struct pollfd pfd;
+
+	if (mountinfo_fd < 0) {
+		mountinfo_fd = open("/proc/self/mountinfo",
+				    O_RDONLY | O_CLOEXEC);
+		/* Each attempt to open it counts as a change, so if
+		 * that fails nothing derived from it is ever reused.
+		 */
+		mountinfo_changed = true;
+		return true;
+	}
+
+	pfd.fd = mountinfo_fd;
+	pfd.events = POLLPRI;
+	pfd.revents = 0;
+	if (poll(&pfd, 1, 0) != 0)
+		mountinfo_changed = true;
+	return mountinfo_changed;
+}
+
+/*
+ * The mount table as last read from /proc/self/mountinfo, sorted by
+ * mount id, so that a change can be narrowed down to the mounts that
+ * appeared, went away or were changed (remounted, moved, ...).  Only
+ * what was derived from those has to be worked out again.
+ */
+struct mount_rec {
+	int		id;
+	uint64_t	hash;		/* of the whole mountinfo line */
+	char		*dir;		/* below the nfsd root, or NULL */
+};
+
+static struct {
+	bool		valid;
+	struct mount_rec *recs;
+	size_t		count;
+} mount_table;
+
+/*
+ * What a mount table change touched.  Each changed mount is listed by
+ * id, once with its old and once with its new mount point if it moved.
+ * If @all is set there was nothing to compare with and everything
+ * derived from the mount table has to be worked out again.
+ */
+struct mount_change {
+	bool		all;
+	struct mount_rec *recs;		/* sorted by id */
+	size_t		count;
+};
+
+static void mount_recs_free(struct mount_rec *recs, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		free(recs[i].dir);
+	free(recs);
+}
+
+static int mount_rec_cmp(const void *a, const void *b)
+{
+	const struct mount_rec *ra = a, *rb = b;
+
+	return (ra->id > rb->id) - (ra->id < rb->id);
+}
+
+static uint64_t mountinfo_hash(const char *line)
+{
+	uint64_t hash = 14695981039346656037ULL;
+
+	while (*line)
+		hash = (hash ^ (unsigned char)*line++) * 1099511628211ULL;
+	return hash;
+}
+
+/* Undo the octal escapes mountinfo uses for blanks and backslashes */
+static void mountinfo_unescape(char *s)
+{
+	char *d = s;
+
+	while (*s) {
+		if (s[0] == '\\' && s[1] >= '0' && s[1] <= '3' &&
+		    s[2] >= '0' && s[2] <= '7' && s[3] >= '0' && s[3] <= '7') {
+			*d++ = (s[1] - '0') << 6 | (s[2] - '0') << 3 |
+			       (s[3] - '0');
+			s += 4;
+		} else
+			*d++ = *s++;
+	}
+	*d = '\0';
+}
+
+static int mount_table_read(struct mount_rec **recsp, size_t *countp)
+{
+	struct mount_rec *recs = NULL, *new;
+	size_t count = 0, size = 0, len = 0;
+	char *line = NULL, *dir, *root;
+	int i, id;
+	FILE *f;
+
+	f = fopen("/proc/self/mountinfo", "re");
+	if (f == NULL)
+		return -1;
+	while (getline(&line, &len, f) > 0) {
+		if (sscanf(line, "%d", &id) != 1)
+			continue;
+		/* Field 5 is the mount point */
+		for (dir = line, i = 0; dir && i < 4; i++)
+			if ((dir = strchr(dir, ' ')) != NULL)
+				dir++;
+		if (dir == NULL)
+			continue;
+		if (count == size) {
+			size = size ? size * 2 : 64;
+			new = realloc(recs, size * sizeof(*recs));
+			if (new == NULL)
+				goto out_nomem;
+			recs = new;
+		}
+		recs[count].id = id;
+		recs[count].hash = mountinfo_hash(line);
+		recs[count].dir = NULL;
+		dir[strcspn(dir, " \n")] = '\0';
+		mountinfo_unescape(dir);
+		root = nfsd_path_strip_root(dir);
+		if (root) {
+			recs[count].dir = strdup(root);
+			if (recs[count].dir == NULL)
+				goto out_nomem;
+		}
+		count++;
+	}
+	free(line);
+	fclose(f);
+
+	qsort(recs, count, sizeof(*recs), mount_rec_cmp);
+	*recsp = recs;
+	*countp = count;
+	return 0;
+
+out_nomem:
+	free(line);
+	fclose(f);
+	mount_recs_free(recs, count);
+	return -1;
+}
+
+static int mount_change_add(struct mount_change *ch, size_t *size,
+			    const struct mount_rec *rec)
+{
+	struct mount_rec *new;
+
+	if (ch->count == *size) {
+		*size = *size ? *size * 2 : 16;
+		new = realloc(ch->recs, *size * sizeof(*ch->recs));
+		if (new == NULL)
+			return -1;
+		ch->recs = new;
+	}
+	new = &ch->recs[ch->count];
+	new->id = rec->id;
+	new->hash = rec->hash;
+	new->dir = NULL;
+	if (rec->dir && (new->dir = strdup(rec->dir)) == NULL)
+		return -1;
+	ch->count++;
+	return 0;
+}
+
+static void mount_change_free(struct mount_change *ch)
+{
+	mount_recs_free(ch->recs, ch->count);
+	memset(ch, 0, sizeof(*ch));
+}
+
+/*
+ * Read the mount table again, and work out in @ch what changed since
+ * the last time.  Both lists are sorted by id, so @ch comes out sorted
+ * as well.
+ */
+static void mount_table_update(struct mount_change *ch)
+{
+	struct mount_rec *recs, *old, *new;
+	size_t count, i = 0, j = 0, size = 0;
+	int ret = 0;
+
+	memset(ch, 0, sizeof(*ch));
+	if (mount_table_read(&recs, &count) < 0) {
+		xlog(L_WARNING, "mount table: cannot read mountinfo");
+		mount_recs_free(mount_table.recs, mount_table.count);
+		memset(&mount_table, 0, sizeof(mount_table));
+		ch->all = true;
+		return;
+	}
+
+	if (!mount_table.valid)
+		ch->all = true;
+	while (!ch->all && ret == 0 && (i < mount_table.count || j < count)) {
+		old = i < mount_table.count ? &mount_table.recs[i] : NULL;
+		new = j < count ? &recs[j] : NULL;
+		if (old && (!new || old->id < new->id)) {
+			ret = mount_change_add(ch, &size, old);
+			i++;
+		} else if (!old || new->id < old->id) {
+			ret = mount_change_add(ch, &size, new);
+			j++;
+		} else {
+			if (old->hash != new->hash &&
+			    (ret = mount_change_add(ch, &size, old)) == 0)
+				ret = mount_change_add(ch, &size, new);
+			i++;
+			j++;
+		}
+	}
+	if (ret < 0) {
+		mount_change_free(ch);
+		ch->all = true;
+	}
+
+	mount_recs_free(mount_table.recs, mount_table.count);
+	mount_table.recs = recs;
+	mount_table.count = count;
+	mount_table.valid = true;
+	if (!ch->all)
+		xlog(D_GENERAL, "mount table: %zu of %zu mounts changed",
+		     ch->count, count);
+}
+
+/* Was mount @id one of those that changed? */
+static bool mount_change_has_id(const struct mount_change *ch, int id)
+{
+	struct mount_rec key = { .id = id };
+
+	if (ch->all || id < 0)
+		return true;
+	return bsearch(&key, ch->recs, ch->count, sizeof(*ch->recs),
+		       mount_rec_cmp) != NULL;
+}
+
+/* Could a changed mount be what @path, or a directory above it, is on? */
+static bool mount_change_covers(const struct mount_change *ch,
+				const char *path)
+{
+	size_t i, len;
+
+	if (ch->all)
+		return true;
+	for (i = 0; i < ch->count; i++) {
+		if (ch->recs[i].dir == NULL)
+			continue;
+		len = strlen(ch->recs[i].dir);
+		if (len == 1 && ch->recs[i].dir[0] == '/')
+			return true;
+		if (strncmp(path, ch->recs[i].dir, len) == 0 &&
+		    (path[len] == '\0' || path[len] == '/'))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Cache of the identifiers uuid_by_path() derives for each filesystem,
+ * keyed by device number and mount id.  Looking these up involves
+ * statfs() and libblkid, which can wake up spun-down disks or hang on
+ * an unresponsive re-exported NFS mount, and the answer only changes
+ * when the mount table does.
+ */
+#define UUID_CACHE_SIZE	1024
+
+struct uuid_cache_ent {
+	struct uuid_cache_ent	*next;
+	dev_t			dev;
+	int			mnt_id;
+	char			*blkid_val;
+	char			fsid_val[17];
+};
+
+static struct {
+	struct uuid_cache_ent	*buckets[UUID_CACHE_SIZE];
+	unsigned int		entries;
+	unsigned long		hits;
+	unsigned long		misses;
+	unsigned long		dropped;
+	pthread_mutex_t		lock;
+} uuid_cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/*
+ * Log the counters and every cached entry under the "general" debug
+ * facility.
+ */
+static void uuid_cache_dump(void)
+{
+	struct uuid_cache_ent *ent;
+	int i;
+
+	if (!xlog_enabled(D_GENERAL))
+		return;
+
+	xlog(D_GENERAL, "uuid cache: %u entries "
+	     "(%lu hits, %lu misses, %lu dropped)",
+	     uuid_cache.entries, uuid_cache.hits,
+	     uuid_cache.misses, uuid_cache.dropped);
+	for (i = 0; i < UUID_CACHE_SIZE; i++)
+		for (ent = uuid_cache.buckets[i]; ent; ent = ent->next)
+			xlog(D_GENERAL, "uuid cache:   dev %u:%u mnt_id %d "
+			     "blkid %s fsid %s",
+			     major(ent->dev), minor(ent->dev), ent->mnt_id,
+			     ent->blkid_val ? ent->blkid_val : "-",
+			     ent->fsid_val[0] ? ent->fsid_val : "-");
+}
+
+/*
+ * Forget what was cached for the mounts in @ch.  Entries whose mount id
+ * could not be told are dropped on every change, as there is no way to
+ * tell whether it concerned them.
+ */
+static void uuid_cache_prune(const struct mount_change *ch)
+{
+	struct uuid_cache_ent *ent, **entp;
+	int i;
+
+	if (uuid_cache.entries)
+		uuid_cache_dump();
+
+	for (i = 0; i < UUID_CACHE_SIZE; i++) {
+		for (entp = &uuid_cache.buckets[i]; (ent = *entp) != NULL; ) {
+			if (!mount_change_has_id(ch, ent->mnt_id)) {
+				entp = &ent->next;
+				continue;
+			}
+			*entp = ent->next;
+			free(ent->blkid_val);
+			free(ent);
+			uuid_cache.entries--;
+			uuid_cache.dropped++;
+		}
+	}
+}
+
+/* The mount id of @path, or -1 if it cannot be told */
+static int path_mnt_id(const char *path)
+{
+	struct {
+		struct file_handle fh;
+		unsigned char handle[128];
+	} fh;
+	int mnt_id;
+
+	fh.fh.handle_bytes = sizeof(fh.handle);
+	if (nfsd_name_to_handle_at(AT_FDCWD, path, &fh.fh, &mnt_id, 0) != 0)
+		return -1;
+	return mnt_id;
+}
+
+static int uuid_cache_key(char *path, dev_t *dev, int *mnt_id)
+{
+	struct stat stb;
+
+	if (nfsd_path_stat(path, &stb) != 0)
+		return -1;
+	*dev = stb.st_dev;
+	*mnt_id = path_mnt_id(path);
+	return 0;
+}
+
+static struct uuid_cache_ent *uuid_cache_find(struct uuid_cache_ent *ent,
+					      dev_t dev, int mnt_id)
+{
+	for (; ent; ent = ent->next)
+		if (ent->dev == dev && ent->mnt_id == mnt_id)
+			return ent;
+	return NULL;
+}
+
+/*
+ * Look up the identifiers of the filesystem that @path is on, probing
+ * and caching them if necessary.  Returns NULL if they could not be
+ * determined.
+ *
+ * Entries are only freed by uuid_cache_prune(), which never runs while
+ * an upcall is being handled, so the result stays valid until the
+ * upcall is done.  The probing is done without the lock held, as it
+ * may block for a long time.
+ */
+static struct uuid_cache_ent *uuid_cache_lookup(char *path)
+{
+	struct uuid_cache_ent *ent, *old, **bucket;
+	struct statfs st;
+	const unsigned long *bad;
+	dev_t dev;
+	int mnt_id;
+
+	if (uuid_cache_key(path, &dev, &mnt_id) != 0)
+		return NULL;
+
+	bucket = &uuid_cache.buckets[((unsigned int)dev ^ (unsigned int)mnt_id)
+				     % UUID_CACHE_SIZE];
+	pthread_mutex_lock(&uuid_cache.lock);
+	ent = uuid_cache_find(*bucket, dev, mnt_id);
+	if (ent)
+		uuid_cache.hits++;
+	else
+		uuid_cache.misses++;
+	pthread_mutex_unlock(&uuid_cache.lock);
+	if (ent)
+		return ent;
+
+	if (nfsd_path_statfs(path, &st) != 0)
+		/* Might be transient, so don't remember it */
+		return NULL;
+
+	ent = calloc(1, sizeof(*ent));
+	if (ent == NULL)
+		return NULL;
+	ent->dev = dev;
+	ent->mnt_id = mnt_id;
+
+	for (bad = nonblkid_filesystems; *bad; bad++) {
+		if (*bad == (unsigned long)st.f_type)
+			break;
+	}
+	if (*bad == 0) {
+		ent->blkid_val = get_uuid_blkdev(path);
+		if (ent->blkid_val == NULL && errno == ENOMEM) {
+			free(ent);
+			return NULL;
+		}
+	}
+
+	if (st.f_fsid.__val[0] || st.f_fsid.__val[1])
+		snprintf(ent->fsid_val, sizeof(ent->fsid_val), "%08x%08x",
+			 st.f_fsid.__val[0], st.f_fsid.__val[1]);
+
+	pthread_mutex_lock(&uuid_cache.lock);
+	/* Another thread may have probed the same filesystem meanwhile */
+	old = uuid_cache_find(*bucket, dev, mnt_id);
+	if (old == NULL) {
+		ent->next = *bucket;
+		*bucket = ent;
+		uuid_cache.entries++;
+	}
+	pthread_mutex_unlock(&uuid_cache.lock);
+	if (old) {
+		free(ent->blkid_val);
+		free(ent);
+		ent = old;
+	}
+	return ent;
+}
+
 static int uuid_by_path(char *path, int type, size_t uuidlen, char *uuid)
 {
 	/* get a uuid for the filesystem found at 'path'.
@@ -369,35 +861,22 @@ static int uuid_by_path(char *path, int type, size_t uuidlen, char *uuid)
 	 * a uuid for filesystems where the statfs uuid is better.
 	 *
 	 */
-	struct statfs st;
-	char fsid_val[17];
+	struct uuid_cache_ent *ent;
 	const char *blkid_val = NULL;
 	const char *val;
-	int rc;
-
-	rc = nfsd_path_statfs(path, &st);
 
-	if (type == 0 && rc == 0) {
-		const unsigned long *bad;
-		for (bad = nonblkid_filesystems; *bad; bad++) {
-			if (*bad == (unsigned long)st.f_type)
-				break;
-		}
-		if (*bad == 0)
-			blkid_val = get_uuid_blkdev(path);
-	}
+	ent = uuid_cache_lookup(path);
+	if (ent == NULL)
+		return 0;
 
-	if (rc == 0 &&
-	    (st.f_fsid.__val[0] || st.f_fsid.__val[1]))
-		snprintf(fsid_val, 17, "%08x%08x",
-			 st.f_fsid.__val[0], st.f_fsid.__val[1]);
-	else
-		fsid_val[0] = 0;
+	/* libblkid is only asked for type 0 */
+	if (type == 0)
+		blkid_val = ent->blkid_val;
 
 	if (blkid_val && (type--) == 0)
 		val = blkid_val;
-	else if (fsid_val[0] && (type--) == 0)
-		val = fsid_val;
+	else if (ent->fsid_val[0] && (type--) == 0)
+		val = ent->fsid_val;
 	else
 		return 0;
 
@@ -405,57 +884,247 @@ static int uuid_by_path(char *path, int type, size_t uuidlen, char *uuid)
 	return 1;
 }
 
-/* Iterate through /etc/mtab, finding mountpoints
- * at or below a given path
+/*
+ * Snapshot of the mount table, as a sorted array of mount points.  All
+ * the mount points below a directory form one contiguous range of it,
+ * so finding the submounts of a crossmnt export is a binary search
+ * rather than a full read of /etc/mtab for every export on every upcall.
+ *
+ * The snapshot is only refreshed by mount_snapshot_update(), from
+ * cache_refresh_mounts(), so it stays put while an upcall walks it.
  */
-static char *next_mnt(void **v, char *p)
+static struct {
+	unsigned int	generation;
+	bool		valid;
+	char		**dirs;
+	size_t		count;
+} mounts;
+
+static int mount_dir_cmp(const void *a, const void *b)
 {
-	FILE *f;
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static void mount_snapshot_free(void)
+{
+	size_t i;
+
+	for (i = 0; i < mounts.count; i++)
+		free(mounts.dirs[i]);
+	free(mounts.dirs);
+	mounts.dirs = NULL;
+	mounts.count = 0;
+	mounts.valid = false;
+}
+
+static void mount_snapshot_update(void)
+{
+	unsigned int generation = mount_generation;
 	struct mntent *me;
-	size_t l = strlen(p);
+	size_t size = 0, i, j;
+	char **dirs;
+	FILE *f;
 
-	if (*v == NULL) {
-		f = setmntent("/etc/mtab", "r");
-		*v = f;
-	} else
-		f = *v;
-	while ((me = getmntent(f)) != NULL && l >= 1) {
+	if (mounts.valid && mounts.generation == generation)
+		return;
+
+	mount_snapshot_free();
+	f = setmntent("/etc/mtab", "r");
+	if (f == NULL)
+		return;
+	while ((me = getmntent(f)) != NULL) {
 		char *mnt_dir = nfsd_path_strip_root(me->mnt_dir);
 
 		if (!mnt_dir)
 			continue;
+		if (mounts.count == size) {
+			size = size ? size * 2 : 64;
+			dirs = realloc(mounts.dirs, size * sizeof(*dirs));
+			if (dirs == NULL)
+				goto out_nomem;
+			mounts.dirs = dirs;
+		}
+		mounts.dirs[mounts.count] = strdup(mnt_dir);
+		if (mounts.dirs[mounts.count] == NULL)
+			goto out_nomem;
+		mounts.count++;
+	}
+	endmntent(f);
 
-		/* Everything below "/" is a proper sub-mount */
-		if (strcmp(p, "/") == 0)
-			return mnt_dir;
-
-		if (strncmp(mnt_dir, p, l) == 0 && mnt_dir[l] == '/')
-			return mnt_dir;
+	if (mounts.count)
+		qsort(mounts.dirs, mounts.count, sizeof(*mounts.dirs),
+		      mount_dir_cmp);
+	/* Stacked mounts show up more than once */
+	for (i = j = 0; i < mounts.count; i++) {
+		if (j && strcmp(mounts.dirs[j - 1], mounts.dirs[i]) == 0) {
+			free(mounts.dirs[i]);
+			continue;
+		}
+		mounts.dirs[j++] = mounts.dirs[i];
 	}
+	mounts.count = j;
+
+	mounts.generation = generation;
+	mounts.valid = true;
+	xlog(D_GENERAL, "mount table: %zu mount points", mounts.count);
+	return;
+
+out_nomem:
 	endmntent(f);
-	*v = NULL;
-	return NULL;
+	xlog(L_WARNING, "mount table: no memory for snapshot");
+	mount_snapshot_free();
 }
 
-/* same_path() check is two paths refer to the same directory.
- * We don't rely on 'strcmp()' as some filesystems support case-insensitive
- * names and we might have two different names for the one directory.
- * Theoretically the lengths of the names could be different, but the
- * number of components must be the same.
- * So if the paths have the same number of components (but aren't identical)
- * we ask the kernel if they are the same thing.
- * By preference we use name_to_handle_at(), as the mntid it returns
- * will distinguish between bind-mount points.  If that isn't available
- * we fall back on lstat, which is usually good enough.
+/*
+ * Compare @dir with the first @len bytes of @path followed by a '/'.
+ * Returns zero iff @dir is strictly below @path.
  */
-static inline int count_slashes(char *p)
+static int mount_dir_prefix_cmp(const char *dir, const char *path, size_t len)
 {
-	int cnt = 0;
-	while (*p)
-		if (*p++ == '/')
-			cnt++;
-	return cnt;
-}
+	int ret;
+
+	ret = strncmp(dir, path, len);
+	if (ret)
+		return ret;
+	return (unsigned char)dir[len] - '/';
+}
+
+/*
+ * Upcalls check whether the snapshot still matches the mount table
+ * through a separate open file of /proc/self/mountinfo, so that doing
+ * so does not consume the event mountinfo_poll() is waiting for.  Once
+ * it reports a change the snapshot is not trusted again until the next
+ * cache_refresh_mounts().
+ */
+static struct {
+	pthread_mutex_t	lock;
+	int		fd;
+	bool		stale;
+} mount_check = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.fd = -1,
+	.stale = true,
+};
+
+static bool mount_check_poll(void)
+{
+	struct pollfd pfd;
+
+	pfd.fd = mount_check.fd;
+	pfd.events = POLLPRI;
+	pfd.revents = 0;
+	return poll(&pfd, 1, 0) != 0;
+}
+
+/* Called before mountinfo_poll(), so no change can slip between them */
+static void mount_check_reset(void)
+{
+	pthread_mutex_lock(&mount_check.lock);
+	if (mount_check.fd < 0)
+		mount_check.fd = open("/proc/self/mountinfo",
+				      O_RDONLY | O_CLOEXEC);
+	if (mount_check.fd >= 0) {
+		mount_check_poll();
+		mount_check.stale = false;
+	} else
+		mount_check.stale = true;
+	pthread_mutex_unlock(&mount_check.lock);
+}
+
+static bool mount_snapshot_fresh(void)
+{
+	bool fresh;
+
+	if (!mounts.valid)
+		return false;
+	pthread_mutex_lock(&mount_check.lock);
+	if (!mount_check.stale && mount_check_poll())
+		mount_check.stale = true;
+	fresh = !mount_check.stale;
+	pthread_mutex_unlock(&mount_check.lock);
+	return fresh;
+}
+
+static bool mount_snapshot_contains(const char *path)
+{
+	size_t lo = 0, hi = mounts.count;
+
+	if (!mounts.valid)
+		return false;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = strcmp(mounts.dirs[mid], path);
+
+		if (cmp == 0)
+			return true;
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return false;
+}
+
+struct submount_iter {
+	size_t	pos;
+	size_t	end;
+};
+
+/* Prepare to iterate through the mountpoints below a given path */
+static void submounts_begin(struct submount_iter *it, const char *p)
+{
+	size_t l = strlen(p), lo = 0, hi = mounts.count;
+
+	it->pos = it->end = 0;
+	if (!mounts.valid || l < 1)
+		return;
+
+	/* Everything below "/" is a proper sub-mount */
+	if (strcmp(p, "/") == 0) {
+		it->end = mounts.count;
+		return;
+	}
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (mount_dir_prefix_cmp(mounts.dirs[mid], p, l) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	it->pos = it->end = lo;
+	while (it->end < mounts.count &&
+	       mount_dir_prefix_cmp(mounts.dirs[it->end], p, l) == 0)
+		it->end++;
+}
+
+static char *next_mnt(struct submount_iter *it)
+{
+	if (it->pos >= it->end)
+		return NULL;
+	return mounts.dirs[it->pos++];
+}
+
+/* same_path() check is two paths refer to the same directory.
+ * We don't rely on 'strcmp()' as some filesystems support case-insensitive
+ * names and we might have two different names for the one directory.
+ * Theoretically the lengths of the names could be different, but the
+ * number of components must be the same.
+ * So if the paths have the same number of components (but aren't identical)
+ * we ask the kernel if they are the same thing.
+ * By preference we use name_to_handle_at(), as the mntid it returns
+ * will distinguish between bind-mount points.  If that isn't available
+ * we fall back on lstat, which is usually good enough.
+ */
+static inline int count_slashes(char *p)
+{
+	int cnt = 0;
+	while (*p)
+		if (*p++ == '/')
+			cnt++;
+	return cnt;
+}
 
 #if defined(HAVE_STRUCT_FILE_HANDLE)
 static int check_same_path_by_handle(const char *child, const char *parent)
@@ -519,7 +1188,7 @@ static int check_same_path_by_inode(const char *child, const char *parent)
 
 static int same_path(char *child, char *parent, int len)
 {
-	static char p[PATH_MAX];
+	char p[PATH_MAX];
 	int err;
 
 	if (len <= 0)
@@ -565,9 +1234,10 @@ static int path_matches(nfs_export *exp, char *path)
 }
 
 static int
-export_matches(nfs_export *exp, char *dom, char *path, struct addrinfo *ai)
+export_matches(nfs_export *exp, char *dom, char *path,
+	       const struct client_set *clients)
 {
-	return path_matches(exp, path) && client_matches(exp, dom, ai);
+	return path_matches(exp, path) && client_matches(exp, dom, clients);
 }
 
 /* True iff e1 is a child of e2 (or descendant) and e2 has crossmnt set: */
@@ -741,9 +1411,13 @@ path_error:
 	return -1;
 }
 
-static struct addrinfo *lookup_client_addr(char *dom)
+/*
+ * Find the clients that the address in a "$<address>" domain matches.
+ */
+static struct client_set *lookup_client_set(char *dom)
 {
-	struct addrinfo *ret;
+	struct client_set *ret;
+	struct addrinfo *ai;
 	struct addrinfo *tmp;
 
 	dom++; /* skip initial "$" */
@@ -751,280 +1425,1345 @@ static struct addrinfo *lookup_client_addr(char *dom)
 	tmp = host_pton(dom);
 	if (tmp == NULL)
 		return NULL;
-	ret = client_resolve(tmp->ai_addr);
+	ai = client_resolve(tmp->ai_addr);
 	nfs_freeaddrinfo(tmp);
+	if (ai == NULL)
+		return NULL;
+	ret = client_match(ai);
+	nfs_freeaddrinfo(ai);
 	return ret;
 }
 
+/*
+ * nfsd.fh requests we could not answer are retried after RETRY_SEC.
+ * Every entry gets the same delay, so appending at the tail keeps the
+ * queue ordered by due time and only the head needs to arm the timer.
+ */
 #define RETRY_SEC 120
 struct delayed {
 	char *message;
-	time_t last_attempt;
+	time_t due;		/* CLOCK_MONOTONIC seconds */
 	int f;
 	struct delayed *next;
 } *delayed;
+static struct delayed **delayed_tail = &delayed;
+static int delayed_timer_fd = -1;
+static pthread_mutex_t delayed_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static int nfsd_handle_fh(int f, char *bp, int blen)
+static time_t monotonic_seconds(void)
 {
-	/* request are:
-	 *  domain fsidtype fsid
-	 * interpret fsid, find export point and options, and write:
-	 *  domain fsidtype fsid expiry path
-	 */
-	char *dom;
-	int fsidtype;
-	int fsidlen;
-	char fsid[32];
-	struct parsed_fsid parsed;
-	struct exportent *found = NULL;
-	struct addrinfo *ai = NULL;
-	char *found_path = NULL;
-	nfs_export *exp;
-	int i;
-	int dev_missing = 0;
-	char buf[RPC_CHAN_BUF_SIZE];
-	int did_uncover = 0;
-	int ret = 0;
+	struct timespec ts;
 
-	dom = malloc(blen);
-	if (dom == NULL)
-		return ret;
-	if (qword_get(&bp, dom, blen) <= 0)
-		goto out;
-	if (qword_get_int(&bp, &fsidtype) != 0)
-		goto out;
-	if (fsidtype < 0 || fsidtype > 7)
-		goto out; /* unknown type */
-	if ((fsidlen = qword_get(&bp, fsid, 32)) <= 0)
-		goto out;
-	if (parse_fsid(fsidtype, fsidlen, fsid, &parsed))
-		goto out;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
 
-	auth_reload();
+static void delayed_arm_timer(void)
+{
+	struct itimerspec its;
 
-	if (is_ipaddr_client(dom)) {
-		ai = lookup_client_addr(dom);
-		if (!ai)
-			goto out;
-	}
+	if (delayed_timer_fd < 0)
+		return;
+	memset(&its, 0, sizeof(its));
+	if (delayed)
+		/* An absolute expiry of 0 would disarm the timer */
+		its.it_value.tv_sec = delayed->due > 0 ? delayed->due : 1;
+	if (timerfd_settime(delayed_timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		xlog(L_WARNING, "delayed_arm_timer: timerfd_settime: %m");
+}
 
-	/* Now determine export point for this fsid/domain */
-	for (i=0 ; i < MCL_MAXTYPES; i++) {
-		nfs_export *next_exp;
-		for (exp = exportlist[i].p_head; exp; exp = next_exp) {
-			char *path;
+static void delayed_queue(struct delayed *d)
+{
+	d->due = monotonic_seconds() + RETRY_SEC;
+	d->next = NULL;
+	pthread_mutex_lock(&delayed_lock);
+	cachestats_delayed(1);
+	*delayed_tail = d;
+	delayed_tail = &d->next;
+	if (delayed == d)
+		delayed_arm_timer();
+	pthread_mutex_unlock(&delayed_lock);
+}
 
-			if (!did_uncover && parsed.fsidnum && parsed.fsidtype == FSID_NUM && exp->m_export.e_reexport != REEXP_NONE) {
-				reexpdb_uncover_subvolume(parsed.fsidnum);
-				did_uncover = 1;
-			}
+/* Remove and return the first request if it has come due */
+static struct delayed *delayed_dequeue(time_t now)
+{
+	struct delayed *d;
+
+	pthread_mutex_lock(&delayed_lock);
+	d = delayed;
+	if (d && d->due <= now) {
+		delayed = d->next;
+		if (!delayed)
+			delayed_tail = &delayed;
+		delayed_arm_timer();
+		cachestats_delayed(-1);
+	} else
+		d = NULL;
+	pthread_mutex_unlock(&delayed_lock);
+	return d;
+}
 
-			if (exp->m_export.e_flags & NFSEXP_CROSSMOUNT) {
-				static nfs_export *prev = NULL;
-				static void *mnt = NULL;
-				
-				if (prev == exp) {
-					/* try a submount */
-					path = next_mnt(&mnt, exp->m_export.e_path);
-					if (!path) {
-						next_exp = exp->m_next;
-						prev = NULL;
-						continue;
-					}
-					next_exp = exp;
-				} else {
-					prev = exp;
-					mnt = NULL;
-					path = exp->m_export.e_path;
-					next_exp = exp;
-				}
-			} else {
-				path = exp->m_export.e_path;
-				next_exp = exp->m_next;
-			}
+/*
+ * nfsd.export requests put off while a junction is read (see
+ * junction_lookup()) are queued here to be handled again once it has
+ * been, and export_ready_fd wakes the main loop to do that.
+ */
+static struct delayed *export_ready;
+static int export_ready_fd = -1;
 
-			if (!is_ipaddr_client(dom)
-					&& !namelist_client_matches(exp, dom))
-				continue;
-			if (exp->m_export.e_mountpoint &&
-			    !is_mountpoint(exp->m_export.e_mountpoint[0]?
-					   exp->m_export.e_mountpoint:
-					   exp->m_export.e_path))
-				dev_missing ++;
-
-			switch(match_fsid(&parsed, exp, path)) {
-			case 0:
-				continue;
-			case -1:
-				dev_missing ++;
-				continue;
-			}
-			if (is_ipaddr_client(dom)
-					&& !ipaddr_client_matches(exp, ai))
-				continue;
-			if (!found || subexport(&exp->m_export, found)) {
-				found = &exp->m_export;
-				free(found_path);
-				found_path = strdup(path);
-				if (found_path == NULL)
-					goto out;
-			} else if (strcmp(found->e_path, exp->m_export.e_path) != 0
-				   && !subexport(found, &exp->m_export))
-			{
-				xlog(L_WARNING, "%s and %s have same filehandle for %s, using first",
-				     found_path, path, dom);
-			} else {
-				/* same path, if one is V4ROOT, choose the other */
-				if (found->e_flags & NFSEXP_V4ROOT) {
-					found = &exp->m_export;
-					free(found_path);
-					found_path = strdup(path);
-					if (found_path == NULL)
-						goto out;
-				}
-			}
-		}
-	}
+static struct delayed *export_ready_take(void)
+{
+	struct delayed *list;
+	uint64_t count;
+
+	if (read(export_ready_fd, &count, sizeof(count)) < 0 &&
+	    errno != EAGAIN)
+		xlog(L_WARNING, "export_ready_take: eventfd: %m");
+	pthread_mutex_lock(&delayed_lock);
+	list = export_ready;
+	export_ready = NULL;
+	pthread_mutex_unlock(&delayed_lock);
+	return list;
+}
 
-	if (!found) {
-		/* The missing dev could be what we want, so just be
-		 * quiet rather than returning stale yet
-		 */
-		if (dev_missing) {
-			ret = 1;
-			goto out;
+/*
+ * State shared between the exports considered for one nfsd.fh upcall.
+ */
+struct fh_search {
+	struct parsed_fsid	*parsed;
+	char			*dom;
+	struct client_set	*clients;
+	struct exportent	*found;
+	char			*found_path;
+	int			dev_missing;
+};
+
+/*
+ * Check whether @path, exported by @exp, is what the filehandle refers to
+ * and record it in @s if it is a better answer than what we have so far.
+ * Returns -1 if we ran out of memory, otherwise 0.
+ */
+static int nfsd_fh_check(struct fh_search *s, nfs_export *exp, char *path)
+{
+	if (!is_ipaddr_client(s->dom)
+			&& !namelist_client_matches(exp, s->dom))
+		return 0;
+	if (exp->m_export.e_mountpoint &&
+	    !is_mountpoint(exp->m_export.e_mountpoint[0]?
+			   exp->m_export.e_mountpoint:
+			   exp->m_export.e_path))
+		s->dev_missing ++;
+
+	switch(match_fsid(s->parsed, exp, path)) {
+	case 0:
+		return 0;
+	case -1:
+		s->dev_missing ++;
+		return 0;
+	}
+	if (is_ipaddr_client(s->dom)
+			&& !ipaddr_client_matches(exp, s->clients))
+		return 0;
+	if (!s->found || subexport(&exp->m_export, s->found)) {
+		s->found = &exp->m_export;
+		free(s->found_path);
+		s->found_path = strdup(path);
+		if (s->found_path == NULL)
+			return -1;
+	} else if (strcmp(s->found->e_path, exp->m_export.e_path) != 0
+		   && !subexport(s->found, &exp->m_export))
+	{
+		xlog(L_WARNING, "%s and %s have same filehandle for %s, using first",
+		     s->found_path, path, s->dom);
+	} else {
+		/* same path, if one is V4ROOT, choose the other */
+		if (s->found->e_flags & NFSEXP_V4ROOT) {
+			s->found = &exp->m_export;
+			free(s->found_path);
+			s->found_path = strdup(path);
+			if (s->found_path == NULL)
+				return -1;
 		}
-	} else if (found->e_mountpoint &&
-	    !is_mountpoint(found->e_mountpoint[0]?
-			   found->e_mountpoint:
-			   found->e_path)) {
-		/* Cannot export this yet
-		 * should log a warning, but need to rate limit
-		   xlog(L_WARNING, "%s not exported as %d not a mountpoint",
-		   found->e_path, found->e_mountpoint);
-		 */
-		ret = 1;
-		goto out;
 	}
-
-	bp = buf; blen = sizeof(buf);
-	qword_add(&bp, &blen, dom);
-	qword_addint(&bp, &blen, fsidtype);
-	qword_addhex(&bp, &blen, fsid, fsidlen);
-	/* The fsid -> path lookup can be quite expensive as it
-	 * potentially stats and reads lots of devices, and some of those
-	 * might have spun-down.  The Answer is not likely to
-	 * change underneath us, and an 'exportfs -f' can always
-	 * remove this from the kernel, so use a really log
-	 * timeout.  Maybe this should be configurable on the command
-	 * line.
-	 */
-	qword_addint(&bp, &blen, 0x7fffffff);
-	if (found)
-		qword_add(&bp, &blen, found_path);
-	qword_addeol(&bp, &blen);
-	if (blen <= 0 || cache_write(f, buf, bp - buf) != bp - buf)
-		xlog(L_ERROR, "nfsd_fh: error writing reply");
-	if (!found)
-		xlog(D_AUTH, "denied access to %s", *dom == '$' ? dom+1 : dom);
-out:
-	if (found_path)
-		free(found_path);
-	nfs_freeaddrinfo(ai);
-	free(dom);
-	if (!ret)
-		xlog(D_CALL, "nfsd_fh: found %p path %s",
-		     found, found ? found->e_path : NULL);
-	return ret;
+	return 0;
 }
 
-static void nfsd_fh(int f)
+/*
+ * Check an export point and, for crossmnt exports, every filesystem
+ * mounted below it.
+ */
+static int nfsd_fh_check_export(struct fh_search *s, nfs_export *exp)
 {
-	struct delayed *d, **dp;
-	char inbuf[RPC_CHAN_BUF_SIZE];
-	int blen;
+	struct submount_iter it;
+	char *path;
 
-	blen = cache_read(f, inbuf, sizeof(inbuf));
-	if (blen <= 0 || inbuf[blen-1] != '\n') return;
-	inbuf[blen-1] = 0;
+	if (nfsd_fh_check(s, exp, exp->m_export.e_path) < 0)
+		return -1;
+	if (!(exp->m_export.e_flags & NFSEXP_CROSSMOUNT))
+		return 0;
 
-	xlog(D_CALL, "nfsd_fh: inbuf '%s'", inbuf);
+	submounts_begin(&it, exp->m_export.e_path);
+	while ((path = next_mnt(&it)) != NULL)
+		if (nfsd_fh_check(s, exp, path) < 0)
+			return -1;
+	return 0;
+}
 
-	if (nfsd_handle_fh(f, inbuf, blen) == 0)
-		return;
-	/* We don't have a definitive answer to give the kernel.
-	 * This is because an export marked "mountpoint" isn't a
-	 * mountpoint, or because a stat of a mountpoint fails with
-	 * a strange error like ETIMEDOUT as is possible with an
-	 * NFS mount marked "softerr" which is being re-exported.
-	 *
-	 * We cannot tell the kernel to retry, so we have to
-	 * retry ourselves.
-	 */
-	d = malloc(sizeof(*d));
+/*
+ * Index of exports by the fsid a filehandle would carry for them.
+ *
+ * Walking every export and calling match_fsid() on each one for every
+ * nfsd.fh upcall gets very expensive with thousands of exports, so the
+ * fsid of each export point is computed once per etab generation and
+ * kept in a hash table.  When the mount table changes only the exports
+ * on the mounts that changed are indexed again (see fsid_index_remount()).
+ * Exports whose fsid cannot be determined up front (crossmnt exports
+ * whose submounts can match too, "mountpoint" exports, reexports and
+ * anything we could not stat) are always checked.
+ * Every candidate is still verified with match_fsid(), and if nothing
+ * matches we fall back to looking at all exports, once for each fsid
+ * and domain until the index is built again (see fsid_misses).
+ */
+enum fsid_key_kind {
+	FSID_KEY_NUM = 1,
+	FSID_KEY_DEV,
+	FSID_KEY_UUID,
+};
 
-	if (!d)
-		return;
-	d->message = strndup(inbuf, blen);
-	if (!d->message) {
-		free(d);
-		return;
-	}
-	d->f = f;
-	d->last_attempt = time(NULL);
-	d->next = NULL;
-	dp = &delayed;
-	while (*dp)
-		dp = &(*dp)->next;
-	*dp = d;
-}
+struct fsid_key {
+	int		kind;
+	unsigned int	major;
+	unsigned int	minor;
+	uint32_t	fsidnum;
+	unsigned int	uuidlen;
+	char		uuid[16];
+};
+
+struct fsid_index_ent {
+	struct fsid_index_ent	*next;
+	nfs_export		*exp;
+	unsigned int		seq;
+	struct fsid_key		key;
+};
+
+/* What each export's keys were derived from, indexed by seq */
+struct fsid_index_exp {
+	nfs_export		*exp;
+	int			mnt_id;		/* -1 if not known */
+	bool			recheck;	/* on any mount change */
+	bool			stale;
+};
 
-static void nfsd_retry_fh(struct delayed *d)
+static struct {
+	unsigned int		generation;
+	unsigned int		mount_generation;
+	unsigned int		nbuckets;
+	struct fsid_index_ent	**buckets;
+	struct fsid_index_ent	*always, *always_last;
+	struct fsid_index_ent	**always_tail;
+	struct fsid_index_exp	*exps;
+	unsigned int		nexports;
+	unsigned int		nkeys;
+	int			has_reexport;
+} fsid_index;
+
+static unsigned int fsid_key_hash(const struct fsid_key *key)
 {
-	struct delayed **dp;
+	const unsigned char *p = (const unsigned char *)key;
+	unsigned int hash = 2166136261u;
+	size_t i;
 
-	if (nfsd_handle_fh(d->f, d->message, strlen(d->message)+1) == 0) {
-		free(d->message);
-		free(d);
-		return;
+	for (i = 0; i < sizeof(*key); i++) {
+		hash ^= p[i];
+		hash *= 16777619u;
 	}
-	d->last_attempt = time(NULL);
-	d->next = NULL;
-	dp = &delayed;
-	while (*dp)
-		dp = &(*dp)->next;
-	*dp = d;
+	return hash;
 }
 
-static void write_fsloc(char **bp, int *blen, struct exportent *ep)
+static void fsid_key_from_parsed(struct fsid_key *key,
+				 const struct parsed_fsid *parsed)
 {
-	struct servers *servers;
+	memset(key, 0, sizeof(*key));
+	switch (parsed->fsidtype) {
+	case FSID_DEV:
+	case FSID_MAJOR_MINOR:
+	case FSID_ENCODE_DEV:
+		key->kind = FSID_KEY_DEV;
+		key->major = parsed->major;
+		key->minor = parsed->minor;
+		break;
+	case FSID_NUM:
+		key->kind = FSID_KEY_NUM;
+		key->fsidnum = parsed->fsidnum;
+		break;
+	default:
+		key->kind = FSID_KEY_UUID;
+		key->uuidlen = parsed->uuidlen;
+		memcpy(key->uuid, parsed->fhuuid, parsed->uuidlen);
+		break;
+	}
+}
 
-	if (ep->e_fslocmethod == FSLOC_NONE)
-		return;
+static struct fsid_index_ent *fsid_index_ent_new(nfs_export *exp,
+						 unsigned int seq)
+{
+	struct fsid_index_ent *ent;
 
-	servers = replicas_lookup(ep->e_fslocmethod, ep->e_fslocdata);
-	if (!servers)
-		return;
-	qword_add(bp, blen, "fsloc");
-	qword_addint(bp, blen, servers->h_num);
-	if (servers->h_num >= 0) {
-		int i;
-		for (i=0; i<servers->h_num; i++) {
-			qword_add(bp, blen, servers->h_mp[i]->h_host);
-			qword_add(bp, blen, servers->h_mp[i]->h_path);
-		}
-	}
-	qword_addint(bp, blen, servers->h_referral);
-	release_replicas(servers);
+	ent = calloc(1, sizeof(*ent));
+	if (ent == NULL)
+		return NULL;
+	ent->exp = exp;
+	ent->seq = seq;
+	return ent;
 }
 
-static void write_secinfo(char **bp, int *blen, struct exportent *ep, int flag_mask, int extra_flag)
+static int fsid_index_insert(nfs_export *exp, unsigned int seq,
+			     const struct fsid_key *key)
 {
-	struct sec_entry *p;
+	struct fsid_index_ent *ent, **entp, **at = NULL;
 
-	for (p = ep->e_secinfo; p->flav; p++)
-		; /* Do nothing */
+	entp = &fsid_index.buckets[fsid_key_hash(key) % fsid_index.nbuckets];
+	for (; *entp; entp = &(*entp)->next) {
+		if ((*entp)->exp == exp &&
+		    memcmp(&(*entp)->key, key, sizeof(*key)) == 0)
+			return 0;
+		if (!at && (*entp)->seq > seq)
+			at = entp;
+	}
+
+	/* Each chain is kept sorted by seq */
+	ent = fsid_index_ent_new(exp, seq);
+	if (ent == NULL)
+		return -1;
+	ent->key = *key;
+	if (at == NULL)
+		at = entp;
+	ent->next = *at;
+	*at = ent;
+	fsid_index.nkeys++;
+	return 0;
+}
+
+static int fsid_index_insert_always(nfs_export *exp, unsigned int seq)
+{
+	struct fsid_index_ent *ent, **entp = fsid_index.always_tail;
+
+	ent = fsid_index_ent_new(exp, seq);
+	if (ent == NULL)
+		return -1;
+	/* Only fsid_index_remount() inserts out of order */
+	if (fsid_index.always_last && fsid_index.always_last->seq > seq)
+		for (entp = &fsid_index.always; (*entp)->seq < seq;
+		     entp = &(*entp)->next)
+			;
+	ent->next = *entp;
+	*entp = ent;
+	if (ent->next == NULL) {
+		fsid_index.always_last = ent;
+		fsid_index.always_tail = &ent->next;
+	}
+	return 0;
+}
+
+static int fsid_index_insert_uuid(nfs_export *exp, unsigned int seq,
+				  unsigned int uuidlen, const char *u)
+{
+	struct fsid_key key;
+
+	memset(&key, 0, sizeof(key));
+	key.kind = FSID_KEY_UUID;
+	key.uuidlen = uuidlen;
+	memcpy(key.uuid, u, uuidlen);
+	return fsid_index_insert(exp, seq, &key);
+}
+
+static int fsid_index_add(nfs_export *exp, unsigned int seq)
+{
+	static const unsigned int uuidlens[] = { 4, 8, 16 };
+	struct fsid_index_exp *rec = &fsid_index.exps[seq];
+	struct exportent *ep = &exp->m_export;
+	struct fsid_key key;
+	struct stat stb;
+	unsigned int i;
+	int type;
+	char u[16];
+
+	rec->exp = exp;
+	rec->mnt_id = -1;
+	rec->recheck = false;
+	rec->stale = false;
+
+	if (ep->e_reexport != REEXP_NONE)
+		fsid_index.has_reexport = 1;
+	if ((ep->e_flags & NFSEXP_CROSSMOUNT) || ep->e_mountpoint ||
+	    ep->e_reexport != REEXP_NONE)
+		return fsid_index_insert_always(exp, seq);
+
+	if (nfsd_path_stat(ep->e_path, &stb) != 0) {
+		/* It may turn up once something is mounted */
+		rec->recheck = true;
+		return fsid_index_insert_always(exp, seq);
+	}
+	rec->mnt_id = path_mnt_id(ep->e_path);
+	if (!S_ISDIR(stb.st_mode) && !S_ISREG(stb.st_mode))
+		/* match_fsid() can never match this one */
+		return 0;
+
+	memset(&key, 0, sizeof(key));
+	key.kind = FSID_KEY_DEV;
+	key.major = major(stb.st_dev);
+	key.minor = minor(stb.st_dev);
+	if (fsid_index_insert(exp, seq, &key) < 0)
+		return -1;
+
+	if (ep->e_flags & NFSEXP_FSID) {
+		memset(&key, 0, sizeof(key));
+		key.kind = FSID_KEY_NUM;
+		key.fsidnum = ep->e_fsid;
+		if (fsid_index_insert(exp, seq, &key) < 0)
+			return -1;
+	}
+
+	for (i = 0; i < sizeof(uuidlens) / sizeof(uuidlens[0]); i++) {
+		if (ep->e_uuid) {
+			get_uuid(ep->e_uuid, uuidlens[i], u);
+			if (fsid_index_insert_uuid(exp, seq, uuidlens[i], u) < 0)
+				return -1;
+			continue;
+		}
+		for (type = 0; uuid_by_path(ep->e_path, type, uuidlens[i], u);
+		     type++)
+			if (fsid_index_insert_uuid(exp, seq, uuidlens[i], u) < 0)
+				return -1;
+	}
+	return 0;
+}
+
+/* Bumped each time the index changes; see fsid_miss_seen() */
+static unsigned int fsid_index_builds;
+
+static void fsid_index_free_chain(struct fsid_index_ent *ent)
+{
+	struct fsid_index_ent *next;
+
+	for (; ent; ent = next) {
+		next = ent->next;
+		free(ent);
+	}
+}
+
+static void fsid_index_free(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < fsid_index.nbuckets; i++)
+		fsid_index_free_chain(fsid_index.buckets[i]);
+	free(fsid_index.buckets);
+	fsid_index_free_chain(fsid_index.always);
+	free(fsid_index.exps);
+	memset(&fsid_index, 0, sizeof(fsid_index));
+}
+
+static bool fsid_index_current(unsigned int generation)
+{
+	return fsid_index.buckets && fsid_index.generation == generation &&
+		fsid_index.mount_generation == mount_generation;
+}
+
+/*
+ * Make sure the index describes export table generation @generation
+ * and the current mount table.  Returns 0 if the index can be used,
+ * otherwise -1.
+ */
+static int fsid_index_update(unsigned int generation)
+{
+	nfs_export *exp;
+	unsigned int seq = 0;
+	int i;
+
+	if (fsid_index_current(generation))
+		return 0;
+
+	fsid_index_free();
+	for (i = 0; i < MCL_MAXTYPES; i++)
+		for (exp = exportlist[i].p_head; exp; exp = exp->m_next)
+			fsid_index.nexports++;
+
+	fsid_index.nbuckets = 2 * fsid_index.nexports + 1;
+	fsid_index.buckets = calloc(fsid_index.nbuckets,
+				    sizeof(*fsid_index.buckets));
+	fsid_index.exps = calloc(fsid_index.nexports + 1,
+				 sizeof(*fsid_index.exps));
+	if (fsid_index.buckets == NULL || fsid_index.exps == NULL)
+		goto out_nomem;
+	fsid_index.always_tail = &fsid_index.always;
+
+	for (i = 0; i < MCL_MAXTYPES; i++)
+		for (exp = exportlist[i].p_head; exp; exp = exp->m_next)
+			if (fsid_index_add(exp, seq++) < 0)
+				goto out_nomem;
+
+	fsid_index.generation = generation;
+	fsid_index.mount_generation = mount_generation;
+	fsid_index_builds++;
+	xlog(D_GENERAL, "nfsd_fh: indexed %u exports using %u fsid keys",
+	     fsid_index.nexports, fsid_index.nkeys);
+	return 0;
+
+out_nomem:
+	xlog(L_WARNING, "nfsd_fh: no memory for fsid index");
+	fsid_index_free();
+	return -1;
+}
+
+/* Unlink the entries of stale exports from the chain at @entp */
+static void fsid_index_drop_stale(struct fsid_index_ent **entp, bool keyed)
+{
+	struct fsid_index_ent *ent;
+
+	while ((ent = *entp) != NULL) {
+		if (!fsid_index.exps[ent->seq].stale) {
+			entp = &ent->next;
+			continue;
+		}
+		*entp = ent->next;
+		free(ent);
+		if (keyed)
+			fsid_index.nkeys--;
+	}
+}
+
+/*
+ * The mount table changed as described by @ch.  Index again just the
+ * exports that are on a changed mount, or below where one was or is
+ * now mounted, rather than probing every export on the next upcall.
+ */
+static void fsid_index_remount(const struct mount_change *ch,
+			       unsigned int generation)
+{
+	struct fsid_index_exp *rec;
+	struct fsid_index_ent *ent;
+	unsigned int seq, nstale = 0;
+
+	if (!fsid_index.buckets)
+		return;
+	if (ch->all || fsid_index.generation != generation ||
+	    fsid_index.mount_generation + 1 != mount_generation) {
+		fsid_index_free();
+		return;
+	}
+
+	for (seq = 0; seq < fsid_index.nexports; seq++) {
+		rec = &fsid_index.exps[seq];
+		rec->stale = rec->recheck ||
+			(rec->mnt_id >= 0 && mount_change_has_id(ch, rec->mnt_id)) ||
+			mount_change_covers(ch, rec->exp->m_export.e_path);
+		if (rec->stale)
+			nstale++;
+	}
+
+	if (nstale) {
+		for (seq = 0; seq < fsid_index.nbuckets; seq++)
+			fsid_index_drop_stale(&fsid_index.buckets[seq], true);
+		fsid_index_drop_stale(&fsid_index.always, false);
+		fsid_index.always_last = NULL;
+		fsid_index.always_tail = &fsid_index.always;
+		for (ent = fsid_index.always; ent; ent = ent->next) {
+			fsid_index.always_last = ent;
+			fsid_index.always_tail = &ent->next;
+		}
+
+		for (seq = 0; seq < fsid_index.nexports; seq++)
+			if (fsid_index.exps[seq].stale &&
+			    fsid_index_add(fsid_index.exps[seq].exp, seq) < 0) {
+				xlog(L_WARNING, "nfsd_fh: no memory for fsid index");
+				fsid_index_free();
+				return;
+			}
+		/* What was not found before may be found now */
+		fsid_index_builds++;
+	}
+
+	fsid_index.mount_generation = mount_generation;
+	xlog(D_GENERAL, "nfsd_fh: indexed %u of %u exports again after "
+	     "a mount change", nstale, fsid_index.nexports);
+}
+
+/*
+ * Check the exports listed in the index for @s->parsed, plus those that
+ * always have to be checked, in the same order a full scan of the
+ * export list would visit them.
+ */
+static int nfsd_fh_search_index(struct fh_search *s)
+{
+	struct fsid_index_ent *ent, *always;
+	struct fsid_key key;
+	nfs_export *exp;
+
+	fsid_key_from_parsed(&key, s->parsed);
+	ent = fsid_index.buckets[fsid_key_hash(&key) % fsid_index.nbuckets];
+	always = fsid_index.always;
+
+	for (;;) {
+		while (ent && memcmp(&ent->key, &key, sizeof(key)) != 0)
+			ent = ent->next;
+		if (ent && (!always || ent->seq < always->seq)) {
+			exp = ent->exp;
+			ent = ent->next;
+		} else if (always) {
+			exp = always->exp;
+			always = always->next;
+		} else
+			break;
+
+		if (nfsd_fh_check_export(s, exp) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * fsid keys that, for the domain asking, neither the index nor a scan
+ * of all exports matched.  A client that keeps sending a stale
+ * filehandle then costs one scan per index build rather than one per
+ * upcall.  Forgotten whenever the index is built again.
+ */
+#define FSID_MISS_BUCKETS	256
+#define FSID_MISS_MAX		1024
+
+struct fsid_miss {
+	struct fsid_miss	*next;
+	struct fsid_key		key;
+	char			dom[];
+};
+
+static struct {
+	pthread_mutex_t		lock;
+	unsigned int		builds;
+	unsigned int		count;
+	struct fsid_miss	*buckets[FSID_MISS_BUCKETS];
+} fsid_misses = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static unsigned int fsid_miss_hash(const struct fsid_key *key,
+				   const char *dom)
+{
+	unsigned int hash = fsid_key_hash(key);
+
+	while (*dom)
+		hash = (hash ^ (unsigned char)*dom++) * 16777619u;
+	return hash % FSID_MISS_BUCKETS;
+}
+
+/* Called with fsid_misses.lock held */
+static void fsid_miss_flush(void)
+{
+	struct fsid_miss *m;
+	unsigned int i;
+
+	for (i = 0; i < FSID_MISS_BUCKETS; i++)
+		while ((m = fsid_misses.buckets[i]) != NULL) {
+			fsid_misses.buckets[i] = m->next;
+			free(m);
+		}
+	fsid_misses.count = 0;
+	fsid_misses.builds = fsid_index_builds;
+}
+
+static bool fsid_miss_seen(const struct fsid_key *key, const char *dom)
+{
+	struct fsid_miss *m;
+	bool seen = false;
+
+	pthread_mutex_lock(&fsid_misses.lock);
+	if (fsid_misses.builds != fsid_index_builds)
+		fsid_miss_flush();
+	for (m = fsid_misses.buckets[fsid_miss_hash(key, dom)]; m; m = m->next)
+		if (memcmp(&m->key, key, sizeof(*key)) == 0 &&
+		    strcmp(m->dom, dom) == 0) {
+			seen = true;
+			break;
+		}
+	pthread_mutex_unlock(&fsid_misses.lock);
+	return seen;
+}
+
+static void fsid_miss_add(const struct fsid_key *key, const char *dom)
+{
+	unsigned int hash = fsid_miss_hash(key, dom);
+	struct fsid_miss *m;
+
+	m = malloc(sizeof(*m) + strlen(dom) + 1);
+	if (!m)
+		return;
+	m->key = *key;
+	strcpy(m->dom, dom);
+
+	pthread_mutex_lock(&fsid_misses.lock);
+	if (fsid_misses.builds != fsid_index_builds ||
+	    fsid_misses.count >= FSID_MISS_MAX)
+		fsid_miss_flush();
+	m->next = fsid_misses.buckets[hash];
+	fsid_misses.buckets[hash] = m;
+	fsid_misses.count++;
+	pthread_mutex_unlock(&fsid_misses.lock);
+}
+
+static bool exportlist_has_reexport(void)
+{
+	nfs_export *exp;
+	int i;
+
+	for (i = 0; i < MCL_MAXTYPES; i++)
+		for (exp = exportlist[i].p_head; exp; exp = exp->m_next)
+			if (exp->m_export.e_reexport != REEXP_NONE)
+				return true;
+	return false;
+}
+
+static void nfsd_fh_uncover(struct parsed_fsid *parsed, bool has_reexport)
+{
+	if (has_reexport && parsed->fsidnum && parsed->fsidtype == FSID_NUM)
+		reexpdb_uncover_subvolume(parsed->fsidnum);
+}
+
+static int nfsd_fh_search_all(struct fh_search *s)
+{
+	nfs_export *exp;
+	int i;
+
+	for (i=0 ; i < MCL_MAXTYPES; i++)
+		for (exp = exportlist[i].p_head; exp; exp = exp->m_next)
+			if (nfsd_fh_check_export(s, exp) < 0)
+				return -1;
+	return 0;
+}
+
+/*
+ * Index of exports by path, for lookup_export().
+ *
+ * Export paths are split at each '/' into a trie, whose nodes are kept
+ * in one hash table keyed by parent and component.  A request path is
+ * then matched by walking it once: the node it ends at holds the
+ * exports of that exact path, and the nodes above it hold the crossmnt
+ * exports it lies below.
+ *
+ * This compares paths as strings, where same_path() also asks the
+ * kernel whether two names are the same directory.  Paths are made
+ * canonical when the export table is read, and the kernel asks about
+ * canonical paths, so the answer is the same for every export whose
+ * path is still canonical when the index is built.  Those that are
+ * not are kept aside and checked with path_matches() as before.  Only
+ * a mount change can make a path stop (or start) being canonical, so
+ * then just the exports below a changed mount are looked at again.  A
+ * path may still name an exported directory another way, through a
+ * bind mount or a case-insensitive filesystem, so when the index finds
+ * nothing lookup_export() still tries every export with same_path(),
+ * once for each path and domain (see path_misses).
+ */
+struct path_index_ent {
+	struct path_index_ent	*next;
+	nfs_export		*exp;
+	unsigned int		seq;
+};
+
+struct path_node {
+	struct path_node	*hnext;		/* in the hash chain */
+	const struct path_node	*parent;
+	struct path_index_ent	*exports, **exports_tail;
+	bool			crossmnt;	/* one of them is crossmnt */
+	unsigned int		len;
+	char			name[];
+};
+
+static struct {
+	unsigned int		generation;
+	unsigned int		mount_generation;
+	unsigned int		nbuckets;
+	struct path_node	**buckets;
+	struct path_node	*root;
+	struct path_index_ent	*aside, **aside_tail;
+	bool			*is_aside;	/* indexed by seq */
+	unsigned int		nexports;
+	unsigned int		nnodes;
+} path_index;
+
+static unsigned int path_node_hash(const struct path_node *parent,
+				   const char *name, size_t len)
+{
+	unsigned int hash = 2166136261u;
+	uintptr_t p = (uintptr_t)parent;
+	size_t i;
+
+	for (i = 0; i < sizeof(p); i++, p >>= 8) {
+		hash ^= p & 0xff;
+		hash *= 16777619u;
+	}
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static struct path_node *path_node_find(const struct path_node *parent,
+					const char *name, size_t len)
+{
+	struct path_node *node;
+
+	node = path_index.buckets[path_node_hash(parent, name, len) %
+				  path_index.nbuckets];
+	for (; node; node = node->hnext)
+		if (node->parent == parent && node->len == len &&
+		    memcmp(node->name, name, len) == 0)
+			return node;
+	return NULL;
+}
+
+static struct path_node *path_node_get(const struct path_node *parent,
+				       const char *name, size_t len)
+{
+	struct path_node *node, **bucket;
+
+	node = path_node_find(parent, name, len);
+	if (node)
+		return node;
+	node = calloc(1, sizeof(*node) + len + 1);
+	if (node == NULL)
+		return NULL;
+	node->parent = parent;
+	node->exports_tail = &node->exports;
+	node->len = len;
+	memcpy(node->name, name, len);
+	bucket = &path_index.buckets[path_node_hash(parent, name, len) %
+				     path_index.nbuckets];
+	node->hnext = *bucket;
+	*bucket = node;
+	path_index.nnodes++;
+	return node;
+}
+
+static struct path_index_ent *path_index_ent_new(nfs_export *exp,
+						 unsigned int seq)
+{
+	struct path_index_ent *ent;
+
+	ent = calloc(1, sizeof(*ent));
+	if (ent == NULL)
+		return NULL;
+	ent->exp = exp;
+	ent->seq = seq;
+	return ent;
+}
+
+/* Does @path have to be kept aside? */
+static bool path_index_aside(const char *path)
+{
+	char rpath[PATH_MAX + 1];
+
+	return path[0] != '/' ||
+		(nfsd_realpath(path, rpath) != NULL && strcmp(rpath, path) != 0);
+}
+
+static int path_index_add(nfs_export *exp, unsigned int seq)
+{
+	char *path = exp->m_export.e_path, *end;
+	struct path_index_ent *ent;
+	struct path_node *node = path_index.root;
+
+	ent = path_index_ent_new(exp, seq);
+	if (ent == NULL)
+		return -1;
+
+	path_index.is_aside[seq] = path_index_aside(path);
+	if (path_index.is_aside[seq]) {
+		*path_index.aside_tail = ent;
+		path_index.aside_tail = &ent->next;
+		return 0;
+	}
+
+	/* "/" is the root itself, "/a/" is "a" then "" */
+	if (path[1] != '\0')
+		for (path++; ; path = end + 1) {
+			end = strchrnul(path, '/');
+			node = path_node_get(node, path, end - path);
+			if (node == NULL) {
+				free(ent);
+				return -1;
+			}
+			if (*end == '\0')
+				break;
+		}
+	*node->exports_tail = ent;
+	node->exports_tail = &ent->next;
+	if (exp->m_export.e_flags & NFSEXP_CROSSMOUNT)
+		node->crossmnt = true;
+	return 0;
+}
+
+static void path_index_free_chain(struct path_index_ent *ent)
+{
+	struct path_index_ent *next;
+
+	for (; ent; ent = next) {
+		next = ent->next;
+		free(ent);
+	}
+}
+
+static void path_index_free(void)
+{
+	struct path_node *node, *next;
+	unsigned int i;
+
+	for (i = 0; i < path_index.nbuckets; i++)
+		for (node = path_index.buckets[i]; node; node = next) {
+			next = node->hnext;
+			path_index_free_chain(node->exports);
+			free(node);
+		}
+	free(path_index.buckets);
+	if (path_index.root) {
+		path_index_free_chain(path_index.root->exports);
+		free(path_index.root);
+	}
+	path_index_free_chain(path_index.aside);
+	free(path_index.is_aside);
+	memset(&path_index, 0, sizeof(path_index));
+}
+
+static bool path_index_current(unsigned int generation)
+{
+	return path_index.root && path_index.generation == generation &&
+		path_index.mount_generation == mount_generation;
+}
+
+/*
+ * Make sure the index describes export table generation @generation
+ * and the current mount table.  Returns 0 if the index can be used,
+ * otherwise -1.
+ */
+static int path_index_update(unsigned int generation)
+{
+	nfs_export *exp;
+	unsigned int seq = 0;
+	int i;
+
+	if (path_index_current(generation))
+		return 0;
+
+	path_index_free();
+	for (i = 0; i < MCL_MAXTYPES; i++)
+		for (exp = exportlist[i].p_head; exp; exp = exp->m_next)
+			path_index.nexports++;
+
+	path_index.nbuckets = 2 * path_index.nexports + 1;
+	path_index.buckets = calloc(path_index.nbuckets,
+				    sizeof(*path_index.buckets));
+	path_index.root = calloc(1, sizeof(*path_index.root) + 1);
+	path_index.is_aside = calloc(path_index.nexports + 1,
+				     sizeof(*path_index.is_aside));
+	if (path_index.buckets == NULL || path_index.root == NULL ||
+	    path_index.is_aside == NULL)
+		goto out_nomem;
+	path_index.root->exports_tail = &path_index.root->exports;
+	path_index.aside_tail = &path_index.aside;
+
+	for (i = 0; i < MCL_MAXTYPES; i++)
+		for (exp = exportlist[i].p_head; exp; exp = exp->m_next)
+			if (path_index_add(exp, seq++) < 0)
+				goto out_nomem;
+
+	path_index.generation = generation;
+	path_index.mount_generation = mount_generation;
+	xlog(D_GENERAL, "nfsd_export: indexed %u exports under %u path nodes",
+	     path_index.nexports, path_index.nnodes);
+	return 0;
+
+out_nomem:
+	xlog(L_WARNING, "nfsd_export: no memory for path index");
+	path_index_free();
+	return -1;
+}
+
+/*
+ * The mount table changed as described by @ch.  The index can be kept
+ * unless an export below a changed mount has to move in or out of the
+ * aside list.
+ */
+static void path_index_remount(const struct mount_change *ch,
+			       unsigned int generation)
+{
+	nfs_export *exp;
+	unsigned int seq = 0;
+	int i;
+
+	if (!path_index.root)
+		return;
+	if (ch->all || path_index.generation != generation ||
+	    path_index.mount_generation + 1 != mount_generation)
+		goto out_rebuild;
+
+	for (i = 0; i < MCL_MAXTYPES; i++)
+		for (exp = exportlist[i].p_head; exp; exp = exp->m_next, seq++)
+			if (mount_change_covers(ch, exp->m_export.e_path) &&
+			    path_index_aside(exp->m_export.e_path) !=
+			    path_index.is_aside[seq])
+				goto out_rebuild;
+	path_index.mount_generation = mount_generation;
+	return;
+
+out_rebuild:
+	path_index_free();
+}
+
+struct path_candidates {
+	nfs_export		**exp;
+	unsigned int		*seq;
+	unsigned int		n, max;
+};
+
+static int path_candidates_add(struct path_candidates *c,
+			       const struct path_index_ent *ent)
+{
+	unsigned int i;
+
+	if (c->n == c->max) {
+		unsigned int max = c->max ? c->max * 2 : 16;
+		nfs_export **exp = realloc(c->exp, max * sizeof(*exp));
+		unsigned int *seq;
+
+		if (exp == NULL)
+			return -1;
+		c->exp = exp;
+		seq = realloc(c->seq, max * sizeof(*seq));
+		if (seq == NULL)
+			return -1;
+		c->seq = seq;
+		c->max = max;
+	}
+	/* keep them in export list order; there are only ever a few */
+	for (i = c->n; i > 0 && c->seq[i - 1] > ent->seq; i--) {
+		c->exp[i] = c->exp[i - 1];
+		c->seq[i] = c->seq[i - 1];
+	}
+	c->exp[i] = ent->exp;
+	c->seq[i] = ent->seq;
+	c->n++;
+	return 0;
+}
+
+/*
+ * Collect, in export list order, the exports whose path matches @path:
+ * those exported at @path and the crossmnt exports above it.  Returns
+ * -1 if the index cannot answer.
+ */
+static int path_index_search(char *path, struct path_candidates *c)
+{
+	const struct path_node *node = path_index.root;
+	const struct path_index_ent *ent;
+	char *name, *end;
+
+	if (path[0] != '/')
+		return -1;
+
+	if (path[1] != '\0')
+		for (name = path + 1; ; name = end + 1) {
+			/* @node is a directory above @path */
+			if (node->crossmnt)
+				for (ent = node->exports; ent; ent = ent->next)
+					if ((ent->exp->m_export.e_flags &
+					     NFSEXP_CROSSMOUNT) &&
+					    path_candidates_add(c, ent) < 0)
+						return -1;
+			end = strchrnul(name, '/');
+			node = path_node_find(node, name, end - name);
+			if (node == NULL || *end == '\0')
+				break;
+		}
+	if (node)
+		for (ent = node->exports; ent; ent = ent->next)
+			if (path_candidates_add(c, ent) < 0)
+				return -1;
+
+	for (ent = path_index.aside; ent; ent = ent->next)
+		if (path_matches(ent->exp, path) &&
+		    path_candidates_add(c, ent) < 0)
+			return -1;
+	return 0;
+}
+
+/*
+ * With a thread pool (see cache_start_threads()) upcalls are handled
+ * concurrently within one process, so they share a single export table
+ * and the caches built from it and from the mount table.  Handlers run
+ * with export_lock held for reading.  Only cache_refresh() changes the
+ * table or those caches, and only with export_lock held for writing,
+ * either from the thread reading the channels or around RPC handling
+ * in mountd.
+ *
+ * Without a thread pool cache_process() still refreshes them before
+ * handling upcalls, and an upcall only reloads a changed etab itself.
+ */
+static struct xthread_workqueue *cache_workers;
+/* Which of the processes started by cache_fork_workers() this is */
+static int worker_index;
+static pthread_rwlock_t export_lock = PTHREAD_RWLOCK_INITIALIZER;
+static unsigned int export_generation;
+
+static void cache_refresh_mounts(void)
+{
+	struct mount_change ch;
+
+	mount_check_reset();
+	if (mountinfo_poll()) {
+		mount_generation++;
+		mountinfo_changed = false;
+		mount_table_update(&ch);
+		uuid_cache_prune(&ch);
+		fsid_index_remount(&ch, export_generation);
+		path_index_remount(&ch, export_generation);
+		mount_change_free(&ch);
+	}
+	mount_snapshot_update();
+}
+
+static void cache_refresh(void)
+{
+	export_generation = auth_reload();
+	cache_refresh_mounts();
+	/* Rather than in the first upcall that needs them */
+	fsid_index_update(export_generation);
+	path_index_update(export_generation);
+}
+
+/*
+ * Returns the generation of the export table the upcall should use.
+ * Mount table changes are picked up by cache_process() before it
+ * handles any upcall, so they are not dealt with here.
+ */
+static unsigned int upcall_refresh(void)
+{
+	if (!cache_workers && auth_reload_needed())
+		cache_refresh();
+	return export_generation;
+}
+
+/*
+ * The request is decoded in place, so one that is to be retried is
+ * encoded again from what was parsed.
+ */
+static char *nfsd_fh_request(char *dom, int fsidtype, char *fsid, int fsidlen)
+{
+	char buf[RPC_CHAN_BUF_SIZE], *bp = buf;
+	int blen = sizeof(buf);
+
+	qword_add(&bp, &blen, dom);
+	qword_addint(&bp, &blen, fsidtype);
+	qword_addhex(&bp, &blen, fsid, fsidlen);
+	if (blen <= 0)
+		return NULL;
+	return strndup(buf, bp - buf);
+}
+
+static int nfsd_handle_fh(int f, char *bp, int blen,
+			  struct cachestats_timer *st, char **retry)
+{
+	/* request are:
+	 *  domain fsidtype fsid
+	 * interpret fsid, find export point and options, and write:
+	 *  domain fsidtype fsid expiry path
+	 */
+	char *dom;
+	int fsidtype;
+	int fsidlen;
+	char *fsid;
+	struct parsed_fsid parsed;
+	struct fh_search s;
+	struct fsid_key miss_key;
+	struct exportent *found = NULL;
+	struct client_set *clients = NULL;
+	unsigned int generation;
+	char buf[RPC_CHAN_BUF_SIZE];
+	int result = CS_FAILED;
+	int ret = 0;
+
+	memset(&s, 0, sizeof(s));
+	if (qword_get_inplace(&bp, &dom) <= 0)
+		goto out;
+	if (qword_get_int(&bp, &fsidtype) != 0)
+		goto out;
+	if (fsidtype < 0 || fsidtype > 7)
+		goto out; /* unknown type */
+	fsidlen = qword_get_inplace(&bp, &fsid);
+	if (fsidlen <= 0 || fsidlen > 32)
+		goto out;
+	if (parse_fsid(fsidtype, fsidlen, fsid, &parsed))
+		goto out;
+
+	generation = upcall_refresh();
+	cachestats_phase(st, CS_PARSE);
+
+	if (is_ipaddr_client(dom)) {
+		clients = lookup_client_set(dom);
+		if (!clients)
+			goto out;
+	}
+	cachestats_phase(st, CS_CLIENT);
+
+	s.parsed = &parsed;
+	s.dom = dom;
+	s.clients = clients;
+
+	/* Now determine export point for this fsid/domain */
+	if (cache_workers ? fsid_index_current(generation) :
+	    fsid_index_update(generation) == 0) {
+		nfsd_fh_uncover(&parsed, fsid_index.has_reexport);
+		if (nfsd_fh_search_index(&s) < 0)
+			goto out;
+		fsid_key_from_parsed(&miss_key, &parsed);
+		if (!s.found && !s.dev_missing &&
+		    !fsid_miss_seen(&miss_key, dom)) {
+			xlog(D_GENERAL, "nfsd_fh: no indexed export for %s, "
+			     "checking all exports", dom);
+			if (nfsd_fh_search_all(&s) < 0)
+				goto out;
+			if (!s.found && !s.dev_missing)
+				fsid_miss_add(&miss_key, dom);
+		}
+	} else {
+		nfsd_fh_uncover(&parsed, exportlist_has_reexport());
+		if (nfsd_fh_search_all(&s) < 0)
+			goto out;
+	}
+	found = s.found;
+	if (s.dev_missing)
+		cachestats_count(CS_FH, CS_DEV_MISSING);
+
+	if (!found) {
+		/* The missing dev could be what we want, so just be
+		 * quiet rather than returning stale yet
+		 */
+		if (s.dev_missing) {
+			*retry = nfsd_fh_request(dom, fsidtype, fsid, fsidlen);
+			ret = 1;
+			goto out;
+		}
+	} else if (found->e_mountpoint &&
+	    !is_mountpoint(found->e_mountpoint[0]?
+			   found->e_mountpoint:
+			   found->e_path)) {
+		/* Cannot export this yet
+		 * should log a warning, but need to rate limit
+		   xlog(L_WARNING, "%s not exported as %d not a mountpoint",
+		   found->e_path, found->e_mountpoint);
+		 */
+		*retry = nfsd_fh_request(dom, fsidtype, fsid, fsidlen);
+		ret = 1;
+		goto out;
+	}
+	cachestats_phase(st, CS_MATCH);
+
+	bp = buf; blen = sizeof(buf);
+	qword_add(&bp, &blen, dom);
+	qword_addint(&bp, &blen, fsidtype);
+	qword_addhex(&bp, &blen, fsid, fsidlen);
+	/* The fsid -> path lookup can be quite expensive as it
+	 * potentially stats and reads lots of devices, and some of those
+	 * might have spun-down.  The Answer is not likely to
+	 * change underneath us, and an 'exportfs -f' can always
+	 * remove this from the kernel, so use a really log
+	 * timeout.  Maybe this should be configurable on the command
+	 * line.
+	 */
+	qword_addint(&bp, &blen, 0x7fffffff);
+	if (found)
+		qword_add(&bp, &blen, s.found_path);
+	qword_addeol(&bp, &blen);
+	if (blen <= 0 || cache_write(f, buf, bp - buf) != bp - buf)
+		xlog(L_ERROR, "nfsd_fh: error writing reply");
+	else {
+		cachestats_phase(st, CS_REPLY);
+		result = found ? CS_HITS : CS_DENIED;
+	}
+	if (!found)
+		xlog(D_AUTH, "denied access to %s", *dom == '$' ? dom+1 : dom);
+out:
+	free(s.found_path);
+	client_set_free(clients);
+	if (!ret) {
+		xlog(D_CALL, "nfsd_fh: found %p path %s",
+		     found, found ? found->e_path : NULL);
+		cachestats_done(st, result);
+	}
+	return ret;
+}
+
+static void nfsd_fh(int f, char *inbuf, int blen)
+{
+	struct cachestats_timer st;
+	struct delayed *d;
+	char *message = NULL;
+
+	xlog(D_CALL, "nfsd_fh: inbuf '%s'", inbuf);
+
+	cachestats_start(&st, CS_FH);
+	if (nfsd_handle_fh(f, inbuf, blen, &st, &message) == 0)
+		return;
+	cachestats_done(&st, CS_RETRIES);
+	/* We don't have a definitive answer to give the kernel.
+	 * This is because an export marked "mountpoint" isn't a
+	 * mountpoint, or because a stat of a mountpoint fails with
+	 * a strange error like ETIMEDOUT as is possible with an
+	 * NFS mount marked "softerr" which is being re-exported.
+	 *
+	 * We cannot tell the kernel to retry, so we have to
+	 * retry ourselves.
+	 */
+	if (!message)
+		return;
+	d = malloc(sizeof(*d));
+
+	if (!d) {
+		free(message);
+		return;
+	}
+	d->message = message;
+	d->f = f;
+	delayed_queue(d);
+}
+
+static void write_fsloc(char **bp, int *blen, struct exportent *ep)
+{
+	struct servers *servers;
+
+	if (ep->e_fslocmethod == FSLOC_NONE)
+		return;
+
+	servers = replicas_lookup(ep->e_fslocmethod, ep->e_fslocdata);
+	if (!servers)
+		return;
+	qword_add(bp, blen, "fsloc");
+	qword_addint(bp, blen, servers->h_num);
+	if (servers->h_num >= 0) {
+		int i;
+		for (i=0; i<servers->h_num; i++) {
+			qword_add(bp, blen, servers->h_mp[i]->h_host);
+			qword_add(bp, blen, servers->h_mp[i]->h_path);
+		}
+	}
+	qword_addint(bp, blen, servers->h_referral);
+	release_replicas(servers);
+}
+
+static void write_secinfo(char **bp, int *blen, struct exportent *ep, int flag_mask, int extra_flag)
+{
+	struct sec_entry *p;
+
+	for (p = ep->e_secinfo; p->flav; p++)
+		; /* Do nothing */
 	if (p == ep->e_secinfo) {
 		/* There was no sec= option */
 		return;
@@ -1154,53 +2893,187 @@ static int dump_to_cache(int f, char *buf, int blen, char *domain,
 	return 0;
 }
 
+/*
+ * Of two exports matching @path, is @exp (of client type @type) a
+ * better choice than @found (of type @found_type)?
+ */
+static bool lookup_export_prefer(nfs_export *found, int found_type,
+				 nfs_export *exp, int type, char *path)
+{
+	/* Always prefer non-V4ROOT exports */
+	if (exp->m_export.e_flags & NFSEXP_V4ROOT)
+		return false;
+	if (found->m_export.e_flags & NFSEXP_V4ROOT)
+		return true;
+
+	/* If one is a CROSSMOUNT, then prefer the longest path */
+	if (((found->m_export.e_flags & NFSEXP_CROSSMOUNT) ||
+	     (exp->m_export.e_flags & NFSEXP_CROSSMOUNT)) &&
+	    strlen(found->m_export.e_path) !=
+	    strlen(exp->m_export.e_path))
+		return strlen(exp->m_export.e_path) >
+			strlen(found->m_export.e_path);
+
+	if (found_type == type && found->m_warned == 0) {
+		xlog(L_WARNING, "%s exported to both %s and %s, "
+		     "arbitrarily choosing options from first",
+		     path, found->m_client->m_hostname, exp->m_client->m_hostname);
+		found->m_warned = 1;
+	}
+	return false;
+}
+
+/*
+ * Paths that, for the domain asking, neither the path index nor a scan
+ * of all exports found.  As with fsid_misses, a client that keeps
+ * asking about a path that is not exported then costs one scan per
+ * export table and mount table generation rather than one per upcall.
+ */
+#define PATH_MISS_BUCKETS	256
+#define PATH_MISS_MAX		1024
+
+struct path_miss {
+	struct path_miss	*next;
+	size_t			domlen;
+	char			key[];		/* domain, NUL, path */
+};
+
+static struct {
+	pthread_mutex_t		lock;
+	unsigned int		generation;
+	unsigned int		mount_generation;
+	unsigned int		count;
+	struct path_miss	*buckets[PATH_MISS_BUCKETS];
+} path_misses = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static unsigned int path_miss_hash(const char *dom, const char *path)
+{
+	unsigned int hash = 2166136261u;
+
+	while (*dom)
+		hash = (hash ^ (unsigned char)*dom++) * 16777619u;
+	hash *= 16777619u;
+	while (*path)
+		hash = (hash ^ (unsigned char)*path++) * 16777619u;
+	return hash % PATH_MISS_BUCKETS;
+}
+
+/* Called with path_misses.lock held */
+static void path_miss_flush(void)
+{
+	struct path_miss *m;
+	unsigned int i;
+
+	for (i = 0; i < PATH_MISS_BUCKETS; i++)
+		while ((m = path_misses.buckets[i]) != NULL) {
+			path_misses.buckets[i] = m->next;
+			free(m);
+		}
+	path_misses.count = 0;
+	path_misses.generation = export_generation;
+	path_misses.mount_generation = mount_generation;
+}
+
+/* Called with path_misses.lock held */
+static void path_miss_check(void)
+{
+	if (path_misses.generation != export_generation ||
+	    path_misses.mount_generation != mount_generation)
+		path_miss_flush();
+}
+
+static bool path_miss_seen(const char *dom, const char *path)
+{
+	size_t domlen = strlen(dom);
+	struct path_miss *m;
+	bool seen = false;
+
+	pthread_mutex_lock(&path_misses.lock);
+	path_miss_check();
+	for (m = path_misses.buckets[path_miss_hash(dom, path)]; m; m = m->next)
+		if (m->domlen == domlen && strcmp(m->key, dom) == 0 &&
+		    strcmp(m->key + domlen + 1, path) == 0) {
+			seen = true;
+			break;
+		}
+	pthread_mutex_unlock(&path_misses.lock);
+	return seen;
+}
+
+static void path_miss_add(const char *dom, const char *path)
+{
+	unsigned int hash = path_miss_hash(dom, path);
+	size_t domlen = strlen(dom);
+	struct path_miss *m;
+
+	m = malloc(sizeof(*m) + domlen + strlen(path) + 2);
+	if (!m)
+		return;
+	m->domlen = domlen;
+	strcpy(m->key, dom);
+	strcpy(m->key + domlen + 1, path);
+
+	pthread_mutex_lock(&path_misses.lock);
+	path_miss_check();
+	if (path_misses.count >= PATH_MISS_MAX)
+		path_miss_flush();
+	m->next = path_misses.buckets[hash];
+	path_misses.buckets[hash] = m;
+	path_misses.count++;
+	pthread_mutex_unlock(&path_misses.lock);
+}
+
 static nfs_export *
-lookup_export(char *dom, char *path, struct addrinfo *ai)
+lookup_export(char *dom, char *path, const struct client_set *clients)
 {
+	struct path_candidates c = { NULL, NULL, 0, 0 };
 	nfs_export *exp;
 	nfs_export *found = NULL;
 	int found_type = 0;
+	unsigned int n;
 	int i;
 
-	for (i=0 ; i < MCL_MAXTYPES; i++) {
-		for (exp = exportlist[i].p_head; exp; exp = exp->m_next) {
-			if (!export_matches(exp, dom, path, ai))
+	if ((cache_workers ? path_index_current(export_generation) :
+			     path_index_update(export_generation) == 0) &&
+	    path_index_search(path, &c) == 0) {
+		for (n = 0; n < c.n; n++) {
+			exp = c.exp[n];
+			i = exp->m_client->m_type;
+			if (!client_matches(exp, dom, clients))
 				continue;
-			if (!found) {
+			if (!found ||
+			    lookup_export_prefer(found, found_type, exp, i, path)) {
 				found = exp;
 				found_type = i;
-				continue;
 			}
-			/* Always prefer non-V4ROOT exports */
-			if (exp->m_export.e_flags & NFSEXP_V4ROOT)
+		}
+		if (found)
+			goto out;
+	}
+
+	/* Also the way to find a path by another name, see path_index */
+	if (path_miss_seen(dom, path))
+		goto out;
+	xlog(D_GENERAL, "nfsd_export: no indexed export of %s for %s, "
+	     "checking all exports", path, dom);
+	for (i=0 ; i < MCL_MAXTYPES; i++) {
+		for (exp = exportlist[i].p_head; exp; exp = exp->m_next) {
+			if (!export_matches(exp, dom, path, clients))
 				continue;
-			if (found->m_export.e_flags & NFSEXP_V4ROOT) {
+			if (!found ||
+			    lookup_export_prefer(found, found_type, exp, i, path)) {
 				found = exp;
 				found_type = i;
-				continue;
-			}
-
-			/* If one is a CROSSMOUNT, then prefer the longest path */
-			if (((found->m_export.e_flags & NFSEXP_CROSSMOUNT) ||
-			     (exp->m_export.e_flags & NFSEXP_CROSSMOUNT)) &&
-			    strlen(found->m_export.e_path) !=
-			    strlen(exp->m_export.e_path)) {
-
-				if (strlen(exp->m_export.e_path) >
-				    strlen(found->m_export.e_path)) {
-					found = exp;
-					found_type = i;
-				}
-				continue;
-
-			} else if (found_type == i && found->m_warned == 0) {
-				xlog(L_WARNING, "%s exported to both %s and %s, "
-				     "arbitrarily choosing options from first",
-				     path, found->m_client->m_hostname, exp->m_client->m_hostname);
-				found->m_warned = 1;
 			}
 		}
 	}
+	if (!found)
+		path_miss_add(dom, path);
+out:
+	free(c.exp);
+	free(c.seq);
 	return found;
 }
 
@@ -1220,7 +3093,7 @@ struct nfs_fsloc_set {
  * Caller must not free returned exportent.
  */
 static struct exportent *lookup_parent_export(char *dom,
-		const char *pathname, struct addrinfo *ai)
+		const char *pathname, const struct client_set *clients)
 {
 	char *parent, *slash;
 	nfs_export *result;
@@ -1244,7 +3117,7 @@ again:
 	*slash = '\0';
 
 	if (strlen(parent) == 0) {
-		result = lookup_export(dom, "/", ai);
+		result = lookup_export(dom, "/", clients);
 		if (result == NULL) {
 			xlog(L_ERROR, "%s: no root export found.", __func__);
 			goto out_default;
@@ -1252,7 +3125,7 @@ again:
 		goto out;
 	}
 
-	result = lookup_export(dom, parent, ai);
+	result = lookup_export(dom, parent, clients);
 	if (result == NULL) {
 		xlog(D_GENERAL, "%s: lookup_export(%s) found nothing",
 			__func__, parent);
@@ -1382,7 +3255,7 @@ out_false:
 static struct exportent *create_junction_exportent(struct exportent *parent,
 		const char *junction, const char *fslocdata, int ttl)
 {
-	static struct exportent *eep;
+	struct exportent *eep;
 
 	eep = (struct exportent *)malloc(sizeof(*eep));
 	if (eep == NULL)
@@ -1414,22 +3287,6 @@ out_nomem:
 	return NULL;
 }
 
-/*
- * Walk through the set of FS locations and build an exportent.
- * Returns pointer to an exportent if "junction" refers to a junction.
- */
-static struct exportent *locations_to_export(struct nfs_fsloc_set *locations,
-		const char *junction, struct exportent *parent)
-{
-	static char fslocdata[BUFSIZ];
-	int ttl;
-
-	fslocdata[0] = '\0';
-	if (!locations_to_fslocdata(locations, fslocdata, sizeof(fslocdata), &ttl))
-		return NULL;
-	return create_junction_exportent(parent, junction, fslocdata, ttl);
-}
-
 static int
 nfs_get_basic_junction(const char *junct_path, struct nfs_fsloc_set **locset)
 {
@@ -1453,66 +3310,318 @@ nfs_get_basic_junction(const char *junct_path, struct nfs_fsloc_set **locset)
 	return 0;
 }
 
-static struct exportent *lookup_junction(char *dom, const char *pathname,
-		struct addrinfo *ai)
+/* libxml2 has to be set up once before any thread parses a junction */
+static pthread_once_t junction_xml_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Read the locations stored in junction "pathname".  Returns the
+ * e_fslocdata string for them, or NULL if "pathname" is not a junction
+ * or its locations cannot be used.
+ */
+static char *read_junction(const char *pathname, int *ttl)
 {
-	struct exportent *parent, *exp = NULL;
 	struct nfs_fsloc_set *locations;
+	char fslocdata[BUFSIZ];
 	int status;
 
-	xmlInitParser();
-
+	pthread_once(&junction_xml_once, xmlInitParser);
 	if (nfs_is_junction(pathname)) {
 		xlog(D_GENERAL, "%s: %s is not a junction",
 			__func__, pathname);
-		goto out;
+		return NULL;
 	}
 	status = nfs_get_basic_junction(pathname, &locations);
 	if (status) {
 		xlog(L_WARNING, "Dangling junction %s: %s",
 			pathname, strerror(status));
-		goto out;
+		return NULL;
 	}
 
-	parent = lookup_parent_export(dom, pathname, ai);
-	if (parent == NULL)
-		goto free_locations;
-
-	exp = locations_to_export(locations, pathname, parent);
-
-free_locations:
+	fslocdata[0] = '\0';
+	if (!locations_to_fslocdata(locations, fslocdata, sizeof(fslocdata), ttl))
+		fslocdata[0] = '\0';
 	nfs_free_locations(locations->ns_list);
 	free(locations);
+	return fslocdata[0] ? strdup(fslocdata) : NULL;
+}
 
-out:
-	xmlCleanupParser();
-	return exp;
+/*
+ * Reading a junction means reading and parsing its extended attributes,
+ * which can take a while, so it is not done by the upcall handlers.
+ * They look the directory up in junction_cache instead, by device and
+ * inode number.  Setting the locations changes the directory's ctime,
+ * so an entry is good until that changes or its TTL runs out.
+ *
+ * A directory not in the cache is read by junction_worker, a thread of
+ * its own.  Meanwhile requests for it wait on its entry, and once it
+ * has been read they are queued with export_ready_queue() to be handled
+ * again by the main loop.  Without a main loop to do that, as when
+ * requests are replayed, the handler reads the directory itself.
+ */
+#define JUNCTION_CACHE_BUCKETS	256
+#define JUNCTION_CACHE_MAX	4096
+
+struct junction_ent {
+	struct junction_ent	*next;
+	dev_t			dev;
+	ino_t			ino;
+	struct timespec		ctime;
+	time_t			expires;	/* CLOCK_MONOTONIC, or 0 */
+	bool			pending;	/* being read */
+	char			*fslocdata;	/* NULL if not a junction */
+	int			ttl;
+	struct delayed		*waiting;	/* requests to handle after */
+	char			path[];
+};
+
+static struct junction_ent *junction_cache[JUNCTION_CACHE_BUCKETS];
+static unsigned int junction_cache_count;
+static pthread_mutex_t junction_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct xthread_workqueue *junction_worker;
+
+static struct junction_ent **junction_bucket(dev_t dev, ino_t ino)
+{
+	return &junction_cache[(ino ^ (ino >> 16) ^ dev) %
+			       JUNCTION_CACHE_BUCKETS];
+}
+
+/* Drop every entry that is not being read.  Called with junction_lock */
+static void junction_cache_prune(void)
+{
+	struct junction_ent **jp, *je;
+	int i;
+
+	for (i = 0; i < JUNCTION_CACHE_BUCKETS; i++)
+		for (jp = &junction_cache[i]; (je = *jp) != NULL; ) {
+			if (je->pending) {
+				jp = &je->next;
+				continue;
+			}
+			*jp = je->next;
+			free(je->fslocdata);
+			free(je);
+			junction_cache_count--;
+		}
+}
+
+static void export_ready_queue(struct delayed *list)
+{
+	struct delayed **tail;
+	uint64_t one = 1;
+
+	if (!list)
+		return;
+	pthread_mutex_lock(&delayed_lock);
+	for (tail = &list; *tail; tail = &(*tail)->next)
+		;
+	*tail = export_ready;
+	export_ready = list;
+	pthread_mutex_unlock(&delayed_lock);
+	if (write(export_ready_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		xlog(L_WARNING, "export_ready_queue: eventfd: %m");
+}
+
+/* Record what reading @je found, and release the requests waiting on it */
+static void junction_cache_set(struct junction_ent *je, char *fslocdata,
+			       int ttl)
+{
+	struct delayed *waiting;
+
+	pthread_mutex_lock(&junction_lock);
+	free(je->fslocdata);
+	je->fslocdata = fslocdata;
+	je->ttl = ttl;
+	je->expires = fslocdata ? monotonic_seconds() + ttl : 0;
+	je->pending = false;
+	waiting = je->waiting;
+	je->waiting = NULL;
+	pthread_mutex_unlock(&junction_lock);
+
+	export_ready_queue(waiting);
+}
+
+static void junction_read_work(void *data)
+{
+	struct junction_ent *je = data;
+	char *fslocdata;
+	int ttl = 0;
+
+	fslocdata = read_junction(je->path, &ttl);
+	junction_cache_set(je, fslocdata, ttl);
+}
+
+/*
+ * The request is decoded in place, so one that is to wait for a
+ * junction is encoded again from what was parsed.
+ */
+static struct delayed *nfsd_export_request(int f, char *dom, char *path)
+{
+	char buf[RPC_CHAN_BUF_SIZE], *bp = buf;
+	int blen = sizeof(buf);
+	struct delayed *d;
+
+	qword_add(&bp, &blen, dom);
+	qword_add(&bp, &blen, path);
+	if (blen <= 0)
+		return NULL;
+	d = calloc(1, sizeof(*d));
+	if (d == NULL)
+		return NULL;
+	d->message = strndup(buf, bp - buf);
+	if (d->message == NULL) {
+		free(d);
+		return NULL;
+	}
+	d->f = f;
+	return d;
+}
+
+/*
+ * Find the locations of junction "pathname".  Returns 0 and sets
+ * "fslocdata" to a copy of them, or to NULL if "pathname" is not a
+ * junction.  Returns 1 if the request on "f" has been put off until
+ * they are known.
+ */
+static int junction_lookup(int f, char *dom, char *pathname,
+		char **fslocdata, int *ttl)
+{
+	struct junction_ent **bucket, *je;
+	struct delayed *d;
+	struct stat st;
+	bool read = false;
+
+	*fslocdata = NULL;
+	if (nfsd_path_stat(pathname, &st) < 0 || !S_ISDIR(st.st_mode))
+		return 0;
+
+	if (export_ready_fd < 0) {
+		/* No main loop to hand requests back to */
+		*fslocdata = read_junction(pathname, ttl);
+		return 0;
+	}
+
+	pthread_mutex_lock(&junction_lock);
+	bucket = junction_bucket(st.st_dev, st.st_ino);
+	for (je = *bucket; je; je = je->next)
+		if (je->dev == st.st_dev && je->ino == st.st_ino)
+			break;
+
+	if (je && !je->pending &&
+	    je->ctime.tv_sec == st.st_ctim.tv_sec &&
+	    je->ctime.tv_nsec == st.st_ctim.tv_nsec &&
+	    (je->expires == 0 || je->expires > monotonic_seconds())) {
+		if (je->fslocdata)
+			*fslocdata = strdup(je->fslocdata);
+		*ttl = je->ttl;
+		pthread_mutex_unlock(&junction_lock);
+		return 0;
+	}
+
+	d = nfsd_export_request(f, dom, pathname);
+	if (d == NULL)
+		goto out_now;
+
+	if (je == NULL) {
+		if (junction_cache_count >= JUNCTION_CACHE_MAX)
+			junction_cache_prune();
+		je = calloc(1, sizeof(*je) + strlen(pathname) + 1);
+		if (je == NULL) {
+			free(d->message);
+			free(d);
+			goto out_now;
+		}
+		je->dev = st.st_dev;
+		je->ino = st.st_ino;
+		strcpy(je->path, pathname);
+		je->next = *bucket;
+		*bucket = je;
+		junction_cache_count++;
+	}
+	if (!je->pending) {
+		/* Changed, expired or not seen before */
+		je->pending = true;
+		je->ctime = st.st_ctim;
+		read = true;
+	}
+	d->next = je->waiting;
+	je->waiting = d;
+	if (read && junction_worker == NULL)
+		junction_worker = xthread_workqueue_alloc();
+	pthread_mutex_unlock(&junction_lock);
+
+	if (read) {
+		xlog(D_GENERAL, "%s: reading junction %s", __func__,
+			je->path);
+		if (junction_worker == NULL ||
+		    xthread_work_queue(junction_worker, junction_read_work,
+				       je) != 0)
+			junction_read_work(je);
+	}
+	return 1;
+
+out_now:
+	pthread_mutex_unlock(&junction_lock);
+	*fslocdata = read_junction(pathname, ttl);
+	return 0;
+}
+
+/*
+ * Returns 0 and sets "eep" to an exportent for junction "pathname",
+ * or to NULL if it is not one.  Returns 1 if the request has been put
+ * off.
+ */
+static int lookup_junction(int f, char *dom, char *pathname,
+		const struct client_set *clients, struct exportent **eep)
+{
+	struct exportent *parent;
+	char *fslocdata;
+	int ttl = 0;
+
+	*eep = NULL;
+	if (junction_lookup(f, dom, pathname, &fslocdata, &ttl))
+		return 1;
+	if (fslocdata == NULL)
+		return 0;
+
+	parent = lookup_parent_export(dom, pathname, clients);
+	if (parent != NULL)
+		*eep = create_junction_exportent(parent, pathname,
+						 fslocdata, ttl);
+	free(fslocdata);
+	return 0;
 }
 
-static void lookup_nonexport(int f, char *buf, int buflen, char *dom, char *path,
-		struct addrinfo *ai)
+/*
+ * Answer a request for a path that is not exported.  Returns 1 if the
+ * answer has been put off.
+ */
+static int lookup_nonexport(int f, char *buf, int buflen, char *dom, char *path,
+		const struct client_set *clients)
 {
 	struct exportent *eep;
 
-	eep = lookup_junction(dom, path, ai);
+	if (lookup_junction(f, dom, path, clients, &eep))
+		return 1;
 	dump_to_cache(f, buf, buflen, dom, path, eep, 0);
 	if (eep == NULL)
-		return;
+		return 0;
 	exportent_release(eep);
 	free(eep);
+	return 0;
 }
 
 #else	/* !HAVE_JUNCTION_SUPPORT */
 
-static void lookup_nonexport(int f, char *buf, int buflen, char *dom, char *path,
-		struct addrinfo *UNUSED(ai))
+static int lookup_nonexport(int f, char *buf, int buflen, char *dom, char *path,
+		const struct client_set *UNUSED(clients))
 {
 	dump_to_cache(f, buf, buflen, dom, path, NULL, 0);
+	return 0;
 }
 
 #endif	/* !HAVE_JUNCTION_SUPPORT */
 
-static void nfsd_export(int f)
+static void nfsd_export(int f, char *inbuf, int UNUSED(blen))
 {
 	/* requests are:
 	 *  domain path
@@ -1522,37 +3631,33 @@ static void nfsd_export(int f)
 
 	char *dom, *path;
 	nfs_export *found = NULL;
-	struct addrinfo *ai = NULL;
+	struct client_set *clients = NULL;
 	char buf[RPC_CHAN_BUF_SIZE], *bp;
-	int blen;
-
-	blen = cache_read(f, buf, sizeof(buf));
-	if (blen <= 0 || buf[blen-1] != '\n') return;
-	buf[blen-1] = 0;
-
-	xlog(D_CALL, "nfsd_export: inbuf '%s'", buf);
+	struct cachestats_timer st;
+	int result = CS_FAILED;
 
-	bp = buf;
-	dom = malloc(blen);
-	path = malloc(blen);
+	xlog(D_CALL, "nfsd_export: inbuf '%s'", inbuf);
 
-	if (!dom || !path)
-		goto out;
+	cachestats_start(&st, CS_EXPORT);
+	bp = inbuf;
+	dom = path = NULL;
 
-	if (qword_get(&bp, dom, blen) <= 0)
+	if (qword_get_inplace(&bp, &dom) <= 0)
 		goto out;
-	if (qword_get(&bp, path, blen) <= 0)
+	if (qword_get_inplace(&bp, &path) <= 0)
 		goto out;
 
-	auth_reload();
+	upcall_refresh();
+	cachestats_phase(&st, CS_PARSE);
 
 	if (is_ipaddr_client(dom)) {
-		ai = lookup_client_addr(dom);
-		if (!ai)
+		clients = lookup_client_set(dom);
+		if (!clients)
 			goto out;
 	}
+	cachestats_phase(&st, CS_CLIENT);
 
-	found = lookup_export(dom, path, ai);
+	found = lookup_export(dom, path, clients);
 
 	if (found) {
 		char *mp = found->m_export.e_mountpoint;
@@ -1563,6 +3668,7 @@ static void nfsd_export(int f)
 		if (mp && !is_mountpoint(mp)) {
 			if (errno != 0 && !path_lookup_error(errno))
 				goto out;
+			cachestats_phase(&st, CS_MATCH);
 			/* Exportpoint is not mounted, so tell kernel it is
 			 * not available.
 			 * This will cause it not to appear in the V4 Pseudo-root
@@ -1576,143 +3682,520 @@ static void nfsd_export(int f)
 			     path);
 			dump_to_cache(f, buf, sizeof(buf), dom, path,
 				      NULL, 60);
-		} else if (dump_to_cache(f, buf, sizeof(buf), dom, path,
-					 &found->m_export, 0) < 0) {
-			xlog(L_WARNING,
-			     "Cannot export %s, possibly unsupported filesystem"
-			     " or fsid= required", path);
-			dump_to_cache(f, buf, sizeof(buf), dom, path, NULL, 0);
+			result = CS_DENIED;
+		} else {
+			cachestats_phase(&st, CS_MATCH);
+			if (dump_to_cache(f, buf, sizeof(buf), dom, path,
+					  &found->m_export, 0) < 0) {
+				xlog(L_WARNING,
+				     "Cannot export %s, possibly unsupported "
+				     "filesystem or fsid= required", path);
+				dump_to_cache(f, buf, sizeof(buf), dom, path,
+					      NULL, 0);
+				result = CS_DENIED;
+			} else
+				result = CS_HITS;
 		}
+	} else if (lookup_nonexport(f, buf, sizeof(buf), dom, path,
+				    clients)) {
+		/* Handled again once the junction has been read */
+		result = CS_RETRIES;
+		goto out;
+	} else {
+		cachestats_phase(&st, CS_MATCH);
+		result = CS_DENIED;
+	}
+	if (result != CS_FAILED)
+		cachestats_phase(&st, CS_REPLY);
+
+ out:
+	cachestats_done(&st, result);
+	xlog(D_CALL, "nfsd_export: found %p path %s", found, path ? path : NULL);
+	client_set_free(clients);
+}
+
+
+struct {
+	char *cache_name;
+	void (*cache_handle)(int f, char *buf, int blen);
+	int f;
+} cachelist[] = {
+	{ "auth.unix.ip", auth_unix_ip, -1 },
+	{ "auth.unix.gid", auth_unix_gid, -1 },
+	{ "nfsd.export", nfsd_export, -1 },
+	{ "nfsd.fh", nfsd_fh, -1 },
+	{ NULL, NULL, -1 }
+};
+
+extern int manage_gids;
+
+/*
+ * Upcall trace, for replaying with tests/upcall_replay.  Each request
+ * read from a channel is appended as one line:
+ *	<seconds>.<nanoseconds> <channel> <request>
+ * Workers share the descriptor, and O_APPEND keeps their lines whole.
+ */
+static char *trace_path;
+static int trace_fd = -1;
+
+/**
+ * cache_open - prepare communications channels with kernel RPC caches
+ *
+ */
+void cache_open(void) 
+{
+	int i;
+
+	for (i=0; cachelist[i].cache_name; i++ ) {
+		char path[100];
+		if (!manage_gids && cachelist[i].cache_handle == auth_unix_gid)
+			continue;
+		sprintf(path, "/proc/net/rpc/%s/channel", cachelist[i].cache_name);
+		cachelist[i].f = open(path, O_RDWR);
+	}
+
+	if (trace_path && trace_fd < 0) {
+		trace_fd = open(trace_path, O_WRONLY | O_CREAT | O_APPEND |
+				O_CLOEXEC, 0600);
+		if (trace_fd < 0)
+			xlog(L_WARNING, "Cannot open upcall trace %s: %m",
+			     trace_path);
+	}
+}
+
+/*
+ * Upcalls are collected with epoll rather than by rebuilding an fd_set
+ * for every select().  The channels are registered edge-triggered and
+ * drained completely on each wakeup, so a burst of upcalls costs one
+ * epoll_wait() rather than one select() per request.  The epoll set is
+ * built on first use so that each worker forked by cache_fork_workers()
+ * gets its own.
+ */
+#define CACHE_MAX_EVENTS 16
+
+static int cache_epoll_fd = -1;
+static int stats_timer_fd = -1;
+static int gid_timer_fd = -1;
+
+static int cache_epoll_add(int fd)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.fd = fd;
+	if (epoll_ctl(cache_epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		xlog(L_ERROR, "cache_epoll_add: fd %d: %m", fd);
+		return -1;
+	}
+	return 0;
+}
+
+static int cache_epoll_init(void)
+{
+	int i;
+
+	if (cache_epoll_fd >= 0)
+		return 0;
+
+	cache_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (cache_epoll_fd < 0) {
+		xlog(L_ERROR, "cache_epoll_init: epoll_create1: %m");
+		return -1;
+	}
+
+	for (i=0; cachelist[i].cache_name; i++)
+		if (cachelist[i].f >= 0)
+			cache_epoll_add(cachelist[i].f);
+
+	if (v4clients_get_fd() >= 0)
+		cache_epoll_add(v4clients_get_fd());
+	if (v4clients_timer_fd() >= 0)
+		cache_epoll_add(v4clients_timer_fd());
+
+	delayed_timer_fd = timerfd_create(CLOCK_MONOTONIC,
+					  TFD_NONBLOCK | TFD_CLOEXEC);
+	if (delayed_timer_fd < 0)
+		xlog(L_WARNING, "cache_epoll_init: timerfd_create: %m");
+	else if (cache_epoll_add(delayed_timer_fd) < 0) {
+		close(delayed_timer_fd);
+		delayed_timer_fd = -1;
 	} else
-		lookup_nonexport(f, buf, sizeof(buf), dom, path, ai);
+		delayed_arm_timer();
+
+	export_ready_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (export_ready_fd < 0)
+		xlog(L_WARNING, "cache_epoll_init: eventfd: %m");
+	else if (cache_epoll_add(export_ready_fd) < 0) {
+		close(export_ready_fd);
+		export_ready_fd = -1;
+	}
+
+	for (i=0; cachelist[i].cache_name; i++)
+		if (cachelist[i].cache_handle == auth_unix_gid &&
+		    cachelist[i].f >= 0) {
+			gid_timer_fd = gidcache_enable(cachelist[i].f);
+			if (gid_timer_fd >= 0 &&
+			    cache_epoll_add(gid_timer_fd) < 0)
+				gid_timer_fd = -1;
+		}
+
+	/* One process is enough to write the statistics */
+	if (worker_index == 0) {
+		stats_timer_fd = cachestats_timer_fd();
+		if (stats_timer_fd >= 0 && cache_epoll_add(stats_timer_fd) < 0)
+			stats_timer_fd = -1;
+	}
+	return 0;
+}
+
+/*
+ * Without a timerfd, fall back to bounding the wait by the first
+ * pending nfsd.fh retry.
+ */
+static int cache_wait_msec(void)
+{
+	time_t delay;
+
+	/* Warm-up goes on between upcalls until it is done */
+	if (cache_warm_pending())
+		return 0;
+	if (delayed_timer_fd >= 0)
+		return -1;
+	pthread_mutex_lock(&delayed_lock);
+	delay = delayed ? delayed->due - monotonic_seconds() : -1;
+	pthread_mutex_unlock(&delayed_lock);
+	if (delay < 0)
+		return delayed ? 0 : -1;
+	return delay * 1000;
+}
+
+struct upcall {
+	void	(*handle)(int f, char *buf, int blen);
+	int	f;
+	int	len;
+	char	buf[];
+};
+
+static void upcall_run(void *data)
+{
+	struct upcall *u = data;
 
- out:
-	xlog(D_CALL, "nfsd_export: found %p path %s", found, path ? path : NULL);
-	if (dom) free(dom);
-	if (path) free(path);
-	nfs_freeaddrinfo(ai);
+	pthread_rwlock_rdlock(&export_lock);
+	u->handle(u->f, u->buf, u->len);
+	pthread_rwlock_unlock(&export_lock);
+	free(u);
 }
 
+/*
+ * Handle one request, which is @len bytes long including the
+ * terminating NUL, here or on a worker thread.
+ */
+static void cache_dispatch(void (*handle)(int f, char *buf, int blen),
+			   int f, char *buf, int len)
+{
+	struct upcall *u;
 
-struct {
-	char *cache_name;
-	void (*cache_handle)(int f);
-	int f;
-} cachelist[] = {
-	{ "auth.unix.ip", auth_unix_ip, -1 },
-	{ "auth.unix.gid", auth_unix_gid, -1 },
-	{ "nfsd.export", nfsd_export, -1 },
-	{ "nfsd.fh", nfsd_fh, -1 },
-	{ NULL, NULL, -1 }
-};
+	if (!cache_workers) {
+		handle(f, buf, len);
+		return;
+	}
 
-extern int manage_gids;
+	u = malloc(sizeof(*u) + len);
+	if (u) {
+		u->handle = handle;
+		u->f = f;
+		u->len = len;
+		memcpy(u->buf, buf, len);
+		if (xthread_work_queue(cache_workers, upcall_run, u) == 0)
+			return;
+		free(u);
+	}
+	/* Better late than never */
+	pthread_rwlock_rdlock(&export_lock);
+	handle(f, buf, len);
+	pthread_rwlock_unlock(&export_lock);
+}
 
-/**
- * cache_open - prepare communications channels with kernel RPC caches
- *
+/*
+ * Retry every queued nfsd.fh request that has come due.  A request that
+ * fails again is queued afresh, RETRY_SEC in the future.
  */
-void cache_open(void) 
+static void nfsd_retry_due(void)
 {
-	int i;
+	time_t now = monotonic_seconds();
+	struct delayed *d;
 
-	for (i=0; cachelist[i].cache_name; i++ ) {
-		char path[100];
-		if (!manage_gids && cachelist[i].cache_handle == auth_unix_gid)
-			continue;
-		sprintf(path, "/proc/net/rpc/%s/channel", cachelist[i].cache_name);
-		cachelist[i].f = open(path, O_RDWR);
+	while ((d = delayed_dequeue(now)) != NULL) {
+		cache_dispatch(nfsd_fh, d->f, d->message,
+			       strlen(d->message) + 1);
+		free(d->message);
+		free(d);
+	}
+}
+
+/* Handle again the nfsd.export requests that were waiting for a junction */
+static void nfsd_export_ready(void)
+{
+	struct delayed *d, *next;
+
+	for (d = export_ready_take(); d; d = next) {
+		next = d->next;
+		cache_dispatch(nfsd_export, d->f, d->message,
+			       strlen(d->message) + 1);
+		free(d->message);
+		free(d);
 	}
 }
 
 /**
- * cache_set_fds - prepare cache file descriptors for one iteration of the service loop
- * @fdset: pointer to fd_set to prepare
+ * cache_trace_enable - record the requests read from the cache channels
+ * @path: file to append them to
+ *
+ * The file is opened by cache_open().
  */
-void cache_set_fds(fd_set *fdset)
+void cache_trace_enable(const char *path)
 {
-	int i;
-	for (i=0; cachelist[i].cache_name; i++) {
-		if (cachelist[i].f >= 0)
-			FD_SET(cachelist[i].f, fdset);
-	}
+	if (trace_path || !path || !*path)
+		return;
+	trace_path = strdup(path);
+}
+
+static void cache_trace(const char *channel, const char *req)
+{
+	char line[RPC_CHAN_BUF_SIZE + 64];
+	struct timespec now;
+	int len;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	len = snprintf(line, sizeof(line), "%lld.%09ld %s %s\n",
+		       (long long)now.tv_sec, now.tv_nsec, channel, req);
+	if (len >= (int)sizeof(line))
+		return;
+	if (write(trace_fd, line, len) != len)
+		xlog(D_GENERAL, "cache_trace: write: %m");
 }
 
 /**
- * cache_process_req - process any active cache file descriptors during service loop iteration
- * @fdset: pointer to fd_set to examine for activity
+ * cache_handle_request - handle one request as if read from a channel
+ * @channel: name of the cache, such as "nfsd.export"
+ * @f: where to write the reply
+ * @buf: the request, without its newline; it is overwritten
+ * @len: length of @buf, including the NUL
+ *
+ * For replaying upcall traces.  Returns -1 if @channel is not known.
  */
-int cache_process_req(fd_set *readfds) 
+int cache_handle_request(const char *channel, int f, char *buf, int len)
 {
 	int i;
-	int cnt = 0;
-	for (i=0; cachelist[i].cache_name; i++) {
-		if (cachelist[i].f >= 0 &&
-		    FD_ISSET(cachelist[i].f, readfds)) {
-			cnt++;
-			cachelist[i].cache_handle(cachelist[i].f);
-			FD_CLR(cachelist[i].f, readfds);
+
+	for (i = 0; cachelist[i].cache_name; i++)
+		if (strcmp(cachelist[i].cache_name, channel) == 0) {
+			cachelist[i].cache_handle(f, buf, len);
+			return 0;
+		}
+	return -1;
+}
+
+/*
+ * Read and handle every request currently queued on a channel.  The
+ * kernel returns 0 from read() once the queue is empty.
+ */
+static void cache_drain(int i)
+{
+	char buf[RPC_CHAN_BUF_SIZE];
+	int f = cachelist[i].f;
+	int len;
+
+	for (;;) {
+		len = cache_read(f, buf, sizeof(buf));
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			break;
+		if (buf[len-1] != '\n')
+			continue;
+		buf[len-1] = '\0';
+		if (trace_fd >= 0)
+			cache_trace(cachelist[i].cache_name, buf);
+		cache_dispatch(cachelist[i].cache_handle, f, buf, len);
+	}
+}
+
+static void cache_handle_events(struct epoll_event *events, int nevents)
+{
+	int n, i;
+
+	for (n = 0; n < nevents; n++) {
+		int fd = events[n].data.fd;
+
+		if (fd == delayed_timer_fd) {
+			uint64_t expirations;
+
+			if (read(fd, &expirations, sizeof(expirations)) < 0 &&
+			    errno != EAGAIN)
+				xlog(L_WARNING, "cache_process: timerfd: %m");
+			continue;
+		}
+		if (fd == export_ready_fd) {
+			nfsd_export_ready();
+			continue;
+		}
+		if (fd == v4clients_get_fd()) {
+			v4clients_process();
+			continue;
+		}
+		if (fd == v4clients_timer_fd()) {
+			v4clients_flush();
+			continue;
+		}
+		if (fd == gid_timer_fd) {
+			gidcache_refresh_ahead();
+			continue;
+		}
+		if (fd == stats_timer_fd) {
+			cachestats_write();
+			continue;
 		}
+		for (i=0; cachelist[i].cache_name; i++)
+			if (cachelist[i].f == fd) {
+				cache_drain(i);
+				break;
+			}
 	}
-	return cnt;
 }
 
 /**
  * cache_process - process incoming upcalls
+ * @readfds: RPC descriptors to wait on as well, or NULL
+ *
  * Returns -ve on error, or number of fds in svc_fds
  * that might need processing.
  */
 int cache_process(fd_set *readfds)
 {
-	fd_set fdset;
-	int	selret;
-	struct timeval tv = { 24*3600, 0 };
-
-	if (!readfds) {
-		FD_ZERO(&fdset);
-		readfds = &fdset;
-	}
-	cache_set_fds(readfds);
-	v4clients_set_fds(readfds);
-
-	if (delayed) {
-		time_t now = time(NULL);
-		time_t delay;
-		if (delayed->last_attempt > now)
-			/* Clock updated - retry immediately */
-			delayed->last_attempt = now - RETRY_SEC;
-		delay = delayed->last_attempt + RETRY_SEC - now;
-		if (delay < 0)
-			delay = 0;
-		tv.tv_sec = delay;
-	}
-	selret = select(FD_SETSIZE, readfds, NULL, NULL, &tv);
-
-	if (delayed) {
-		time_t now = time(NULL);
-		struct delayed *d = delayed;
-
-		if (d->last_attempt + RETRY_SEC <= now) {
-			delayed = d->next;
-			d->next = NULL;
-			nfsd_retry_fh(d);
-		}
-	}
+	struct epoll_event events[CACHE_MAX_EVENTS];
+	int nevents, selret = 0;
 
-	switch (selret) {
-	case -1:
-		if (errno == EINTR || errno == ECONNREFUSED
-		    || errno == ENETUNREACH || errno == EHOSTUNREACH)
-			return 0;
+	if (cache_epoll_init() < 0)
 		return -1;
 
-	default:
-		selret -= cache_process_req(readfds);
-		selret -= v4clients_process(readfds);
+	if (readfds) {
+		/* mountd still serves RPC from svc_fdset, so wait on
+		 * those descriptors and the epoll descriptor together.
+		 */
+		struct timeval tv, *tvp = NULL;
+		int msec = cache_wait_msec();
+
+		if (msec >= 0) {
+			tv.tv_sec = msec / 1000;
+			tv.tv_usec = (msec % 1000) * 1000;
+			tvp = &tv;
+		}
+		if (cache_epoll_fd >= FD_SETSIZE) {
+			errno = EMFILE;
+			return -1;
+		}
+		FD_SET(cache_epoll_fd, readfds);
+		selret = select(FD_SETSIZE, readfds, NULL, NULL, tvp);
 		if (selret < 0)
-			selret = 0;
+			goto err;
+		nevents = 0;
+		if (FD_ISSET(cache_epoll_fd, readfds)) {
+			FD_CLR(cache_epoll_fd, readfds);
+			selret--;
+			nevents = epoll_wait(cache_epoll_fd, events,
+					     CACHE_MAX_EVENTS, 0);
+		}
+	} else
+		nevents = epoll_wait(cache_epoll_fd, events, CACHE_MAX_EVENTS,
+				     cache_wait_msec());
+
+	if (nevents < 0)
+		goto err;
+	if (auth_reload_needed() || mountinfo_poll()) {
+		/* Waits for the upcalls already handed out to finish */
+		if (cache_workers)
+			pthread_rwlock_wrlock(&export_lock);
+		cache_refresh();
+		if (cache_workers)
+			pthread_rwlock_unlock(&export_lock);
 	}
+	cache_warm_check();
+	cachestats_publish();
+	cache_handle_events(events, nevents);
+	nfsd_retry_due();
 	return selret;
+
+err:
+	if (errno == EINTR || errno == ECONNREFUSED
+	    || errno == ENETUNREACH || errno == EHOSTUNREACH)
+		return 0;
+	return -1;
+}
+
+/**
+ * cache_start_threads - handle upcalls on a pool of threads
+ * @num_threads: number of worker threads to start
+ *
+ * The alternative to cache_fork_workers(): this process goes on reading
+ * the channels in cache_process() and hands each upcall to one of the
+ * threads, which all share its export table and caches.
+ *
+ * Returns 0 on success, or -1 if the threads could not be started.
+ */
+int cache_start_threads(int num_threads)
+{
+	pthread_rwlockattr_t attr;
+
+	/* Don't let a stream of upcalls hold off a reload */
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr,
+			PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&export_lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+
+	cache_workers = xthread_workqueue_alloc_pool(num_threads);
+	if (!cache_workers) {
+		xlog(L_WARNING, "Unable to start upcall worker threads");
+		return -1;
+	}
+	xlog(L_NOTICE, "Handling upcalls with %d worker threads",
+	     num_threads);
+	return 0;
+}
+
+/**
+ * cache_lock_exports - share the export table with upcalls
+ *
+ * Code outside the upcall handlers that walks the export table, such
+ * as mountd's RPC handlers, must call this first when upcalls are
+ * handled by worker threads.  A changed etab is loaded here, and the
+ * table is then held for reading only: until cache_unlock_exports(),
+ * auth_reload() leaves it as it is and upcalls carry on alongside.
+ */
+void cache_lock_exports(void)
+{
+	if (!cache_workers)
+		return;
+	if (auth_reload_needed()) {
+		pthread_rwlock_wrlock(&export_lock);
+		cache_refresh();
+		pthread_rwlock_unlock(&export_lock);
+	}
+	pthread_rwlock_rdlock(&export_lock);
+	auth_reload_freeze(true);
+}
+
+/**
+ * cache_unlock_exports - stop sharing the export table
+ */
+void cache_unlock_exports(void)
+{
+	if (!cache_workers)
+		return;
+	auth_reload_freeze(false);
+	pthread_rwlock_unlock(&export_lock);
 }
 
 /*
@@ -1721,11 +4204,26 @@ int cache_process(fd_set *readfds)
  * % echo $domain $path $[now+DEFAULT_TTL] $options $anonuid $anongid $fsid > /proc/net/rpc/nfsd.export/channel
  */
 
+/*
+ * Descriptors for writing to the auth.unix.ip and nfsd.export channels
+ * outside of upcalls.  They are opened on first use and kept open.
+ */
+static int ip_channel_fd = -1;
+static int export_channel_fd = -1;
+
+static int cache_channel_fd(int *fdp, const char *path)
+{
+	if (*fdp < 0)
+		*fdp = open(path, O_WRONLY | O_CLOEXEC);
+	return *fdp;
+}
+
 static int cache_export_ent(char *buf, int buflen, char *domain, struct exportent *exp, char *path)
 {
 	int f, err;
 
-	f = open("/proc/net/rpc/nfsd.export/channel", O_WRONLY);
+	f = cache_channel_fd(&export_channel_fd,
+			     "/proc/net/rpc/nfsd.export/channel");
 	if (f < 0) return -1;
 
 	err = dump_to_cache(f, buf, buflen, domain, exp->e_path, exp, 0);
@@ -1775,7 +4273,6 @@ static int cache_export_ent(char *buf, int buflen, char *domain, struct exporten
 		break;
 	}
 
-	close(f);
 	return err;
 }
 
@@ -1790,7 +4287,8 @@ int cache_export(nfs_export *exp, char *path)
 	char buf[RPC_CHAN_BUF_SIZE], *bp;
 	int blen, f;
 
-	f = open("/proc/net/rpc/auth.unix.ip/channel", O_WRONLY);
+	f = cache_channel_fd(&ip_channel_fd,
+			     "/proc/net/rpc/auth.unix.ip/channel");
 	if (f < 0)
 		return -1;
 
@@ -1801,12 +4299,331 @@ int cache_export(nfs_export *exp, char *path)
 	qword_add(&bp, &blen, exp->m_client->m_hostname);
 	qword_addeol(&bp, &blen);
 	if (blen <= 0 || cache_write(f, buf, bp - buf) != bp - buf) blen = -1;
-	close(f);
 	if (blen < 0) return -1;
 
+	/*
+	 * Not called from an upcall, so the mount table caches may be
+	 * stale.  Worker threads may be reading them, though, and then
+	 * cache_process() has just refreshed them.
+	 */
+	if (!cache_workers)
+		cache_refresh_mounts();
 	return cache_export_ent(buf, sizeof(buf), exp->m_client->m_hostname, &exp->m_export, path);
 }
 
+/*
+ * Warm-up: when the export table is (re)loaded, tell the kernel which
+ * domain each client we know of belongs to, and which exports each of
+ * those domains may use, before the clients ask.  After a restart or
+ * failover this saves every client a round of upcalls per export.
+ *
+ * The kernel parses a single entry per write, so entries are written
+ * one at a time, but all over the same descriptors and only once per
+ * domain however many clients map to it.
+ *
+ * Warm-up is done a bit at a time, between handling upcalls, so that
+ * it does not hold them up: each pass of cache_process() spends at
+ * most WARM_BUDGET_MSEC on it, resuming where the last one stopped.
+ * The budget is checked after each export and each client; looking a
+ * client up in DNS is not interrupted.  A new export table starts it
+ * over.
+ */
+#define WARM_BUDGET_MSEC	20
+
+static char **(*warm_known_clients)(void);
+static bool warm_enabled;
+
+struct warm_domain {
+	struct warm_domain	*next;
+	char			name[];
+};
+
+static struct {
+	unsigned int		generation;
+	bool			active;
+	char			**lists[2];
+	int			list;
+	char			**next;		/* in lists[list] */
+	struct warm_domain	*done;
+	/* the domain whose exports are being written, and how far */
+	char			*domain;
+	struct client_set	*clients;
+	int			type;
+	nfs_export		*exp;
+	unsigned int		entries;
+	unsigned int		nclients;
+	struct timespec		start;
+} warm;
+
+static void cache_warm_free(char **addrs)
+{
+	char **ap;
+
+	if (addrs == NULL)
+		return;
+	for (ap = addrs; *ap; ap++)
+		free(*ap);
+	free(addrs);
+}
+
+static bool cache_warm_seen(struct warm_domain **done, const char *domain)
+{
+	struct warm_domain *d;
+
+	for (d = *done; d; d = d->next)
+		if (strcmp(d->name, domain) == 0)
+			return true;
+	d = malloc(sizeof(*d) + strlen(domain) + 1);
+	if (d) {
+		strcpy(d->name, domain);
+		d->next = *done;
+		*done = d;
+	}
+	return false;
+}
+
+static bool cache_warm_expired(const struct timespec *deadline)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec > deadline->tv_sec ||
+		(now.tv_sec == deadline->tv_sec &&
+		 now.tv_nsec >= deadline->tv_nsec);
+}
+
+static void cache_warm_domain_done(void)
+{
+	client_set_free(warm.clients);
+	free(warm.domain);
+	warm.clients = NULL;
+	warm.domain = NULL;
+}
+
+/*
+ * Write the entries for warm.domain, from warm.exp on.  Returns false
+ * if the budget ran out before all exports were looked at.
+ */
+static bool cache_warm_domain(const struct timespec *deadline)
+{
+	char buf[RPC_CHAN_BUF_SIZE];
+	nfs_export *exp, *found;
+	char *mp;
+	int f;
+
+	f = cache_channel_fd(&export_channel_fd,
+			     "/proc/net/rpc/nfsd.export/channel");
+	if (f < 0)
+		return true;
+
+	for (; warm.type < MCL_MAXTYPES; warm.type++) {
+		if (warm.exp == NULL)
+			warm.exp = exportlist[warm.type].p_head;
+		for (; warm.exp; warm.exp = exp->m_next) {
+			if (cache_warm_expired(deadline))
+				return false;
+			exp = warm.exp;
+			if (!client_matches(exp, warm.domain, warm.clients))
+				continue;
+			/* write each path once, with what an upcall
+			 * would have got */
+			found = lookup_export(warm.domain, exp->m_export.e_path,
+					      warm.clients);
+			if (found != exp)
+				continue;
+			mp = exp->m_export.e_mountpoint;
+			if (mp && !*mp)
+				mp = exp->m_export.e_path;
+			if (mp && !is_mountpoint(mp))
+				continue;
+			if (dump_to_cache(f, buf, sizeof(buf), warm.domain,
+					  exp->m_export.e_path,
+					  &exp->m_export, 0) == 0)
+				warm.entries++;
+		}
+	}
+	return true;
+}
+
+/*
+ * Tell the kernel which domain @addr belongs to, and if that is a new
+ * one, make it warm.domain.
+ */
+static void cache_warm_client(const char *addr)
+{
+	char ipaddr[INET6_ADDRSTRLEN + 1];
+	char buf[RPC_CHAN_BUF_SIZE], *bp;
+	struct client_set *clients = NULL;
+	struct addrinfo *tmp, *ai;
+	char *client, *domain;
+	int blen, f;
+
+	f = cache_channel_fd(&ip_channel_fd,
+			     "/proc/net/rpc/auth.unix.ip/channel");
+	if (f < 0)
+		return;
+
+	tmp = host_pton(addr);
+	if (tmp == NULL)
+		return;
+	ai = client_resolve(tmp->ai_addr);
+	nfs_freeaddrinfo(tmp);
+	if (ai == NULL)
+		return;
+
+	/* the same answer auth_unix_ip() would give */
+	client = client_compose(ai);
+	if (client == NULL)
+		goto out;
+	ipaddr[0] = '$';
+	host_ntop(ai->ai_addr, ipaddr + 1, sizeof(ipaddr) - 1);
+	if (use_ipaddr)
+		domain = ipaddr;
+	else
+		domain = *client ? client : "DEFAULT";
+
+	bp = buf; blen = sizeof(buf);
+	qword_add(&bp, &blen, "nfsd");
+	qword_add(&bp, &blen, ipaddr + 1);
+	qword_adduint(&bp, &blen, time(0) + default_ttl);
+	qword_add(&bp, &blen, domain);
+	qword_addeol(&bp, &blen);
+	if (blen <= 0 || cache_write(f, buf, bp - buf) != bp - buf)
+		goto out;
+
+	if (cache_warm_seen(&warm.done, domain))
+		goto out;
+	if (is_ipaddr_client(domain)) {
+		clients = client_match(ai);
+		if (clients == NULL)
+			goto out;
+	}
+	warm.domain = strdup(domain);
+	if (warm.domain == NULL)
+		goto out;
+	warm.clients = clients;
+	clients = NULL;
+	warm.type = 0;
+	warm.exp = NULL;
+out:
+	client_set_free(clients);
+	free(client);
+	nfs_freeaddrinfo(ai);
+}
+
+static void cache_warm_stop(void)
+{
+	struct warm_domain *d;
+	int i;
+
+	cache_warm_domain_done();
+	for (i = 0; i < 2; i++)
+		cache_warm_free(warm.lists[i]);
+	while ((d = warm.done) != NULL) {
+		warm.done = d->next;
+		free(d);
+	}
+	memset(&warm, 0, sizeof(warm));
+}
+
+static void cache_warm_start(unsigned int generation)
+{
+	cache_warm_stop();
+	warm.generation = generation;
+	warm.active = true;
+	clock_gettime(CLOCK_MONOTONIC, &warm.start);
+	if (warm_known_clients)
+		warm.lists[0] = warm_known_clients();
+	warm.lists[1] = v4clients_addrs();
+	warm.next = warm.lists[0];
+}
+
+/* Returns the next client address to warm for, or NULL when done */
+static const char *cache_warm_next(void)
+{
+	while (warm.list < 2) {
+		if (warm.next && *warm.next)
+			return *warm.next++;
+		if (++warm.list < 2)
+			warm.next = warm.lists[warm.list];
+	}
+	return NULL;
+}
+
+/* Do as much of the warm-up as fits in the budget */
+static void cache_warm_step(void)
+{
+	struct timespec deadline, end;
+	unsigned int generation;
+	const char *addr;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_nsec += WARM_BUDGET_MSEC * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	for (;;) {
+		if (warm.domain) {
+			if (!cache_warm_domain(&deadline))
+				return;
+			cache_warm_domain_done();
+		}
+		if (cache_warm_expired(&deadline))
+			return;
+		addr = cache_warm_next();
+		if (addr == NULL)
+			break;
+		cache_warm_client(addr);
+		warm.nclients++;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	xlog(D_GENERAL, "cache_warm: %u export entries for %u clients in %ld ms",
+	     warm.entries, warm.nclients,
+	     (long)((end.tv_sec - warm.start.tv_sec) * 1000 +
+		    (end.tv_nsec - warm.start.tv_nsec) / 1000000));
+	/* keep the generation, so it is not done again */
+	generation = warm.generation;
+	cache_warm_stop();
+	warm.generation = generation;
+}
+
+static bool cache_warm_pending(void)
+{
+	return warm.active;
+}
+
+/*
+ * Warm the kernel caches if the export table changed since last time,
+ * or carry on doing so.  Called by cache_process() after refreshing
+ * the export table.
+ */
+static void cache_warm_check(void)
+{
+	/* forked workers share the kernel caches; one is enough */
+	if (!warm_enabled || worker_index != 0)
+		return;
+	if (export_generation != warm.generation)
+		cache_warm_start(export_generation);
+	if (warm.active)
+		cache_warm_step();
+}
+
+/**
+ * cache_warm_enable - preload the kernel caches on startup and reload
+ * @known_clients: returns a NULL-terminated array of addresses of
+ *		   clients to preload for, in addition to the NFSv4
+ *		   clients the kernel knows about; may be NULL.  The
+ *		   array and the strings in it are freed with free(3).
+ */
+void cache_warm_enable(char **(*known_clients)(void))
+{
+	warm_known_clients = known_clients;
+	warm_enabled = true;
+}
+
 /**
  * cache_get_filehandle - given an nfs_export, get its root filehandle
  * @exp: target nfs_export
@@ -1903,6 +4720,8 @@ cache_fork_workers(char *prog, int num_threads)
 		}
 		if (pid == 0) {
 			/* worker child */
+			worker_index = i;
+			cachestats_worker(i);
 
 			/* Re-enable the default action on SIGTERM et al
 			 * so that workers die naturally when sent them.
@@ -0,0 +1,373 @@
+/*
+ * support/export/cachestats.c
+ *
+ * Counters and latency histograms for kernel cache upcalls.
+ *
+ * Each upcall handler notes when it finishes a phase of its work
+ * (parsing the request, matching the client, matching the export or
+ * filehandle, writing the reply) and how the upcall ended.  Times go
+ * into power-of-two histograms, one per channel and phase.  When a
+ * stats file is configured, the totals are written to it every few
+ * seconds, in a form a local monitoring agent can parse.
+ *
+ * The counters live in a shared mapping made before the daemon forks
+ * its workers, so the file covers every worker, not just the one that
+ * writes it.  The gid cache is private to each worker, so each copies
+ * its counters into a slot of the mapping for the writer to add up.
+ * What the last etab reload did and the NFSv4 client summary are the
+ * writer's own view; every worker reads the same etab and client list,
+ * and the file says so.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include "nfslib.h"
+#include "export.h"
+#include "xlog.h"
+
+#define CACHESTATS_BUCKETS	24
+/* As many as mountd and exportd fork at most */
+#define CACHESTATS_WORKERS	64
+
+enum {
+	GS_ENTRIES, GS_HITS, GS_STALE, GS_MISSES, GS_NEGATIVE, GS_REFRESHES,
+	GS_EVICTIONS,
+	GS_COUNTERS
+};
+
+struct cachestats {
+	uint64_t	counters[CS_CHANNELS][CS_COUNTERS];
+	uint64_t	usecs[CS_CHANNELS][CS_PHASES];
+	uint64_t	hist[CS_CHANNELS][CS_PHASES][CACHESTATS_BUCKETS];
+	int64_t		delayed;
+	uint64_t	gidcache[CACHESTATS_WORKERS][GS_COUNTERS];
+};
+
+static struct cachestats *stats;
+static int stats_worker;
+static char *stats_path;
+static int stats_interval;
+static int stats_timer_fd = -1;
+static time_t stats_started;
+
+static const char *channel_names[CS_CHANNELS] = {
+	[CS_IP]		= "auth.unix.ip",
+	[CS_GID]	= "auth.unix.gid",
+	[CS_EXPORT]	= "nfsd.export",
+	[CS_FH]		= "nfsd.fh",
+};
+
+static const char *phase_names[CS_PHASES] = {
+	[CS_PARSE]	= "parse",
+	[CS_CLIENT]	= "client",
+	[CS_MATCH]	= "match",
+	[CS_REPLY]	= "reply",
+	[CS_TOTAL]	= "total",
+};
+
+static const char *gidcache_names[GS_COUNTERS] = {
+	[GS_ENTRIES]	= "entries",
+	[GS_HITS]	= "hits",
+	[GS_STALE]	= "stale",
+	[GS_MISSES]	= "misses",
+	[GS_NEGATIVE]	= "negative",
+	[GS_REFRESHES]	= "refreshes",
+	[GS_EVICTIONS]	= "evictions",
+};
+
+static const char *counter_names[CS_COUNTERS] = {
+	[CS_UPCALLS]	= "upcalls",
+	[CS_HITS]	= "hits",
+	[CS_DENIED]	= "denied",
+	[CS_FAILED]	= "failed",
+	[CS_RETRIES]	= "retries",
+	[CS_DEV_MISSING] = "dev_missing",
+};
+
+static inline void stat_add(uint64_t *p, uint64_t n)
+{
+	__atomic_fetch_add(p, n, __ATOMIC_RELAXED);
+}
+
+static uint64_t elapsed_usecs(const struct timespec *from,
+			      const struct timespec *to)
+{
+	int64_t us = (int64_t)(to->tv_sec - from->tv_sec) * 1000000 +
+		     (to->tv_nsec - from->tv_nsec) / 1000;
+
+	return us < 0 ? 0 : us;
+}
+
+static void record(int channel, int phase, uint64_t us)
+{
+	int bucket = 0;
+
+	while (bucket < CACHESTATS_BUCKETS - 1 && us >= (1ULL << bucket))
+		bucket++;
+	stat_add(&stats->usecs[channel][phase], us);
+	stat_add(&stats->hist[channel][phase][bucket], 1);
+}
+
+/**
+ * cachestats_enable - start collecting upcall statistics
+ * @path: file to write them to
+ * @interval: seconds between updates of @path
+ *
+ * Must be called before the daemon forks its workers.
+ */
+void cachestats_enable(const char *path, int interval)
+{
+	if (stats || !path || !*path)
+		return;
+	stats = mmap(NULL, sizeof(*stats), PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (stats == MAP_FAILED) {
+		xlog(L_WARNING, "cachestats: cannot allocate counters: %m");
+		stats = NULL;
+		return;
+	}
+	stats_path = strdup(path);
+	stats_interval = interval > 0 ? interval : 10;
+	stats_started = time(NULL);
+}
+
+/**
+ * cachestats_timer_fd - descriptor that becomes readable when the stats
+ * file is due to be written, or -1
+ *
+ * Only the process that calls this writes the stats file.
+ */
+int cachestats_timer_fd(void)
+{
+	struct itimerspec its = {
+		.it_value.tv_sec = stats_interval,
+		.it_interval.tv_sec = stats_interval,
+	};
+
+	if (!stats || !stats_path || stats_timer_fd >= 0)
+		return stats_timer_fd;
+	stats_timer_fd = timerfd_create(CLOCK_MONOTONIC,
+					TFD_NONBLOCK | TFD_CLOEXEC);
+	if (stats_timer_fd < 0)
+		return -1;
+	if (timerfd_settime(stats_timer_fd, 0, &its, NULL) < 0) {
+		close(stats_timer_fd);
+		stats_timer_fd = -1;
+	}
+	return stats_timer_fd;
+}
+
+void cachestats_start(struct cachestats_timer *t, int channel)
+{
+	t->channel = channel;
+	if (!stats)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &t->start);
+	t->mark = t->start;
+}
+
+/* Charge the time since the previous phase ended to @phase */
+void cachestats_phase(struct cachestats_timer *t, int phase)
+{
+	struct timespec now;
+
+	if (!stats)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	record(t->channel, phase, elapsed_usecs(&t->mark, &now));
+	t->mark = now;
+}
+
+/* The upcall is finished, with @result (CS_HITS, CS_DENIED, ...) */
+void cachestats_done(struct cachestats_timer *t, int result)
+{
+	struct timespec now;
+
+	if (!stats)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	record(t->channel, CS_TOTAL, elapsed_usecs(&t->start, &now));
+	stat_add(&stats->counters[t->channel][CS_UPCALLS], 1);
+	stat_add(&stats->counters[t->channel][result], 1);
+}
+
+void cachestats_count(int channel, int counter)
+{
+	if (stats)
+		stat_add(&stats->counters[channel][counter], 1);
+}
+
+/* Track the length of the nfsd.fh retry list */
+void cachestats_delayed(int delta)
+{
+	if (stats)
+		__atomic_fetch_add(&stats->delayed, delta, __ATOMIC_RELAXED);
+}
+
+static uint64_t stat_get(uint64_t *p)
+{
+	return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+/**
+ * cachestats_worker - tell which worker process this is
+ * @index: from 0 up, as numbered by cache_fork_workers()
+ *
+ */
+void cachestats_worker(int index)
+{
+	stats_worker = index;
+}
+
+static void publish(void)
+{
+	struct gidcache_stats gs;
+	uint64_t *slot;
+
+	if (stats_worker < 0 || stats_worker >= CACHESTATS_WORKERS)
+		return;
+	slot = stats->gidcache[stats_worker];
+	gidcache_get_stats(&gs);
+	__atomic_store_n(&slot[GS_ENTRIES], gs.entries, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot[GS_HITS], gs.hits, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot[GS_STALE], gs.stale, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot[GS_MISSES], gs.misses, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot[GS_NEGATIVE], gs.negative, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot[GS_REFRESHES], gs.refreshes, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot[GS_EVICTIONS], gs.evictions, __ATOMIC_RELAXED);
+}
+
+/**
+ * cachestats_publish - share this worker's private counters
+ *
+ * Cheap enough to call on every pass of the main loop; the counters
+ * are copied at most once a second.
+ */
+void cachestats_publish(void)
+{
+	static time_t last;
+	time_t now;
+
+	if (!stats)
+		return;
+	now = time(NULL);
+	if (now == last)
+		return;
+	last = now;
+	publish();
+}
+
+static void cachestats_print(FILE *f)
+{
+	const struct xtab_reload_stats *rs = auth_reload_stats();
+	struct v4clients_stats vs;
+	uint64_t sum;
+	int c, p, i, w;
+
+	fprintf(f, "# nfs-utils upcall statistics\n");
+	fprintf(f, "pid %d\n", (int)getpid());
+	fprintf(f, "time %lld\n", (long long)time(NULL));
+	fprintf(f, "uptime %lld\n", (long long)(time(NULL) - stats_started));
+	/* Up to date for this worker, the others as of their last pass */
+	publish();
+	for (i = 0; i < GS_COUNTERS; i++) {
+		for (sum = 0, w = 0; w < CACHESTATS_WORKERS; w++)
+			sum += stat_get(&stats->gidcache[w][i]);
+		fprintf(f, "gidcache.%s %llu\n", gidcache_names[i],
+			(unsigned long long)sum);
+	}
+	fprintf(f, "# reload.* and v4clients.* as seen by worker %d\n",
+		stats_worker);
+	fprintf(f, "reload.generation %u\n", rs->generation);
+	fprintf(f, "reload.entries %u\n", rs->entries);
+	fprintf(f, "reload.added %u\n", rs->added);
+	fprintf(f, "reload.changed %u\n", rs->changed);
+	fprintf(f, "reload.removed %u\n", rs->removed);
+	fprintf(f, "reload.usecs %lu\n", rs->usecs);
+	fprintf(f, "reload.image %u\n", rs->image);
+	v4clients_get_stats(&vs);
+	fprintf(f, "v4clients.clients %u\n", vs.clients);
+	fprintf(f, "v4clients.unconfirmed %u\n", vs.unconfirmed);
+	fprintf(f, "v4clients.unread %u\n", vs.unread);
+	for (i = 0; i < V4CLIENTS_MINORS; i++)
+		fprintf(f, "v4clients.minor%d %u\n", i, vs.minor[i]);
+	fprintf(f, "v4clients.events %lu\n", vs.events);
+	fprintf(f, "v4clients.coalesced %lu\n", vs.coalesced);
+	fprintf(f, "v4clients.reads %lu\n", vs.reads);
+	fprintf(f, "v4clients.overflows %lu\n", vs.overflows);
+	fprintf(f, "delayed %lld\n",
+		(long long)__atomic_load_n(&stats->delayed, __ATOMIC_RELAXED));
+
+	/* Bucket i counts times under 2^i microseconds, the last the rest */
+	fprintf(f, "histogram.bounds_usecs");
+	for (i = 0; i < CACHESTATS_BUCKETS - 1; i++)
+		fprintf(f, " %llu", 1ULL << i);
+	fprintf(f, " inf\n");
+
+	for (c = 0; c < CS_CHANNELS; c++) {
+		for (i = 0; i < CS_COUNTERS; i++)
+			fprintf(f, "%s.%s %llu\n", channel_names[c],
+				counter_names[i],
+				(unsigned long long)stat_get(&stats->counters[c][i]));
+		for (p = 0; p < CS_PHASES; p++) {
+			fprintf(f, "%s.%s.usecs %llu\n", channel_names[c],
+				phase_names[p],
+				(unsigned long long)stat_get(&stats->usecs[c][p]));
+			fprintf(f, "%s.%s.histogram", channel_names[c],
+				phase_names[p]);
+			for (i = 0; i < CACHESTATS_BUCKETS; i++)
+				fprintf(f, " %llu", (unsigned long long)
+					stat_get(&stats->hist[c][p][i]));
+			fprintf(f, "\n");
+		}
+	}
+}
+
+/**
+ * cachestats_write - write the stats file
+ *
+ * The file is replaced atomically, so a reader never sees half of it.
+ */
+void cachestats_write(void)
+{
+	uint64_t expirations;
+	char *tmp;
+	FILE *f;
+	int err;
+
+	if (!stats || !stats_path)
+		return;
+	if (stats_timer_fd >= 0 &&
+	    read(stats_timer_fd, &expirations, sizeof(expirations)) < 0 &&
+	    errno != EAGAIN)
+		xlog(L_WARNING, "cachestats: timerfd: %m");
+
+	if (asprintf(&tmp, "%s.tmp", stats_path) < 0)
+		return;
+	f = fopen(tmp, "w");
+	if (!f) {
+		xlog(L_WARNING, "cachestats: cannot create %s: %m", tmp);
+		free(tmp);
+		return;
+	}
+	cachestats_print(f);
+	err = ferror(f);
+	if (fclose(f) != 0 || err || rename(tmp, stats_path) < 0) {
+		xlog(L_WARNING, "cachestats: cannot write %s: %m", stats_path);
+		unlink(tmp);
+	}
+	free(tmp);
+}
@@ -18,20 +18,15 @@
 #include <ctype.h>
 #include <netdb.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "sockaddr.h"
 #include "misc.h"
 #include "nfslib.h"
 #include "exportfs.h"
 
-/* netgroup stuff never seems to be defined in any header file. Linux is
- * not alone in this.
- */
-#if !defined(__GLIBC__) || __GLIBC__ < 2
-extern int	innetgr(char *netgr, char *host, char *, char *);
-#endif
-
 static char	*add_name(char *old, const char *add);
+static void	client_index_invalidate(void);
 
 nfs_client	*clientlist[MCL_MAXTYPES] = { NULL, };
 
@@ -55,6 +50,7 @@ init_addrlist(nfs_client *clp, const struct addrinfo *ai)
 static void
 client_free(nfs_client *clp)
 {
+	client_index_invalidate();
 	free(clp->m_hostname);
 	free(clp);
 }
@@ -237,6 +233,7 @@ client_init(nfs_client *clp, const char *hname, const struct addrinfo *ai)
 	clp->m_exported = 0;
 	clp->m_count = 0;
 	clp->m_naddr = 0;
+	clp->m_refresh_gen = 0;
 
 	if (clp->m_type == MCL_SUBNETWORK)
 		return init_subnetwork(clp);
@@ -250,6 +247,7 @@ client_add(nfs_client *clp)
 {
 	nfs_client **cpp;
 
+	client_index_invalidate();
 	cpp = &clientlist[clp->m_type];
 	while (*cpp != NULL)
 		cpp = &((*cpp)->m_next);
@@ -270,12 +268,14 @@ client_lookup(char *hname, int canonical)
 {
 	nfs_client	*clp = NULL;
 	int		htype;
-	struct addrinfo	*ai = NULL;
+	struct addrinfo	*res = NULL;
+	const struct addrinfo *ai = NULL;
 
 	htype = client_gettype(hname);
 
 	if (htype == MCL_FQDN && !canonical) {
-		ai = host_addrinfo(hname);
+		if (!host_prefetched(hname, &ai))
+			ai = res = host_addrinfo(hname);
 		if (!ai) {
 			xlog(L_WARNING, "Failed to resolve %s", hname);
 			goto out;
@@ -305,11 +305,13 @@ client_lookup(char *hname, int canonical)
 		client_add(clp);
 	}
 
-	if (htype == MCL_FQDN && clp->m_naddr == 0)
+	if (htype == MCL_FQDN && clp->m_naddr == 0) {
 		init_addrlist(clp, ai);
+		client_index_invalidate();
+	}
 
 out:
-	nfs_freeaddrinfo(ai);
+	nfs_freeaddrinfo(res);
 	return clp;
 }
 
@@ -342,6 +344,69 @@ client_dup(const nfs_client *clp, const struct addrinfo *ai)
 	return new;
 }
 
+static int
+client_same_addrs(const nfs_client *clp, const struct addrinfo *ai)
+{
+	int i;
+
+	for (i = 0; ai != NULL && i < NFSCLNT_ADDRMAX; i++, ai = ai->ai_next)
+		if (i >= clp->m_naddr ||
+		    !nfs_compare_sockaddr(get_addrlist(clp, i), ai->ai_addr))
+			return 0;
+	return i == clp->m_naddr;
+}
+
+/* Moved on by client_refresh_begin(), once per export table reload */
+static unsigned int client_refresh_gen;
+
+/**
+ * client_refresh_begin - start an export table reload
+ *
+ * Each client is looked up at most once per reload by client_refresh(),
+ * however many of the kept exports name it.
+ */
+void
+client_refresh_begin(void)
+{
+	if (++client_refresh_gen == 0)
+		client_refresh_gen++;
+}
+
+/**
+ * client_refresh - look up the addresses of a kept nfs_client again
+ * @clp: client that is being kept across an export table reload
+ * @hname: hostname the client was named by in the export table
+ *
+ * Only MCL_FQDN clients carry resolved addresses; those are replaced
+ * with what @hname resolves to now.  Returns 1 if @clp can be kept,
+ * or 0 if @hname no longer resolves.
+ */
+int
+client_refresh(nfs_client *clp, const char *hname)
+{
+	struct addrinfo *res = NULL;
+	const struct addrinfo *ai = NULL;
+
+	if (clp->m_type != MCL_FQDN)
+		return 1;
+	if (clp->m_refresh_gen == client_refresh_gen)
+		return clp->m_refresh_ok;
+	clp->m_refresh_gen = client_refresh_gen;
+	clp->m_refresh_ok = 0;
+
+	if (!host_prefetched(hname, &ai))
+		ai = res = host_addrinfo(hname);
+	if (!ai)
+		return 0;
+	if (!client_same_addrs(clp, ai)) {
+		init_addrlist(clp, ai);
+		client_index_invalidate();
+	}
+	nfs_freeaddrinfo(res);
+	clp->m_refresh_ok = 1;
+	return 1;
+}
+
 /**
  * client_release - drop a reference to an nfs_client record
  *
@@ -373,6 +438,29 @@ client_freeall(void)
 	}
 }
 
+/**
+ * client_prune - deallocate the nfs_client records no export refers to
+ *
+ */
+void
+client_prune(void)
+{
+	nfs_client	*clp, **cpp;
+	int		i;
+
+	for (i = 0; i < MCL_MAXTYPES; i++) {
+		cpp = clientlist + i;
+		while ((clp = *cpp) != NULL) {
+			if (clp->m_count > 0) {
+				cpp = &clp->m_next;
+				continue;
+			}
+			*cpp = clp->m_next;
+			client_free(clp);
+		}
+	}
+}
+
 /**
  * client_resolve - look up an IP address
  * @sap: pointer to socket address to resolve
@@ -383,14 +471,10 @@ client_freeall(void)
 struct addrinfo *
 client_resolve(const struct sockaddr *sap)
 {
-	struct addrinfo *ai = NULL;
-
-	if (clientlist[MCL_WILDCARD] || clientlist[MCL_NETGROUP])
-		ai = host_reliable_addrinfo(sap);
-	if (ai == NULL)
-		ai = host_numeric_addrinfo(sap);
-
-	return ai;
+	/* Wildcard and netgroup clients look up the host's name
+	 * themselves, through the host cache.
+	 */
+	return host_numeric_addrinfo(sap);
 }
 
 /**
@@ -408,17 +492,19 @@ client_resolve(const struct sockaddr *sap)
 char *
 client_compose(const struct addrinfo *ai)
 {
+	struct client_set *set;
 	char *name = NULL;
-	int i;
+	unsigned int i;
 
-	for (i = 0 ; i < MCL_MAXTYPES; i++) {
-		nfs_client	*clp;
-		for (clp = clientlist[i]; clp ; clp = clp->m_next) {
-			if (!client_check(clp, ai))
-				continue;
-			name = add_name(name, clp->m_hostname);
-		}
+	set = client_match(ai);
+	if (set == NULL)
+		return NULL;
+	for (i = 0; i < set->count; i++) {
+		name = add_name(name, set->clients[i]->m_hostname);
+		if (name == NULL)
+			break;
 	}
+	client_set_free(set);
 	return name;
 }
 
@@ -609,13 +695,12 @@ static int
 check_wildcard(const nfs_client *clp, const struct addrinfo *ai)
 {
 	char *hname, *cname = clp->m_hostname;
-	struct hostent *hp;
-	char **ap;
+	char **aliases, **ap;
 	int match;
 
 	match = 0;
 
-	hname = host_canonname(ai->ai_addr);
+	hname = hostcache_canonname(ai->ai_addr);
 	if (hname == NULL)
 		goto out;
 
@@ -626,13 +711,14 @@ check_wildcard(const nfs_client *clp, const struct addrinfo *ai)
 
 	/* See if hname aliases listed in /etc/hosts or nis[+]
 	 * match the requested wildcard */
-	hp = gethostbyname(hname);
-	if (hp != NULL) {
-		for (ap = hp->h_aliases; *ap; ap++)
+	aliases = hostcache_aliases(hname);
+	if (aliases != NULL) {
+		for (ap = aliases; *ap; ap++)
 			if (wildmat(*ap, cname)) {
 				match = 1;
-				goto out;
+				break;
 			}
+		hostcache_free_aliases(aliases);
 	}
 
 out:
@@ -651,46 +737,46 @@ check_netgroup(const nfs_client *clp, const struct addrinfo *ai)
 {
 	const char *netgroup = clp->m_hostname + 1;
 	struct addrinfo *tmp = NULL;
-	struct hostent *hp;
 	char *dot, *hname, *ip;
+	char **aliases;
 	int i, match;
 
 	match = 0;
 
-	hname = host_canonname(ai->ai_addr);
+	hname = hostcache_canonname(ai->ai_addr);
 	if (hname == NULL)
 		goto out;
 
 	/* First, try to match the hostname without
 	 * splitting off the domain */
-	if (innetgr(netgroup, hname, NULL, NULL)) {
+	if (hostcache_innetgr(netgroup, hname)) {
 		match = 1;
 		goto out;
 	}
 
 	/* See if hname aliases listed in /etc/hosts or nis[+]
 	 * match the requested netgroup */
-	hp = gethostbyname(hname);
-	if (hp != NULL) {
-		for (i = 0; hp->h_aliases[i]; i++)
-			if (innetgr(netgroup, hp->h_aliases[i], NULL, NULL)) {
-				match = 1;
-				goto out;
-			}
+	aliases = hostcache_aliases(hname);
+	if (aliases != NULL) {
+		for (i = 0; !match && aliases[i]; i++)
+			match = hostcache_innetgr(netgroup, aliases[i]);
+		hostcache_free_aliases(aliases);
+		if (match)
+			goto out;
 	}
 
 	/* If hname happens to be an IP address, convert it
 	 * to a the canonical DNS name bound to this address. */
 	tmp = host_pton(hname);
 	if (tmp != NULL) {
-		char *cname = host_canonname(tmp->ai_addr);
+		char *cname = hostcache_canonname(tmp->ai_addr);
 		nfs_freeaddrinfo(tmp);
 
 		/* The resulting FQDN may be in our netgroup. */
 		if (cname != NULL) {
 			free(hname);
 			hname = cname;
-			if (innetgr(netgroup, hname, NULL, NULL)) {
+			if (hostcache_innetgr(netgroup, hname)) {
 				match = 1;
 				goto out;
 			}
@@ -703,7 +789,7 @@ check_netgroup(const nfs_client *clp, const struct addrinfo *ai)
 		goto out;
 
 	if (inet_ntop(ai->ai_family, &(((struct sockaddr_in *)ai->ai_addr)->sin_addr), ip, INET6_ADDRSTRLEN) == ip) {
-		if (innetgr(netgroup, ip, NULL, NULL)) {
+		if (hostcache_innetgr(netgroup, ip)) {
 			free(hname);
 			hname = ip;
 			match = 1;
@@ -718,7 +804,7 @@ check_netgroup(const nfs_client *clp, const struct addrinfo *ai)
 		goto out;
 
 	*dot = '\0';
-	match = innetgr(netgroup, hname, NULL, NULL);
+	match = hostcache_innetgr(netgroup, hname);
 
 out:
 	free(hname);
@@ -765,6 +851,528 @@ client_check(const nfs_client *clp, const struct addrinfo *ai)
 	return 0;
 }
 
+/*
+ * The client records compiled for matching them all against one
+ * address at a time.  FQDN and subnetwork clients go in a binary trie
+ * per address family, keyed by address prefix, and wildcards of the
+ * form "*suffix" in a trie of their reversed suffixes.  A walk down
+ * either trie picks up every client on the way, so one lookup finds
+ * all matching clients of those kinds.  Other wildcards are matched
+ * against the host's names, which are looked up only once, and
+ * whatever is left over is checked with client_check().
+ *
+ * The index is built on first use and thrown away whenever clientlist
+ * changes.  Changes to clientlist must not race with lookups.
+ */
+struct client_hit {
+	struct client_hit	*next;
+	nfs_client		*clp;
+};
+
+struct addr_node {
+	struct addr_node	*child[2];
+	struct client_hit	*hits;
+};
+
+struct suffix_node {
+	struct suffix_node	*child;
+	struct suffix_node	*sibling;
+	struct client_hit	*hits;
+	unsigned char		c;
+};
+
+struct client_index {
+	struct addr_node	*inet;
+	struct addr_node	*inet6;
+	struct suffix_node	*suffixes;
+	struct client_hit	*patterns;	/* other wildcards */
+	struct client_hit	*always;	/* anonymous, "*" */
+	struct client_hit	*others;	/* use client_check() */
+};
+
+static struct client_index	*client_index;
+static pthread_mutex_t		client_index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+client_hit_add(struct client_hit **list, nfs_client *clp)
+{
+	struct client_hit *hit;
+
+	hit = malloc(sizeof(*hit));
+	if (hit == NULL)
+		return 0;
+	hit->clp = clp;
+	hit->next = *list;
+	*list = hit;
+	return 1;
+}
+
+static void
+client_hit_free(struct client_hit *hit)
+{
+	struct client_hit *next;
+
+	for (; hit; hit = next) {
+		next = hit->next;
+		free(hit);
+	}
+}
+
+static void
+addr_node_free(struct addr_node *node)
+{
+	if (node == NULL)
+		return;
+	addr_node_free(node->child[0]);
+	addr_node_free(node->child[1]);
+	client_hit_free(node->hits);
+	free(node);
+}
+
+static void
+suffix_node_free(struct suffix_node *node)
+{
+	struct suffix_node *next;
+
+	for (; node; node = next) {
+		next = node->sibling;
+		suffix_node_free(node->child);
+		client_hit_free(node->hits);
+		free(node);
+	}
+}
+
+static void
+client_index_invalidate(void)
+{
+	struct client_index *index = client_index;
+
+	if (index == NULL)
+		return;
+	client_index = NULL;
+	addr_node_free(index->inet);
+	addr_node_free(index->inet6);
+	suffix_node_free(index->suffixes);
+	client_hit_free(index->patterns);
+	client_hit_free(index->always);
+	client_hit_free(index->others);
+	free(index);
+}
+
+static inline int
+addr_bit(const unsigned char *addr, unsigned int bit)
+{
+	return (addr[bit >> 3] >> (7 - (bit & 7))) & 1;
+}
+
+/*
+ * Returns the length of the prefix that @mask selects, or -1 if
+ * @mask is not contiguous.
+ */
+static int
+mask_prefixlen(const unsigned char *mask, unsigned int bits)
+{
+	unsigned int len = 0, bit;
+
+	while (len < bits && addr_bit(mask, len))
+		len++;
+	for (bit = len; bit < bits; bit++)
+		if (addr_bit(mask, bit))
+			return -1;
+	return len;
+}
+
+static int
+addr_insert(struct addr_node **root, const unsigned char *addr,
+	    unsigned int prefixlen, nfs_client *clp)
+{
+	struct addr_node **np = root;
+	unsigned int bit;
+
+	for (bit = 0; ; bit++) {
+		if (*np == NULL) {
+			*np = calloc(1, sizeof(**np));
+			if (*np == NULL)
+				return 0;
+		}
+		if (bit == prefixlen)
+			break;
+		np = &(*np)->child[addr_bit(addr, bit)];
+	}
+	return client_hit_add(&(*np)->hits, clp);
+}
+
+static int
+suffix_insert(struct suffix_node **root, const char *suffix,
+	      nfs_client *clp)
+{
+	struct suffix_node **np = root, *node = NULL;
+	const char *cp;
+	unsigned char c;
+
+	for (cp = suffix + strlen(suffix); cp-- > suffix; np = &node->child) {
+		c = tolower((unsigned char)*cp);
+		for (node = *np; node; node = node->sibling)
+			if (node->c == c)
+				break;
+		if (node == NULL) {
+			node = calloc(1, sizeof(*node));
+			if (node == NULL)
+				return 0;
+			node->c = c;
+			node->sibling = *np;
+			*np = node;
+		}
+	}
+	if (node == NULL)
+		/* pattern was all '*' */
+		return 0;
+	return client_hit_add(&node->hits, clp);
+}
+
+/*
+ * Returns the literal part of a wildcard that is "*" followed by
+ * plain characters, or NULL if the wildcard is anything else.
+ */
+static const char *
+wildcard_suffix(const char *pattern)
+{
+	const char *cp;
+
+	if (*pattern != '*')
+		return NULL;
+	while (*pattern == '*')
+		pattern++;
+	for (cp = pattern; *cp; cp++)
+		if (*cp == '*' || *cp == '?' || *cp == '[' || *cp == '\\')
+			return NULL;
+	return pattern;
+}
+
+static int
+client_index_add_fqdn(struct client_index *index, nfs_client *clp)
+{
+	int i;
+
+	for (i = 0; i < clp->m_naddr; i++) {
+		switch (get_addrlist(clp, i)->sa_family) {
+		case AF_INET:
+			if (!addr_insert(&index->inet, (const unsigned char *)
+					 &get_addrlist_in(clp, i)->sin_addr,
+					 32, clp))
+				return 0;
+			break;
+#ifdef IPV6_SUPPORTED
+		case AF_INET6: {
+			const struct sockaddr_in6 *sin6 = get_addrlist_in6(clp, i);
+
+			/* these also have to match the scope id */
+			if (IN6_IS_ADDR_LINKLOCAL(&sin6->sin6_addr))
+				return client_hit_add(&index->others, clp);
+			if (!addr_insert(&index->inet6, (const unsigned char *)
+					 &sin6->sin6_addr, 128, clp))
+				return 0;
+			break;
+		}
+#endif
+		}
+	}
+	return 1;
+}
+
+static int
+client_index_add_subnet(struct client_index *index, nfs_client *clp)
+{
+	int prefixlen;
+
+	switch (get_addrlist(clp, 0)->sa_family) {
+	case AF_INET:
+		prefixlen = mask_prefixlen((const unsigned char *)
+				&get_addrlist_in(clp, 1)->sin_addr, 32);
+		if (prefixlen < 0)
+			break;
+		return addr_insert(&index->inet, (const unsigned char *)
+				   &get_addrlist_in(clp, 0)->sin_addr,
+				   prefixlen, clp);
+#ifdef IPV6_SUPPORTED
+	case AF_INET6:
+		prefixlen = mask_prefixlen((const unsigned char *)
+				&get_addrlist_in6(clp, 1)->sin6_addr, 128);
+		if (prefixlen < 0)
+			break;
+		return addr_insert(&index->inet6, (const unsigned char *)
+				   &get_addrlist_in6(clp, 0)->sin6_addr,
+				   prefixlen, clp);
+#endif
+	default:
+		return 1;
+	}
+	return client_hit_add(&index->others, clp);
+}
+
+static int
+client_index_add_wildcard(struct client_index *index, nfs_client *clp)
+{
+	const char *suffix;
+
+	suffix = wildcard_suffix(clp->m_hostname);
+	if (suffix == NULL)
+		return client_hit_add(&index->patterns, clp);
+	if (*suffix == '\0')
+		return client_hit_add(&index->always, clp);
+	return suffix_insert(&index->suffixes, suffix, clp);
+}
+
+static struct client_index *
+client_index_build(void)
+{
+	struct client_index *index;
+	nfs_client *clp;
+	int i, ok;
+
+	index = calloc(1, sizeof(*index));
+	if (index == NULL)
+		return NULL;
+	client_index = index;
+
+	for (i = 0; i < MCL_MAXTYPES; i++)
+		for (clp = clientlist[i]; clp; clp = clp->m_next) {
+			switch (clp->m_type) {
+			case MCL_FQDN:
+				ok = client_index_add_fqdn(index, clp);
+				break;
+			case MCL_SUBNETWORK:
+				ok = client_index_add_subnet(index, clp);
+				break;
+			case MCL_WILDCARD:
+				ok = client_index_add_wildcard(index, clp);
+				break;
+			case MCL_ANONYMOUS:
+				ok = client_hit_add(&index->always, clp);
+				break;
+			case MCL_GSS:
+				ok = 1;
+				break;
+			default:
+				ok = client_hit_add(&index->others, clp);
+			}
+			if (!ok) {
+				xlog(L_ERROR, "%s: out of memory", __func__);
+				client_index_invalidate();
+				return NULL;
+			}
+		}
+	return index;
+}
+
+static int
+client_set_add(struct client_set *set, nfs_client *clp)
+{
+	nfs_client **clients;
+	unsigned int size;
+
+	if (set->count == set->size) {
+		size = set->size ? set->size * 2 : 8;
+		clients = realloc(set->clients, size * sizeof(*clients));
+		if (clients == NULL)
+			return 0;
+		set->clients = clients;
+		set->size = size;
+	}
+	set->clients[set->count++] = clp;
+	return 1;
+}
+
+static int
+client_set_add_hits(struct client_set *set, const struct client_hit *hit)
+{
+	for (; hit; hit = hit->next)
+		if (!client_set_add(set, hit->clp))
+			return 0;
+	return 1;
+}
+
+static int
+client_set_add_addr(struct client_set *set, const struct addr_node *node,
+		    const unsigned char *addr, unsigned int bits)
+{
+	unsigned int bit;
+
+	for (bit = 0; node; node = node->child[addr_bit(addr, bit++)]) {
+		if (!client_set_add_hits(set, node->hits))
+			return 0;
+		if (bit == bits)
+			break;
+	}
+	return 1;
+}
+
+static int
+client_set_add_name(struct client_set *set, const struct client_index *index,
+		    const char *name)
+{
+	const struct suffix_node *node;
+	const struct client_hit *hit;
+	const char *cp;
+	unsigned char c;
+
+	node = index->suffixes;
+	for (cp = name + strlen(name); node && cp-- > name; node = node->child) {
+		c = tolower((unsigned char)*cp);
+		for (; node; node = node->sibling)
+			if (node->c == c)
+				break;
+		if (node == NULL)
+			break;
+		if (!client_set_add_hits(set, node->hits))
+			return 0;
+	}
+
+	for (hit = index->patterns; hit; hit = hit->next)
+		if (wildmat((char *)name, hit->clp->m_hostname) &&
+		    !client_set_add(set, hit->clp))
+			return 0;
+	return 1;
+}
+
+/*
+ * Match the canonical name of the host, and its aliases, against
+ * the wildcards in @index.
+ */
+static int
+client_set_add_names(struct client_set *set, const struct client_index *index,
+		     const struct addrinfo *ai)
+{
+	char *hname;
+	char **aliases, **ap;
+	int ok;
+
+	hname = hostcache_canonname(ai->ai_addr);
+	if (hname == NULL)
+		return 1;
+	ok = client_set_add_name(set, index, hname);
+	if (ok) {
+		aliases = hostcache_aliases(hname);
+		if (aliases != NULL) {
+			for (ap = aliases; ok && *ap; ap++)
+				ok = client_set_add_name(set, index, *ap);
+			hostcache_free_aliases(aliases);
+		}
+	}
+	free(hname);
+	return ok;
+}
+
+static int
+client_ptr_cmp(const void *a, const void *b)
+{
+	const nfs_client *ca = *(nfs_client * const *)a;
+	const nfs_client *cb = *(nfs_client * const *)b;
+
+	return ca < cb ? -1 : ca > cb;
+}
+
+/**
+ * client_match - find every nfs_client that matches an IP address
+ * @ai: pointer to addrinfo to match
+ *
+ * Returns a client_set, or NULL if memory could not be allocated.
+ * Caller must free the result with client_set_free().
+ */
+struct client_set *
+client_match(const struct addrinfo *ai)
+{
+	struct client_index *index;
+	struct client_set *set;
+	const struct client_hit *hit;
+	const struct addrinfo *a;
+	unsigned int i, n;
+	int ok = 1;
+
+	set = calloc(1, sizeof(*set));
+	if (set == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&client_index_lock);
+	index = client_index;
+	if (index == NULL)
+		index = client_index_build();
+	pthread_mutex_unlock(&client_index_lock);
+	if (index == NULL)
+		goto out_free;
+
+	for (a = ai; ok && a; a = a->ai_next) {
+		switch (a->ai_addr->sa_family) {
+		case AF_INET:
+			ok = client_set_add_addr(set, index->inet,
+				(const unsigned char *)
+				&((const struct sockaddr_in *)a->ai_addr)->sin_addr,
+				32);
+			break;
+#ifdef IPV6_SUPPORTED
+		case AF_INET6:
+			ok = client_set_add_addr(set, index->inet6,
+				(const unsigned char *)
+				&((const struct sockaddr_in6 *)a->ai_addr)->sin6_addr,
+				128);
+			break;
+#endif
+		}
+	}
+	if (ok && (index->suffixes || index->patterns))
+		ok = client_set_add_names(set, index, ai);
+	if (ok)
+		ok = client_set_add_hits(set, index->always);
+	for (hit = index->others; ok && hit; hit = hit->next)
+		if (client_check(hit->clp, ai))
+			ok = client_set_add(set, hit->clp);
+	if (!ok)
+		goto out_free;
+
+	/* An address can reach the same client more than one way */
+	qsort(set->clients, set->count, sizeof(*set->clients), client_ptr_cmp);
+	for (i = n = 0; i < set->count; i++)
+		if (n == 0 || set->clients[n - 1] != set->clients[i])
+			set->clients[n++] = set->clients[i];
+	set->count = n;
+	return set;
+
+out_free:
+	xlog(L_ERROR, "%s: out of memory", __func__);
+	client_set_free(set);
+	return NULL;
+}
+
+/**
+ * client_set_member - check if @clp is in a set returned by client_match()
+ * @set: pointer to client_set, may be NULL
+ * @clp: pointer to nfs_client to look for
+ *
+ * Returns 1 if @clp is in @set, otherwise zero.
+ */
+int
+client_set_member(const struct client_set *set, const nfs_client *clp)
+{
+	if (set == NULL || set->count == 0)
+		return 0;
+	return bsearch(&clp, set->clients, set->count, sizeof(*set->clients),
+		       client_ptr_cmp) != NULL;
+}
+
+/**
+ * client_set_free - release a client_set
+ * @set: pointer to client_set returned by client_match(), may be NULL
+ *
+ */
+void
+client_set_free(struct client_set *set)
+{
+	if (set == NULL)
+		return;
+	free(set->clients);
+	free(set);
+}
+
 /**
  * client_gettype - determine type of nfs_client given an identifier
  * @ident: '\0'-terminated ASCII string containing a client identifier
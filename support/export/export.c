@@ -33,8 +33,6 @@ static int export_hash(char *);
 static void	export_init(nfs_export *exp, nfs_client *clp,
 					struct exportent *nep);
 static void	export_add(nfs_export *exp);
-static int	export_check(const nfs_export *exp, const struct addrinfo *ai,
-				const char *path);
 
 /* Return a real path for the export. */
 static void
@@ -152,17 +150,15 @@ export_read(char *fname, int ignore_hosts)
 	return volumes;
 }
 
-/**
- * export_d_read - read entries from /etc/exports.
- * @fname: name of directory to read from
- * @ignore_hosts: don't check validity of host names
- *
- * Returns number of read entries.
+/*
+ * Call @fn on each exports file in directory @dname, in order, and
+ * return the sum of what it returns.
  * Based on mnt_table_parse_dir() in
  *  util-linux-ng/shlibs/mount/src/tab_parse.c
  */
-int
-export_d_read(const char *dname, int ignore_hosts)
+static int
+export_d_foreach(const char *dname, int (*fn)(char *fname, void *data),
+		 void *data)
 {
 	int n = 0, i;
 	struct dirent **namelist = NULL;
@@ -206,7 +202,7 @@ export_d_read(const char *dname, int ignore_hosts)
 			continue;
 		}
 
-		volumes += export_read(fname, ignore_hosts);
+		volumes += fn(fname, data);
 	}
 
 	for (i = 0; i < n; i++)
@@ -216,6 +212,84 @@ export_d_read(const char *dname, int ignore_hosts)
 	return volumes;
 }
 
+static int
+export_d_read_one(char *fname, void *data)
+{
+	return export_read(fname, *(int *)data);
+}
+
+/**
+ * export_d_read - read entries from /etc/exports.
+ * @fname: name of directory to read from
+ * @ignore_hosts: don't check validity of host names
+ *
+ * Returns number of read entries.
+ */
+int
+export_d_read(const char *dname, int ignore_hosts)
+{
+	return export_d_foreach(dname, export_d_read_one, &ignore_hosts);
+}
+
+struct export_hosts {
+	char		**names;
+	int		count;
+	int		max;
+};
+
+static int
+export_scan_hosts(char *fname, void *data)
+{
+	struct export_hosts *h = data;
+	char *hname, **names;
+
+	/* export_read() will complain about it */
+	if (access(fname, R_OK) != 0)
+		return 0;
+	setexportent(fname, "r");
+	while ((hname = getexporthost()) != NULL) {
+		if (client_gettype(hname) != MCL_FQDN)
+			continue;
+		if (h->count == h->max) {
+			names = realloc(h->names, (h->max ? h->max * 2 : 256) *
+					sizeof(*names));
+			if (names == NULL)
+				break;
+			h->names = names;
+			h->max = h->max ? h->max * 2 : 256;
+		}
+		if ((h->names[h->count] = strdup(hname)) != NULL)
+			h->count++;
+	}
+	endexportent();
+	return 0;
+}
+
+/**
+ * export_prefetch_hosts - look up the clients named in the exports files
+ * @fname: name of the exports file
+ * @dname: name of the directory of further exports files
+ * @nthreads: how many lookups may be outstanding at the same time
+ *
+ * The answers are used by export_read() and export_d_read() until
+ * host_prefetch_release() is called.  Returns the number of distinct
+ * hostnames looked up.
+ */
+int
+export_prefetch_hosts(char *fname, const char *dname, int nthreads)
+{
+	struct export_hosts h = { NULL, 0, 0 };
+	int i, n;
+
+	export_scan_hosts(fname, &h);
+	export_d_foreach(dname, export_scan_hosts, &h);
+	n = host_prefetch(h.names, h.count, nthreads);
+	for (i = 0; i < h.count; i++)
+		free(h.names[i]);
+	free(h.names);
+	return n;
+}
+
 /**
  * export_create - create an in-core nfs_export record from an export entry
  * @xep: export entry to lookup
@@ -331,19 +405,26 @@ export_add(nfs_export *exp)
 nfs_export *
 export_find(const struct addrinfo *ai, const char *path)
 {
+	struct client_set *clients;
 	nfs_export	*exp;
 	int		i;
 
+	clients = client_match(ai);
+	if (clients == NULL)
+		return NULL;
 	for (i = 0; i < MCL_MAXTYPES; i++) {
 		for (exp = exportlist[i].p_head; exp; exp = exp->m_next) {
-			if (!export_check(exp, ai, path))
+			if (strcmp(path, exp->m_export.e_path) ||
+			    !client_set_member(clients, exp->m_client))
 				continue;
+			client_set_free(clients);
 			if (exp->m_client->m_type == MCL_FQDN)
 				return exp;
 			return export_dup(exp, ai);
 		}
 	}
 
+	client_set_free(clients);
 	return NULL;
 }
 
@@ -360,14 +441,27 @@ nfs_export *
 export_lookup(char *hname, char *path, int canonical)
 {
 	nfs_client *clp;
-	nfs_export *exp;
-	exp_hash_entry *p_hen;
-
-	int pos;
 
 	clp = client_lookup(hname, canonical);
 	if(clp == NULL)
 		return NULL;
+	return export_lookup_client(clp, path);
+}
+
+/**
+ * export_lookup_client - search hash table for the export of a path to a client
+ * @clp: client to look for
+ * @path: '\0'-terminated ASCII string containing export path to look for
+ *
+ * Like export_lookup(), without looking up the client by name first.
+ */
+nfs_export *
+export_lookup_client(nfs_client *clp, char *path)
+{
+	nfs_export *exp;
+	exp_hash_entry *p_hen;
+
+	int pos;
 
 	pos = export_hash(path);
 	p_hen = &(exportlist[clp->m_type].entries[pos]); 
@@ -380,14 +474,6 @@ export_lookup(char *hname, char *path, int canonical)
 	return NULL;
 }
 
-static int
-export_check(const nfs_export *exp, const struct addrinfo *ai, const char *path)
-{
-	if (strcmp(path, exp->m_export.e_path))
-		return 0;
-
-	return client_check(exp->m_client, ai);
-}
 
 /**
  * export_freeall - deallocate all nfs_export records
@@ -414,6 +500,64 @@ export_freeall(void)
 	client_freeall();
 }
 
+/**
+ * export_unlink_all - take every nfs_export record out of exportlist
+ * @count: OUT: number of records returned
+ *
+ * Returns the records in exportlist order, in an array the caller must
+ * free(3).  Each record must then be passed either to export_relink()
+ * or to export_release().  Returns NULL if memory runs out, leaving
+ * exportlist as it was.
+ */
+nfs_export **
+export_unlink_all(unsigned int *count)
+{
+	nfs_export	*exp, **exps;
+	unsigned int	n = 0;
+	int		i, j;
+
+	for (i = 0; i < MCL_MAXTYPES; i++)
+		for (exp = exportlist[i].p_head; exp; exp = exp->m_next)
+			n++;
+	exps = malloc((n ? n : 1) * sizeof(*exps));
+	if (exps == NULL)
+		return NULL;
+
+	n = 0;
+	for (i = 0; i < MCL_MAXTYPES; i++) {
+		for (exp = exportlist[i].p_head; exp; exp = exp->m_next)
+			exps[n++] = exp;
+		for (j = 0; j < HASH_TABLE_SIZE; j++) {
+			exportlist[i].entries[j].p_first = NULL;
+			exportlist[i].entries[j].p_last = NULL;
+		}
+		exportlist[i].p_head = NULL;
+	}
+	*count = n;
+	return exps;
+}
+
+/**
+ * export_relink - put a record from export_unlink_all() back in exportlist
+ * @exp: record to add
+ */
+void
+export_relink(nfs_export *exp)
+{
+	export_add(exp);
+}
+
+/**
+ * export_release - deallocate a record from export_unlink_all()
+ * @exp: record to free
+ */
+void
+export_release(nfs_export *exp)
+{
+	client_release(exp->m_client);
+	export_free(exp);
+}
+
 /*
  * Compute and returns integer from string. 
  * Note: Its understood the smae integers can be same for 
@@ -9,33 +9,104 @@
 #ifndef EXPORT_H
 #define EXPORT_H
 
+#include <time.h>
 #include "nfslib.h"
 #include "exportfs.h"
 
 unsigned int	auth_reload(void);
+bool		auth_reload_needed(void);
+void		auth_reload_freeze(bool frozen);
+const struct xtab_reload_stats *
+		auth_reload_stats(void);
 nfs_export *	auth_authenticate(const char *what,
 					const struct sockaddr *caller,
 					const char *path);
 
 void		cache_open(void);
-void		cache_set_fds(fd_set *fdset);
-int		cache_process_req(fd_set *readfds);
 void		cache_process_loop(void);
+void		cache_trace_enable(const char *path);
+int		cache_handle_request(const char *channel, int f,
+				     char *buf, int len);
+
+#define V4CLIENTS_MINORS	3
+
+struct v4clients_stats {
+	unsigned int	clients, unconfirmed, unread;
+	unsigned int	minor[V4CLIENTS_MINORS];	/* confirmed clients */
+	unsigned long	events, coalesced, reads, overflows;
+};
 
 void		v4clients_init(void);
-void		v4clients_set_fds(fd_set *fdset);
-int		v4clients_process(fd_set *fdset);
+int		v4clients_get_fd(void);
+int		v4clients_timer_fd(void);
+void		v4clients_process(void);
+void		v4clients_flush(void);
+char **		v4clients_addrs(void);
+void		v4clients_get_stats(struct v4clients_stats *stats);
 
 struct nfs_fh_len *
 		cache_get_filehandle(nfs_export *exp, int len, char *p);
 int		cache_export(nfs_export *exp, char *path);
 int		cache_fork_workers(char *prog, int num_threads);
+int		cache_start_threads(int num_threads);
+void		cache_lock_exports(void);
+void		cache_unlock_exports(void);
 void		cache_wait_for_workers(char *prog);
 int		cache_process(fd_set *readfds);
+void		cache_warm_enable(char **(*known_clients)(void));
+
+/* Upcall statistics, see cachestats.c */
+enum {
+	CS_IP, CS_GID, CS_EXPORT, CS_FH,
+	CS_CHANNELS
+};
+enum {
+	CS_PARSE,	/* reading the request */
+	CS_CLIENT,	/* resolving or matching the client */
+	CS_MATCH,	/* finding the export, filehandle or groups */
+	CS_REPLY,	/* writing the answer */
+	CS_TOTAL,
+	CS_PHASES
+};
+enum {
+	CS_UPCALLS, CS_HITS, CS_DENIED, CS_FAILED, CS_RETRIES, CS_DEV_MISSING,
+	CS_COUNTERS
+};
+struct cachestats_timer {
+	int		channel;
+	struct timespec	start, mark;
+};
+
+void		cachestats_enable(const char *path, int interval);
+int		cachestats_timer_fd(void);
+void		cachestats_start(struct cachestats_timer *t, int channel);
+void		cachestats_phase(struct cachestats_timer *t, int phase);
+void		cachestats_done(struct cachestats_timer *t, int result);
+void		cachestats_count(int channel, int counter);
+void		cachestats_delayed(int delta);
+void		cachestats_worker(int index);
+void		cachestats_publish(void);
+void		cachestats_write(void);
+
+/* Group lists for auth.unix.gid, see gidcache.c */
+extern int gidcache_size;
+extern int gidcache_negative_ttl;
+
+struct gidcache_stats {
+	unsigned long	hits, stale, misses, negative, refreshes, evictions;
+	unsigned int	entries;
+};
+
+int		gidcache_lookup(uid_t uid, gid_t **groups, time_t *expires);
+int		gidcache_enable(int fd);
+void		gidcache_refresh_ahead(void);
+void		gidcache_get_stats(struct gidcache_stats *stats);
 
-bool ipaddr_client_matches(nfs_export *exp, struct addrinfo *ai);
+bool ipaddr_client_matches(nfs_export *exp,
+			   const struct client_set *clients);
 bool namelist_client_matches(nfs_export *exp, char *dom);
-bool client_matches(nfs_export *exp, char *dom, struct addrinfo *ai);
+bool client_matches(nfs_export *exp, char *dom,
+		    const struct client_set *clients);
 
 static inline bool is_ipaddr_client(char *dom)
 {
@@ -0,0 +1,423 @@
+/*
+ * support/export/gidcache.c
+ *
+ * Cache of group lists for auth.unix.gid upcalls.
+ *
+ * With manage-gids, every uid the kernel has not seen recently costs
+ * a getpwuid() and a getgrouplist(), which with sssd or LDAP behind
+ * NSS can take as long as the directory server likes.  Answers are
+ * kept here for as long as the kernel keeps them (default_ttl), or
+ * gid-cache-negative-ttl seconds for unknown users.
+ *
+ * Users who were asked about during an entry's lifetime are looked up
+ * again in the background shortly before it expires, and the new list
+ * is written to the kernel straight away, so the kernel never has to
+ * ask again.  If the kernel asks about an entry that has expired, it
+ * gets the old list for a short while and a refresh is queued.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/timerfd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pwd.h>
+#include <grp.h>
+#include <pthread.h>
+
+#include "misc.h"
+#include "nfslib.h"
+#include "export.h"
+#include "workqueue.h"
+#include "xlog.h"
+
+int gidcache_size = 8192;
+int gidcache_negative_ttl = 60;
+
+#define GIDCACHE_BUCKETS	1024
+#define INITIAL_MANAGED_GROUPS	100
+
+struct gidcache_entry {
+	struct gidcache_entry	*next;
+	uid_t			uid;
+	time_t			expires;	/* as told to the kernel */
+	int			used;		/* asked for since last lookup */
+	int			refreshing;
+	int			ngroups;	/* -1 for unknown users */
+	gid_t			*groups;
+};
+
+static struct gidcache_entry	*gidcache[GIDCACHE_BUCKETS];
+static unsigned int		gidcache_count;
+static pthread_mutex_t		gidcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct gidcache_stats	gidcache_counters;
+
+static int			channel_fd = -1;
+static int			timer_fd = -1;
+static struct xthread_workqueue	*refresh_wq;
+static pid_t			refresh_pid;
+
+/*
+ * How long before expiry entries in use are looked up again, and how
+ * long a stale answer is given out for while that happens.
+ */
+static time_t
+gidcache_window(void)
+{
+	time_t window = default_ttl / 10;
+
+	return window > 2 ? window : 2;
+}
+
+static unsigned int
+gidcache_hash(uid_t uid)
+{
+	return (uid * 2654435761u) % GIDCACHE_BUCKETS;
+}
+
+/*
+ * Ask NSS.  Returns the number of groups in *@groups, which the caller
+ * frees, or -1 if the user is unknown.
+ */
+static int
+gidcache_resolve(uid_t uid, gid_t **groups)
+{
+	struct passwd pwd, *pw = NULL;
+	gid_t *list, *more;
+	char *pwbuf = NULL;
+	long pwbuf_len;
+	int ngroups = INITIAL_MANAGED_GROUPS;
+	int rv = -1;
+
+	*groups = NULL;
+	list = malloc(sizeof(gid_t) * ngroups);
+	if (!list)
+		return -1;
+
+	pwbuf_len = sysconf(_SC_GETPW_R_SIZE_MAX);
+	if (pwbuf_len <= 0)
+		pwbuf_len = 16384;
+	for (;;) {
+		pwbuf = malloc(pwbuf_len);
+		if (!pwbuf)
+			break;
+		if (getpwuid_r(uid, &pwd, pwbuf, pwbuf_len, &pw) != ERANGE)
+			break;
+		free(pwbuf);
+		pwbuf = NULL;
+		pwbuf_len *= 2;
+	}
+
+	if (pw) {
+		rv = getgrouplist(pw->pw_name, pw->pw_gid, list, &ngroups);
+		if (rv == -1 && ngroups >= INITIAL_MANAGED_GROUPS) {
+			more = realloc(list, sizeof(gid_t) * ngroups);
+			if (more) {
+				list = more;
+				rv = getgrouplist(pw->pw_name, pw->pw_gid,
+						  list, &ngroups);
+			}
+		}
+	}
+	free(pwbuf);
+
+	if (rv < 0) {
+		free(list);
+		return -1;
+	}
+	*groups = list;
+	return ngroups;
+}
+
+static gid_t *
+gidcache_dup_groups(const gid_t *groups, int ngroups)
+{
+	gid_t *new;
+
+	new = malloc(sizeof(gid_t) * (ngroups > 0 ? ngroups : 1));
+	if (new && ngroups > 0)
+		memcpy(new, groups, sizeof(gid_t) * ngroups);
+	return new;
+}
+
+static time_t
+gidcache_ttl(int ngroups)
+{
+	if (ngroups < 0 && gidcache_negative_ttl < default_ttl)
+		return gidcache_negative_ttl;
+	return default_ttl;
+}
+
+static struct gidcache_entry *
+gidcache_find(uid_t uid)
+{
+	struct gidcache_entry *e;
+
+	for (e = gidcache[gidcache_hash(uid)]; e; e = e->next)
+		if (e->uid == uid)
+			return e;
+	return NULL;
+}
+
+/*
+ * Drop entries that have been expired for a full period, or failing
+ * that, everything that has expired.
+ */
+static void
+gidcache_purge(time_t now)
+{
+	struct gidcache_entry *e, **ep;
+	time_t grace;
+	int pass, i;
+
+	for (pass = 0; pass < 2 && gidcache_count >= (unsigned)gidcache_size;
+	     pass++) {
+		grace = pass ? 0 : default_ttl;
+		for (i = 0; i < GIDCACHE_BUCKETS; i++) {
+			ep = &gidcache[i];
+			while ((e = *ep) != NULL) {
+				if (e->refreshing || now < e->expires + grace) {
+					ep = &e->next;
+					continue;
+				}
+				*ep = e->next;
+				free(e->groups);
+				free(e);
+				gidcache_count--;
+				gidcache_counters.evictions++;
+			}
+		}
+	}
+}
+
+/*
+ * Remember @groups for @uid, until @expires.  @groups is copied.
+ */
+static void
+gidcache_store(uid_t uid, const gid_t *groups, int ngroups, time_t expires,
+	       int used)
+{
+	struct gidcache_entry *e;
+	gid_t *copy;
+
+	copy = gidcache_dup_groups(groups, ngroups);
+	if (!copy)
+		return;
+
+	pthread_mutex_lock(&gidcache_lock);
+	e = gidcache_find(uid);
+	if (e == NULL) {
+		if (gidcache_count >= (unsigned)gidcache_size)
+			gidcache_purge(time(NULL));
+		if (gidcache_count >= (unsigned)gidcache_size ||
+		    (e = calloc(1, sizeof(*e))) == NULL) {
+			pthread_mutex_unlock(&gidcache_lock);
+			free(copy);
+			return;
+		}
+		e->uid = uid;
+		e->next = gidcache[gidcache_hash(uid)];
+		gidcache[gidcache_hash(uid)] = e;
+		gidcache_count++;
+	} else
+		free(e->groups);
+	e->groups = copy;
+	e->ngroups = ngroups;
+	e->expires = expires;
+	e->used = used;
+	e->refreshing = 0;
+	pthread_mutex_unlock(&gidcache_lock);
+}
+
+/* Tell the kernel about @uid before it asks */
+static void
+gidcache_push(uid_t uid, const gid_t *groups, int ngroups, time_t expires)
+{
+	char buf[RPC_CHAN_BUF_SIZE], *bp;
+	int blen, i;
+
+	if (channel_fd < 0)
+		return;
+	bp = buf; blen = sizeof(buf);
+	qword_adduint(&bp, &blen, uid);
+	qword_adduint(&bp, &blen, expires);
+	qword_adduint(&bp, &blen, ngroups > 0 ? ngroups : 0);
+	for (i = 0; i < ngroups; i++)
+		qword_adduint(&bp, &blen, groups[i]);
+	qword_addeol(&bp, &blen);
+	if (blen <= 0 || write(channel_fd, buf, bp - buf) != bp - buf)
+		xlog(L_WARNING, "gidcache: error writing entry for uid %u",
+		     (unsigned)uid);
+}
+
+static void
+gidcache_refresh(void *data)
+{
+	uid_t uid = (uid_t)(unsigned long)data;
+	gid_t *groups;
+	time_t expires;
+	int ngroups;
+
+	ngroups = gidcache_resolve(uid, &groups);
+	expires = time(NULL) + gidcache_ttl(ngroups);
+	gidcache_store(uid, groups, ngroups, expires, 0);
+	gidcache_push(uid, groups, ngroups, expires);
+	free(groups);
+
+	pthread_mutex_lock(&gidcache_lock);
+	gidcache_counters.refreshes++;
+	pthread_mutex_unlock(&gidcache_lock);
+}
+
+/*
+ * Have @e looked up again in the background.  Called with
+ * gidcache_lock held.  Returns 1 if the lookup was queued.
+ */
+static int
+gidcache_queue_refresh(struct gidcache_entry *e)
+{
+	/* the thread does not survive fork() */
+	if (refresh_wq == NULL || refresh_pid != getpid()) {
+		refresh_wq = xthread_workqueue_alloc_pool(1);
+		refresh_pid = getpid();
+		if (refresh_wq == NULL)
+			return 0;
+	}
+	return xthread_work_queue(refresh_wq, gidcache_refresh,
+				  (void *)(unsigned long)e->uid) == 0;
+}
+
+/**
+ * gidcache_lookup - find the groups of a user
+ * @uid: user to look up
+ * @groups: OUT: the groups, to be freed by the caller
+ * @expires: OUT: when the kernel should forget the answer
+ *
+ * Returns the number of groups, or -1 if the user is unknown.
+ */
+int
+gidcache_lookup(uid_t uid, gid_t **groups, time_t *expires)
+{
+	struct gidcache_entry *e;
+	time_t now = time(NULL);
+	int ngroups;
+
+	if (gidcache_size <= 0) {
+		ngroups = gidcache_resolve(uid, groups);
+		*expires = now + gidcache_ttl(ngroups);
+		return ngroups;
+	}
+
+	pthread_mutex_lock(&gidcache_lock);
+	e = gidcache_find(uid);
+	if (e && now < e->expires + default_ttl &&
+	    (*groups = gidcache_dup_groups(e->groups, e->ngroups)) != NULL) {
+		ngroups = e->ngroups;
+		e->used = 1;
+		if (now < e->expires) {
+			*expires = e->expires;
+			gidcache_counters.hits++;
+		} else {
+			/* Give out the old list until the new one is in */
+			*expires = now + gidcache_window();
+			if (!e->refreshing)
+				e->refreshing = gidcache_queue_refresh(e);
+			gidcache_counters.stale++;
+		}
+		pthread_mutex_unlock(&gidcache_lock);
+		return ngroups;
+	}
+	gidcache_counters.misses++;
+	pthread_mutex_unlock(&gidcache_lock);
+
+	ngroups = gidcache_resolve(uid, groups);
+	*expires = now + gidcache_ttl(ngroups);
+	if (ngroups < 0) {
+		pthread_mutex_lock(&gidcache_lock);
+		gidcache_counters.negative++;
+		pthread_mutex_unlock(&gidcache_lock);
+	}
+	gidcache_store(uid, *groups, ngroups, *expires, 1);
+	return ngroups;
+}
+
+/**
+ * gidcache_enable - start refreshing entries ahead of their expiry
+ * @fd: auth.unix.gid channel to write refreshed entries to
+ *
+ * Returns a descriptor that becomes readable whenever
+ * gidcache_refresh_ahead() should be called, or -1.
+ */
+int
+gidcache_enable(int fd)
+{
+	struct itimerspec its;
+
+	channel_fd = fd;
+	if (gidcache_size <= 0 || fd < 0)
+		return -1;
+	if (timer_fd >= 0)
+		return timer_fd;
+
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd < 0)
+		return -1;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = its.it_interval.tv_sec = gidcache_window() / 2;
+	if (timerfd_settime(timer_fd, 0, &its, NULL) < 0) {
+		close(timer_fd);
+		timer_fd = -1;
+	}
+	return timer_fd;
+}
+
+/**
+ * gidcache_refresh_ahead - queue lookups for entries about to expire
+ *
+ * Only entries the kernel has asked about since they were last looked
+ * up are refreshed, so users who have gone away drop out of the cache.
+ */
+void
+gidcache_refresh_ahead(void)
+{
+	struct gidcache_entry *e;
+	uint64_t expirations;
+	time_t now, window;
+	int i;
+
+	if (timer_fd >= 0 &&
+	    read(timer_fd, &expirations, sizeof(expirations)) < 0 &&
+	    errno != EAGAIN)
+		xlog(L_WARNING, "gidcache: timerfd: %m");
+
+	now = time(NULL);
+	window = gidcache_window();
+	pthread_mutex_lock(&gidcache_lock);
+	for (i = 0; i < GIDCACHE_BUCKETS; i++)
+		for (e = gidcache[i]; e; e = e->next)
+			if (e->used && !e->refreshing &&
+			    e->expires - now <= window)
+				e->refreshing = gidcache_queue_refresh(e);
+	pthread_mutex_unlock(&gidcache_lock);
+}
+
+/**
+ * gidcache_get_stats - report what the cache has been doing
+ * @stats: OUT: counters
+ *
+ */
+void
+gidcache_get_stats(struct gidcache_stats *stats)
+{
+	pthread_mutex_lock(&gidcache_lock);
+	*stats = gidcache_counters;
+	stats->entries = gidcache_count;
+	pthread_mutex_unlock(&gidcache_lock);
+}
@@ -0,0 +1,463 @@
+/*
+ * support/export/hostcache.c
+ *
+ * Cache of resolver and netgroup answers used to match clients.
+ *
+ * Matching a client against wildcard and netgroup exports needs the
+ * canonical name of its address, the aliases of that name, and the
+ * netgroups the names are in.  Each of those can take as long as the
+ * slowest DNS, NIS or LDAP server, so answers are kept here for
+ * resolver-cache-ttl seconds (resolver-cache-negative-ttl for failed
+ * lookups and non-members).  Once an entry expires it is still used
+ * for one more period while a background thread looks it up again,
+ * so a busy client never waits on the resolver after the first time.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <netdb.h>
+#include <pthread.h>
+
+#include "sockaddr.h"
+#include "nfslib.h"
+#include "exportfs.h"
+#include "workqueue.h"
+#include "xlog.h"
+
+#if !defined(__GLIBC__) || __GLIBC__ < 2
+extern int	innetgr(char *netgr, char *host, char *, char *);
+#endif
+
+int hostcache_ttl = 120;
+int hostcache_negative_ttl = 30;
+
+#define HOSTCACHE_BUCKETS	1024
+#define HOSTCACHE_MAX		8192
+
+enum hostcache_type {
+	HC_ADDR,		/* address -> canonical name */
+	HC_ALIASES,		/* name -> aliases */
+	HC_NETGROUP,		/* netgroup, host -> member */
+};
+
+struct hostcache_value {
+	char			*name;
+	char			**aliases;
+	int			member;
+};
+
+struct hostcache_entry {
+	struct hostcache_entry	*next;
+	enum hostcache_type	type;
+	unsigned int		hash;
+	size_t			keylen;
+	time_t			expires;
+	int			refreshing;
+	struct hostcache_value	value;
+	char			key[];
+};
+
+struct hostcache_refresh {
+	enum hostcache_type	type;
+	size_t			keylen;
+	char			key[];
+};
+
+static struct hostcache_entry	*hostcache[HOSTCACHE_BUCKETS];
+static unsigned int		hostcache_count;
+static pthread_mutex_t		hostcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct xthread_workqueue	*refresh_wq;
+static pid_t			refresh_pid;
+
+/* gethostbyname() and innetgr() keep their state in static
+ * storage, so only one thread may be using them at a time.
+ */
+static pthread_mutex_t		nss_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static time_t
+hostcache_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
+
+static unsigned int
+hostcache_hash(enum hostcache_type type, const char *key, size_t keylen)
+{
+	unsigned int h = 2166136261u ^ type;
+
+	while (keylen--) {
+		h ^= (unsigned char)*key++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/**
+ * hostcache_free_aliases - release the result of hostcache_aliases()
+ * @aliases: array to free, may be NULL
+ *
+ */
+void
+hostcache_free_aliases(char **aliases)
+{
+	char **ap;
+
+	if (aliases == NULL)
+		return;
+	for (ap = aliases; *ap; ap++)
+		free(*ap);
+	free(aliases);
+}
+
+static void
+hostcache_value_release(struct hostcache_value *v)
+{
+	free(v->name);
+	hostcache_free_aliases(v->aliases);
+	memset(v, 0, sizeof(*v));
+}
+
+static char **
+hostcache_dup_aliases(char * const *aliases)
+{
+	char **new;
+	int i, n;
+
+	for (n = 0; aliases[n]; n++)
+		;
+	new = calloc(n + 1, sizeof(*new));
+	if (new == NULL)
+		return NULL;
+	for (i = 0; i < n; i++) {
+		new[i] = strdup(aliases[i]);
+		if (new[i] == NULL) {
+			hostcache_free_aliases(new);
+			return NULL;
+		}
+	}
+	return new;
+}
+
+static int
+hostcache_value_copy(struct hostcache_value *dst,
+		     const struct hostcache_value *src)
+{
+	*dst = *src;
+	dst->name = NULL;
+	dst->aliases = NULL;
+	if (src->name && (dst->name = strdup(src->name)) == NULL)
+		return 0;
+	if (src->aliases &&
+	    (dst->aliases = hostcache_dup_aliases(src->aliases)) == NULL) {
+		hostcache_value_release(dst);
+		return 0;
+	}
+	return 1;
+}
+
+static int
+hostcache_value_negative(enum hostcache_type type,
+			 const struct hostcache_value *v)
+{
+	switch (type) {
+	case HC_ADDR:
+		return v->name == NULL;
+	case HC_ALIASES:
+		return v->aliases == NULL;
+	case HC_NETGROUP:
+		return !v->member;
+	}
+	return 1;
+}
+
+/*
+ * Ask the resolver.  Called without hostcache_lock held.
+ */
+static void
+hostcache_resolve(enum hostcache_type type, const char *key,
+		  struct hostcache_value *v)
+{
+	struct hostent *hp;
+
+	memset(v, 0, sizeof(*v));
+	switch (type) {
+	case HC_ADDR:
+		v->name = host_canonname((const struct sockaddr *)key);
+		break;
+	case HC_ALIASES:
+		pthread_mutex_lock(&nss_lock);
+		hp = gethostbyname(key);
+		if (hp != NULL)
+			v->aliases = hostcache_dup_aliases(hp->h_aliases);
+		pthread_mutex_unlock(&nss_lock);
+		break;
+	case HC_NETGROUP:
+#ifdef HAVE_INNETGR
+		/* key is "netgroup\0host" */
+		pthread_mutex_lock(&nss_lock);
+		v->member = innetgr(key, key + strlen(key) + 1, NULL, NULL);
+		pthread_mutex_unlock(&nss_lock);
+#endif
+		break;
+	}
+}
+
+static struct hostcache_entry *
+hostcache_find(enum hostcache_type type, const char *key, size_t keylen,
+	       unsigned int hash)
+{
+	struct hostcache_entry *e;
+
+	for (e = hostcache[hash % HOSTCACHE_BUCKETS]; e; e = e->next)
+		if (e->hash == hash && e->type == type &&
+		    e->keylen == keylen && memcmp(e->key, key, keylen) == 0)
+			return e;
+	return NULL;
+}
+
+/*
+ * Drop entries that are past their grace period, or failing that,
+ * everything that has expired.
+ */
+static void
+hostcache_purge(time_t now)
+{
+	struct hostcache_entry *e, **ep;
+	time_t grace;
+	int pass, i;
+
+	for (pass = 0; pass < 2 && hostcache_count >= HOSTCACHE_MAX; pass++) {
+		grace = pass ? 0 : hostcache_ttl;
+		for (i = 0; i < HOSTCACHE_BUCKETS; i++) {
+			ep = &hostcache[i];
+			while ((e = *ep) != NULL) {
+				if (e->refreshing || now < e->expires + grace) {
+					ep = &e->next;
+					continue;
+				}
+				*ep = e->next;
+				hostcache_value_release(&e->value);
+				free(e);
+				hostcache_count--;
+			}
+		}
+	}
+}
+
+/*
+ * Remember @v for @key.  @v is copied.
+ */
+static void
+hostcache_store(enum hostcache_type type, const char *key, size_t keylen,
+		const struct hostcache_value *v)
+{
+	struct hostcache_entry *e;
+	struct hostcache_value copy;
+	unsigned int hash;
+	time_t now;
+
+	if (!hostcache_value_copy(&copy, v))
+		return;
+	hash = hostcache_hash(type, key, keylen);
+	now = hostcache_now();
+
+	pthread_mutex_lock(&hostcache_lock);
+	e = hostcache_find(type, key, keylen, hash);
+	if (e == NULL) {
+		if (hostcache_count >= HOSTCACHE_MAX)
+			hostcache_purge(now);
+		if (hostcache_count >= HOSTCACHE_MAX ||
+		    (e = calloc(1, sizeof(*e) + keylen)) == NULL) {
+			pthread_mutex_unlock(&hostcache_lock);
+			hostcache_value_release(&copy);
+			return;
+		}
+		e->type = type;
+		e->hash = hash;
+		e->keylen = keylen;
+		memcpy(e->key, key, keylen);
+		e->next = hostcache[hash % HOSTCACHE_BUCKETS];
+		hostcache[hash % HOSTCACHE_BUCKETS] = e;
+		hostcache_count++;
+	} else
+		hostcache_value_release(&e->value);
+	e->value = copy;
+	e->refreshing = 0;
+	e->expires = now + (hostcache_value_negative(type, &copy) ?
+			    hostcache_negative_ttl : hostcache_ttl);
+	pthread_mutex_unlock(&hostcache_lock);
+}
+
+static void
+hostcache_refresh(void *data)
+{
+	struct hostcache_refresh *r = data;
+	struct hostcache_value v;
+
+	hostcache_resolve(r->type, r->key, &v);
+	hostcache_store(r->type, r->key, r->keylen, &v);
+	hostcache_value_release(&v);
+	free(r);
+}
+
+/*
+ * Have @e looked up again in the background.  Called with
+ * hostcache_lock held.  Returns 1 if the lookup was queued.
+ */
+static int
+hostcache_queue_refresh(struct hostcache_entry *e)
+{
+	struct hostcache_refresh *r;
+
+	/* the thread does not survive fork() */
+	if (refresh_wq == NULL || refresh_pid != getpid()) {
+		refresh_wq = xthread_workqueue_alloc_pool(1);
+		refresh_pid = getpid();
+		if (refresh_wq == NULL)
+			return 0;
+	}
+
+	r = malloc(sizeof(*r) + e->keylen);
+	if (r == NULL)
+		return 0;
+	r->type = e->type;
+	r->keylen = e->keylen;
+	memcpy(r->key, e->key, e->keylen);
+	if (xthread_work_queue(refresh_wq, hostcache_refresh, r) < 0) {
+		free(r);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Fill in @v, which the caller must release, with the answer for @key.
+ */
+static void
+hostcache_get(enum hostcache_type type, const char *key, size_t keylen,
+	      struct hostcache_value *v)
+{
+	struct hostcache_entry *e;
+	unsigned int hash;
+	time_t now;
+
+	if (hostcache_ttl <= 0) {
+		hostcache_resolve(type, key, v);
+		return;
+	}
+
+	hash = hostcache_hash(type, key, keylen);
+	now = hostcache_now();
+
+	pthread_mutex_lock(&hostcache_lock);
+	e = hostcache_find(type, key, keylen, hash);
+	if (e && now < e->expires + hostcache_ttl &&
+	    hostcache_value_copy(v, &e->value)) {
+		if (now >= e->expires && !e->refreshing)
+			e->refreshing = hostcache_queue_refresh(e);
+		pthread_mutex_unlock(&hostcache_lock);
+		return;
+	}
+	pthread_mutex_unlock(&hostcache_lock);
+
+	hostcache_resolve(type, key, v);
+	hostcache_store(type, key, keylen, v);
+}
+
+/*
+ * Addresses are cached by family, address and scope only.
+ */
+static size_t
+hostcache_addr_key(const struct sockaddr *sap, union nfs_sockaddr *key)
+{
+	memset(key, 0, sizeof(*key));
+	switch (sap->sa_family) {
+	case AF_INET:
+		key->s4.sin_family = AF_INET;
+		key->s4.sin_addr = ((const struct sockaddr_in *)sap)->sin_addr;
+		return sizeof(key->s4);
+	case AF_INET6:
+		key->s6.sin6_family = AF_INET6;
+		key->s6.sin6_addr = ((const struct sockaddr_in6 *)sap)->sin6_addr;
+		key->s6.sin6_scope_id =
+			((const struct sockaddr_in6 *)sap)->sin6_scope_id;
+		return sizeof(key->s6);
+	}
+	return 0;
+}
+
+/**
+ * hostcache_canonname - return canonical hostname bound to an address
+ * @sap: pointer to socket address to look up
+ *
+ * Cached version of host_canonname().  Returns a '\0'-terminated
+ * string the caller must free, or NULL if no name can be found.
+ */
+char *
+hostcache_canonname(const struct sockaddr *sap)
+{
+	struct hostcache_value v;
+	union nfs_sockaddr key;
+	size_t keylen;
+
+	keylen = hostcache_addr_key(sap, &key);
+	if (keylen == 0)
+		return host_canonname(sap);
+
+	hostcache_get(HC_ADDR, (const char *)&key, keylen, &v);
+	return v.name;
+}
+
+/**
+ * hostcache_aliases - return the aliases of a hostname
+ * @hname: '\0'-terminated ASCII string containing hostname
+ *
+ * Returns a NULL-terminated array of aliases from gethostbyname(3),
+ * or NULL if @hname could not be looked up.  Caller must free the
+ * result with hostcache_free_aliases().
+ */
+char **
+hostcache_aliases(const char *hname)
+{
+	struct hostcache_value v;
+
+	hostcache_get(HC_ALIASES, hname, strlen(hname) + 1, &v);
+	return v.aliases;
+}
+
+/**
+ * hostcache_innetgr - cached innetgr(3)
+ * @netgroup: '\0'-terminated netgroup name, without the '@'
+ * @host: '\0'-terminated host name
+ *
+ * Returns 1 if @host is a member of @netgroup, otherwise zero.
+ */
+int
+hostcache_innetgr(const char *netgroup, const char *host)
+{
+	struct hostcache_value v;
+	size_t glen = strlen(netgroup) + 1, hlen = strlen(host) + 1;
+	char *key;
+
+	key = malloc(glen + hlen);
+	if (key == NULL)
+		return 0;
+	memcpy(key, netgroup, glen);
+	memcpy(key + glen, host, hlen);
+	hostcache_get(HC_NETGROUP, key, glen + hlen, &v);
+	free(key);
+	return v.member;
+}
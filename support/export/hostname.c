@@ -29,6 +29,7 @@
 
 #include "sockaddr.h"
 #include "exportfs.h"
+#include "workqueue.h"
 
 /**
  * host_ntop - generate presentation address given a sockaddr
@@ -364,3 +365,112 @@ host_numeric_addrinfo(const struct sockaddr *sap)
 	return host_pton(buf);
 }
 #endif	/* !HAVE_GETNAMEINFO */
+
+/*
+ * Answers to host_addrinfo() looked up ahead of time, concurrently.
+ * exportfs -a looks up every client named in the exports files this
+ * way before reading them, instead of one line at a time.
+ */
+struct host_prefetched {
+	char			*name;
+	struct addrinfo		*ai;
+};
+
+static struct host_prefetched	*prefetched;
+static int			nprefetched;
+
+static int
+host_prefetch_cmp(const void *a, const void *b)
+{
+	const struct host_prefetched *x = a, *y = b;
+
+	return strcasecmp(x->name, y->name);
+}
+
+static void
+host_prefetch_one(int i, void *data)
+{
+	struct host_prefetched *hp = data;
+
+	hp[i].ai = host_addrinfo(hp[i].name);
+}
+
+/**
+ * host_prefetch_release - forget the answers of host_prefetch()
+ */
+void
+host_prefetch_release(void)
+{
+	int i;
+
+	for (i = 0; i < nprefetched; i++) {
+		free(prefetched[i].name);
+		nfs_freeaddrinfo(prefetched[i].ai);
+	}
+	free(prefetched);
+	prefetched = NULL;
+	nprefetched = 0;
+}
+
+/**
+ * host_prefetch - look up several hostnames at once
+ * @names: array of hostnames, which may repeat
+ * @count: number of @names
+ * @nthreads: how many lookups may be outstanding at the same time
+ *
+ * Until host_prefetch_release() is called, host_prefetched() gives the
+ * answers.  Returns the number of distinct names that were looked up.
+ */
+int
+host_prefetch(char **names, int count, int nthreads)
+{
+	int i, n = 0;
+
+	host_prefetch_release();
+	if (count <= 0)
+		return 0;
+	prefetched = calloc(count, sizeof(*prefetched));
+	if (prefetched == NULL)
+		return 0;
+	for (i = 0; i < count; i++) {
+		prefetched[n].name = strdup(names[i]);
+		if (prefetched[n].name == NULL)
+			break;
+		n++;
+	}
+	qsort(prefetched, n, sizeof(*prefetched), host_prefetch_cmp);
+	for (i = 1, nprefetched = n ? 1 : 0; i < n; i++) {
+		if (host_prefetch_cmp(&prefetched[i],
+				      &prefetched[nprefetched - 1]) == 0)
+			free(prefetched[i].name);
+		else
+			prefetched[nprefetched++] = prefetched[i];
+	}
+
+	xthread_parallel(nthreads, nprefetched, host_prefetch_one, prefetched);
+	return nprefetched;
+}
+
+/**
+ * host_prefetched - find what host_prefetch() got for a hostname
+ * @hostname: pointer to a '\0'-terminated ASCII string containing a hostname
+ * @ai: OUT: the answer, NULL if @hostname did not resolve; it belongs to
+ *	the prefetched table and must not be freed
+ *
+ * Returns 1 if @hostname was prefetched, otherwise 0.
+ */
+int
+host_prefetched(const char *hostname, const struct addrinfo **ai)
+{
+	struct host_prefetched key = { .name = (char *)hostname };
+	struct host_prefetched *hp;
+
+	if (nprefetched == 0)
+		return 0;
+	hp = bsearch(&key, prefetched, nprefetched, sizeof(*prefetched),
+		     host_prefetch_cmp);
+	if (hp == NULL)
+		return 0;
+	*ai = hp->ai;
+	return 1;
+}
@@ -3,231 +3,606 @@
  *
  * Montior clients appearing in, and disappearing from, /proc/fs/nfsd/clients
  * and log relevant information.
+ *
+ * When a server restarts, all of its NFSv4 clients reconnect at once,
+ * and each creates a directory and rewrites its info file a few times.
+ * So events are not acted on as they arrive: the clients they name are
+ * noted, and V4CLIENTS_WINDOW_MS later each noted client has its info
+ * file read once, however many events named it.
  */
 
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include <sys/inotify.h>
+#include <sys/timerfd.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include "export.h"
 
-/* search.h declares 'struct entry' and nfs_prot.h
- * does too.  Easiest fix is to trick search.h into
- * calling its struct "struct Entry".
- */
-#define entry Entry
-#include <search.h>
-#undef entry
+#define V4CLIENTS_DIR		"/proc/fs/nfsd/clients"
+#define V4CLIENTS_WINDOW_MS	100
+#define V4CLIENTS_MIN_BUCKETS	1024
+
+struct v4client {
+	struct v4client	*next;		/* in the id hash chain */
+	struct v4client	*wnext;		/* in the watch hash chain */
+	unsigned long	num;
+	int		wid;		/* info file watch while unconfirmed */
+	unsigned char	vers;
+	unsigned char	unconfirmed;
+	unsigned char	pending;	/* info file to be read */
+	unsigned char	announce;	/* log it once it is confirmed */
+	unsigned char	seen;		/* still in the directory on resync */
+	char		*clientid;	/* clientid and addr share one block */
+	char		*addr;
+};
+
+static struct {
+	struct v4client	**ids;
+	struct v4client	**wids;
+	unsigned int	size;		/* buckets, in both tables */
+	unsigned int	count;
+	unsigned long	*pending;	/* ids of clients to be read */
+	unsigned int	npending, maxpending;
+	char		*buf;		/* for info files */
+	size_t		buflen;
+	unsigned long	events, coalesced, reads, overflows;
+} clients;
 
 static int clients_fd = -1;
+static int window_fd = -1;
 
-void v4clients_init(void)
+static void v4clients_resync(int announce);
+
+static const char *or_none(const char *s)
 {
-	struct stat sb;
+	return s && *s ? s : "-none-";
+}
 
-	if (stat("/proc/fs/nfsd/clients", &sb) != 0 ||
-	    !S_ISDIR(sb.st_mode))
-		return;
-	if (clients_fd >= 0)
-		return;
-	clients_fd = inotify_init1(IN_NONBLOCK);
-	if (clients_fd < 0) {
-		xlog_err("Unable to initialise v4clients watcher: %s\n",
-			 strerror(errno));
-		return;
-	}
-	if (inotify_add_watch(clients_fd, "/proc/fs/nfsd/clients",
-			      IN_CREATE | IN_DELETE) < 0) {
-		xlog_err("Unable to watch /proc/fs/nfsd/clients: %s\n",
-			 strerror(errno));
-		close(clients_fd);
-		clients_fd = -1;
-		return;
-	}
+static unsigned int id_hash(unsigned long num)
+{
+	/* ids are handed out in sequence */
+	return num & (clients.size - 1);
 }
 
-void v4clients_set_fds(fd_set *fdset)
+static unsigned int wid_hash(int wid)
 {
-	if (clients_fd >= 0)
-		FD_SET(clients_fd, fdset);
+	return (unsigned int)wid & (clients.size - 1);
+}
+
+static struct v4client *find_id(unsigned long num)
+{
+	struct v4client *c;
+
+	if (!clients.size)
+		return NULL;
+	for (c = clients.ids[id_hash(num)]; c; c = c->next)
+		if (c->num == num)
+			return c;
+	return NULL;
 }
 
-static void *tree_root;
-static int have_unconfirmed;
+static struct v4client *find_wid(int wid)
+{
+	struct v4client *c;
 
-struct ent {
-	unsigned long num;
-	char *clientid;
-	char *addr;
-	int vers;
-	int unconfirmed;
-	int wid;
-};
+	if (!clients.size || wid < 0)
+		return NULL;
+	for (c = clients.wids[wid_hash(wid)]; c; c = c->wnext)
+		if (c->wid == wid)
+			return c;
+	return NULL;
+}
 
-static int ent_cmp(const void *av, const void *bv)
+static int grow_tables(void)
 {
-	const struct ent *a = av;
-	const struct ent *b = bv;
+	unsigned int size = clients.size ? clients.size * 2 :
+					   V4CLIENTS_MIN_BUCKETS;
+	struct v4client **ids, **wids, *c, *next;
+	unsigned int i, oldsize = clients.size;
 
-	if (a->num < b->num)
-		return -1;
-	if (a->num > b->num)
-		return 1;
+	ids = calloc(size, sizeof(*ids));
+	wids = calloc(size, sizeof(*wids));
+	if (!ids || !wids) {
+		free(ids);
+		free(wids);
+		return clients.size ? 0 : -1;
+	}
+	clients.size = size;
+	for (i = 0; i < oldsize; i++) {
+		for (c = clients.ids[i]; c; c = next) {
+			next = c->next;
+			c->next = ids[id_hash(c->num)];
+			ids[id_hash(c->num)] = c;
+			if (c->wid >= 0) {
+				c->wnext = wids[wid_hash(c->wid)];
+				wids[wid_hash(c->wid)] = c;
+			}
+		}
+	}
+	free(clients.ids);
+	free(clients.wids);
+	clients.ids = ids;
+	clients.wids = wids;
 	return 0;
 }
 
-static void free_ent(struct ent *ent)
+static void watch_add(struct v4client *c, int wid)
 {
-	free(ent->clientid);
-	free(ent->addr);
-	free(ent);
+	c->wid = wid;
+	c->wnext = clients.wids[wid_hash(wid)];
+	clients.wids[wid_hash(wid)] = c;
 }
 
-static char *dup_line(char *line)
+static void watch_del(struct v4client *c)
 {
-	char *ret;
-	char *e = strchr(line, '\n');
-	if (!e)
-		e = line + strlen(line);
-	ret = malloc(e - line + 1);
-	if (ret) {
-		memcpy(ret, line, e - line);
-		ret[e-line] = 0;
-	}
-	return ret;
+	struct v4client **cp;
+
+	if (c->wid < 0)
+		return;
+	for (cp = &clients.wids[wid_hash(c->wid)]; *cp; cp = &(*cp)->wnext)
+		if (*cp == c) {
+			*cp = c->wnext;
+			break;
+		}
+	inotify_rm_watch(clients_fd, c->wid);
+	c->wid = -1;
+}
+
+static struct v4client *add_id(unsigned long num)
+{
+	struct v4client *c;
+
+	if ((c = find_id(num)) != NULL)
+		return c;
+	if (clients.count >= clients.size * 2 && grow_tables() < 0)
+		return NULL;
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return NULL;
+	c->num = num;
+	c->wid = -1;
+	c->next = clients.ids[id_hash(num)];
+	clients.ids[id_hash(num)] = c;
+	clients.count++;
+	return c;
 }
 
-static void read_info(struct ent *key)
+static void del_id(unsigned long num)
 {
-	char buf[2048];
-	char *path;
-	int was_unconfirmed = key->unconfirmed;
-	FILE *f;
+	struct v4client **cp, *c;
 
-	if (asprintf(&path, "/proc/fs/nfsd/clients/%lu/info", key->num) < 0)
+	if (!clients.size)
+		return;
+	for (cp = &clients.ids[id_hash(num)]; (c = *cp) != NULL; cp = &c->next)
+		if (c->num == num)
+			break;
+	if (!c)
 		return;
+	*cp = c->next;
+	clients.count--;
+
+	/* one we never got to read is of no interest */
+	if (!c->unconfirmed && c->clientid)
+		xlog(L_NOTICE, "v4.%d client detached: %s from %s",
+		     c->vers, or_none(c->clientid), or_none(c->addr));
+	watch_del(c);
+	free(c->clientid);
+	free(c);
+}
 
-	f = fopen(path, "r");
-	if (!f) {
-		free(path);
+/* Note that @c's info file is to be read when the window closes */
+static void queue_id(struct v4client *c)
+{
+	struct itimerspec its = {
+		.it_value.tv_sec = V4CLIENTS_WINDOW_MS / 1000,
+		.it_value.tv_nsec = (V4CLIENTS_WINDOW_MS % 1000) * 1000000,
+	};
+	unsigned long *pending;
+
+	if (c->pending) {
+		clients.coalesced++;
 		return;
 	}
-	if (key->wid < 0)
-		key->wid = inotify_add_watch(clients_fd, path, IN_MODIFY);
+	if (clients.npending == clients.maxpending) {
+		unsigned int max = clients.maxpending ?
+				   clients.maxpending * 2 : 256;
+
+		pending = realloc(clients.pending, max * sizeof(*pending));
+		if (!pending)
+			return;
+		clients.pending = pending;
+		clients.maxpending = max;
+	}
+	clients.pending[clients.npending++] = c->num;
+	c->pending = 1;
+	if (clients.npending == 1 && window_fd >= 0)
+		timerfd_settime(window_fd, 0, &its, NULL);
+}
+
+static void set_strings(struct v4client *c, const char *clientid,
+			size_t idlen, const char *addr, size_t addrlen)
+{
+	char *s = malloc(idlen + addrlen + 2);
+
+	if (!s)
+		return;
+	memcpy(s, clientid, idlen);
+	s[idlen] = '\0';
+	memcpy(s + idlen + 1, addr, addrlen);
+	s[idlen + 1 + addrlen] = '\0';
+	free(c->clientid);
+	c->clientid = s;
+	c->addr = s + idlen + 1;
+}
+
+/* Read the whole of @path into clients.buf; returns its length or -1 */
+static ssize_t read_file(const char *path)
+{
+	ssize_t len = 0, n;
+	char *buf;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	for (;;) {
+		if ((size_t)len + 1 >= clients.buflen) {
+			size_t buflen = clients.buflen ? clients.buflen * 2 :
+							 4096;
 
-	while (fgets(buf, sizeof(buf), f)) {
-		if (strncmp(buf, "clientid: ", 10) == 0) {
-			free(key->clientid);
-			key->clientid = dup_line(buf+10);
+			buf = realloc(clients.buf, buflen);
+			if (!buf) {
+				len = -1;
+				break;
+			}
+			clients.buf = buf;
+			clients.buflen = buflen;
 		}
-		if (strncmp(buf, "address: ", 9) == 0) {
-			free(key->addr);
-			key->addr = dup_line(buf+9);
+		n = read(fd, clients.buf + len, clients.buflen - len - 1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			len = -1;
+			break;
 		}
-		if (strncmp(buf, "minor version: ", 15) == 0)
-			key->vers = atoi(buf+15);
-		if (strncmp(buf, "status: ", 8) == 0 &&
-		    strstr(buf, " unconfirmed") != NULL) {
-			key->unconfirmed = 1;
-			have_unconfirmed = 1;
+		if (n == 0)
+			break;
+		len += n;
+	}
+	close(fd);
+	if (len >= 0)
+		clients.buf[len] = '\0';
+	return len;
+}
+
+static int has_prefix(const char *line, size_t len, const char *prefix,
+		      size_t plen)
+{
+	return len >= plen && memcmp(line, prefix, plen) == 0;
+}
+
+#define PREFIX(s)	s, sizeof(s) - 1
+
+static int parse_info(struct v4client *c, const char *path)
+{
+	const char *clientid = "", *addr = "";
+	size_t idlen = 0, addrlen = 0, len;
+	char *line, *end, *eol;
+	ssize_t n;
+
+	n = read_file(path);
+	if (n < 0)
+		return -1;
+	clients.reads++;
+	for (line = clients.buf, end = clients.buf + n; line < end;
+	     line = eol + 1) {
+		eol = memchr(line, '\n', end - line);
+		if (!eol)
+			eol = end;
+		len = eol - line;
+		if (has_prefix(line, len, PREFIX("clientid: "))) {
+			clientid = line + 10;
+			idlen = len - 10;
+		} else if (has_prefix(line, len, PREFIX("address: "))) {
+			addr = line + 9;
+			addrlen = len - 9;
+		} else if (has_prefix(line, len, PREFIX("minor version: "))) {
+			*eol = '\0';
+			c->vers = atoi(line + 15);
+		} else if (has_prefix(line, len, PREFIX("status: "))) {
+			if (memmem(line, len, PREFIX(" unconfirmed")))
+				c->unconfirmed = 1;
+			else if (memmem(line, len, PREFIX(" confirmed")))
+				c->unconfirmed = 0;
+		}
+	}
+	set_strings(c, clientid, idlen, addr, addrlen);
+	return 0;
+}
+
+static void read_info(struct v4client *c)
+{
+	char path[sizeof(V4CLIENTS_DIR) + 32];
+	int wid;
+
+	snprintf(path, sizeof(path), V4CLIENTS_DIR "/%lu/info", c->num);
+	if (parse_info(c, path) < 0)
+		return;
+
+	/*
+	 * Only unconfirmed clients are watched.  Read again once the
+	 * watch is in place, in case it was confirmed in between.
+	 */
+	if (c->unconfirmed && c->wid < 0) {
+		wid = inotify_add_watch(clients_fd, path, IN_MODIFY);
+		if (wid >= 0) {
+			watch_add(c, wid);
+			parse_info(c, path);
 		}
-		if (strncmp(buf, "status: ", 8) == 0 &&
-		    strstr(buf, " confirmed") != NULL)
-			key->unconfirmed = 0;
 	}
-	fclose(f);
-	free(path);
-
-	if (was_unconfirmed && !key->unconfirmed)
-		xlog(L_NOTICE, "v4.%d client attached: %s from %s",
-		     key->vers, key->clientid ?: "-none-",
-		     key->addr ?: "-none-");
-	if (!key->unconfirmed && key->wid >= 0) {
-		inotify_rm_watch(clients_fd, key->wid);
-		key->wid = -1;
+
+	if (c->unconfirmed)
+		c->announce = 1;
+	else {
+		if (c->announce)
+			xlog(L_NOTICE, "v4.%d client attached: %s from %s",
+			     c->vers, or_none(c->clientid),
+			     or_none(c->addr));
+		c->announce = 0;
+		watch_del(c);
 	}
 }
 
-static void add_id(int id)
+void v4clients_init(void)
 {
-	struct ent **ent;
-	struct ent *key;
+	struct stat sb;
 
-	key = calloc(1, sizeof(*key));
-	if (!key) {
+	if (stat(V4CLIENTS_DIR, &sb) != 0 ||
+	    !S_ISDIR(sb.st_mode))
+		return;
+	if (clients_fd >= 0)
+		return;
+	clients_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (clients_fd < 0) {
+		xlog_err("Unable to initialise v4clients watcher: %s\n",
+			 strerror(errno));
+		return;
+	}
+	if (inotify_add_watch(clients_fd, V4CLIENTS_DIR,
+			      IN_CREATE | IN_DELETE) < 0) {
+		xlog_err("Unable to watch " V4CLIENTS_DIR ": %s\n",
+			 strerror(errno));
+		close(clients_fd);
+		clients_fd = -1;
+		return;
+	}
+	if (grow_tables() < 0) {
+		close(clients_fd);
+		clients_fd = -1;
 		return;
 	}
-	key->num = id;
-	key->wid = -1;
 
-	ent = tsearch(key, &tree_root, ent_cmp);
+	/* Without it, events are handled as they come */
+	window_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (window_fd < 0)
+		xlog(L_WARNING, "v4clients: timerfd_create: %m");
 
-	if (!ent || *ent != key)
-		/* Already existed, or insertion failed */
-		free_ent(key);
-	else
-		read_info(key);
+	/* Pick up the clients that connected before we started watching */
+	v4clients_resync(0);
+	v4clients_flush();
 }
 
-static void del_id(unsigned long id)
+/**
+ * v4clients_get_fd - inotify descriptor to wait on, or -1 if not watching
+ */
+int v4clients_get_fd(void)
 {
-	struct ent key = {.num = id};
-	struct ent **e, *ent;
+	return clients_fd;
+}
 
-	e = tfind(&key, &tree_root, ent_cmp);
-	if (!e || !*e)
-		return;
-	ent = *e;
-	tdelete(ent, &tree_root, ent_cmp);
-	if (!ent->unconfirmed)
-		xlog(L_NOTICE, "v4.%d client detached: %s from %s",
-		     ent->vers, ent->clientid, ent->addr);
-	if (ent->wid >= 0)
-		inotify_rm_watch(clients_fd, ent->wid);
-	free_ent(ent);
+/**
+ * v4clients_timer_fd - descriptor that is readable when events are due to
+ * be handled (call v4clients_flush()), or -1
+ */
+int v4clients_timer_fd(void)
+{
+	return clients_fd >= 0 ? window_fd : -1;
 }
 
-static void check_id(unsigned long id)
+/*
+ * Bring the table in line with the directory, after inotify dropped
+ * events.  Clients found now are logged once confirmed if @announce.
+ */
+static void v4clients_resync(int announce)
 {
-	struct ent key = {.num = id};
-	struct ent **e, *ent;
+	struct v4client *c, *next;
+	struct dirent *de;
+	unsigned int i;
+	DIR *dir;
 
-	e = tfind(&key, &tree_root, ent_cmp);
-	if (!e || !*e)
+	dir = opendir(V4CLIENTS_DIR);
+	if (!dir)
 		return;
-	ent = *e;
-	if (ent->unconfirmed)
-		read_info(ent);
+	for (i = 0; i < clients.size; i++)
+		for (c = clients.ids[i]; c; c = c->next)
+			c->seen = 0;
+	while ((de = readdir(dir)) != NULL) {
+		if (atol(de->d_name) <= 0)
+			continue;
+		c = find_id(atol(de->d_name));
+		if (!c && (c = add_id(atol(de->d_name))) != NULL)
+			c->announce = announce;
+		if (c) {
+			c->seen = 1;
+			queue_id(c);
+		}
+	}
+	closedir(dir);
+	for (i = 0; i < clients.size; i++)
+		for (c = clients.ids[i]; c; c = next) {
+			next = c->next;
+			if (!c->seen)
+				del_id(c->num);
+		}
 }
 
-int v4clients_process(fd_set *fdset)
+void v4clients_process(void)
 {
 	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
 	const struct inotify_event *ev;
+	struct v4client *c;
 	ssize_t len;
 	char *ptr;
+	long id;
 
-	if (clients_fd < 0 ||
-	    !FD_ISSET(clients_fd, fdset))
-		return 0;
+	if (clients_fd < 0)
+		return;
 
 	while ((len = read(clients_fd, buf, sizeof(buf))) > 0) {
 		for (ptr = buf; ptr < buf + len;
 		     ptr += sizeof(struct inotify_event) + ev->len) {
-			int id;
 			ev = (const struct inotify_event *)ptr;
 
-			id = atoi(ev->name);
+			clients.events++;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				clients.overflows++;
+				v4clients_resync(1);
+				continue;
+			}
+			/* the info file of a client being watched */
+			if (ev->len == 0) {
+				if ((ev->mask & IN_MODIFY) &&
+				    (c = find_wid(ev->wd)) != NULL)
+					queue_id(c);
+				continue;
+			}
+			id = atol(ev->name);
 			if (id <= 0)
 				continue;
-			if (ev->mask & IN_CREATE)
-				add_id(id);
+			if (ev->mask & IN_CREATE) {
+				c = add_id(id);
+				if (c && !c->clientid)
+					c->announce = 1;
+				if (c)
+					queue_id(c);
+			}
 			if (ev->mask & IN_DELETE)
 				del_id(id);
-			if (ev->mask & IN_MODIFY)
-				check_id(id);
 		}
 	}
-	return 1;
+	if (window_fd < 0)
+		v4clients_flush();
+}
+
+/**
+ * v4clients_flush - read the info files of the clients events named
+ */
+void v4clients_flush(void)
+{
+	unsigned long *pending = clients.pending;
+	unsigned int i, npending = clients.npending;
+	uint64_t expirations;
+	struct v4client *c;
+
+	if (window_fd >= 0 &&
+	    read(window_fd, &expirations, sizeof(expirations)) < 0 &&
+	    errno != EAGAIN)
+		xlog(L_WARNING, "v4clients: timerfd: %m");
+
+	/* read_info() doesn't queue, but start afresh in case it ever does */
+	clients.pending = NULL;
+	clients.npending = clients.maxpending = 0;
+	for (i = 0; i < npending; i++) {
+		c = find_id(pending[i]);
+		if (!c || !c->pending)
+			continue;
+		c->pending = 0;
+		read_info(c);
+	}
+	free(pending);
+	if (npending)
+		xlog(D_GENERAL, "v4clients: read %u info files, %u clients known",
+		     npending, clients.count);
+}
+
+/**
+ * v4clients_get_stats - summary of the NFSv4 clients the kernel knows about
+ * @st: OUT: the summary
+ */
+void v4clients_get_stats(struct v4clients_stats *st)
+{
+	struct v4client *c;
+	unsigned int i;
+
+	memset(st, 0, sizeof(*st));
+	for (i = 0; i < clients.size; i++)
+		for (c = clients.ids[i]; c; c = c->next) {
+			st->clients++;
+			if (c->pending || !c->clientid)
+				st->unread++;
+			else if (c->unconfirmed)
+				st->unconfirmed++;
+			else if (c->vers < V4CLIENTS_MINORS)
+				st->minor[c->vers]++;
+		}
+	st->events = clients.events;
+	st->coalesced = clients.coalesced;
+	st->reads = clients.reads;
+	st->overflows = clients.overflows;
+}
+
+/* The address part of "192.0.2.1:port" or "[2001:db8::1]:port", possibly quoted */
+static char *client_addr(const struct v4client *c)
+{
+	const char *start, *end;
+
+	start = c->addr;
+	if (*start == '"')
+		start++;
+	if (*start == '[') {
+		start++;
+		end = strchr(start, ']');
+	} else
+		end = strrchr(start, ':');
+	if (!end || end == start)
+		return NULL;
+	return strndup(start, end - start);
+}
+
+/**
+ * v4clients_addrs - addresses of the NFSv4 clients the kernel knows about
+ *
+ * Returns a NULL-terminated array of address strings, or NULL if there
+ * are none.  The caller frees the strings and the array.
+ */
+char **v4clients_addrs(void)
+{
+	char **addrs = NULL, **new, *addr;
+	size_t naddrs = 0, size = 0;
+	struct v4client *c;
+	unsigned int i;
+
+	for (i = 0; i < clients.size; i++)
+		for (c = clients.ids[i]; c; c = c->next) {
+			if (c->unconfirmed || !c->addr || !*c->addr)
+				continue;
+			if (naddrs + 1 >= size) {
+				new = realloc(addrs, (size + 32) * sizeof(*addrs));
+				if (!new)
+					goto out;
+				addrs = new;
+				size += 32;
+			}
+			addr = client_addr(c);
+			if (addr)
+				addrs[naddrs++] = addr;
+		}
+out:
+	if (addrs)
+		addrs[naddrs] = NULL;
+	return addrs;
 }
@@ -55,12 +55,18 @@ static nfs_export pseudo_root = {
 	.m_warned = 0,
 };
 
+/*
+ * Give @pseudo every flavor that can be used now.  Kept pseudo exports
+ * come through here again on each reload, so the list is rebuilt from
+ * scratch rather than added to.
+ */
 static void
 set_pseudofs_security(struct exportent *pseudo)
 {
 	struct flav_info *flav;
 	int i;
 
+	memset(pseudo->e_secinfo, 0, sizeof(pseudo->e_secinfo));
 	for (flav = flav_map; flav < flav_map + flav_map_size; flav++) {
 		struct sec_entry *new;
 
@@ -70,6 +76,8 @@ set_pseudofs_security(struct exportent *pseudo)
 			continue;
 
 		i = secinfo_addflavor(flav, pseudo);
+		if (i < 0)
+			break;
 		new = &pseudo->e_secinfo[i];
 
 		new->flags |= NFSEXP_INSECURE_PORT;
@@ -143,53 +151,299 @@ v4root_support(void)
 	return 0;
 }
 
+/*
+ * Before any pseudo export is made, the parent directories of every
+ * export are gathered, for every client, into a trie of path
+ * components.  Each (client, directory) pair is then dealt with once,
+ * parents first, however many exports lie below it.
+ *
+ * The pseudo exports made last time are handed back by
+ * xtab_export_update() to v4root_keep(), and put in the trie too.
+ * Those still wanted go straight back into the export table, so a
+ * reload that changes a few exports only makes pseudo exports for
+ * the directories those few need.
+ */
+struct v4root_host {
+	struct v4root_host	*next;		/* at this node */
+	struct v4root_host	*hnext;		/* in hash chain */
+	struct v4root_node	*node;
+	nfs_client		*client;
+	nfs_export		*source;	/* an export below, if any */
+	nfs_export		*pseudo;	/* made last time, if any */
+};
+
+struct v4root_node {
+	struct v4root_node	*parent;
+	struct v4root_node	*children;
+	struct v4root_node	*sibling;
+	struct v4root_node	*hnext;		/* in hash chain */
+	struct v4root_host	*hosts;
+	unsigned int		nchildren;
+	size_t			namelen;
+	char			name[];		/* last path component */
+};
+
+struct v4root_trie {
+	struct v4root_node	*root;
+	struct v4root_node	**nodes;
+	struct v4root_host	**hosts;
+	unsigned int		mask;
+	unsigned int		kept, created, released;
+};
+
+static nfs_export **kept_pseudo;
+static unsigned int nkept, kept_size;
+
+/**
+ * v4root_keep - hand back a pseudo export for v4root_set() to reuse
+ * @exp: pseudo export, no longer in the export table
+ *
+ */
+void
+v4root_keep(nfs_export *exp)
+{
+	nfs_export **new;
+
+	if (nkept == kept_size) {
+		new = realloc(kept_pseudo, (kept_size + 64) * sizeof(*new));
+		if (new == NULL) {
+			export_release(exp);
+			return;
+		}
+		kept_pseudo = new;
+		kept_size += 64;
+	}
+	kept_pseudo[nkept++] = exp;
+}
+
+static unsigned int
+v4root_hash(const void *parent, const char *name, size_t len)
+{
+	unsigned int h = 2166136261u ^ (unsigned int)(unsigned long)parent;
+
+	while (len--) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static struct v4root_node *
+v4root_child(struct v4root_trie *t, struct v4root_node *parent,
+	     const char *name, size_t len)
+{
+	unsigned int h = v4root_hash(parent, name, len) & t->mask;
+	struct v4root_node *n;
+
+	for (n = t->nodes[h]; n; n = n->hnext)
+		if (n->parent == parent && n->namelen == len &&
+		    memcmp(n->name, name, len) == 0)
+			return n;
+
+	n = calloc(1, sizeof(*n) + len + 1);
+	if (n == NULL)
+		return NULL;
+	n->parent = parent;
+	n->namelen = len;
+	memcpy(n->name, name, len);
+	n->hnext = t->nodes[h];
+	t->nodes[h] = n;
+	if (parent) {
+		n->sibling = parent->children;
+		parent->children = n;
+		parent->nchildren++;
+	}
+	return n;
+}
+
+static struct v4root_host *
+v4root_host_get(struct v4root_trie *t, struct v4root_node *node,
+		nfs_client *client)
+{
+	unsigned int h = v4root_hash(node, (const char *)&client,
+				     sizeof(client)) & t->mask;
+	struct v4root_host *host;
+
+	for (host = t->hosts[h]; host; host = host->hnext)
+		if (host->node == node && host->client == client)
+			return host;
+
+	host = calloc(1, sizeof(*host));
+	if (host == NULL)
+		return NULL;
+	host->node = node;
+	host->client = client;
+	host->hnext = t->hosts[h];
+	t->hosts[h] = host;
+	host->next = node->hosts;
+	node->hosts = host;
+	return host;
+}
+
+/*
+ * Add @exp to the trie: as the source of pseudo exports for its
+ * parents, or if it is a pseudo export itself, at its own path.
+ * Returns -ENOMEM if it could not be added.
+ */
+static int
+v4root_insert(struct v4root_trie *t, nfs_export *exp, int pseudo)
+{
+	const char *p = exp->m_export.e_path;
+	struct v4root_node *node = t->root;
+	struct v4root_host *host;
+	const char *end;
+
+	for (;;) {
+		while (*p == '/')
+			p++;
+		end = strchrnul(p, '/');
+		if (!pseudo) {
+			/* the export itself is no parent of its own */
+			if (*p == '\0')
+				break;
+			host = v4root_host_get(t, node, exp->m_client);
+			if (host == NULL)
+				return -ENOMEM;
+			if (host->source == NULL)
+				host->source = exp;
+		}
+		if (*p == '\0')
+			break;
+		node = v4root_child(t, node, p, end - p);
+		if (node == NULL)
+			return -ENOMEM;
+		p = end;
+	}
+
+	if (pseudo) {
+		host = v4root_host_get(t, node, exp->m_client);
+		if (host == NULL || host->pseudo)
+			return -ENOMEM;
+		host->pseudo = exp;
+	}
+	return 0;
+}
+
 static int
-pseudofs_update(char *hostname, char *path, nfs_export *source)
+v4root_node_cmp(const void *a, const void *b)
 {
+	const struct v4root_node *na = *(struct v4root_node * const *)a;
+	const struct v4root_node *nb = *(struct v4root_node * const *)b;
+	int ret;
+
+	ret = memcmp(na->name, nb->name, na->namelen < nb->namelen ?
+					 na->namelen : nb->namelen);
+	if (ret)
+		return ret;
+	return (na->namelen > nb->namelen) - (na->namelen < nb->namelen);
+}
+
+/* Set up the pseudo exports wanted at @path for every client of @node */
+static void
+v4root_node_update(struct v4root_trie *t, struct v4root_node *node,
+		   char *path)
+{
+	struct v4root_host *host;
 	nfs_export *exp;
 
-	exp = export_lookup(hostname, path, 0);
-	if (exp && !(exp->m_export.e_flags & NFSEXP_V4ROOT))
-		return 0;
-	if (!exp) {
-		if (v4root_create(path, source) == NULL) {
+	for (host = node->hosts; host; host = host->next) {
+		exp = host->source ?
+			export_lookup_client(host->client, path) : NULL;
+		if (host->pseudo) {
+			if (host->source == NULL || exp) {
+				/* no longer wanted, or now really exported */
+				export_release(host->pseudo);
+				t->released++;
+				continue;
+			}
+			set_pseudofs_security(&host->pseudo->m_export);
+			export_relink(host->pseudo);
+			t->kept++;
+			continue;
+		}
+		if (host->source == NULL)
+			continue;
+		if (exp) {
+			if (exp->m_export.e_flags & NFSEXP_V4ROOT)
+				set_pseudofs_security(&exp->m_export);
+			continue;
+		}
+		if (v4root_create(path, host->source) == NULL) {
 			xlog(L_WARNING, "v4root_set: Unable to create "
 					"pseudo export for '%s'", path);
-			return -ENOMEM;
+			continue;
 		}
-		return 0;
+		t->created++;
 	}
-	/* Update an existing V4ROOT export: */
-	set_pseudofs_security(&exp->m_export);
-	return 0;
 }
 
-static int v4root_add_parents(nfs_export *exp)
+/*
+ * Visit @node and everything below it, parents first and children in
+ * name order.  @path holds the path of @node, @len bytes long.
+ */
+static void
+v4root_walk(struct v4root_trie *t, struct v4root_node *node,
+	    char *path, size_t len)
 {
-	char *hostname = exp->m_export.e_hostname;
-	char *path;
-	char *ptr;
-	int ret = 0;
-
-	path = strdup(exp->m_export.e_path);
-	if (!path) {
-		xlog(L_WARNING, "v4root_add_parents: Unable to create "
-				"pseudo export for '%s'", exp->m_export.e_path);
-		return -ENOMEM;
+	struct v4root_node **children, *child;
+	unsigned int i;
+
+	v4root_node_update(t, node, len ? path : "/");
+
+	if (node->nchildren == 0)
+		return;
+	children = malloc(node->nchildren * sizeof(*children));
+	if (children == NULL)
+		return;
+	for (i = 0, child = node->children; child; child = child->sibling)
+		children[i++] = child;
+	qsort(children, node->nchildren, sizeof(*children), v4root_node_cmp);
+
+	for (i = 0; i < node->nchildren; i++) {
+		child = children[i];
+		if (len + 1 + child->namelen >= NFS_MAXPATHLEN)
+			continue;
+		path[len] = '/';
+		memcpy(path + len + 1, child->name, child->namelen);
+		path[len + 1 + child->namelen] = '\0';
+		v4root_walk(t, child, path, len + 1 + child->namelen);
 	}
-	for (ptr = path; ptr; ptr = strchr(ptr, '/')) {
-		char saved;
+	path[len] = '\0';
+	free(children);
+}
 
-		saved = *ptr;
-		*ptr = '\0';
-		ret = pseudofs_update(hostname, *path ? path : "/", exp);
-		if (ret)
-			break;
-		*ptr = saved;
-		ptr++;
+/*
+ * Release whatever in the trie was not used, and the trie itself.
+ */
+static void
+v4root_trie_free(struct v4root_trie *t)
+{
+	struct v4root_host *host;
+	struct v4root_node *node;
+	unsigned int i;
+
+	for (i = 0; i <= t->mask; i++) {
+		while ((host = t->hosts[i]) != NULL) {
+			t->hosts[i] = host->hnext;
+			free(host);
+		}
+		while ((node = t->nodes[i]) != NULL) {
+			t->nodes[i] = node->hnext;
+			free(node);
+		}
 	}
-	free(path);
-	return ret;
+	free(t->hosts);
+	free(t->nodes);
+}
+
+static void
+v4root_release_kept(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < nkept; i++)
+		export_release(kept_pseudo[i]);
+	nkept = 0;
 }
 
 /*
@@ -202,21 +456,37 @@ static int v4root_add_parents(nfs_export *exp)
 void
 v4root_set(void)
 {
+	struct v4root_trie t;
+	char path[NFS_MAXPATHLEN + 1];
 	nfs_export	*exp;
+	unsigned int	count = nkept, size;
 	int	i;
 
-	if (!v4root_needed)
+	if (!v4root_needed || !v4root_support()) {
+		v4root_release_kept();
 		return;
-	if (!v4root_support())
+	}
+
+	memset(&t, 0, sizeof(t));
+	for (i = 0; i < MCL_MAXTYPES; i++)
+		for (exp = exportlist[i].p_head; exp; exp = exp->m_next)
+			count++;
+	for (size = 64; size < count * 4; size <<= 1)
+		;
+	t.mask = size - 1;
+	t.nodes = calloc(size, sizeof(*t.nodes));
+	t.hosts = calloc(size, sizeof(*t.hosts));
+	if (t.nodes == NULL || t.hosts == NULL ||
+	    (t.root = v4root_child(&t, NULL, "", 0)) == NULL) {
+		xlog(L_WARNING, "v4root_set: Unable to create pseudo exports");
+		v4root_trie_free(&t);
+		v4root_release_kept();
 		return;
+	}
 
 	for (i = 0; i < MCL_MAXTYPES; i++) {
 		for (exp = exportlist[i].p_head; exp; exp = exp->m_next) {
 			if (exp->m_export.e_flags & NFSEXP_V4ROOT)
-				/*
-				 * We just added this one, so its
-				 * parents are already dealt with!
-				 */
 				continue;
 
 			if (strcmp(exp->m_export.e_path, "/") == 0 &&
@@ -226,8 +496,23 @@ v4root_set(void)
 				exp->m_export.e_fsid = 0;
 			}
 
-			v4root_add_parents(exp);
-			/* XXX: error handling! */
+			if (v4root_insert(&t, exp, 0) < 0)
+				xlog(L_WARNING, "v4root_set: Unable to create "
+				     "pseudo exports for '%s'",
+				     exp->m_export.e_path);
 		}
 	}
+	for (i = 0; i < (int)nkept; i++)
+		if (v4root_insert(&t, kept_pseudo[i], 1) < 0) {
+			export_release(kept_pseudo[i]);
+			t.released++;
+		}
+	nkept = 0;
+
+	path[0] = '\0';
+	v4root_walk(&t, t.root, path, 0);
+	v4root_trie_free(&t);
+
+	xlog(D_GENERAL, "v4root_set: %u pseudo exports kept, %u created, "
+	     "%u released", t.kept, t.created, t.released);
 }
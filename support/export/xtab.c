@@ -18,6 +18,9 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <libgen.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/param.h>
 
 #include "nfslib.h"
 #include "exportfs.h"
@@ -25,6 +28,10 @@
 #include "xlog.h"
 #include "v4root.h"
 #include "misc.h"
+#include "xmalloc.h"
+#include "pseudoflavors.h"
+#include "reexport.h"
+#include "nfsd_path.h"
 
 static char state_base_dirname[PATH_MAX] = NFS_STATEDIR;
 struct state_paths etab;
@@ -32,22 +39,579 @@ struct state_paths etab;
 int v4root_needed;
 static void cond_rename(char *newfile, char *oldfile);
 
+/* FNV-1a, for the etab image checksum and the reload hashes */
+#define FNV_OFFSET	0xcbf29ce484222325ULL
+#define FNV_PRIME	0x100000001b3ULL
+
+static uint64_t
+fnv_add(uint64_t h, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while (len--) {
+		h ^= *p++;
+		h *= FNV_PRIME;
+	}
+	return h;
+}
+
+static uint64_t
+fnv_add_str(uint64_t h, const char *str)
+{
+	/* tell NULL apart from "" */
+	if (str == NULL)
+		return fnv_add(h, "\1", 1);
+	return fnv_add(h, str, strlen(str) + 1);
+}
+
+/*
+ * Compiled etab image.
+ *
+ * Parsing etab option by option is most of the cost of a reload when
+ * there are many exports, and every mountd worker pays it.  So when
+ * exportfs writes etab it also writes etab.bin, holding the same
+ * entries already parsed: a header, an array of fixed-size entries,
+ * the squash id lists, and a table of the strings they refer to.
+ * Readers map it and fill in exportents straight from it.
+ *
+ * The header records which etab the image was made from.  If etab has
+ * since been written by something else, or the image is missing,
+ * truncated or fails its checksum, etab itself is parsed instead.
+ */
+#define ETAB_IMAGE_MAGIC	"NFSETAB"
+#define ETAB_IMAGE_VERSION	1
+#define ETAB_IMAGE_NOSTR	UINT32_MAX
+
+struct etab_image_hdr {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	entsize;	/* sizeof(struct etab_image_ent) */
+	uint64_t	checksum;	/* of everything after the header */
+	uint64_t	etab_dev;
+	uint64_t	etab_ino;
+	uint64_t	etab_size;
+	int64_t		etab_mtime_sec;
+	int64_t		etab_mtime_nsec;
+	uint32_t	nentries;
+	uint32_t	nids;		/* squash uids and gids */
+	uint32_t	strsize;
+	uint32_t	pad;
+};
+
+struct etab_image_sec {
+	uint32_t	name;		/* flavor or xprtsec mode */
+	int32_t		flags;
+};
+
+/* Strings are offsets into the string table, squash lists into the ids */
+struct etab_image_ent {
+	uint32_t	hostname;
+	uint32_t	path;
+	uint32_t	mountpoint;
+	uint32_t	fslocdata;
+	uint32_t	uuid;
+	int32_t		flags;
+	int32_t		anonuid;
+	int32_t		anongid;
+	uint32_t	squids;
+	uint32_t	nsquids;
+	uint32_t	sqgids;
+	uint32_t	nsqgids;
+	uint32_t	fsid;
+	int32_t		fslocmethod;
+	int32_t		reexport;
+	uint32_t	nsec;
+	uint32_t	nxprtsec;
+	struct etab_image_sec sec[SECFLAVOR_COUNT];
+	struct etab_image_sec xprtsec[XPRTSECMODE_COUNT];
+};
+
+/* An image being read */
+struct etab_image {
+	char		*xtab;
+	void		*map;
+	size_t		len;
+	const struct etab_image_hdr *hdr;
+	const struct etab_image_ent *ents;
+	const int32_t	*ids;
+	const char	*strs;
+	uint32_t	next;
+};
+
+/* An image being built */
+struct etab_image_buf {
+	struct etab_image_ent *ents;
+	int32_t		*ids;
+	char		*strs;
+	uint32_t	nents, maxents;
+	uint32_t	nids, maxids;
+	uint32_t	strsize, maxstrs;
+	int		failed;
+};
+
+static char *
+etab_image_path(const char *xtab)
+{
+	static char path[PATH_MAX];
+
+	if (snprintf(path, sizeof(path), "%s.bin", xtab) >= (int)sizeof(path))
+		return NULL;
+	return path;
+}
+
+static struct flav_info *
+etab_image_flavor(const char *name)
+{
+	int i;
+
+	for (i = 0; i < flav_map_size; i++)
+		if (strcmp(flav_map[i].flavour, name) == 0)
+			return &flav_map[i];
+	return NULL;
+}
+
+static int
+etab_image_str_ok(const struct etab_image *img, uint32_t off, int null_ok)
+{
+	if (off == ETAB_IMAGE_NOSTR)
+		return null_ok;
+	return off < img->hdr->strsize;
+}
+
+static char *
+etab_image_str(const struct etab_image *img, uint32_t off)
+{
+	if (off == ETAB_IMAGE_NOSTR)
+		return NULL;
+	return (char *)img->strs + off;
+}
+
+static int
+etab_image_ids_ok(const struct etab_image *img, uint32_t off, uint32_t n)
+{
+	return (uint64_t)off + n <= img->hdr->nids;
+}
+
+static const char *
+etab_image_check_ent(const struct etab_image *img,
+		     const struct etab_image_ent *ent)
+{
+	uint32_t i;
+
+	if (!etab_image_str_ok(img, ent->hostname, 1) ||
+	    !etab_image_str_ok(img, ent->path, 0) ||
+	    !etab_image_str_ok(img, ent->mountpoint, 1) ||
+	    !etab_image_str_ok(img, ent->fslocdata, 1) ||
+	    !etab_image_str_ok(img, ent->uuid, 1))
+		return "bad string offset";
+	if (strlen(img->strs + ent->path) > NFS_MAXPATHLEN)
+		return "path too long";
+	if (!etab_image_ids_ok(img, ent->squids, ent->nsquids) ||
+	    !etab_image_ids_ok(img, ent->sqgids, ent->nsqgids))
+		return "bad squash list";
+	if (ent->nsec > SECFLAVOR_COUNT || ent->nxprtsec > XPRTSECMODE_COUNT)
+		return "bad security info";
+	for (i = 0; i < ent->nsec; i++)
+		if (!etab_image_str_ok(img, ent->sec[i].name, 0) ||
+		    !etab_image_flavor(img->strs + ent->sec[i].name))
+			return "unknown security flavor";
+	for (i = 0; i < ent->nxprtsec; i++)
+		if (!etab_image_str_ok(img, ent->xprtsec[i].name, 0) ||
+		    !find_xprtsec_info(img->strs + ent->xprtsec[i].name))
+			return "unknown xprtsec mode";
+	return NULL;
+}
+
+/* Returns why the mapped image can't be used, or NULL if it can */
+static const char *
+etab_image_check(struct etab_image *img, const struct stat *etab_st)
+{
+	const struct etab_image_hdr *hdr = img->map;
+	const char *body = (const char *)img->map + sizeof(*hdr);
+	const char *why;
+	uint64_t len;
+	uint32_t i;
+
+	if (img->len < sizeof(*hdr) ||
+	    memcmp(hdr->magic, ETAB_IMAGE_MAGIC, sizeof(hdr->magic)) != 0)
+		return "not an etab image";
+	if (hdr->version != ETAB_IMAGE_VERSION ||
+	    hdr->entsize != sizeof(struct etab_image_ent))
+		return "unsupported version";
+	if (hdr->etab_dev != (uint64_t)etab_st->st_dev ||
+	    hdr->etab_ino != (uint64_t)etab_st->st_ino ||
+	    hdr->etab_size != (uint64_t)etab_st->st_size ||
+	    hdr->etab_mtime_sec != (int64_t)etab_st->st_mtim.tv_sec ||
+	    hdr->etab_mtime_nsec != (int64_t)etab_st->st_mtim.tv_nsec)
+		return "etab has changed since";
+
+	len = sizeof(*hdr) + (uint64_t)hdr->nentries * hdr->entsize +
+		(uint64_t)hdr->nids * sizeof(int32_t) + hdr->strsize;
+	if (len != img->len)
+		return "wrong size";
+	if (fnv_add(FNV_OFFSET, body, img->len - sizeof(*hdr)) != hdr->checksum)
+		return "bad checksum";
+
+	img->hdr = hdr;
+	img->ents = (const struct etab_image_ent *)body;
+	img->ids = (const int32_t *)(img->ents + hdr->nentries);
+	img->strs = (const char *)(img->ids + hdr->nids);
+	if (hdr->strsize && img->strs[hdr->strsize - 1] != '\0')
+		return "bad string table";
+	for (i = 0; i < hdr->nentries; i++)
+		if ((why = etab_image_check_ent(img, &img->ents[i])) != NULL)
+			return why;
+	return NULL;
+}
+
+static void
+etab_image_close(struct etab_image *img)
+{
+	if (img->map)
+		munmap(img->map, img->len);
+	img->map = NULL;
+}
+
+/* Map the image of @xtab, if there is a good one */
+static int
+etab_image_open(struct etab_image *img, char *xtab)
+{
+	struct stat st, etab_st;
+	const char *why;
+	char *path;
+	int fd;
+
+	memset(img, 0, sizeof(*img));
+	img->xtab = xtab;
+	path = etab_image_path(xtab);
+	if (path == NULL || (fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return 0;
+	if (fstat(fd, &st) < 0 || st.st_size == 0 || stat(xtab, &etab_st) < 0) {
+		close(fd);
+		return 0;
+	}
+	img->len = st.st_size;
+	img->map = mmap(NULL, img->len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (img->map == MAP_FAILED) {
+		img->map = NULL;
+		return 0;
+	}
+	if ((why = etab_image_check(img, &etab_st)) != NULL) {
+		xlog(D_GENERAL, "ignoring %s: %s", path, why);
+		etab_image_close(img);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Like getexportent(), but from the image.  The entry was checked by
+ * etab_image_check(); the squash lists, mountpoint and fsloc data point
+ * into the mapping and are only good until etab_image_close().
+ */
+static struct exportent *
+etab_image_next(struct etab_image *img)
+{
+	static struct exportent ee;
+	const struct etab_image_ent *ent;
+	char rpath[MAXPATHLEN+1];
+	uint32_t i;
+
+	if (img->next >= img->hdr->nentries)
+		return NULL;
+	ent = &img->ents[img->next++];
+
+	memset(&ee, 0, sizeof(ee));
+	if (ent->hostname != ETAB_IMAGE_NOSTR)
+		ee.e_hostname = xstrdup(etab_image_str(img, ent->hostname));
+	strcpy(ee.e_path, etab_image_str(img, ent->path));
+	ee.e_flags = ent->flags;
+	ee.e_anonuid = ent->anonuid;
+	ee.e_anongid = ent->anongid;
+	if ((ee.e_nsquids = ent->nsquids) != 0)
+		ee.e_squids = (int *)(img->ids + ent->squids);
+	if ((ee.e_nsqgids = ent->nsqgids) != 0)
+		ee.e_sqgids = (int *)(img->ids + ent->sqgids);
+	ee.e_fsid = ent->fsid;
+	ee.e_mountpoint = etab_image_str(img, ent->mountpoint);
+	ee.e_fslocmethod = ent->fslocmethod;
+	ee.e_fslocdata = etab_image_str(img, ent->fslocdata);
+	if (ent->uuid != ETAB_IMAGE_NOSTR)
+		ee.e_uuid = xstrdup(etab_image_str(img, ent->uuid));
+	for (i = 0; i < ent->nsec; i++) {
+		ee.e_secinfo[i].flav =
+			etab_image_flavor(etab_image_str(img, ent->sec[i].name));
+		ee.e_secinfo[i].flags = ent->sec[i].flags;
+	}
+	ee.e_secinfo[i].flav = NULL;
+	for (i = 0; i < ent->nxprtsec; i++) {
+		ee.e_xprtsec[i].info =
+			find_xprtsec_info(etab_image_str(img, ent->xprtsec[i].name));
+		ee.e_xprtsec[i].flags = ent->xprtsec[i].flags;
+	}
+	ee.e_xprtsec[i].info = NULL;
+	ee.e_ttl = default_ttl;
+	ee.e_reexport = ent->reexport;
+
+	/* the same checks getexportent() makes on etab */
+	if (ee.e_reexport != REEXP_NONE &&
+	    reexpdb_apply_reexport_settings(&ee, img->xtab, 0) != 0) {
+		xfree(ee.e_hostname);
+		xfree(ee.e_uuid);
+		return NULL;
+	}
+	if (nfsd_realpath(ee.e_path, rpath) != NULL) {
+		rpath[sizeof(rpath) - 1] = '\0';
+		strncpy(ee.e_path, rpath, sizeof(ee.e_path) - 1);
+		ee.e_path[sizeof(ee.e_path) - 1] = '\0';
+	}
+	return &ee;
+}
+
+static int
+etab_image_grow(void **bufp, uint32_t *maxp, uint64_t need, size_t size)
+{
+	uint64_t max = *maxp ? *maxp : 64;
+	void *buf;
+
+	if (need <= *maxp)
+		return 1;
+	while (max < need)
+		max <<= 1;
+	if (max >= ETAB_IMAGE_NOSTR)
+		return 0;
+	buf = realloc(*bufp, max * size);
+	if (buf == NULL)
+		return 0;
+	*bufp = buf;
+	*maxp = max;
+	return 1;
+}
+
+static uint32_t
+etab_image_add_str(struct etab_image_buf *b, const char *str)
+{
+	size_t len;
+	uint32_t off;
+
+	if (str == NULL)
+		return ETAB_IMAGE_NOSTR;
+	len = strlen(str) + 1;
+	if (!etab_image_grow((void **)&b->strs, &b->maxstrs,
+			     (uint64_t)b->strsize + len, 1)) {
+		b->failed = 1;
+		return ETAB_IMAGE_NOSTR;
+	}
+	off = b->strsize;
+	memcpy(b->strs + off, str, len);
+	b->strsize += len;
+	return off;
+}
+
+static uint32_t
+etab_image_add_ids(struct etab_image_buf *b, const int *ids, int n)
+{
+	uint32_t off = b->nids;
+	int i;
+
+	if (n <= 0)
+		return off;
+	if (!etab_image_grow((void **)&b->ids, &b->maxids,
+			     (uint64_t)b->nids + n, sizeof(*b->ids))) {
+		b->failed = 1;
+		return off;
+	}
+	for (i = 0; i < n; i++)
+		b->ids[b->nids++] = ids[i];
+	return off;
+}
+
+static void
+etab_image_add(struct etab_image_buf *b, const struct exportent *eep)
+{
+	const struct sec_entry *p;
+	const struct xprtsec_entry *xp;
+	struct etab_image_ent *ent;
+
+	if (!etab_image_grow((void **)&b->ents, &b->maxents,
+			     (uint64_t)b->nents + 1, sizeof(*b->ents))) {
+		b->failed = 1;
+		return;
+	}
+	ent = &b->ents[b->nents++];
+	memset(ent, 0, sizeof(*ent));
+	ent->hostname = etab_image_add_str(b, eep->e_hostname);
+	ent->path = etab_image_add_str(b, eep->e_path);
+	ent->mountpoint = etab_image_add_str(b, eep->e_mountpoint);
+	ent->fslocdata = etab_image_add_str(b, eep->e_fslocdata);
+	ent->uuid = etab_image_add_str(b, eep->e_uuid);
+	ent->flags = eep->e_flags;
+	ent->anonuid = eep->e_anonuid;
+	ent->anongid = eep->e_anongid;
+	ent->nsquids = eep->e_nsquids;
+	ent->squids = etab_image_add_ids(b, eep->e_squids, eep->e_nsquids);
+	ent->nsqgids = eep->e_nsqgids;
+	ent->sqgids = etab_image_add_ids(b, eep->e_sqgids, eep->e_nsqgids);
+	ent->fsid = eep->e_fsid;
+	ent->fslocmethod = eep->e_fslocmethod;
+	ent->reexport = eep->e_reexport;
+	for (p = eep->e_secinfo; p->flav; p++) {
+		ent->sec[ent->nsec].name = etab_image_add_str(b, p->flav->flavour);
+		ent->sec[ent->nsec++].flags = p->flags;
+	}
+	for (xp = eep->e_xprtsec; xp->info; xp++) {
+		ent->xprtsec[ent->nxprtsec].name =
+			etab_image_add_str(b, xp->info->name);
+		ent->xprtsec[ent->nxprtsec++].flags = xp->flags;
+	}
+}
+
+static int
+etab_image_put(int fd, const void *data, size_t len)
+{
+	const char *p = data;
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return 0;
+		p += n;
+		len -= n;
+	}
+	return 1;
+}
+
+/*
+ * Write the image of @xtab, which must be locked.  etab is parsed back
+ * rather than the exportlist being copied, so that the image holds
+ * exactly what a reader parsing etab would get.
+ */
+static void
+etab_image_write(char *xtab)
+{
+	struct etab_image_buf b;
+	struct etab_image_hdr hdr;
+	struct etab_image img;
+	struct exportent *xp;
+	struct stat st;
+	char *path, *tmp = NULL;
+	uint64_t h;
+	int fd, ok;
+
+	/* etab didn't change, and neither need the image */
+	if (etab_image_open(&img, xtab)) {
+		etab_image_close(&img);
+		return;
+	}
+	if ((path = etab_image_path(xtab)) == NULL)
+		return;
+
+	memset(&b, 0, sizeof(b));
+	setexportent(xtab, "r");
+	while ((xp = getexportent(0)) != NULL) {
+		etab_image_add(&b, xp);
+		xfree(xp->e_hostname);
+		xp->e_hostname = NULL;
+		xfree(xp->e_uuid);
+		xp->e_uuid = NULL;
+	}
+	endexportent();
+	if (b.failed || stat(xtab, &st) < 0)
+		goto out_unlink;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, ETAB_IMAGE_MAGIC, sizeof(hdr.magic));
+	hdr.version = ETAB_IMAGE_VERSION;
+	hdr.entsize = sizeof(struct etab_image_ent);
+	hdr.etab_dev = st.st_dev;
+	hdr.etab_ino = st.st_ino;
+	hdr.etab_size = st.st_size;
+	hdr.etab_mtime_sec = st.st_mtim.tv_sec;
+	hdr.etab_mtime_nsec = st.st_mtim.tv_nsec;
+	hdr.nentries = b.nents;
+	hdr.nids = b.nids;
+	hdr.strsize = b.strsize;
+	h = fnv_add(FNV_OFFSET, b.ents, b.nents * sizeof(*b.ents));
+	h = fnv_add(h, b.ids, b.nids * sizeof(*b.ids));
+	hdr.checksum = fnv_add(h, b.strs, b.strsize);
+
+	if (asprintf(&tmp, "%s.tmp", path) < 0) {
+		tmp = NULL;
+		goto out_unlink;
+	}
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		xlog(L_WARNING, "can't create %s: %m", tmp);
+		goto out_unlink;
+	}
+	ok = etab_image_put(fd, &hdr, sizeof(hdr)) &&
+		etab_image_put(fd, b.ents, b.nents * sizeof(*b.ents)) &&
+		etab_image_put(fd, b.ids, b.nids * sizeof(*b.ids)) &&
+		etab_image_put(fd, b.strs, b.strsize);
+	if (close(fd) < 0)
+		ok = 0;
+	if (ok && rename(tmp, path) == 0)
+		goto out;
+	xlog(L_WARNING, "can't write %s: %m", path);
+	unlink(tmp);
+out_unlink:
+	/* a stale image would be ignored anyway; don't leave it about */
+	unlink(path);
+out:
+	free(tmp);
+	free(b.ents);
+	free(b.ids);
+	free(b.strs);
+}
+
+/* Read etab from its image when there is a good one, else parse it */
+static void
+xtab_open(struct etab_image *img, char *xtab, int use_image)
+{
+	if (!use_image || !etab_image_open(img, xtab)) {
+		memset(img, 0, sizeof(*img));
+		setexportent(xtab, "r");
+	}
+}
+
+static struct exportent *
+xtab_getent(struct etab_image *img, int fromkernel)
+{
+	if (img->map)
+		return etab_image_next(img);
+	return getexportent(fromkernel);
+}
+
+static void
+xtab_close(struct etab_image *img)
+{
+	if (img->map)
+		etab_image_close(img);
+	else
+		endexportent();
+}
+
 static int
 xtab_read(char *xtab, char *lockfn, int is_export)
 {
     /* is_export == 0  => reading /proc/fs/nfs/exports - we know these things are exported to kernel
      * is_export == 1  => reading /var/lib/nfs/etab - these things are allowed to be exported
      */
+	struct etab_image	img;
 	struct exportent	*xp;
 	nfs_export		*exp;
 	int			lockid;
 
 	if ((lockid = xflock(lockfn, "r")) < 0)
 		return 0;
-	setexportent(xtab, "r");
+	xtab_open(&img, xtab, is_export == 1);
 	if (is_export == 1)
 		v4root_needed = 1;
-	while ((xp = getexportent(is_export==0)) != NULL) {
+	while ((xp = xtab_getent(&img, is_export==0)) != NULL) {
 		if (!(exp = export_lookup(xp->e_hostname, xp->e_path, is_export != 1)) &&
 		    !(exp = export_create(xp, is_export!=1))) {
                         if(xp->e_hostname) {
@@ -81,7 +645,7 @@ xtab_read(char *xtab, char *lockfn, int is_export)
                 }
 
 	}
-	endexportent();
+	xtab_close(&img);
 	xfunlock(lockid);
 
 	return 0;
@@ -93,6 +657,259 @@ xtab_export_read(void)
 	return xtab_read(etab.statefn, etab.lockfn, 1);
 }
 
+/*
+ * Incremental reload of etab.
+ *
+ * Each line of etab is hashed over everything that export_create()
+ * would copy into the nfs_export, and compared against the export
+ * already in core for the same hostname and path, field by field when
+ * the hashes agree.  Exports whose line did not change are kept as they
+ * are, along with their client; a client named by hostname has its
+ * addresses looked up again though, once however many exports name it,
+ * as a full reload would.  Only added and changed lines go through
+ * export_create().  The resulting exportlist is in etab order, just as
+ * after export_freeall() + xtab_export_read().
+ */
+static uint64_t
+xtab_key_hash(const char *hostname, const char *path)
+{
+	return fnv_add_str(fnv_add_str(FNV_OFFSET, hostname), path);
+}
+
+static uint64_t
+exportent_hash(const struct exportent *eep)
+{
+	const struct sec_entry *p;
+	const struct xprtsec_entry *xp;
+	uint64_t h;
+
+	h = xtab_key_hash(eep->e_hostname, eep->e_path);
+	h = fnv_add(h, &eep->e_flags, sizeof(eep->e_flags));
+	h = fnv_add(h, &eep->e_anonuid, sizeof(eep->e_anonuid));
+	h = fnv_add(h, &eep->e_anongid, sizeof(eep->e_anongid));
+	h = fnv_add(h, &eep->e_nsquids, sizeof(eep->e_nsquids));
+	if (eep->e_nsquids)
+		h = fnv_add(h, eep->e_squids,
+			    eep->e_nsquids * sizeof(*eep->e_squids));
+	h = fnv_add(h, &eep->e_nsqgids, sizeof(eep->e_nsqgids));
+	if (eep->e_nsqgids)
+		h = fnv_add(h, eep->e_sqgids,
+			    eep->e_nsqgids * sizeof(*eep->e_sqgids));
+	h = fnv_add(h, &eep->e_fsid, sizeof(eep->e_fsid));
+	h = fnv_add_str(h, eep->e_mountpoint);
+	h = fnv_add(h, &eep->e_fslocmethod, sizeof(eep->e_fslocmethod));
+	h = fnv_add_str(h, eep->e_fslocdata);
+	h = fnv_add_str(h, eep->e_uuid);
+	for (p = eep->e_secinfo; p->flav; p++) {
+		h = fnv_add(h, &p->flav, sizeof(p->flav));
+		h = fnv_add(h, &p->flags, sizeof(p->flags));
+	}
+	for (xp = eep->e_xprtsec; xp->info; xp++) {
+		h = fnv_add(h, &xp->info, sizeof(xp->info));
+		h = fnv_add(h, &xp->flags, sizeof(xp->flags));
+	}
+	h = fnv_add(h, &eep->e_ttl, sizeof(eep->e_ttl));
+	h = fnv_add(h, &eep->e_reexport, sizeof(eep->e_reexport));
+	return h;
+}
+
+static int
+xtab_same_str(const char *a, const char *b)
+{
+	if (a == NULL || b == NULL)
+		return a == b;
+	return strcmp(a, b) == 0;
+}
+
+/* Compare everything exportent_hash() covers */
+static int
+exportent_same(const struct exportent *a, const struct exportent *b)
+{
+	int i;
+
+	if (!xtab_same_str(a->e_hostname, b->e_hostname) ||
+	    strcmp(a->e_path, b->e_path) != 0 ||
+	    a->e_flags != b->e_flags ||
+	    a->e_anonuid != b->e_anonuid ||
+	    a->e_anongid != b->e_anongid ||
+	    a->e_nsquids != b->e_nsquids ||
+	    a->e_nsqgids != b->e_nsqgids ||
+	    a->e_fsid != b->e_fsid ||
+	    a->e_fslocmethod != b->e_fslocmethod ||
+	    a->e_ttl != b->e_ttl ||
+	    a->e_reexport != b->e_reexport)
+		return 0;
+	if (a->e_nsquids && memcmp(a->e_squids, b->e_squids,
+				   a->e_nsquids * sizeof(*a->e_squids)) != 0)
+		return 0;
+	if (a->e_nsqgids && memcmp(a->e_sqgids, b->e_sqgids,
+				   a->e_nsqgids * sizeof(*a->e_sqgids)) != 0)
+		return 0;
+	if (!xtab_same_str(a->e_mountpoint, b->e_mountpoint) ||
+	    !xtab_same_str(a->e_fslocdata, b->e_fslocdata) ||
+	    !xtab_same_str(a->e_uuid, b->e_uuid))
+		return 0;
+	for (i = 0; a->e_secinfo[i].flav || b->e_secinfo[i].flav; i++)
+		if (a->e_secinfo[i].flav != b->e_secinfo[i].flav ||
+		    a->e_secinfo[i].flags != b->e_secinfo[i].flags)
+			return 0;
+	for (i = 0; a->e_xprtsec[i].info || b->e_xprtsec[i].info; i++)
+		if (a->e_xprtsec[i].info != b->e_xprtsec[i].info ||
+		    a->e_xprtsec[i].flags != b->e_xprtsec[i].flags)
+			return 0;
+	return 1;
+}
+
+/* An export that was in core before the reload */
+struct xtab_slot {
+	nfs_export		*exp;
+	uint64_t		hash;
+	enum {
+		XTAB_UNSEEN,
+		XTAB_REUSED,
+		XTAB_REPLACED,
+	}			state;
+};
+
+static struct xtab_slot *
+xtab_slot_find(struct xtab_slot *slots, unsigned int mask,
+	       const char *hostname, const char *path, int insert)
+{
+	struct xtab_slot *slot;
+	unsigned int i;
+
+	i = xtab_key_hash(hostname, path) & mask;
+	for (;; i = (i + 1) & mask) {
+		slot = &slots[i];
+		if (slot->exp == NULL)
+			return insert ? slot : NULL;
+		if (strcmp(slot->exp->m_export.e_path, path) == 0 &&
+		    strcmp(slot->exp->m_export.e_hostname, hostname) == 0)
+			return slot;
+	}
+}
+
+/**
+ * xtab_export_update - bring exportlist in line with etab
+ * @stats: OUT: what was done
+ * @keep_pseudo: given the pseudo exports taken out of the table, or NULL
+ *
+ * Must be called on an exportlist that was built from etab only, i.e.
+ * with the pseudo exports of v4root_set() still in it at most; those
+ * are handed to @keep_pseudo, or released if it is NULL.
+ */
+int
+xtab_export_update(struct xtab_reload_stats *stats,
+		   void (*keep_pseudo)(nfs_export *))
+{
+	struct etab_image	img;
+	struct exportent	*xp;
+	struct xtab_slot	*slots, *slot;
+	nfs_export		*exp, **old;
+	unsigned int		nold, size, i;
+	int			lockid;
+
+	memset(stats, 0, sizeof(*stats));
+
+	if ((lockid = xflock(etab.lockfn, "r")) < 0)
+		return 0;
+	client_refresh_begin();
+	old = export_unlink_all(&nold);
+	if (old == NULL) {
+		xfunlock(lockid);
+		return 0;
+	}
+	for (size = 16; size < 2 * nold; size <<= 1)
+		;
+	slots = calloc(size, sizeof(*slots));
+	if (slots == NULL) {
+		for (i = 0; i < nold; i++)
+			export_relink(old[i]);
+		free(old);
+		xfunlock(lockid);
+		return 0;
+	}
+	for (i = 0; i < nold; i++) {
+		exp = old[i];
+		if (keep_pseudo && !exp->m_xtabent &&
+		    (exp->m_export.e_flags & NFSEXP_V4ROOT)) {
+			keep_pseudo(exp);
+			continue;
+		}
+		if (!exp->m_xtabent || !exp->m_export.e_hostname) {
+			export_release(exp);
+			continue;
+		}
+		slot = xtab_slot_find(slots, size - 1, exp->m_export.e_hostname,
+				      exp->m_export.e_path, 1);
+		if (slot->exp) {
+			/* can't happen: export_lookup() would have merged it */
+			export_release(exp);
+			continue;
+		}
+		slot->exp = exp;
+		slot->hash = exportent_hash(&exp->m_export);
+	}
+	free(old);
+
+	xtab_open(&img, etab.statefn, 1);
+	stats->image = img.map != NULL;
+	v4root_needed = 1;
+	while ((xp = xtab_getent(&img, 0)) != NULL) {
+		stats->entries++;
+		exp = NULL;
+		slot = NULL;
+		if (xp->e_hostname)
+			slot = xtab_slot_find(slots, size - 1, xp->e_hostname,
+					      xp->e_path, 0);
+		if (slot && slot->state == XTAB_REUSED)
+			exp = slot->exp;
+		else if (slot && slot->state == XTAB_UNSEEN &&
+			 slot->hash == exportent_hash(xp) &&
+			 exportent_same(&slot->exp->m_export, xp) &&
+			 client_refresh(slot->exp->m_client, xp->e_hostname)) {
+			exp = slot->exp;
+			slot->state = XTAB_REUSED;
+			/* the path may resolve differently by now */
+			free(exp->m_export.e_realpath);
+			exp->m_export.e_realpath = NULL;
+			export_relink(exp);
+		} else if ((exp = export_lookup(xp->e_hostname, xp->e_path, 0)) == NULL &&
+			   (exp = export_create(xp, 0)) != NULL) {
+			if (slot && slot->state == XTAB_UNSEEN) {
+				slot->state = XTAB_REPLACED;
+				stats->changed++;
+			} else
+				stats->added++;
+		}
+		if (exp) {
+			exp->m_xtabent = 1;
+			exp->m_mayexport = 1;
+			if ((xp->e_flags & NFSEXP_FSID) && xp->e_fsid == 0)
+				v4root_needed = 0;
+		}
+		free(xp->e_hostname);
+		xp->e_hostname = NULL;
+		free(xp->e_uuid);
+		xp->e_uuid = NULL;
+	}
+	xtab_close(&img);
+	xfunlock(lockid);
+
+	for (i = 0; i < size; i++) {
+		slot = &slots[i];
+		if (slot->exp == NULL || slot->state == XTAB_REUSED)
+			continue;
+		if (slot->state == XTAB_UNSEEN)
+			stats->removed++;
+		export_release(slot->exp);
+	}
+	free(slots);
+	client_prune();
+
+	return 0;
+}
+
 /*
  * mountd now keeps an open fd for the etab at all times to make sure that the
  * inode number changes when the xtab_export_write is done. If you change the
@@ -128,6 +945,8 @@ xtab_write(char *xtab, char *xtabtmp, char *lockfn, int is_export)
 	endexportent();
 
 	cond_rename(xtabtmp, xtab);
+	if (is_export)
+		etab_image_write(xtab);
 
 	xfunlock(lockid);
 
@@ -45,6 +45,8 @@ typedef struct mclient {
 	union nfs_sockaddr	m_addrlist[NFSCLNT_ADDRMAX];
 	int			m_exported;	/* exported to nfsd */
 	int			m_count;
+	unsigned int		m_refresh_gen;	/* see client_refresh() */
+	int			m_refresh_ok;
 } nfs_client;
 
 static inline const struct sockaddr *
@@ -128,28 +130,62 @@ nfs_client *			client_dup(const nfs_client *clp,
 int				client_gettype(char *hname);
 int				client_check(const nfs_client *clp,
 						const struct addrinfo *ai);
+void				client_refresh_begin(void);
+int				client_refresh(nfs_client *clp, const char *hname);
 void				client_release(nfs_client *);
 void				client_freeall(void);
+void				client_prune(void);
 char *				client_compose(const struct addrinfo *ai);
+
+/* The nfs_clients that match one address, see client_match() */
+struct client_set {
+	unsigned int		count;
+	unsigned int		size;
+	nfs_client **		clients;	/* sorted */
+};
+struct client_set *		client_match(const struct addrinfo *ai);
+int				client_set_member(const struct client_set *set,
+						const nfs_client *clp);
+void				client_set_free(struct client_set *set);
 struct addrinfo *		client_resolve(const struct sockaddr *sap);
 int 				client_member(const char *client,
 						const char *name);
 
 int				export_read(char *fname, int ignore_hosts);
 int				export_d_read(const char *dname, int ignore_hosts);
+int				export_prefetch_hosts(char *fname,
+						const char *dname, int nthreads);
 void				export_reset(nfs_export *);
 nfs_export *			export_lookup(char *hname, char *path, int caconical);
+nfs_export *			export_lookup_client(nfs_client *clp, char *path);
 nfs_export *			export_find(const struct addrinfo *ai,
 						const char *path);
 nfs_export *			export_create(struct exportent *, int canonical);
 void				exportent_release(struct exportent *);
 void				export_freeall(void);
+nfs_export **			export_unlink_all(unsigned int *count);
+void				export_relink(nfs_export *);
+void				export_release(nfs_export *);
+
+/* What an incremental reload of etab did */
+struct xtab_reload_stats {
+	unsigned int		generation;
+	unsigned int		entries;	/* read from etab */
+	unsigned int		added;
+	unsigned int		changed;
+	unsigned int		removed;
+	unsigned int		image;		/* read from etab.bin */
+	unsigned long		usecs;		/* time taken */
+};
 
 extern struct state_paths etab;
 int				xtab_export_read(void);
+int				xtab_export_update(struct xtab_reload_stats *,
+						void (*keep_pseudo)(nfs_export *));
 int				xtab_export_write(void);
 
 int				secinfo_addflavor(struct flav_info *, struct exportent *);
+const struct xprtsec_info *	find_xprtsec_info(const char *name);
 
 char *				host_ntop(const struct sockaddr *sap,
 						char *buf, const size_t buflen);
@@ -163,6 +199,19 @@ __attribute__((__malloc__))
 struct addrinfo *		host_reliable_addrinfo(const struct sockaddr *sap);
 __attribute__((__malloc__))
 struct addrinfo *		host_numeric_addrinfo(const struct sockaddr *sap);
+int				host_prefetch(char **names, int count,
+						int nthreads);
+int				host_prefetched(const char *hostname,
+						const struct addrinfo **ai);
+void				host_prefetch_release(void);
+
+extern int hostcache_ttl;
+extern int hostcache_negative_ttl;
+char *				hostcache_canonname(const struct sockaddr *sap);
+char **				hostcache_aliases(const char *hname);
+void				hostcache_free_aliases(char **aliases);
+int				hostcache_innetgr(const char *netgroup,
+						const char *host);
 
 struct nfskey *			key_lookup(char *hname);
 
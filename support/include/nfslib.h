@@ -112,6 +112,7 @@ struct rmtabent {
  */
 void			setexportent(char *fname, char *type);
 struct exportent *	getexportent(int);
+char *			getexporthost(void);
 void 			secinfo_show(FILE *fp, struct exportent *ep);
 void			xprtsecinfo_show(FILE *fp, struct exportent *ep);
 void			putexportent(struct exportent *xep);
@@ -147,6 +148,7 @@ void daemon_ready(void);
 int			wildmat(char *text, char *pattern);
 
 int qword_get(char **bpp, char *dest, int bufsize);
+int qword_get_inplace(char **bpp, char **word);
 int qword_get_int(char **bpp, int *anint);
 void cache_flush(void);
 void qword_add(char **bpp, int *lp, char *str);
@@ -11,5 +11,6 @@
 
 extern int v4root_needed;
 extern void v4root_set(void);
+extern void v4root_keep(nfs_export *exp);
 
 #endif /* V4ROOT_H */
@@ -53,6 +53,8 @@ struct xthread_work {
 	struct xwork_struct work;
 
 	pthread_cond_t cond;
+	unsigned char async : 1;
+	unsigned char done : 1;
 };
 
 struct xthread_workqueue {
@@ -60,6 +62,7 @@ struct xthread_workqueue {
 
 	pthread_mutex_t mutex;
 	pthread_cond_t cond;
+	int running;
 };
 
 static void xthread_workqueue_init(struct xthread_workqueue *wq)
@@ -67,6 +70,7 @@ static void xthread_workqueue_init(struct xthread_workqueue *wq)
 	xwork_queue_init(&wq->queue);
 	pthread_mutex_init(&wq->mutex, NULL);
 	pthread_cond_init(&wq->cond, NULL);
+	wq->running = 0;
 }
 
 static void xthread_workqueue_fini(struct xthread_workqueue *wq)
@@ -94,12 +98,23 @@ static void xthread_workqueue_do_work(struct xthread_workqueue *wq)
 
 	pthread_mutex_lock(&wq->mutex);
 	/* Signal the caller that we're up and running */
-	pthread_cond_signal(&wq->cond);
+	wq->running++;
+	pthread_cond_broadcast(&wq->cond);
 	for (;;) {
 		work = xthread_work_dequeue(wq);
 		if (work) {
+			/* Let other threads in the pool pick up work
+			 * while this item runs.
+			 */
+			pthread_mutex_unlock(&wq->mutex);
 			work->work.fn(work->work.data);
-			pthread_cond_signal(&work->cond);
+			pthread_mutex_lock(&wq->mutex);
+			if (work->async)
+				free(work);
+			else {
+				work->done = 1;
+				pthread_cond_signal(&work->cond);
+			}
 			continue;
 		}
 		if (wq->queue.shutdown)
@@ -113,7 +128,7 @@ void xthread_workqueue_shutdown(struct xthread_workqueue *wq)
 {
 	pthread_mutex_lock(&wq->mutex);
 	wq->queue.shutdown = 1;
-	pthread_cond_signal(&wq->cond);
+	pthread_cond_broadcast(&wq->cond);
 	pthread_mutex_unlock(&wq->mutex);
 }
 
@@ -125,7 +140,15 @@ static void xthread_workqueue_free(struct xthread_workqueue *wq)
 
 static void xthread_workqueue_cleanup(void *data)
 {
-	xthread_workqueue_free(data);
+	struct xthread_workqueue *wq = data;
+	int last;
+
+	/* The last thread of a pool to exit frees it */
+	pthread_mutex_lock(&wq->mutex);
+	last = --wq->running == 0;
+	pthread_mutex_unlock(&wq->mutex);
+	if (last)
+		xthread_workqueue_free(wq);
 }
 
 static void *xthread_workqueue_worker(void *data)
@@ -136,31 +159,48 @@ static void *xthread_workqueue_worker(void *data)
 	return NULL;
 }
 
-struct xthread_workqueue *xthread_workqueue_alloc(void)
+/**
+ * xthread_workqueue_alloc_pool - start a workqueue served by several threads
+ * @nthreads: number of threads to start
+ *
+ * Work items may then run concurrently, in any order.  Returns NULL
+ * if not even one thread could be started.
+ */
+struct xthread_workqueue *xthread_workqueue_alloc_pool(int nthreads)
 {
 	struct xthread_workqueue *ret;
 	pthread_t thread;
+	int i;
 
 	ret = malloc(sizeof(*ret));
 	if (ret) {
 		xthread_workqueue_init(ret);
 
 		pthread_mutex_lock(&ret->mutex);
-		if (pthread_create(&thread, NULL,
-					xthread_workqueue_worker,
-					ret) == 0) {
+		for (i = 0; i < nthreads; i++) {
+			if (pthread_create(&thread, NULL,
+						xthread_workqueue_worker,
+						ret) != 0)
+				break;
+			pthread_detach(thread);
 			/* Wait for thread to start */
-			pthread_cond_wait(&ret->cond, &ret->mutex);
-			pthread_mutex_unlock(&ret->mutex);
-			return ret;
+			while (ret->running <= i)
+				pthread_cond_wait(&ret->cond, &ret->mutex);
 		}
 		pthread_mutex_unlock(&ret->mutex);
+		if (i > 0)
+			return ret;
 		xthread_workqueue_free(ret);
 		ret = NULL;
 	}
 	return NULL;
 }
 
+struct xthread_workqueue *xthread_workqueue_alloc(void)
+{
+	return xthread_workqueue_alloc_pool(1);
+}
+
 void xthread_work_run_sync(struct xthread_workqueue *wq,
 		void (*fn)(void *), void *data)
 {
@@ -171,14 +211,94 @@ void xthread_work_run_sync(struct xthread_workqueue *wq,
 			data
 		},
 		PTHREAD_COND_INITIALIZER,
+		0,
+		0,
 	};
 	pthread_mutex_lock(&wq->mutex);
 	xthread_work_enqueue(wq, &work);
-	pthread_cond_wait(&work.cond, &wq->mutex);
+	/* Condition variables can wake up spuriously */
+	while (!work.done)
+		pthread_cond_wait(&work.cond, &wq->mutex);
 	pthread_mutex_unlock(&wq->mutex);
 	pthread_cond_destroy(&work.cond);
 }
 
+/**
+ * xthread_work_queue - run @fn on a workqueue thread without waiting
+ * @wq: workqueue
+ * @fn: function to run
+ * @data: argument for @fn, which must dispose of it
+ *
+ * Returns 0 on success, or -1 if memory could not be allocated.
+ */
+int xthread_work_queue(struct xthread_workqueue *wq,
+		void (*fn)(void *), void *data)
+{
+	struct xthread_work *work;
+
+	work = malloc(sizeof(*work));
+	if (!work)
+		return -1;
+	work->work.fn = fn;
+	work->work.data = data;
+	work->async = 1;
+	pthread_mutex_lock(&wq->mutex);
+	xthread_work_enqueue(wq, work);
+	pthread_mutex_unlock(&wq->mutex);
+	return 0;
+}
+
+struct xthread_parallel {
+	void (*fn)(int, void *);
+	void *data;
+	int count;
+	int next;
+};
+
+static void *xthread_parallel_worker(void *arg)
+{
+	struct xthread_parallel *p = arg;
+	int i;
+
+	while ((i = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED)) <
+			p->count)
+		p->fn(i, p->data);
+	return NULL;
+}
+
+/**
+ * xthread_parallel - call @fn for every index below @count, concurrently
+ * @nthreads: most threads to use, counting the caller
+ * @count: number of calls
+ * @fn: function to call with the index and @data
+ * @data: argument for @fn
+ *
+ * Returns when every call has returned.  If no thread can be started,
+ * the caller makes all the calls itself.
+ */
+void xthread_parallel(int nthreads, int count,
+		void (*fn)(int, void *), void *data)
+{
+	struct xthread_parallel p = { fn, data, count, 0 };
+	pthread_t *threads = NULL;
+	int i, started = 0;
+
+	if (nthreads > count)
+		nthreads = count;
+	if (nthreads > 1)
+		threads = calloc(nthreads - 1, sizeof(*threads));
+	for (i = 0; threads && i < nthreads - 1; i++) {
+		if (pthread_create(&threads[started], NULL,
+					xthread_parallel_worker, &p) != 0)
+			break;
+		started++;
+	}
+	xthread_parallel_worker(&p);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+}
+
 static void xthread_workqueue_do_chroot(void *data)
 {
 	const char *path = data;
@@ -209,6 +329,11 @@ struct xthread_workqueue *xthread_workqueue_alloc(void)
 	return &ret;
 }
 
+struct xthread_workqueue *xthread_workqueue_alloc_pool(int nthreads)
+{
+	return NULL;
+}
+
 void xthread_workqueue_shutdown(struct xthread_workqueue *wq)
 {
 }
@@ -219,6 +344,22 @@ void xthread_work_run_sync(struct xthread_workqueue *wq,
 	fn(data);
 }
 
+int xthread_work_queue(struct xthread_workqueue *wq,
+		void (*fn)(void *), void *data)
+{
+	fn(data);
+	return 0;
+}
+
+void xthread_parallel(int nthreads, int count,
+		void (*fn)(int, void *), void *data)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		fn(i, data);
+}
+
 void xthread_workqueue_chroot(struct xthread_workqueue *wq,
 		const char *path)
 {
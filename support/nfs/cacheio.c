@@ -25,6 +25,7 @@
 #include <stdio_ext.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -32,37 +33,61 @@
 #include <time.h>
 #include <errno.h>
 
+/*
+ * Characters qword_add() escapes, and those that end a word on input.
+ * Runs of other characters are found with strcspn(), which the C
+ * library scans a vector at a time, and copied with memcpy().
+ */
+static const char qword_escaped[] = " \t\n\\";
+static const char qword_delim[] = " \n\\";
+
+static const char qword_hexdigit[] = "0123456789abcdef";
+
+/* hex digit values plus one, so that zero marks a non-digit */
+static const unsigned char qword_hexval[256] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
 void qword_add(char **bpp, int *lp, char *str)
 {
 	char *bp = *bpp;
 	int len = *lp;
+	size_t run;
 	char c;
 
 	if (len < 0) return;
 
-	while ((c=*str++) && len > 0)
-		switch(c) {
-		case ' ':
-		case '\t':
-		case '\n':
-		case '\\':
-			if (len >= 4) {
-				*bp++ = '\\';
-				*bp++ = '0' + ((c & 0300)>>6);
-				*bp++ = '0' + ((c & 0070)>>3);
-				*bp++ = '0' + ((c & 0007)>>0);
-			}
-			len -= 4;
+	for (;;) {
+		run = strcspn(str, qword_escaped);
+		if (run >= (size_t)len) {
+			len = -1;
+			goto out;
+		}
+		memcpy(bp, str, run);
+		bp += run;
+		len -= run;
+		str += run;
+		if ((c = *str++) == '\0')
 			break;
-		default:
-			*bp++ = c;
-			len--;
+		if (len < 4) {
+			len = -1;
+			goto out;
 		}
-	if (c || len <1) len = -1;
+		*bp++ = '\\';
+		*bp++ = '0' + ((c & 0300)>>6);
+		*bp++ = '0' + ((c & 0070)>>3);
+		*bp++ = '0' + ((c & 0007)>>0);
+		len -= 4;
+	}
+	if (len < 1) len = -1;
 	else {
 		*bp++ = ' ';
 		len--;
 	}
+out:
 	*bpp = bp;
 	*lp = len;
 }
@@ -80,8 +105,8 @@ void qword_addhex(char **bpp, int *lp, char *buf, int blen)
 		len -= 2;
 		while (blen && len >= 2) {
 			unsigned char c = *buf++;
-			*bp++ = '0' + ((c&0xf0)>>4) + (c>=0xa0)*('a'-'9'-1);
-			*bp++ = '0' + (c&0x0f) + ((c&0x0f)>=0x0a)*('a'-'9'-1);
+			*bp++ = qword_hexdigit[c >> 4];
+			*bp++ = qword_hexdigit[c & 0x0f];
 			len -= 2;
 			blen--;
 		}
@@ -126,44 +151,55 @@ void qword_addeol(char **bpp, int *lp)
 	(*lp)--;
 }
 
-#define isodigit(c) (isdigit(c) && c <= '7')
+#define isodigit(c) ((c) >= '0' && (c) <= '7')
+/*
+ * Decoding never writes ahead of where it reads, so @dest may be the
+ * word's own place in the buffer; qword_get_inplace() relies on that.
+ */
 int qword_get(char **bpp, char *dest, int bufsize)
 {
 	/* return bytes copied, or -1 on error */
 	char *bp = *bpp;
 	int len = 0;
+	size_t run;
 
 	while (*bp == ' ') bp++;
 
 	if (bp[0] == '\\' && bp[1] == 'x') {
 		/* HEX STRING */
+		unsigned char hi, lo;
+
 		bp += 2;
-		while (isxdigit(bp[0]) && isxdigit(bp[1]) && len < bufsize) {
-			int byte = isdigit(*bp) ? *bp-'0' : toupper(*bp)-'A'+10;
-			bp++;
-			byte <<= 4;
-			byte |= isdigit(*bp) ? *bp-'0' : toupper(*bp)-'A'+10;
-			*dest++ = byte;
-			bp++;
+		while ((hi = qword_hexval[(unsigned char)bp[0]]) &&
+		       (lo = qword_hexval[(unsigned char)bp[1]]) &&
+		       len < bufsize) {
+			*dest++ = ((hi - 1) << 4) | (lo - 1);
+			bp += 2;
 			len++;
 		}
 	} else {
 		/* text with \nnn octal quoting */
-		while (*bp != ' ' && *bp != '\n' && *bp && len < bufsize-1) {
-			if (*bp == '\\' &&
-			    isodigit(bp[1]) && (bp[1] <= '3') &&
+		while (len < bufsize-1) {
+			run = strcspn(bp, qword_delim);
+			if (run > (size_t)(bufsize-1 - len))
+				run = bufsize-1 - len;
+			if (dest != bp)
+				memmove(dest, bp, run);
+			dest += run;
+			bp += run;
+			len += run;
+			if (*bp != '\\' || len >= bufsize-1)
+				break;
+			if (isodigit(bp[1]) && (bp[1] <= '3') &&
 			    isodigit(bp[2]) &&
 			    isodigit(bp[3])) {
-				int byte = (*++bp -'0');
-				bp++;
-				byte = (byte << 3) | (*bp++ - '0');
-				byte = (byte << 3) | (*bp++ - '0');
-				*dest++ = byte;
-				len++;
-			} else {
+				*dest++ = ((bp[1] - '0') << 6) |
+					  ((bp[2] - '0') << 3) |
+					  (bp[3] - '0');
+				bp += 4;
+			} else
 				*dest++ = *bp++;
-				len++;
-			}
+			len++;
 		}
 	}
 
@@ -175,12 +211,66 @@ int qword_get(char **bpp, char *dest, int bufsize)
 	return len;
 }
 
+/**
+ * qword_get_inplace - decode the next word where it lies in the buffer
+ * @bpp: IN/OUT: position in a writable, NUL-terminated request
+ * @word: OUT: the decoded, NUL-terminated word
+ *
+ * Returns the length of the word, or -1 on error.  The request is
+ * overwritten as it is decoded, so it cannot be parsed a second time.
+ */
+int qword_get_inplace(char **bpp, char **word)
+{
+	char *bp = *bpp;
+
+	while (*bp == ' ') bp++;
+	*word = bp;
+	*bpp = bp;
+	return qword_get(bpp, bp, INT_MAX);
+}
+
+/*
+ * Find the next word for qword_get_int() and qword_get_uint(), which
+ * convert it where it lies unless it is quoted.  Returns its length,
+ * or -1 if it has to be decoded first.
+ */
+static int qword_number(char **bpp)
+{
+	char *bp = *bpp;
+	size_t run;
+
+	while (*bp == ' ') bp++;
+	*bpp = bp;
+	run = strcspn(bp, qword_delim);
+	if (bp[run] == '\\' || run >= 50)
+		return -1;
+	return run;
+}
+
+static int qword_number_end(char **bpp, char *ep, int len)
+{
+	if (len == 0 || ep != *bpp + len)
+		return -1;
+	while (*ep == ' ') ep++;
+	*bpp = ep;
+	return 0;
+}
+
 int qword_get_int(char **bpp, int *anint)
 {
 	char buf[50];
 	char *ep;
 	int rv;
-	int len = qword_get(bpp, buf, 50);
+	int len = qword_number(bpp);
+
+	if (len >= 0) {
+		rv = strtol(*bpp, &ep, 0);
+		if (qword_number_end(bpp, ep, len) < 0)
+			return -1;
+		*anint = rv;
+		return 0;
+	}
+	len = qword_get(bpp, buf, 50);
 	if (len < 0) return -1;
 	if (len ==0) return -1;
 	rv = strtol(buf, &ep, 0);
@@ -194,7 +284,16 @@ int qword_get_uint(char **bpp, unsigned int *anint)
 	char buf[50];
 	char *ep;
 	unsigned int rv;
-	int len = qword_get(bpp, buf, 50);
+	int len = qword_number(bpp);
+
+	if (len >= 0) {
+		rv = strtoul(*bpp, &ep, 0);
+		if (qword_number_end(bpp, ep, len) < 0)
+			return -1;
+		*anint = rv;
+		return 0;
+	}
+	len = qword_get(bpp, buf, 50);
 	if (len < 0) return -1;
 	if (len ==0) return -1;
 	rv = strtoul(buf, &ep, 0);
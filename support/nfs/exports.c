@@ -210,6 +210,40 @@ getexportent(int fromkernel)
 	return &ee;
 }
 
+/**
+ * getexporthost - return the next client name in the exports file
+ *
+ * Walks the file opened by setexportent() like getexportent() does,
+ * but without parsing paths or options, so that the client names can
+ * be looked up ahead of time.  Returns NULL at the end of the file.
+ */
+char *
+getexporthost(void)
+{
+	static char	exp[512];
+	char		path[NFS_MAXPATHLEN+1];
+	char		*opt;
+	int		ok = 0;
+
+	if (!efp)
+		return NULL;
+	if (first || (ok = getexport(exp, sizeof(exp))) == 0) {
+		if (getpath(path, sizeof(path)) <= 0)
+			return NULL;
+		ok = getexport(exp, sizeof(exp));
+	}
+	first = 0;
+	if (ok > 0 && exp[0] == '-')
+		ok = getexport(exp, sizeof(exp));
+	if (ok < 0)
+		return NULL;
+	if (ok == 0)
+		exp[0] = '\0';
+	if ((opt = strchr(exp, '(')) != NULL)
+		*opt = '\0';
+	return exp;
+}
+
 static const struct secinfo_flag_displaymap {
 	unsigned int flag;
 	const char *set;
@@ -522,7 +556,7 @@ static const struct xprtsec_info xprtsec_name2info[] = {
 	{ NULL,		0 }
 };
 
-static const struct xprtsec_info *find_xprtsec_info(const char *name)
+const struct xprtsec_info *find_xprtsec_info(const char *name)
 {
 	const struct xprtsec_info *info;
 
@@ -10,6 +10,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <stddef.h>
+#include <pthread.h>
 
 #include "nfsd_path.h"
 #include "conffile.h"
@@ -113,7 +114,9 @@ static bool parse_fsidd_reply(const char *cmd_info, char *buf, size_t len, char
 	return true;
 }
 
-static bool do_fsidd_cmd(const char *cmd_info, char *msg, size_t len, char **result)
+static pthread_mutex_t fsidd_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool do_fsidd_cmd_locked(const char *cmd_info, char *msg, size_t len, char **result)
 {
 	char recvbuf[1024];
 	int n;
@@ -156,6 +159,17 @@ out_close:
 	return false;
 }
 
+/* Requests and answers share one connection, so issue one at a time */
+static bool do_fsidd_cmd(const char *cmd_info, char *msg, size_t len, char **result)
+{
+	bool ret;
+
+	pthread_mutex_lock(&fsidd_lock);
+	ret = do_fsidd_cmd_locked(cmd_info, msg, len, result);
+	pthread_mutex_unlock(&fsidd_lock);
+	return ret;
+}
+
 static bool fsidnum_get_by_path(char *path, uint32_t *fsidnum, bool may_create)
 {
 	char *msg, *result;
@@ -0,0 +1,384 @@
+/*
+ * qword_bench.c -- time the cache channel qword codec
+ *
+ * Each request is decoded the way the mountd handlers decode it, and a
+ * reply of the same shape is encoded.  Requests come from a trace file
+ * as recorded with mountd's "trace-file" setting, one per line as
+ * "[<seconds>] <channel> <request>", or from a small built-in set.
+ *
+ * Before anything is timed, the codec is checked against known answers
+ * and for round trips; the program fails if any of that does not hold.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "misc.h"
+#include "nfslib.h"
+
+static const char *builtin[] = {
+	"auth.unix.ip nfsd 192.0.2.17",
+	"auth.unix.ip nfsd 2001:db8::1:17",
+	"auth.unix.gid 1000",
+	"nfsd.export $192.0.2.17 /srv/nfs/home",
+	"nfsd.export *.example.com /srv/nfs/project\\040files/build",
+	"nfsd.fh $192.0.2.17 1 \\x00000000",
+	"nfsd.fh $192.0.2.17 6 \\x5f3c1a2b4d6e7f8091a2b3c4d5e6f708",
+	"nfsd.fh @trusted 7 \\x0000000000000080d1c2b3a495867768594a3b2c1d0e0f10",
+};
+
+struct request {
+	char	*channel;
+	char	*text;
+	size_t	len;
+};
+
+static int load(const char *fname, struct request **reqs)
+{
+	struct request *r = NULL;
+	char line[RPC_CHAN_BUF_SIZE], *channel, *sp;
+	int n = 0, max = 0, i;
+	FILE *f;
+
+	if (!fname) {
+		n = sizeof(builtin) / sizeof(builtin[0]);
+		r = calloc(n, sizeof(*r));
+		for (i = 0; r && i < n; i++) {
+			r[i].channel = strdup(builtin[i]);
+			sp = strchr(r[i].channel, ' ');
+			*sp = '\0';
+			r[i].text = sp + 1;
+			r[i].len = strlen(r[i].text) + 1;
+		}
+		*reqs = r;
+		return r ? n : -1;
+	}
+
+	f = fopen(fname, "r");
+	if (!f) {
+		perror(fname);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\n")] = '\0';
+		channel = line;
+		if (isdigit((unsigned char)line[0]))
+			channel += strcspn(line, " ") + 1;
+		sp = strchr(channel, ' ');
+		if (line[0] == '#' || !sp)
+			continue;
+		if (n == max) {
+			max = max ? max * 2 : 64;
+			r = realloc(r, max * sizeof(*r));
+			if (!r)
+				break;
+		}
+		r[n].channel = strdup(channel);
+		r[n].channel[sp - channel] = '\0';
+		r[n].text = r[n].channel + (sp - channel) + 1;
+		r[n].len = strlen(r[n].text) + 1;
+		n++;
+	}
+	fclose(f);
+	*reqs = r;
+	return r ? n : -1;
+}
+
+static int failed;
+
+#define CHECK(cond, ...)						\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "qword_bench: FAIL: " __VA_ARGS__); \
+			fputc('\n', stderr);				\
+			failed++;					\
+		}							\
+	} while (0)
+
+/* Encode @word with qword_add() into @size bytes; returns what is left */
+static int add(char *out, int size, const char *word)
+{
+	char *bp = out;
+	int len = size;
+
+	qword_add(&bp, &len, (char *)word);
+	if (len >= 0)
+		*bp = '\0';
+	return len;
+}
+
+static int addhex(char *out, int size, const char *buf, int blen)
+{
+	char *bp = out;
+	int len = size;
+
+	qword_addhex(&bp, &len, (char *)buf, blen);
+	if (len >= 0)
+		*bp = '\0';
+	return len;
+}
+
+static const struct {
+	const char	*word;
+	const char	*encoded;
+} add_answers[] = {
+	{ "abc",		"abc " },
+	{ "",			" " },
+	{ "a b",		"a\\040b " },
+	{ "tab\there",		"tab\\011here " },
+	{ "nl\n",		"nl\\012 " },
+	{ "back\\slash",	"back\\134slash " },
+	{ "\\x00",		"\\134x00 " },
+	{ "\303\251t\303\251",	"\303\251t\303\251 " },
+};
+
+static const struct {
+	const char	*encoded;
+	int		bufsize;
+	int		len;		/* -1 for an error */
+	const char	*word;		/* @len bytes */
+	const char	*rest;		/* what follows the word */
+} get_answers[] = {
+	{ "abc def",		64, 3,	"abc",		"def" },
+	{ "   abc   def",	64, 3,	"abc",		"def" },
+	{ "abc\n",		64, 3,	"abc",		"\n" },
+	{ "",			64, 0,	"",		"" },
+	{ " ",			64, 0,	"",		"" },
+	{ "a\\040b c",		64, 3,	"a b",		"c" },
+	{ "\\011\\012\\134",	64, 3,	"\t\n\\",	"" },
+	{ "\\377",		64, 1,	"\377",		"" },
+	{ "a\\9 b",		64, 3,	"a\\9",		"b" },
+	{ "\\400",		64, 4,	"\\400",	"" },
+	{ "\\x00ff10 z",	64, 3,	"\0\377\020",	"z" },
+	{ "\\xAbCd",		64, 2,	"\253\315",	"" },
+	{ "\\x",		64, 0,	"",		"" },
+	{ "\\x0g",		64, -1,	NULL,		NULL },
+	{ "\\x012",		64, -1,	NULL,		NULL },
+	{ "abcdef",		7,  6,	"abcdef",	"" },
+	{ "abcdef",		6,  -1,	NULL,		NULL },
+	{ "a\\040bcd",		4,  -1,	NULL,		NULL },
+	{ "\\x0102",		2,  2,	"\001\002",	"" },
+	{ "\\x010203",		2,  -1,	NULL,		NULL },
+};
+
+static void check_get(int i, const char *how, int len, const char *word,
+		      const char *rest, const char *expect_rest)
+{
+	CHECK(len == get_answers[i].len, "%s \"%s\": length %d, not %d",
+	      how, get_answers[i].encoded, len, get_answers[i].len);
+	if (len < 0 || len != get_answers[i].len)
+		return;
+	CHECK(memcmp(word, get_answers[i].word, len) == 0 && word[len] == '\0',
+	      "%s \"%s\": wrong word", how, get_answers[i].encoded);
+	CHECK(strcmp(rest, expect_rest) == 0,
+	      "%s \"%s\": \"%s\" left, not \"%s\"", how,
+	      get_answers[i].encoded, rest, expect_rest);
+}
+
+/* Decode @encoded both ways and compare with the @len bytes of @word */
+static void check_round_trip(const char *encoded, const char *word, int len)
+{
+	char in[RPC_CHAN_BUF_SIZE], dest[RPC_CHAN_BUF_SIZE], *bp, *w;
+	int n;
+
+	strcpy(in, encoded);
+	bp = in;
+	n = qword_get(&bp, dest, sizeof(dest));
+	CHECK(n == len && memcmp(dest, word, len) == 0 && *bp == '\0',
+	      "qword_get round trip of \"%s\"", encoded);
+
+	strcpy(in, encoded);
+	bp = in;
+	n = qword_get_inplace(&bp, &w);
+	CHECK(n == len && memcmp(w, word, len) == 0 && *bp == '\0',
+	      "qword_get_inplace round trip of \"%s\"", encoded);
+}
+
+static void check_codec(void)
+{
+	char out[RPC_CHAN_BUF_SIZE], in[RPC_CHAN_BUF_SIZE];
+	char word[256], *bp, *w;
+	const char *enc;
+	size_t i;
+	int n;
+
+	for (i = 0; i < sizeof(add_answers) / sizeof(add_answers[0]); i++) {
+		enc = add_answers[i].encoded;
+		n = add(out, sizeof(out), add_answers[i].word);
+		CHECK(n >= 0 && strcmp(out, enc) == 0,
+		      "qword_add \"%s\" gave \"%s\", not \"%s\"",
+		      add_answers[i].word, n >= 0 ? out : "(error)", enc);
+		/* exactly enough room, and one byte short */
+		CHECK(add(out, strlen(enc), add_answers[i].word) == 0,
+		      "qword_add \"%s\" into %zu bytes", add_answers[i].word,
+		      strlen(enc));
+		CHECK(add(out, strlen(enc) - 1, add_answers[i].word) == -1,
+		      "qword_add \"%s\" into %zu bytes", add_answers[i].word,
+		      strlen(enc) - 1);
+		check_round_trip(enc, add_answers[i].word,
+				 strlen(add_answers[i].word));
+	}
+
+	n = addhex(out, sizeof(out), "\0\377\020", 3);
+	CHECK(n >= 0 && strcmp(out, "\\x00ff10 ") == 0, "qword_addhex");
+	n = addhex(out, sizeof(out), "", 0);
+	CHECK(n >= 0 && strcmp(out, "\\x ") == 0, "qword_addhex, empty");
+	CHECK(addhex(out, 9, "\0\377\020", 3) == 0, "qword_addhex, 9 bytes");
+	CHECK(addhex(out, 8, "\0\377\020", 3) == -1, "qword_addhex, 8 bytes");
+
+	for (i = 0; i < sizeof(get_answers) / sizeof(get_answers[0]); i++) {
+		strcpy(in, get_answers[i].encoded);
+		bp = in;
+		n = qword_get(&bp, out, get_answers[i].bufsize);
+		check_get(i, "qword_get", n, out, bp, get_answers[i].rest);
+
+		if (get_answers[i].bufsize != 64)
+			continue;
+		strcpy(in, get_answers[i].encoded);
+		bp = in;
+		n = qword_get_inplace(&bp, &w);
+		/* the word is terminated over a newline right after it */
+		check_get(i, "qword_get_inplace", n, w, bp,
+			  get_answers[i].rest &&
+			  strcmp(get_answers[i].rest, "\n") == 0 ?
+			  "" : get_answers[i].rest);
+	}
+
+	/* every byte value but NUL as text, and every one as hex */
+	for (i = 0; i < 255; i++)
+		word[i] = i + 1;
+	word[255] = '\0';
+	add(out, sizeof(out), word);
+	check_round_trip(out, word, 255);
+	for (i = 0; i < 256; i++)
+		word[i] = i;
+	addhex(out, sizeof(out), word, 256);
+	check_round_trip(out, word, 256);
+
+	/* words that only just fit the buffer, and one more */
+	memset(word, 'x', sizeof(word) - 1);
+	word[sizeof(word) - 1] = '\0';
+	CHECK(add(out, sizeof(word), word) == 0, "qword_add, full buffer");
+	CHECK(add(out, sizeof(word) - 1, word) == -1,
+	      "qword_add, overlong word");
+}
+
+/* Decode @req as its handler would, and encode a reply; 0 if it parsed */
+static int handle(const struct request *req, char *in, char *out)
+{
+	char *bp = in, *w1, *w2, *ob = out;
+	int olen = RPC_CHAN_BUF_SIZE;
+	int n, len;
+	unsigned int u;
+
+	memcpy(in, req->text, req->len);
+	if (strcmp(req->channel, "auth.unix.ip") == 0) {
+		/* class addr */
+		if (qword_get_inplace(&bp, &w1) <= 0 ||
+		    qword_get_inplace(&bp, &w2) <= 0)
+			return -1;
+		qword_add(&ob, &olen, w1);
+		qword_add(&ob, &olen, w2);
+		qword_adduint(&ob, &olen, 1800);
+		qword_add(&ob, &olen, "*.example.com");
+	} else if (strcmp(req->channel, "auth.unix.gid") == 0) {
+		/* uid */
+		if (qword_get_uint(&bp, &u) != 0)
+			return -1;
+		qword_adduint(&ob, &olen, u);
+		qword_adduint(&ob, &olen, 1800);
+		qword_adduint(&ob, &olen, 2);
+		qword_adduint(&ob, &olen, 100);
+		qword_adduint(&ob, &olen, u);
+	} else if (strcmp(req->channel, "nfsd.fh") == 0) {
+		/* domain fsidtype fsid */
+		if (qword_get_inplace(&bp, &w1) <= 0 ||
+		    qword_get_int(&bp, &n) != 0 ||
+		    (len = qword_get_inplace(&bp, &w2)) <= 0)
+			return -1;
+		qword_add(&ob, &olen, w1);
+		qword_addint(&ob, &olen, n);
+		qword_addhex(&ob, &olen, w2, len);
+		qword_addint(&ob, &olen, 0x7fffffff);
+		qword_add(&ob, &olen, "/srv/nfs/home");
+	} else {
+		/* nfsd.export: domain path */
+		if (qword_get_inplace(&bp, &w1) <= 0 ||
+		    qword_get_inplace(&bp, &w2) <= 0)
+			return -1;
+		qword_add(&ob, &olen, w1);
+		qword_add(&ob, &olen, w2);
+		qword_adduint(&ob, &olen, 1800);
+		qword_addint(&ob, &olen, 0x2401);
+		qword_addint(&ob, &olen, 65534);
+		qword_addint(&ob, &olen, 65534);
+		qword_addint(&ob, &olen, 0);
+	}
+	qword_addeol(&ob, &olen);
+	return olen > 0 ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+	static char in[RPC_CHAN_BUF_SIZE], out[RPC_CHAN_BUF_SIZE];
+	struct request *reqs;
+	struct timespec start, end;
+	long rounds = 200000, i;
+	int n, j, bad = 0;
+	double ns;
+
+	if (argc > 1 && strcmp(argv[1], "-n") == 0 && argc > 2) {
+		rounds = atol(argv[2]);
+		argc -= 2;
+		argv += 2;
+	}
+	check_codec();
+	if (failed) {
+		fprintf(stderr, "qword_bench: %d checks failed\n", failed);
+		return 1;
+	}
+	n = load(argc > 1 ? argv[1] : NULL, &reqs);
+	if (n <= 0) {
+		fprintf(stderr, "qword_bench: no requests\n");
+		return 1;
+	}
+	for (j = 0; j < n; j++)
+		if (handle(&reqs[j], in, out) < 0) {
+			fprintf(stderr, "qword_bench: cannot parse %s %s\n",
+				reqs[j].channel, reqs[j].text);
+			bad++;
+		}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < rounds; i++)
+		for (j = 0; j < n; j++)
+			handle(&reqs[j], in, out);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+	printf("%d requests x %ld rounds: %.1f ns per request\n",
+	       n, rounds, ns / ((double)rounds * n));
+	return bad ? 1 : 0;
+}
@@ -0,0 +1,740 @@
+/*
+ * upcall_replay.c -- replay recorded cache upcalls against mountd's handlers
+ *
+ * mountd and exportd record the requests they read from the kernel's
+ * cache channels when "trace-file" is set in nfs.conf.  This program
+ * feeds such a trace to the same handlers, in-process, and reports how
+ * quickly they answered.  It needs neither a kernel nor a network:
+ *
+ *  - the export table is an etab given with -e, or one made up with -G;
+ *  - with -R, every exported path and every path asked about is moved
+ *    below a scratch directory, where the exported directories are
+ *    created, so the local mount table does not matter;
+ *  - names are resolved only from a hosts file given with -H, netgroups
+ *    are empty, and blkid finds no devices, so filesystem UUIDs come
+ *    from statfs().
+ *
+ * Replies go to /dev/null, or to the file given with -o.  auth.unix.gid
+ * requests are skipped, as they would look up local users.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <time.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "misc.h"
+#include "nfslib.h"
+#include "exportfs.h"
+#include "export.h"
+#include "xlog.h"
+
+/* Normally defined by the daemon */
+int use_ipaddr = -1;
+int manage_gids;
+
+struct request {
+	double	when;			/* seconds into the trace */
+	char	*channel;
+	char	*text;
+	int	len;			/* of text, with its NUL */
+};
+
+static struct request *reqs;
+static int nreqs, maxreqs;
+
+static const char *channels[] = {
+	"auth.unix.ip", "auth.unix.gid", "nfsd.export", "nfsd.fh", NULL
+};
+#define NCHANNELS 4
+
+/* Latencies in nanoseconds, per channel */
+static uint32_t *lat[NCHANNELS];
+static long nlat[NCHANNELS];
+
+static char scratch[] = "/tmp/upcall_replay.XXXXXX";
+static const char *root;
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: upcall_replay [-d] [-i] [-p] [-n rounds] [-H hosts]\n"
+		"                     [-R root] [-o replies] [-s stats-file]\n"
+		"                     { -e etab trace | -G exports [trace] }\n");
+	exit(2);
+}
+
+/*
+ * The fake resolver.  Its table is an /etc/hosts style file; names and
+ * addresses not in it are not found.
+ */
+struct fake_host {
+	char	*addr;
+	char	**names;
+};
+
+static struct fake_host *hosts;
+static int nhosts, maxhosts;
+
+static void add_host(const char *addr, char **names, int nnames)
+{
+	struct fake_host *h;
+	int i;
+
+	if (nhosts == maxhosts) {
+		maxhosts = maxhosts ? maxhosts * 2 : 64;
+		hosts = realloc(hosts, maxhosts * sizeof(*hosts));
+		if (!hosts)
+			exit(1);
+	}
+	h = &hosts[nhosts++];
+	h->addr = strdup(addr);
+	h->names = calloc(nnames + 1, sizeof(char *));
+	for (i = 0; i < nnames; i++)
+		h->names[i] = strdup(names[i]);
+}
+
+static void load_hosts(const char *fname)
+{
+	char line[1024], *names[16], *addr, *tok;
+	int n;
+	FILE *f;
+
+	f = fopen(fname, "r");
+	if (!f) {
+		perror(fname);
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "#\n")] = '\0';
+		addr = strtok(line, " \t");
+		if (!addr)
+			continue;
+		n = 0;
+		while (n < 16 && (tok = strtok(NULL, " \t")) != NULL)
+			names[n++] = tok;
+		if (n)
+			add_host(addr, names, n);
+	}
+	fclose(f);
+}
+
+static struct fake_host *host_byname(const char *name)
+{
+	char **np;
+	int i;
+
+	for (i = 0; i < nhosts; i++)
+		for (np = hosts[i].names; *np; np++)
+			if (strcasecmp(*np, name) == 0)
+				return &hosts[i];
+	return NULL;
+}
+
+static struct fake_host *host_byaddr(const char *addr)
+{
+	int i;
+
+	for (i = 0; i < nhosts; i++)
+		if (strcmp(hosts[i].addr, addr) == 0)
+			return &hosts[i];
+	return NULL;
+}
+
+int __real_getaddrinfo(const char *node, const char *service,
+		       const struct addrinfo *hints, struct addrinfo **res);
+int __wrap_getaddrinfo(const char *node, const char *service,
+		       const struct addrinfo *hints, struct addrinfo **res);
+int __real_getnameinfo(const struct sockaddr *sa, socklen_t salen,
+		       char *host, socklen_t hostlen, char *serv,
+		       socklen_t servlen, int flags);
+int __wrap_getnameinfo(const struct sockaddr *sa, socklen_t salen,
+		       char *host, socklen_t hostlen, char *serv,
+		       socklen_t servlen, int flags);
+struct hostent *__wrap_gethostbyname(const char *name);
+struct hostent *__wrap_gethostbyaddr(const void *addr, socklen_t len,
+				     int type);
+int __wrap_innetgr(const char *netgroup, const char *host,
+		   const char *user, const char *domain);
+char *__wrap_blkid_devno_to_devname(dev_t devno);
+
+int __wrap_getaddrinfo(const char *node, const char *service,
+		       const struct addrinfo *hints, struct addrinfo **res)
+{
+	struct addrinfo h;
+	struct fake_host *fh;
+	int err;
+
+	memset(&h, 0, sizeof(h));
+	if (hints)
+		h = *hints;
+	h.ai_flags |= AI_NUMERICHOST;
+	err = __real_getaddrinfo(node, service, &h, res);
+	if (err != EAI_NONAME || !node ||
+	    (hints && (hints->ai_flags & AI_NUMERICHOST)))
+		return err;
+
+	fh = host_byname(node);
+	if (!fh)
+		return EAI_NONAME;
+	err = __real_getaddrinfo(fh->addr, service, &h, res);
+	if (err == 0 && (h.ai_flags & AI_CANONNAME)) {
+		free((*res)->ai_canonname);
+		(*res)->ai_canonname = strdup(fh->names[0]);
+	}
+	return err;
+}
+
+int __wrap_getnameinfo(const struct sockaddr *sa, socklen_t salen,
+		       char *host, socklen_t hostlen, char *serv,
+		       socklen_t servlen, int flags)
+{
+	char addr[INET6_ADDRSTRLEN];
+	struct fake_host *fh;
+	int err;
+
+	if (!host || (flags & NI_NUMERICHOST))
+		return __real_getnameinfo(sa, salen, host, hostlen,
+					  serv, servlen, flags);
+	err = __real_getnameinfo(sa, salen, addr, sizeof(addr), NULL, 0,
+				 NI_NUMERICHOST);
+	if (err)
+		return err;
+	fh = host_byaddr(addr);
+	if (!fh) {
+		if (flags & NI_NAMEREQD)
+			return EAI_NONAME;
+		return __real_getnameinfo(sa, salen, host, hostlen,
+					  serv, servlen, flags | NI_NUMERICHOST);
+	}
+	if (strlen(fh->names[0]) >= hostlen)
+		return EAI_OVERFLOW;
+	strcpy(host, fh->names[0]);
+	if (serv && servlen)
+		*serv = '\0';
+	return 0;
+}
+
+static struct hostent *fake_hostent(struct fake_host *fh)
+{
+	static struct hostent he;
+	static struct in_addr in;
+	static char *addrs[2];
+
+	if (!fh || inet_pton(AF_INET, fh->addr, &in) != 1) {
+		h_errno = HOST_NOT_FOUND;
+		return NULL;
+	}
+	addrs[0] = (char *)&in;
+	he.h_name = fh->names[0];
+	he.h_aliases = fh->names + 1;
+	he.h_addrtype = AF_INET;
+	he.h_length = sizeof(in);
+	he.h_addr_list = addrs;
+	return &he;
+}
+
+struct hostent *__wrap_gethostbyname(const char *name)
+{
+	struct in_addr in;
+
+	if (inet_pton(AF_INET, name, &in) == 1) {
+		struct fake_host *fh = host_byaddr(name);
+
+		if (fh)
+			return fake_hostent(fh);
+	}
+	return fake_hostent(host_byname(name));
+}
+
+struct hostent *__wrap_gethostbyaddr(const void *addr, socklen_t len,
+				     int type)
+{
+	char buf[INET6_ADDRSTRLEN];
+
+	if (type != AF_INET || len != sizeof(struct in_addr) ||
+	    !inet_ntop(AF_INET, addr, buf, sizeof(buf))) {
+		h_errno = HOST_NOT_FOUND;
+		return NULL;
+	}
+	return fake_hostent(host_byaddr(buf));
+}
+
+int __wrap_innetgr(const char *UNUSED(netgroup), const char *UNUSED(host),
+		   const char *UNUSED(user), const char *UNUSED(domain))
+{
+	return 0;
+}
+
+char *__wrap_blkid_devno_to_devname(dev_t UNUSED(devno))
+{
+	return NULL;
+}
+
+/*
+ * Trace files hold one request per line, "<seconds> <channel> <request>";
+ * the time may be left out.
+ */
+static void add_request(double when, const char *channel, const char *text)
+{
+	struct request *r;
+
+	if (nreqs == maxreqs) {
+		maxreqs = maxreqs ? maxreqs * 2 : 1024;
+		reqs = realloc(reqs, maxreqs * sizeof(*reqs));
+		if (!reqs)
+			exit(1);
+	}
+	r = &reqs[nreqs++];
+	r->when = when;
+	r->channel = strdup(channel);
+	r->text = strdup(text);
+	r->len = strlen(text) + 1;
+}
+
+/* "domain path" becomes "domain <root>path" */
+static int reroot_export(char *text, char *out, int outlen)
+{
+	char dom[RPC_CHAN_BUF_SIZE], path[RPC_CHAN_BUF_SIZE];
+	char *bp = text, *ob = out;
+
+	if (qword_get(&bp, dom, sizeof(dom)) <= 0 ||
+	    qword_get(&bp, path, sizeof(path)) <= 0)
+		return -1;
+	qword_add(&ob, &outlen, dom);
+	if (snprintf(dom, sizeof(dom), "%s%s", root, path) >= (int)sizeof(dom))
+		return -1;
+	qword_add(&ob, &outlen, dom);
+	if (outlen <= 0)
+		return -1;
+	ob[-1] = '\0';
+	return 0;
+}
+
+static void load_trace(const char *fname)
+{
+	static char line[RPC_CHAN_BUF_SIZE + 64], text[RPC_CHAN_BUF_SIZE + 64];
+	char *channel, *req, *ep;
+	double when, first = -1;
+	FILE *f;
+
+	f = fopen(fname, "r");
+	if (!f) {
+		perror(fname);
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\n")] = '\0';
+		if (line[0] == '#' || line[0] == '\0')
+			continue;
+		when = strtod(line, &ep);
+		if (ep != line && *ep == ' ') {
+			channel = ep + 1;
+			if (first < 0)
+				first = when;
+			when -= first;
+		} else {
+			channel = line;
+			when = 0;
+		}
+		req = strchr(channel, ' ');
+		if (!req)
+			continue;
+		*req++ = '\0';
+		if (root && strcmp(channel, "nfsd.export") == 0) {
+			if (reroot_export(req, text, sizeof(text)) < 0) {
+				fprintf(stderr, "upcall_replay: skipping %s\n",
+					req);
+				continue;
+			}
+			req = text;
+		}
+		add_request(when, channel, req);
+	}
+	fclose(f);
+}
+
+static void mkdirs(const char *path)
+{
+	char buf[PATH_MAX], *p;
+
+	if (snprintf(buf, sizeof(buf), "%s", path) >= (int)sizeof(buf))
+		return;
+	for (p = buf + 1; *p; p++)
+		if (*p == '/') {
+			*p = '\0';
+			mkdir(buf, 0755);
+			*p = '/';
+		}
+	mkdir(buf, 0755);
+}
+
+/*
+ * Copy @fname to the scratch etab, moving the exported paths below
+ * root and creating them there.
+ */
+static void load_etab(const char *fname)
+{
+	char line[NFS_MAXPATHLEN * 4], path[NFS_MAXPATHLEN + 1], *bp, *tab;
+	FILE *in, *out;
+
+	in = fopen(fname, "r");
+	if (!in) {
+		perror(fname);
+		exit(1);
+	}
+	out = fopen(etab.statefn, "w");
+	if (!out) {
+		perror(etab.statefn);
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), in)) {
+		if (!root || line[0] != '/') {
+			fputs(line, out);
+			continue;
+		}
+		fprintf(out, "%s%s", root, line);
+		tab = strchr(line, '\t');
+		if (!tab)
+			continue;
+		*tab = '\0';
+		bp = line;
+		if (qword_get(&bp, path, sizeof(path)) > 0) {
+			char full[PATH_MAX];
+
+			snprintf(full, sizeof(full), "%s%s", root, path);
+			mkdirs(full);
+		}
+	}
+	fclose(in);
+	fclose(out);
+}
+
+/*
+ * Make up an export table of @nexports directories, shared out by
+ * subnet, wildcard and host name, and a trace of lookups by the
+ * clients in 192.0.2.0/24.  Clients are told apart by address.
+ */
+static void generate(int nexports, const char *trace)
+{
+	char etabname[PATH_MAX], name[64], addr[32], *names[1];
+	FILE *f;
+	int i, c;
+	uint32_t fsid;
+
+	for (c = 1; c < 255; c++) {
+		snprintf(addr, sizeof(addr), "192.0.2.%d", c);
+		snprintf(name, sizeof(name), "client%d.example.com", c);
+		names[0] = name;
+		add_host(addr, names, 1);
+	}
+
+	snprintf(etabname, sizeof(etabname), "%s/generated.etab", scratch);
+	f = fopen(etabname, "w");
+	if (!f) {
+		perror(etabname);
+		exit(1);
+	}
+	for (i = 0; i < nexports; i++) {
+		const char *opts = "rw,sync,wdelay,hide,nocrossmnt,secure,"
+				   "root_squash,no_all_squash,no_subtree_check,"
+				   "secure_locks,acl,no_pnfs";
+
+		switch (i % 3) {
+		case 0:
+			fprintf(f, "/export/vol%d\t192.0.2.0/24(%s,fsid=%d)\n",
+				i, opts, i + 1);
+			break;
+		case 1:
+			fprintf(f, "/export/vol%d\t*.example.com(%s,fsid=%d)\n",
+				i, opts, i + 1);
+			break;
+		default:
+			fprintf(f, "/export/vol%d\tclient%d.example.com(%s,fsid=%d)\n",
+				i, i % 254 + 1, opts, i + 1);
+		}
+	}
+	fclose(f);
+	load_etab(etabname);
+
+	if (trace) {
+		load_trace(trace);
+		return;
+	}
+	srandom(1);
+	for (i = 0; i < nexports * 4; i++) {
+		char text[256], *bp = text;
+		int blen = sizeof(text);
+		int vol = random() % nexports;
+
+		c = vol % 3 == 2 ? vol % 254 + 1 : random() % 254 + 1;
+		snprintf(addr, sizeof(addr), "192.0.2.%d", c);
+		snprintf(name, sizeof(name), "$%s", addr);
+		switch (i % 4) {
+		case 0:
+			qword_add(&bp, &blen, "nfsd");
+			qword_add(&bp, &blen, addr);
+			bp[-1] = '\0';
+			add_request(0, "auth.unix.ip", text);
+			break;
+		case 1:
+		case 2:
+			/* the nfsd.fh for type 1 (FSID_NUM) */
+			fsid = vol + 1;
+			qword_add(&bp, &blen, name);
+			qword_addint(&bp, &blen, 1);
+			qword_addhex(&bp, &blen, (char *)&fsid, sizeof(fsid));
+			bp[-1] = '\0';
+			add_request(0, "nfsd.fh", text);
+			break;
+		default:
+			snprintf(etabname, sizeof(etabname),
+				 "%s/export/vol%d", root, vol);
+			qword_add(&bp, &blen, name);
+			qword_add(&bp, &blen, etabname);
+			bp[-1] = '\0';
+			add_request(0, "nfsd.export", text);
+		}
+	}
+}
+
+static int channel_index(const char *channel)
+{
+	int i;
+
+	for (i = 0; channels[i]; i++)
+		if (strcmp(channels[i], channel) == 0)
+			return i;
+	return -1;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double pct(uint32_t *v, long n, int p)
+{
+	long i = (n * p + 99) / 100 - 1;
+
+	return v[i < 0 ? 0 : i] / 1000.0;
+}
+
+static void report(double elapsed)
+{
+	uint32_t *all;
+	long total = 0, n;
+	int c;
+
+	for (c = 0; c < NCHANNELS; c++)
+		total += nlat[c];
+	printf("%ld requests in %.3f s: %.0f requests/s\n",
+	       total, elapsed, elapsed > 0 ? total / elapsed : 0);
+	if (!total)
+		return;
+	printf("%-14s %10s %10s %10s %10s %10s\n", "channel", "requests",
+	       "p50 us", "p90 us", "p99 us", "max us");
+	all = malloc(total * sizeof(*all));
+	n = 0;
+	for (c = 0; c < NCHANNELS; c++) {
+		if (!nlat[c])
+			continue;
+		qsort(lat[c], nlat[c], sizeof(uint32_t), cmp_u32);
+		printf("%-14s %10ld %10.1f %10.1f %10.1f %10.1f\n", channels[c],
+		       nlat[c], pct(lat[c], nlat[c], 50), pct(lat[c], nlat[c], 90),
+		       pct(lat[c], nlat[c], 99), lat[c][nlat[c] - 1] / 1000.0);
+		if (all) {
+			memcpy(all + n, lat[c], nlat[c] * sizeof(uint32_t));
+			n += nlat[c];
+		}
+	}
+	if (all) {
+		qsort(all, n, sizeof(uint32_t), cmp_u32);
+		printf("%-14s %10ld %10.1f %10.1f %10.1f %10.1f\n", "all", n,
+		       pct(all, n, 50), pct(all, n, 90), pct(all, n, 99),
+		       all[n - 1] / 1000.0);
+		free(all);
+	}
+}
+
+static int rm_one(const char *path, const struct stat *UNUSED(sb),
+		  int UNUSED(flag), struct FTW *UNUSED(ftw))
+{
+	remove(path);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	static char buf[RPC_CHAN_BUF_SIZE];
+	const char *etabfile = NULL, *replies = "/dev/null";
+	const char *stats = NULL, *rootarg = NULL;
+	char path[PATH_MAX], rootbuf[PATH_MAX];
+	int opt, debug = 0, pace = 0, nexports = 0, f, c, i;
+	long rounds = 1, r, k;
+	double start, elapsed;
+	struct timespec t0, t1;
+
+	while ((opt = getopt(argc, argv, "de:G:H:in:o:pR:s:")) != -1) {
+		switch (opt) {
+		case 'd':
+			debug = 1;
+			break;
+		case 'e':
+			etabfile = optarg;
+			break;
+		case 'G':
+			nexports = atoi(optarg);
+			break;
+		case 'H':
+			load_hosts(optarg);
+			break;
+		case 'i':
+			use_ipaddr = 2;
+			break;
+		case 'n':
+			rounds = atol(optarg);
+			break;
+		case 'o':
+			replies = optarg;
+			break;
+		case 'p':
+			pace = 1;
+			break;
+		case 'R':
+			rootarg = optarg;
+			break;
+		case 's':
+			stats = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if ((!etabfile) == (nexports <= 0) || rounds < 1 ||
+	    (etabfile && optind != argc - 1) || optind < argc - 1)
+		usage();
+
+	xlog_open("upcall_replay");
+	xlog_stderr(1);
+	xlog_syslog(0);
+	if (debug)
+		xlog_config(D_ALL, 1);
+
+	if (!mkdtemp(scratch)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	snprintf(path, sizeof(path), "%s/etab", scratch);
+	etab.statefn = strdup(path);
+	snprintf(path, sizeof(path), "%s/etab.lock", scratch);
+	etab.lockfn = strdup(path);
+	snprintf(path, sizeof(path), "%s/etab.tmp", scratch);
+	etab.tmpfn = strdup(path);
+
+	if (rootarg)
+		root = rootarg;
+	else if (nexports) {
+		snprintf(rootbuf, sizeof(rootbuf), "%s/root", scratch);
+		root = rootbuf;
+	}
+	if (root)
+		mkdirs(root);
+
+	if (nexports) {
+		use_ipaddr = 2;
+		generate(nexports, optind < argc ? argv[optind] : NULL);
+	} else {
+		load_etab(etabfile);
+		load_trace(argv[optind]);
+	}
+
+	f = open(replies, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (f < 0) {
+		perror(replies);
+		return 1;
+	}
+	if (stats)
+		cachestats_enable(stats, 0);
+	auth_reload();
+
+	for (c = 0; c < NCHANNELS; c++) {
+		lat[c] = malloc(nreqs * rounds * sizeof(uint32_t));
+		if (!lat[c]) {
+			fprintf(stderr, "upcall_replay: out of memory\n");
+			return 1;
+		}
+	}
+
+	start = now();
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < nreqs; i++) {
+			c = channel_index(reqs[i].channel);
+			if (c < 0)
+				continue;
+			if (c == 1)
+				continue;
+			if (pace && r == 0) {
+				double wait = reqs[i].when - (now() - start);
+
+				if (wait > 0)
+					usleep(wait * 1e6);
+			}
+			memcpy(buf, reqs[i].text, reqs[i].len);
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			cache_handle_request(reqs[i].channel, f, buf,
+					     reqs[i].len);
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			k = (t1.tv_sec - t0.tv_sec) * 1000000000L +
+			    (t1.tv_nsec - t0.tv_nsec);
+			lat[c][nlat[c]++] = k > UINT32_MAX ? UINT32_MAX : k;
+		}
+	elapsed = now() - start;
+	close(f);
+
+	report(elapsed);
+	if (stats)
+		cachestats_write();
+
+	nftw(scratch, rm_one, 16, FTW_DEPTH | FTW_PHYS);
+	return 0;
+}
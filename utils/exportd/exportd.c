@@ -30,6 +30,10 @@ extern void my_svc_run(void);
 static int num_threads = 1;
 /* Arbitrary limit on number of threads */
 #define MAX_THREADS 64
+/* Run the workers as threads sharing one export table,
+ * rather than as separate processes. */
+static int thread_pool = 0;
+static int warm_cache = 0;
 
 int manage_gids;
 int use_ipaddr = -1;
@@ -62,7 +66,7 @@ cleanup_lockfiles (void)
 static void
 killer (int sig)
 {
-	if (num_threads > 1) {
+	if (num_threads > 1 && !thread_pool) {
 		/* play Kronos and eat our children */
 		kill(0, SIGTERM);
 		cache_wait_for_workers("exportd");
@@ -125,6 +129,17 @@ read_exportd_conf(char *progname, char **argv)
 
 	manage_gids = conf_get_bool("exportd", "manage-gids", manage_gids);
 	num_threads = conf_get_num("exportd", "threads", num_threads);
+	thread_pool = conf_get_bool("exportd", "thread-pool", thread_pool);
+	warm_cache = conf_get_bool("exportd", "warm-cache", warm_cache);
+	gidcache_size = conf_get_num("exportd", "gid-cache-size", gidcache_size);
+	gidcache_negative_ttl = conf_get_num("exportd", "gid-cache-negative-ttl",
+					     gidcache_negative_ttl);
+	cachestats_enable(conf_get_str("exportd", "stats-file"),
+			  conf_get_num("exportd", "stats-interval", 10));
+	cache_trace_enable(conf_get_str("exportd", "trace-file"));
+	hostcache_ttl = conf_get_num("exportd", "resolver-cache-ttl", hostcache_ttl);
+	hostcache_negative_ttl = conf_get_num("exportd", "resolver-cache-negative-ttl",
+					      hostcache_negative_ttl);
 	if (conf_get_bool("mountd", "cache-use-ipaddr", 0))
 		use_ipaddr = 2;
 
@@ -212,7 +227,7 @@ main(int argc, char **argv)
 	daemon_ready();
 
 	/* silently bounds check num_threads */
-	if (foreground)
+	if (foreground && !thread_pool)
 		num_threads = 1;
 	else if (num_threads < 1)
 		num_threads = 1;
@@ -224,8 +239,13 @@ main(int argc, char **argv)
 	 * read and write.
 	 */
 	cache_open();
+	if (warm_cache)
+		cache_warm_enable(NULL);
 
-	if (cache_fork_workers(progname, num_threads) == 0) {
+	if (thread_pool && cache_start_threads(num_threads) < 0)
+		thread_pool = 0;
+
+	if (!thread_pool && cache_fork_workers(progname, num_threads) == 0) {
 		/* We forked, waited, and now need to clean up */
 		cleanup_lockfiles();
 		free_state_path_names(&etab);
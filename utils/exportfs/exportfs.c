@@ -36,9 +36,11 @@
 #include "nfsd_path.h"
 #include "nfslib.h"
 #include "exportfs.h"
+#include "xmalloc.h"
 #include "xlog.h"
 #include "conffile.h"
 #include "reexport.h"
+#include "workqueue.h"
 
 static void	export_all(int verbose);
 static void	exportfs(char *arg, char *options, int verbose);
@@ -46,6 +48,7 @@ static void	unexportfs(char *arg, int verbose);
 static void	dump(int verbose, int export_format);
 static void	usage(const char *progname, int n);
 static void	validate_export(nfs_export *exp);
+static int	can_test(void);
 static int	matchhostname(const char *hostname1, const char *hostname2);
 static void grab_lockfile(void);
 static void release_lockfile(void);
@@ -53,6 +56,52 @@ static void release_lockfile(void);
 static const char *lockfile = EXP_LOCKFILE;
 static int _lockfd = -1;
 
+/* How many host lookups and export checks may run at once */
+static int exportfs_threads;
+
+/* Where the time goes, reported with -v */
+enum {
+	PHASE_RESOLVE,
+	PHASE_READ,
+	PHASE_VALIDATE,
+	PHASE_WRITE,
+	PHASE_COUNT
+};
+
+static const char *phase_names[PHASE_COUNT] = {
+	[PHASE_RESOLVE]		= "resolve",
+	[PHASE_READ]		= "read",
+	[PHASE_VALIDATE]	= "validate",
+	[PHASE_WRITE]		= "write",
+};
+
+static struct timespec phase_start;
+static long phase_usecs[PHASE_COUNT];
+
+/* Charge the time since the previous phase ended to @phase */
+static void
+phase_done(int phase)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	phase_usecs[phase] += (now.tv_sec - phase_start.tv_sec) * 1000000L +
+			      (now.tv_nsec - phase_start.tv_nsec) / 1000;
+	phase_start = now;
+}
+
+static void
+phase_report(void)
+{
+	int i;
+
+	printf("timing:");
+	for (i = 0; i < PHASE_COUNT; i++)
+		printf(" %s %ld.%03ld ms%s", phase_names[i],
+		       phase_usecs[i] / 1000, phase_usecs[i] % 1000,
+		       i < PHASE_COUNT - 1 ? "," : "\n");
+}
+
 /*
  * If we aren't careful, changes made by exportfs can be lost
  * when multiple exports process run at once:
@@ -107,6 +156,11 @@ read_exportfs_conf(char **argv)
 	if (s && !state_setup_basedir(argv[0], s))
 		exit(1);
 
+	exportfs_threads = conf_get_num("exportfs", "threads", 0);
+	if (exportfs_threads <= 0)
+		exportfs_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (exportfs_threads <= 0)
+		exportfs_threads = 1;
 }
 int
 main(int argc, char **argv)
@@ -211,12 +265,20 @@ main(int argc, char **argv)
 	grab_lockfile();
 	atexit(release_lockfile);
 
+	clock_gettime(CLOCK_MONOTONIC, &phase_start);
 	if (f_export && ! f_ignore) {
+		/* look up all the clients at once, not line by line */
+		if (exportfs_threads > 1)
+			export_prefetch_hosts(_PATH_EXPORTS, _PATH_EXPORTS_D,
+					      exportfs_threads);
+		phase_done(PHASE_RESOLVE);
 		if (! (export_read(_PATH_EXPORTS, 0) +
 		       export_d_read(_PATH_EXPORTS_D, 0))) {
 			if (f_verbose)
 				xlog(L_WARNING, "No file systems exported!");
 		}
+		host_prefetch_release();
+		phase_done(PHASE_READ);
 	}
 	if (f_export) {
 		if (f_all)
@@ -224,6 +286,7 @@ main(int argc, char **argv)
 		else
 			for (i = optind; i < argc ; i++)
 				exportfs(argv[i], options, f_verbose);
+		phase_done(PHASE_VALIDATE);
 	}
 	/* If we are unexporting everything, then
 	 * don't care about what should be exported, as that
@@ -235,18 +298,30 @@ main(int argc, char **argv)
 		 */
 		if (!f_reexport)
 			xtab_export_read();
+		phase_done(PHASE_READ);
 		if (!f_export)
 			for (i = optind ; i < argc ; i++)
 				unexportfs(argv[i], f_verbose);
 	}
 	xtab_export_write();
 	cache_flush();
+	phase_done(PHASE_WRITE);
+	if (f_verbose && f_all)
+		phase_report();
 	free_state_path_names(&etab);
 	export_freeall();
 
 	return export_errno;
 }
 
+static void
+validate_one(int i, void *data)
+{
+	nfs_export **exps = data;
+
+	validate_export(exps[i]);
+}
+
 /*
  * export_all finds all entries and
  *    marks them xtabent and mayexport so that they get exported
@@ -254,8 +329,8 @@ main(int argc, char **argv)
 static void
 export_all(int verbose)
 {
-	nfs_export	*exp;
-	int		i;
+	nfs_export	*exp, **exps = NULL;
+	int		i, n = 0, max = 0;
 
 	for (i = 0; i < MCL_MAXTYPES; i++) {
 		for (exp = exportlist[i].p_head; exp; exp = exp->m_next) {
@@ -267,9 +342,18 @@ export_all(int verbose)
 			exp->m_mayexport = 1;
 			exp->m_changed = 1;
 			exp->m_warned = 0;
-			validate_export(exp);
+			if (n == max) {
+				max = max ? max * 2 : 256;
+				exps = xrealloc(exps, max * sizeof(*exps));
+			}
+			exps[n++] = exp;
 		}
 	}
+
+	/* the checks only look at the file system and the kernel */
+	can_test();
+	xthread_parallel(exportfs_threads, n, validate_one, exps);
+	free(exps);
 }
 
 
@@ -478,11 +562,16 @@ unexportfs(char *arg, int verbose)
 
 static int can_test(void)
 {
+	static int tested = -1;
 	char buf[1024] = { 0 };
 	int fd;
 	int n;
 	size_t bufsiz = sizeof(buf);
 
+	/* once is enough; export_all() asks before starting threads */
+	if (tested >= 0)
+		return tested;
+	tested = 0;
 	fd = open("/proc/net/rpc/auth.unix.ip/channel", O_WRONLY);
 	if (fd < 0)
 		return 0;
@@ -507,6 +596,7 @@ static int can_test(void)
 	if (fd < 0)
 		return 0;
 	close(fd);
+	tested = 1;
 	return 1;
 }
 
@@ -98,6 +98,8 @@ static struct event_base *evbase = NULL;
 
 int upcall_timeout = DEF_UPCALL_TIMEOUT;
 static bool cancel_timed_out_upcalls = false;
+int upcall_threads = DEF_UPCALL_THREADS;
+int upcall_queue_size = DEF_UPCALL_QUEUE;
 
 TAILQ_HEAD(topdir_list_head, topdir) topdir_list;
 
@@ -109,15 +111,34 @@ TAILQ_HEAD(topdir_list_head, topdir) topdir_list;
  * 	protected by the active_thread_list_lock mutex.
  *
  * 	upcall_thread_info structures are added to the tail of the list
- * 	by start_upcall_thread(), so entries closer to the head of the list
+ * 	when a worker thread takes an upcall off the queue (see
+ * 	dequeue_upcall()), so entries closer to the head of the list
  * 	will be closer to hitting the upcall timeout.
  *
- * 	upcall_thread_info structures are removed from the list upon a
- * 	sucessful join of the upcall thread by the watchdog thread (via
- * 	scan_active_thread_list().
+ * 	upcall_thread_info structures are removed from the list by the
+ * 	worker thread when it has finished the upcall, or, if the thread
+ * 	exits, upon a sucessful join of the thread by the watchdog thread
+ * 	(via scan_active_thread_list()).  Workers that exit mark their
+ * 	entry UPCALL_THREAD_EXITING and signal watchdog_cond.
  */
 TAILQ_HEAD(active_thread_list_head, upcall_thread_info) active_thread_list;
 pthread_mutex_t active_thread_list_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t watchdog_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Worker threads the watchdog could not start in place of those that
+ * exited, protected by active_thread_list_lock.  They are tried again
+ * every WORKER_RETRY_SECS until the pool is whole.
+ */
+static int missing_workers;
+#define WORKER_RETRY_SECS	5
+
+/*
+ * Worker threads that started their own replacement before taking on
+ * a user's identity and have not been joined yet, protected by
+ * active_thread_list_lock.  See upcall_worker_replace().
+ */
+int retiring_workers;
 
 struct topdir {
 	TAILQ_ENTRY(topdir) list;
@@ -501,13 +522,17 @@ gssd_clnt_krb5_cb(int UNUSED(fd), short UNUSED(which), void *data)
 /*
  * scan_active_thread_list:
  *
- * Walks the active_thread_list, trying to join as many upcall threads as
- * possible.  For threads that have terminated, the corresponding
- * upcall_thread_info will be removed from the list and freed.  Threads that
+ * Walks the active_thread_list, trying to join as many exited worker
+ * threads as possible.  For threads that have terminated, the
+ * corresponding upcall_thread_info will be removed from the list and
+ * freed, and a new worker thread started in place of each (or retried
+ * on a later pass, if that fails).  Threads that
  * are still busy and have exceeded the upcall_timeout will cause an error to
  * be logged and may be canceled (depending on the value of
  * cancel_timed_out_upcalls).
  *
+ * Called with the active_thread_list_lock held.
+ *
  * Returns the number of seconds that the watchdog thread should wait before
  * calling scan_active_thread_list() again.
  */
@@ -522,21 +547,29 @@ scan_active_thread_list(void)
 	void *tret, *saveprev;
 
 	sleeptime = upcall_timeout;
-	pthread_mutex_lock(&active_thread_list_lock);
 	clock_gettime(CLOCK_MONOTONIC, &now);
 	TAILQ_FOREACH(info, &active_thread_list, list) {
-		err = pthread_tryjoin_np(info->tid, &tret);
+		/* An exiting thread has nothing more to do than exit */
+		if (info->flags & UPCALL_THREAD_EXITING)
+			err = pthread_join(info->tid, &tret);
+		else
+			err = pthread_tryjoin_np(info->tid, &tret);
 		switch (err) {
 		case 0:
 			/*
-			 * The upcall thread has either completed successfully, or
-			 * has been canceled _and_ has acted on the cancellation request
-			 * (i.e. has hit a cancellation point).  We can now remove the
-			 * upcall_thread_info from the list and free it.
+			 * The worker thread has either given up its place in
+			 * the pool, or has been canceled _and_ has acted on the
+			 * cancellation request (i.e. has hit a cancellation
+			 * point).  We can now remove the upcall_thread_info from
+			 * the list and free it, and start a worker in its place.
 			 */
 			if (tret == PTHREAD_CANCELED)
 				printerr(2, "watchdog: thread id 0x%lx cancelled successfully\n",
 						info->tid);
+			if (info->flags & UPCALL_THREAD_REPLACED)
+				retiring_workers--;
+			else
+				missing_workers++;
 			saveprev = info->list.tqe_prev;
 			TAILQ_REMOVE(&active_thread_list, info, list);
 			free(info);
@@ -556,7 +589,12 @@ scan_active_thread_list(void)
 							info->tid);
 					pthread_cancel(info->tid);
 					info->flags |= (UPCALL_THREAD_CANCELED|UPCALL_THREAD_WARNED);
-					do_error_downcall(info->fd, info->uid, -ETIMEDOUT);
+					if (info->upcall)
+						error_downcall_all(info->upcall,
+								   -ETIMEDOUT);
+					else
+						do_error_downcall(info->fd, info->uid,
+								  -ETIMEDOUT);
 				} else {
 					if (!(info->flags & UPCALL_THREAD_WARNED)) {
 						printerr(0, "watchdog: thread id 0x%lx running for %lld seconds\n",
@@ -585,21 +623,57 @@ scan_active_thread_list(void)
 			break;
 		}
 	}
-	pthread_mutex_unlock(&active_thread_list_lock);
+
+	while (missing_workers > 0 && start_upcall_worker() == 0)
+		missing_workers--;
+	if (missing_workers > 0) {
+		printerr(0, "watchdog: %d of %d upcall worker threads missing, "
+			 "retrying in %d seconds\n", missing_workers,
+			 upcall_threads, WORKER_RETRY_SECS);
+		if (sleeptime > WORKER_RETRY_SECS)
+			sleeptime = WORKER_RETRY_SECS;
+	}
 
 	return sleeptime;
 }
 
+static bool
+worker_exiting(void)
+{
+	struct upcall_thread_info *info;
+
+	TAILQ_FOREACH(info, &active_thread_list, list)
+		if (info->flags & UPCALL_THREAD_EXITING)
+			return true;
+	return false;
+}
+
 static void *
 watchdog_thread_fn(void *UNUSED(arg))
 {
 	unsigned int sleeptime;
+	struct timespec wake;
+	int reap;
 
+	pthread_mutex_lock(&active_thread_list_lock);
 	for (;;) {
 		sleeptime = scan_active_thread_list();
+		pthread_mutex_unlock(&active_thread_list_lock);
+		reap = rpc_pool_reap();
+		pthread_mutex_lock(&active_thread_list_lock);
+		if (reap >= 0 && (unsigned int)reap < sleeptime)
+			sleeptime = reap;
 		printerr(4, "watchdog: sleeping %u secs\n", sleeptime);
-		sleep(sleeptime);
+		/* ...or until a worker thread exits */
+		clock_gettime(CLOCK_REALTIME, &wake);
+		wake.tv_sec += sleeptime;
+		while (!worker_exiting() &&
+		       pthread_cond_timedwait(&watchdog_cond,
+					      &active_thread_list_lock,
+					      &wake) == 0)
+			;
 	}
+	pthread_mutex_unlock(&active_thread_list_lock);
 	return (void *)0;
 }
 
@@ -1043,6 +1117,9 @@ read_gss_conf(void)
 	upcall_timeout = conf_get_num("gssd", "upcall-timeout", upcall_timeout);
 	cancel_timed_out_upcalls = conf_get_bool("gssd", "cancel-timed-out-upcalls",
 						cancel_timed_out_upcalls);
+	upcall_threads = conf_get_num("gssd", "upcall-threads", upcall_threads);
+	upcall_queue_size = conf_get_num("gssd", "upcall-queue-size",
+					 upcall_queue_size);
 	s = conf_get_str("gssd", "pipefs-directory");
 	if (!s)
 		s = conf_get_str("general", "pipefs-directory");
@@ -1216,6 +1293,10 @@ main(int argc, char *argv[])
 		upcall_timeout = MAX_UPCALL_TIMEOUT;
 	else if (upcall_timeout < MIN_UPCALL_TIMEOUT)
 		upcall_timeout = MIN_UPCALL_TIMEOUT;
+	if (upcall_threads < 1)
+		upcall_threads = 1;
+	if (upcall_queue_size < 1)
+		upcall_queue_size = 1;
 
 	initerr(progname, verbosity, fg);
 #ifdef HAVE_LIBTIRPC_SET_DEBUG
@@ -1289,6 +1370,17 @@ main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
+	rc = start_upcall_workers();
+	if (rc != 0) {
+		printerr(0, "ERROR: failed to start upcall worker threads: %d\n", rc);
+		exit(EXIT_FAILURE);
+	}
+
+	rc = gssd_start_machine_cred_refresh();
+	if (rc != 0)
+		printerr(0, "WARNING: failed to start machine credential "
+			 "refresh thread: %d\n", rc);
+
 	TAILQ_INIT(&topdir_list);
 	gssd_scan();
 	daemon_ready();
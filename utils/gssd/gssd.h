@@ -56,6 +56,10 @@
 #define DEF_UPCALL_TIMEOUT			30
 #define MAX_UPCALL_TIMEOUT			600
 
+/* upcalls are handled by a pool of worker threads */
+#define DEF_UPCALL_THREADS			32
+#define DEF_UPCALL_QUEUE			1024
+
 /*
  * The gss mechanisms that we can handle
  */
@@ -95,12 +99,19 @@ struct clnt_info {
 };
 
 struct clnt_upcall_info {
+	TAILQ_ENTRY(clnt_upcall_info) list;
+	LIST_ENTRY(clnt_upcall_info) inflight;
+	bool			in_flight;	/* on the in-flight table */
+	int			followers;	/* upcalls merged with this */
+	struct timespec		queued;
 	struct clnt_info 	*clp;
 	uid_t			uid;
 	int			fd;
 	char			*srchost;
 	char			*target;
 	char			*service;
+	char			*enctypes;
+	struct upcall_thread_info *thread;	/* handling it, if any */
 };
 
 struct upcall_thread_info {
@@ -109,9 +120,12 @@ struct upcall_thread_info {
 	struct timespec		timeout;
 	uid_t			uid;
 	int			fd;
+	struct clnt_upcall_info	*upcall;	/* being handled, if any */
 	unsigned short		flags;
 #define UPCALL_THREAD_CANCELED	0x0001
 #define UPCALL_THREAD_WARNED	0x0002
+#define UPCALL_THREAD_EXITING	0x0004
+#define UPCALL_THREAD_REPLACED	0x0008
 };
 
 void handle_krb5_upcall(struct clnt_info *clp);
@@ -119,6 +133,10 @@ void handle_gssd_upcall(struct clnt_info *clp);
 void free_upcall_info(struct clnt_upcall_info *info);
 void gssd_free_client(struct clnt_info *clp);
 int do_error_downcall(int k5_fd, uid_t uid, int err);
+void error_downcall_all(struct clnt_upcall_info *info, int err);
+int start_upcall_workers(void);
+int start_upcall_worker(void);
+int rpc_pool_reap(void);
 
 
 #endif /* _RPC_GSSD_H_ */
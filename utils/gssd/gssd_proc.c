@@ -85,9 +85,104 @@
 
 extern pthread_mutex_t clp_lock;
 extern pthread_mutex_t active_thread_list_lock;
+extern pthread_cond_t watchdog_cond;
+extern int retiring_workers;
 extern int upcall_timeout;
+extern int upcall_threads;
+extern int upcall_queue_size;
 extern TAILQ_HEAD(active_thread_list_head, upcall_thread_info) active_thread_list;
 
+/*
+ * upcall_queue:
+ *
+ * 	upcalls read from the pipes, waiting for a worker thread.
+ *
+ * 	protected by the upcall_queue_lock mutex.  A thread holding it may
+ * 	also take the active_thread_list_lock, but not the other way round.
+ */
+static TAILQ_HEAD(upcall_queue_head, clnt_upcall_info) upcall_queue =
+	TAILQ_HEAD_INITIALIZER(upcall_queue);
+static int upcall_queue_len;
+static bool upcall_queue_warned;
+static pthread_mutex_t upcall_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t upcall_queue_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * upcall_inflight:
+ *
+ * 	upcalls queued or being handled, hashed by pipe and uid, so that
+ * 	an identical one read meanwhile can wait for the same answer
+ * 	rather than be handled again.  See coalesce_upcall().
+ *
+ * 	protected by the upcall_inflight_lock mutex, which may be taken
+ * 	with the upcall_queue_lock or the active_thread_list_lock held.
+ */
+#define UPCALL_INFLIGHT_BUCKETS	64
+static LIST_HEAD(upcall_inflight_head, clnt_upcall_info)
+	upcall_inflight[UPCALL_INFLIGHT_BUCKETS];
+static pthread_mutex_t upcall_inflight_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * rpc_pool:
+ *
+ * 	transports to servers kept open between upcalls, so that an upcall
+ * 	need not connect again.  Each is for one server address and port,
+ * 	program, version, protocol, and for the uid that made it, as root's
+ * 	use a reserved port.  Only the transport is reused; every upcall
+ * 	still establishes a GSS context of its own for the kernel.
+ *
+ * 	most recently used first; protected by the rpc_pool_lock mutex.
+ * 	The watchdog closes those left idle, see rpc_pool_reap().
+ */
+#define RPC_POOL_MAX		64	/* transports kept in all */
+#define RPC_POOL_IDLE		60	/* seconds one is kept unused */
+
+struct rpc_pool_key {
+	struct sockaddr_storage	addr;
+	rpcprog_t		prog;
+	rpcvers_t		vers;
+	int			protocol;
+	uid_t			uid;
+};
+
+struct rpc_pool_ent {
+	TAILQ_ENTRY(rpc_pool_ent) list;
+	struct rpc_pool_key	key;
+	time_t			idle_since;
+	CLIENT			*clnt;
+};
+
+static TAILQ_HEAD(rpc_pool_head, rpc_pool_ent) rpc_pool =
+	TAILQ_HEAD_INITIALIZER(rpc_pool);
+static int rpc_pool_len;
+static pthread_mutex_t rpc_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * port_cache:
+ *
+ * 	ports found with rpcbind by populate_port(), so that every mount
+ * 	of a server does not ask it again.  Kept for PORT_CACHE_TTL
+ * 	seconds, or until connecting to the port fails; protected by the
+ * 	port_cache_lock mutex.
+ */
+#define PORT_CACHE_MAX		64
+#define PORT_CACHE_TTL		300
+
+struct port_cache_ent {
+	TAILQ_ENTRY(port_cache_ent) list;
+	struct sockaddr_storage	addr;
+	rpcprog_t		prog;
+	rpcvers_t		vers;
+	unsigned short		protocol;
+	unsigned short		port;
+	time_t			expires;
+};
+
+static TAILQ_HEAD(port_cache_head, port_cache_ent) port_cache =
+	TAILQ_HEAD_INITIALIZER(port_cache);
+static int port_cache_len;
+static pthread_mutex_t port_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /* Encryption types supported by the kernel rpcsec_gss code */
 int num_krb5_enctypes = 0;
 krb5_enctype *krb5_enctypes = NULL;
@@ -100,6 +195,7 @@ struct cleanup_args  {
 	struct authgss_private_data *pd;
 	AUTH		**auth;
 	CLIENT		**rpc_clnt;
+	struct clnt_info *clp;
 };
 
 /*
@@ -159,10 +255,16 @@ parse_enctypes(char *enctypes)
 	return 0;
 }
 
+/*
+ * do_downcall:
+ *
+ * Hand the kernel the context, once for each of "copies" upcalls that
+ * asked for it.
+ */
 static void
 do_downcall(int k5_fd, uid_t uid, struct authgss_private_data *pd,
 	    gss_buffer_desc *context_token, OM_uint32 lifetime_rec,
-	    gss_buffer_desc *acceptor)
+	    gss_buffer_desc *acceptor, int copies)
 {
 	char    *buf = NULL, *p = NULL, *end = NULL;
 	unsigned int timeout = context_timeout;
@@ -193,6 +295,11 @@ do_downcall(int k5_fd, uid_t uid, struct authgss_private_data *pd,
 	if (write_buffer(&p, end, acceptor)) goto out_err;
 
 	if (write(k5_fd, buf, p - buf) < p - buf) goto out_err;
+	/* The kernel may have answered the others with this one already */
+	while (--copies > 0)
+		if (write(k5_fd, buf, p - buf) < p - buf)
+			printerr(3, "do_downcall(0x%lx): copy not taken: %s\n",
+				 tid, strerror(errno));
 	free(buf);
 	return;
 out_err:
@@ -225,6 +332,110 @@ out_err:
 	return -1;
 }
 
+/*
+ * Do "a" and "b" name the same host, whatever their ports?
+ */
+static bool
+same_host(const struct sockaddr *a, const struct sockaddr *b)
+{
+	if (a->sa_family != b->sa_family)
+		return false;
+	switch (a->sa_family) {
+	case AF_INET:
+		return ((struct sockaddr_in *)a)->sin_addr.s_addr ==
+		       ((struct sockaddr_in *)b)->sin_addr.s_addr;
+#ifdef IPV6_SUPPORTED
+	case AF_INET6:
+		return IN6_ARE_ADDR_EQUAL(&((struct sockaddr_in6 *)a)->sin6_addr,
+					  &((struct sockaddr_in6 *)b)->sin6_addr);
+#endif /* IPV6_SUPPORTED */
+	}
+	return false;
+}
+
+/*
+ * Return the port rpcbind on "sa" gave for the program lately, or 0
+ */
+static unsigned short
+port_cache_find(const struct sockaddr *sa, const rpcprog_t program,
+		const rpcvers_t version, const unsigned short protocol)
+{
+	struct port_cache_ent *e;
+	unsigned short port = 0;
+	time_t now = time(NULL);
+
+	pthread_mutex_lock(&port_cache_lock);
+	TAILQ_FOREACH(e, &port_cache, list)
+		if (e->prog == program && e->vers == version &&
+		    e->protocol == protocol &&
+		    same_host((struct sockaddr *)&e->addr, sa)) {
+			if (e->expires > now)
+				port = e->port;
+			break;
+		}
+	pthread_mutex_unlock(&port_cache_lock);
+	return port;
+}
+
+/*
+ * Forget the port for the program on "sa", as the server may have moved
+ * it; the next populate_port() asks rpcbind again.
+ */
+static void
+port_cache_del(const struct sockaddr *sa, const rpcprog_t program,
+	       const rpcvers_t version, const unsigned short protocol)
+{
+	struct port_cache_ent *e;
+
+	pthread_mutex_lock(&port_cache_lock);
+	TAILQ_FOREACH(e, &port_cache, list)
+		if (e->prog == program && e->vers == version &&
+		    e->protocol == protocol &&
+		    same_host((struct sockaddr *)&e->addr, sa))
+			break;
+	if (e) {
+		TAILQ_REMOVE(&port_cache, e, list);
+		port_cache_len--;
+		free(e);
+	}
+	pthread_mutex_unlock(&port_cache_lock);
+}
+
+static void
+port_cache_add(const struct sockaddr *sa, const socklen_t salen,
+	       const rpcprog_t program, const rpcvers_t version,
+	       const unsigned short protocol, const unsigned short port)
+{
+	struct port_cache_ent *e;
+
+	pthread_mutex_lock(&port_cache_lock);
+	TAILQ_FOREACH(e, &port_cache, list)
+		if (e->prog == program && e->vers == version &&
+		    e->protocol == protocol &&
+		    same_host((struct sockaddr *)&e->addr, sa))
+			break;
+	if (e)
+		TAILQ_REMOVE(&port_cache, e, list);
+	else if (port_cache_len >= PORT_CACHE_MAX) {
+		e = TAILQ_LAST(&port_cache, port_cache_head);
+		TAILQ_REMOVE(&port_cache, e, list);
+	} else {
+		e = calloc(1, sizeof(*e));
+		if (!e)
+			goto out;
+		port_cache_len++;
+	}
+	memcpy(&e->addr, sa, salen);
+	e->prog = program;
+	e->vers = version;
+	e->protocol = protocol;
+	e->port = port;
+	e->expires = time(NULL) + PORT_CACHE_TTL;
+	TAILQ_INSERT_HEAD(&port_cache, e, list);
+out:
+	pthread_mutex_unlock(&port_cache_lock);
+}
+
 /*
  * If the port isn't already set, do an rpcbind query to the remote server
  * using the program and version and get the port.
@@ -233,11 +444,13 @@ out_err:
  * file for the upcall or '0' for NFSv2/3. For NFSv4 it sends the value
  * of the port= option or '2049'. The port field in a new sockaddr should
  * reflect the value that was sent by the kernel.
+ *
+ * "cached" is set if the port was taken from the port_cache.
  */
 static int
 populate_port(struct sockaddr *sa, const socklen_t salen,
 	      const rpcprog_t program, const rpcvers_t version,
-	      const unsigned short protocol)
+	      const unsigned short protocol, bool *cached)
 {
 	struct sockaddr_in	*s4 = (struct sockaddr_in *) sa;
 #ifdef IPV6_SUPPORTED
@@ -245,6 +458,7 @@ populate_port(struct sockaddr *sa, const socklen_t salen,
 #endif /* IPV6_SUPPORTED */
 	unsigned short		port;
 
+	*cached = false;
 	/*
 	 * Newer kernels send the port in the upcall. If we already have
 	 * the port, there's no need to look it up.
@@ -285,12 +499,19 @@ populate_port(struct sockaddr *sa, const socklen_t salen,
 		goto set_port;
 	}
 
+	port = port_cache_find(sa, program, version, protocol);
+	if (port) {
+		*cached = true;
+		goto set_port;
+	}
+
 	port = nfs_getport(sa, salen, program, version, protocol);
 	if (!port) {
 		printerr(0, "ERROR: unable to obtain port for prog %lu "
 			    "vers %lu\n", (long unsigned int)program, (long unsigned int)version);
 		return 0;
 	}
+	port_cache_add(sa, salen, program, version, protocol, port);
 
 set_port:
 	printerr(2, "DEBUG: setting port to %hu for prog %lu vers %lu\n", port,
@@ -310,6 +531,170 @@ set_port:
 	return 1;
 }
 
+static int
+clnt_protocol(struct clnt_info *clp)
+{
+	if ((strcmp(clp->protocol, "udp")) == 0)
+		return IPPROTO_UDP;
+	return IPPROTO_TCP;
+}
+
+static socklen_t
+clnt_addrlen(struct clnt_info *clp)
+{
+	switch (((struct sockaddr *)&clp->addr)->sa_family) {
+	case AF_INET:
+		return sizeof(struct sockaddr_in);
+#ifdef IPV6_SUPPORTED
+	case AF_INET6:
+		return sizeof(struct sockaddr_in6);
+#endif /* IPV6_SUPPORTED */
+	}
+	return 0;
+}
+
+/*
+ * The rpc_pool key for a transport to clp's server, made by this thread
+ */
+static void
+rpc_pool_key(struct clnt_info *clp, struct rpc_pool_key *key)
+{
+	memset(key, 0, sizeof(*key));
+	memcpy(&key->addr, &clp->addr, clnt_addrlen(clp));
+	key->prog = clp->prog;
+	key->vers = clp->vers;
+	key->protocol = clnt_protocol(clp);
+	key->uid = geteuid();
+}
+
+/*
+ * Has the server closed the connection, or sent something unasked?
+ */
+static bool
+rpc_pool_stale(CLIENT *clnt, int protocol)
+{
+	struct pollfd pfd = { .events = POLLIN | POLLRDHUP };
+
+	if (protocol != IPPROTO_TCP)
+		return false;
+	if (!clnt_control(clnt, CLGET_FD, (char *)&pfd.fd))
+		return true;
+	return poll(&pfd, 1, 0) != 0;
+}
+
+/*
+ * Take a transport to clp's server from the pool, or return NULL
+ */
+static CLIENT *
+rpc_pool_get(struct clnt_info *clp)
+{
+	TAILQ_HEAD(, rpc_pool_ent) old = TAILQ_HEAD_INITIALIZER(old);
+	struct rpc_pool_ent *e, *next;
+	struct rpc_pool_key key;
+	CLIENT *clnt = NULL;
+	time_t now = time(NULL);
+
+	rpc_pool_key(clp, &key);
+	pthread_mutex_lock(&rpc_pool_lock);
+	for (e = TAILQ_FIRST(&rpc_pool); e; e = next) {
+		next = TAILQ_NEXT(e, list);
+		if (now - e->idle_since >= RPC_POOL_IDLE ||
+		    (!clnt && memcmp(&e->key, &key, sizeof(key)) == 0)) {
+			TAILQ_REMOVE(&rpc_pool, e, list);
+			rpc_pool_len--;
+			if (!clnt && now - e->idle_since < RPC_POOL_IDLE) {
+				clnt = e->clnt;
+				free(e);
+			} else
+				TAILQ_INSERT_TAIL(&old, e, list);
+		}
+	}
+	pthread_mutex_unlock(&rpc_pool_lock);
+
+	while ((e = TAILQ_FIRST(&old)) != NULL) {
+		TAILQ_REMOVE(&old, e, list);
+		clnt_destroy(e->clnt);
+		free(e);
+	}
+	if (clnt && rpc_pool_stale(clnt, key.protocol)) {
+		printerr(3, "%s: connection to %s was closed\n", __func__,
+			 clp->servername);
+		clnt_destroy(clnt);
+		clnt = NULL;
+	}
+	return clnt;
+}
+
+/*
+ * Close the transports that have been idle too long, without waiting
+ * for an upcall to come across them.  Returns the number of seconds
+ * until the next one is due, or -1 if the pool is empty.
+ */
+int
+rpc_pool_reap(void)
+{
+	TAILQ_HEAD(, rpc_pool_ent) old = TAILQ_HEAD_INITIALIZER(old);
+	struct rpc_pool_ent *e;
+	time_t now = time(NULL);
+	int next = -1;
+
+	pthread_mutex_lock(&rpc_pool_lock);
+	/* Least recently used last */
+	while ((e = TAILQ_LAST(&rpc_pool, rpc_pool_head)) != NULL &&
+	       now - e->idle_since >= RPC_POOL_IDLE) {
+		TAILQ_REMOVE(&rpc_pool, e, list);
+		rpc_pool_len--;
+		TAILQ_INSERT_TAIL(&old, e, list);
+	}
+	if (e)
+		next = e->idle_since + RPC_POOL_IDLE - now;
+	pthread_mutex_unlock(&rpc_pool_lock);
+
+	while ((e = TAILQ_FIRST(&old)) != NULL) {
+		TAILQ_REMOVE(&old, e, list);
+		printerr(3, "%s: closing idle transport\n", __func__);
+		clnt_destroy(e->clnt);
+		free(e);
+	}
+	return next;
+}
+
+/*
+ * Give back a transport to clp's server once the upcall is done with it
+ */
+static void
+rpc_pool_put(struct clnt_info *clp, CLIENT *clnt)
+{
+	struct rpc_pool_ent *e;
+
+	e = malloc(sizeof(*e));
+	if (!e || !clnt_addrlen(clp)) {
+		free(e);
+		clnt_destroy(clnt);
+		return;
+	}
+	/* The upcall's AUTH is gone */
+	clnt->cl_auth = authnone_create();
+	rpc_pool_key(clp, &e->key);
+	e->idle_since = time(NULL);
+	e->clnt = clnt;
+
+	pthread_mutex_lock(&rpc_pool_lock);
+	TAILQ_INSERT_HEAD(&rpc_pool, e, list);
+	if (++rpc_pool_len > RPC_POOL_MAX) {
+		e = TAILQ_LAST(&rpc_pool, rpc_pool_head);
+		TAILQ_REMOVE(&rpc_pool, e, list);
+		rpc_pool_len--;
+	} else
+		e = NULL;
+	pthread_mutex_unlock(&rpc_pool_lock);
+
+	if (e) {
+		clnt_destroy(e->clnt);
+		free(e);
+	}
+}
+
 /*
  * Create an RPC connection and establish an authenticated
  * gss context with a server.
@@ -331,8 +716,10 @@ create_auth_rpc_client(struct clnt_info *clp,
 	char			rpc_errmsg[1024];
 	int			protocol;
 	struct timeval	timeout;
-	struct sockaddr		*addr = (struct sockaddr *) &clp->addr;
+	struct sockaddr_storage	ss;
+	struct sockaddr		*addr = (struct sockaddr *) &ss;
 	socklen_t		salen;
+	bool			port_cached;
 #ifdef HAVE_TIRPC_GSS_SECCREATE
 	rpc_gss_options_req_t	req;
 	rpc_gss_options_ret_t	ret;
@@ -375,34 +762,41 @@ create_auth_rpc_client(struct clnt_info *clp,
 	printerr(3, "create_auth_rpc_client(0x%lx): creating %s client for server %s\n", 
 		tid, clp->protocol, clp->servername);
 
-	protocol = IPPROTO_TCP;
-	if ((strcmp(clp->protocol, "udp")) == 0)
-		protocol = IPPROTO_UDP;
-
-	switch (addr->sa_family) {
-	case AF_INET:
-		salen = sizeof(struct sockaddr_in);
-		break;
-#ifdef IPV6_SUPPORTED
-	case AF_INET6:
-		salen = sizeof(struct sockaddr_in6);
-		break;
-#endif /* IPV6_SUPPORTED */
-	default:
+	protocol = clnt_protocol(clp);
+	/*
+	 * Fill in the port on a copy: clp is shared with other upcalls, and
+	 * a port that stops working must not stick to it
+	 */
+	memcpy(&ss, &clp->addr, sizeof(ss));
+	salen = clnt_addrlen(clp);
+	if (!salen) {
 		printerr(1, "ERROR: Unknown address family %d\n",
 			 addr->sa_family);
 		goto out_fail;
 	}
 
-	if (!populate_port(addr, salen, clp->prog, clp->vers, protocol))
+	if (!populate_port(addr, salen, clp->prog, clp->vers, protocol,
+			   &port_cached))
 		goto out_fail;
 
 	/* set the timeout according to the requested valued */
 	timeout.tv_sec = (long) rpc_timeout;
 	timeout.tv_usec = (long) 0;
 
-	rpc_clnt = nfs_get_rpcclient(addr, salen, protocol, clp->prog,
-				     clp->vers, &timeout);
+	rpc_clnt = rpc_pool_get(clp);
+	if (!rpc_clnt)
+		rpc_clnt = nfs_get_rpcclient(addr, salen, protocol, clp->prog,
+					     clp->vers, &timeout);
+	if (!rpc_clnt && port_cached) {
+		/* The server may have moved the service; ask rpcbind again */
+		port_cache_del(addr, clp->prog, clp->vers, protocol);
+		memcpy(&ss, &clp->addr, sizeof(ss));
+		if (populate_port(addr, salen, clp->prog, clp->vers, protocol,
+				  &port_cached))
+			rpc_clnt = nfs_get_rpcclient(addr, salen, protocol,
+						     clp->prog, clp->vers,
+						     &timeout);
+	}
 	if (!rpc_clnt) {
 		snprintf(rpc_errmsg, sizeof(rpc_errmsg),
 			 "WARNING: can't create %s rpc_clnt to server %s for "
@@ -450,6 +844,9 @@ create_auth_rpc_client(struct clnt_info *clp,
 		printerr(2, "WARNING: Failed to create krb5 context for "
 			    "user with uid %d for server %s\n",
 			 uid, tgtname);
+		/* It may have been the connection that failed */
+		if (port_cached)
+			port_cache_del(addr, clp->prog, clp->vers, protocol);
 		goto out_fail;
 	}
 #ifdef HAVE_TIRPC_GSS_SECCREATE
@@ -698,8 +1095,113 @@ cleanup_handler(void *arg)
 #endif
 	if (*args->auth)
 		AUTH_DESTROY(*args->auth);
+	/*
+	 * Cancellation only happens between RPCs, so even then the
+	 * transport is fit to be used again
+	 */
 	if (*args->rpc_clnt)
-		clnt_destroy(*args->rpc_clnt);
+		rpc_pool_put(args->clp, *args->rpc_clnt);
+}
+
+/*
+ * upcall_changes_identity:
+ *
+ * Will process_krb5_upcall() take on the identity of the user?  It
+ * cannot be given back, so the thread must not be used for another
+ * upcall afterwards.
+ */
+static bool
+upcall_changes_identity(struct clnt_upcall_info *info)
+{
+	return info->uid != 0 || (root_uses_machine_creds == 0 &&
+				  info->service == NULL);
+}
+
+static bool
+same_str(const char *a, const char *b)
+{
+	return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+static struct upcall_inflight_head *
+upcall_inflight_bucket(struct clnt_upcall_info *info)
+{
+	return &upcall_inflight[(info->uid * 31 + info->fd) %
+				UPCALL_INFLIGHT_BUCKETS];
+}
+
+/*
+ * coalesce_upcall:
+ *
+ * Returns true if an upcall just like "info", from the same pipe, is
+ * queued or being handled already; the answer to it will be copied for
+ * "info" too.  Otherwise "info" goes on the in-flight table, and false
+ * is returned.
+ *
+ * Upcalls from different pipes are never merged: each belongs to its
+ * own RPC client, and two clients must not share a context, as their
+ * sequence numbers would collide at the server.
+ */
+static bool
+coalesce_upcall(struct clnt_upcall_info *info)
+{
+	struct upcall_inflight_head *bucket = upcall_inflight_bucket(info);
+	struct clnt_upcall_info *leader;
+
+	pthread_mutex_lock(&upcall_inflight_lock);
+	LIST_FOREACH(leader, bucket, inflight)
+		if (leader->clp == info->clp && leader->fd == info->fd &&
+		    leader->uid == info->uid &&
+		    same_str(leader->srchost, info->srchost) &&
+		    same_str(leader->target, info->target) &&
+		    same_str(leader->service, info->service) &&
+		    same_str(leader->enctypes, info->enctypes)) {
+			leader->followers++;
+			pthread_mutex_unlock(&upcall_inflight_lock);
+			printerr(2, "%s: uid %d upcall merged with one in "
+				 "progress\n", __func__, info->uid);
+			return true;
+		}
+	LIST_INSERT_HEAD(bucket, info, inflight);
+	info->in_flight = true;
+	pthread_mutex_unlock(&upcall_inflight_lock);
+	return false;
+}
+
+/*
+ * end_coalesced_upcall:
+ *
+ * Take "info" off the in-flight table, and return the number of upcalls
+ * that were merged with it.  Any that come later are handled afresh.
+ */
+static int
+end_coalesced_upcall(struct clnt_upcall_info *info)
+{
+	int followers = 0;
+
+	pthread_mutex_lock(&upcall_inflight_lock);
+	if (info->in_flight) {
+		LIST_REMOVE(info, inflight);
+		info->in_flight = false;
+		followers = info->followers;
+	}
+	pthread_mutex_unlock(&upcall_inflight_lock);
+	return followers;
+}
+
+/*
+ * error_downcall_all:
+ *
+ * Answer "info" and every upcall merged with it with "err".  Also used
+ * by the watchdog for the upcall of a worker thread it cancels.
+ */
+void
+error_downcall_all(struct clnt_upcall_info *info, int err)
+{
+	int copies = 1 + end_coalesced_upcall(info);
+
+	while (copies-- > 0)
+		do_error_downcall(info->fd, info->uid, err);
 }
 
 /*
@@ -730,7 +1232,8 @@ process_krb5_upcall(struct clnt_upcall_info *info)
 	gss_name_t		gacceptor = GSS_C_NO_NAME;
 	gss_OID			mech;
 	gss_buffer_desc		acceptor  = {0};
-	struct cleanup_args cleanup_args = {&min_stat, &acceptor, &token, &pd, &auth, &rpc_clnt};
+	struct cleanup_args cleanup_args = {&min_stat, &acceptor, &token, &pd,
+					    &auth, &rpc_clnt, clp};
 
 	token.length = 0;
 	token.value = NULL;
@@ -760,8 +1263,7 @@ process_krb5_upcall(struct clnt_upcall_info *info)
 	 */
 	downcall_err = -EACCES;
 	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	if (uid != 0 || (uid == 0 && root_uses_machine_creds == 0 &&
-				service == NULL)) {
+	if (upcall_changes_identity(info)) {
 
 		auth = krb5_not_machine_creds(clp, uid, tgtname, &downcall_err,
 						&err, &rpc_clnt);
@@ -824,7 +1326,8 @@ process_krb5_upcall(struct clnt_upcall_info *info)
 	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 	pthread_testcancel();
 
-	do_downcall(fd, uid, &pd, &token, lifetime_rec, &acceptor);
+	do_downcall(fd, uid, &pd, &token, lifetime_rec, &acceptor,
+		    1 + end_coalesced_upcall(info));
 
 out:
 	pthread_cleanup_pop(1);
@@ -835,13 +1338,13 @@ out_return_error:
 	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 	pthread_testcancel();
 
-	do_error_downcall(fd, uid, downcall_err);
+	error_downcall_all(info, downcall_err);
 	goto out;
 }
 
 static struct clnt_upcall_info *
 alloc_upcall_info(struct clnt_info *clp, uid_t uid, int fd, char *srchost,
-		  char *target, char *service)
+		  char *target, char *service, char *enctypes)
 {
 	struct clnt_upcall_info *info;
 
@@ -871,10 +1374,18 @@ alloc_upcall_info(struct clnt_info *clp, uid_t uid, int fd, char *srchost,
 		if (info->service == NULL)
 			goto out_target;
 	}
+	if (enctypes) {
+		info->enctypes = strdup(enctypes);
+		if (info->enctypes == NULL)
+			goto out_service;
+	}
 
 out:
 	return info;
 
+out_service:
+	if (info->service)
+		free(info->service);
 out_target:
 	if (info->target)
 		free(info->target);
@@ -889,7 +1400,17 @@ out_info:
 
 void free_upcall_info(struct clnt_upcall_info *info)
 {
+	if (info->thread) {
+		/* The watchdog must not answer it any more */
+		pthread_mutex_lock(&active_thread_list_lock);
+		info->thread->upcall = NULL;
+		pthread_mutex_unlock(&active_thread_list_lock);
+	}
+	/* It has been answered, along with those merged with it */
+	end_coalesced_upcall(info);
 	gssd_free_client(info->clp);
+	if (info->enctypes)
+		free(info->enctypes);
 	if (info->service)
 		free(info->service);
 	if (info->target)
@@ -927,47 +1448,234 @@ alloc_upcall_thread_info(void)
 	return info;
 }
 
+/*
+ * queue_upcall:
+ *
+ * Hand an upcall to the worker threads, unless it can share the answer
+ * to one already in progress.  When upcall_queue_size upcalls are
+ * already waiting for a thread, -EAGAIN is returned instead, and the
+ * caller answers the kernel with an error right away.
+ */
 static int
-start_upcall_thread(void (*func)(struct clnt_upcall_info *), struct clnt_upcall_info *info)
+queue_upcall(struct clnt_upcall_info *info)
 {
-	pthread_attr_t attr;
-	pthread_t th;
-	struct upcall_thread_info *tinfo;
-	int ret;
-	pthread_t tid = pthread_self();
+	pthread_mutex_lock(&upcall_queue_lock);
+	if (coalesce_upcall(info)) {
+		pthread_mutex_unlock(&upcall_queue_lock);
+		free_upcall_info(info);
+		return 0;
+	}
+	if (upcall_queue_len >= upcall_queue_size) {
+		if (!upcall_queue_warned)
+			printerr(0, "WARNING: %d upcalls are waiting for a "
+				 "worker thread; refusing more\n",
+				 upcall_queue_len);
+		upcall_queue_warned = true;
+		/* Nothing can have been merged with it yet */
+		end_coalesced_upcall(info);
+		pthread_mutex_unlock(&upcall_queue_lock);
+		return -EAGAIN;
+	}
+	upcall_queue_warned = false;
+	clock_gettime(CLOCK_MONOTONIC, &info->queued);
+	TAILQ_INSERT_TAIL(&upcall_queue, info, list);
+	upcall_queue_len++;
+	pthread_cond_signal(&upcall_queue_cond);
+	pthread_mutex_unlock(&upcall_queue_lock);
+	return 0;
+}
 
+/*
+ * dequeue_upcall:
+ *
+ * Wait for the next upcall, and add the calling worker thread to the
+ * active_thread_list for the watchdog.  An upcall's time runs from when
+ * it was queued, so one that has waited for upcall_timeout seconds
+ * already is answered with an error here, and NULL is returned.
+ *
+ * The upcall is taken off the queue and put on the list under the same
+ * lock, so the list stays in timeout order.
+ */
+static struct clnt_upcall_info *
+dequeue_upcall(struct upcall_thread_info **tinfop)
+{
+	struct clnt_upcall_info *info;
+	struct upcall_thread_info *tinfo;
+	struct timespec now;
+	int err = -ETIMEDOUT;
+
+	pthread_mutex_lock(&upcall_queue_lock);
+	while (TAILQ_EMPTY(&upcall_queue))
+		pthread_cond_wait(&upcall_queue_cond, &upcall_queue_lock);
+	info = TAILQ_FIRST(&upcall_queue);
+	TAILQ_REMOVE(&upcall_queue, info, list);
+	upcall_queue_len--;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec >= info->queued.tv_sec + upcall_timeout)
+		goto out_error;
 	tinfo = alloc_upcall_thread_info();
-	if (!tinfo)
-		return -ENOMEM;
+	if (!tinfo) {
+		err = -EACCES;
+		goto out_error;
+	}
+	tinfo->tid = pthread_self();
 	tinfo->fd = info->fd;
 	tinfo->uid = info->uid;
+	tinfo->upcall = info;
+	info->thread = tinfo;
+	tinfo->timeout = info->queued;
+	tinfo->timeout.tv_sec += upcall_timeout;
+
+	pthread_mutex_lock(&active_thread_list_lock);
+	TAILQ_INSERT_TAIL(&active_thread_list, tinfo, list);
+	pthread_mutex_unlock(&active_thread_list_lock);
+	pthread_mutex_unlock(&upcall_queue_lock);
+
+	*tinfop = tinfo;
+	return info;
+
+out_error:
+	pthread_mutex_unlock(&upcall_queue_lock);
+	if (err == -ETIMEDOUT)
+		printerr(0, "WARNING: upcall for uid %d waited %lld seconds "
+			 "for a worker thread\n", info->uid,
+			 (long long)(now.tv_sec - info->queued.tv_sec));
+	error_downcall_all(info, err);
+	free_upcall_info(info);
+	return NULL;
+}
+
+/*
+ * upcall_worker_exit:
+ *
+ * Leave the worker's entry on the active_thread_list for the watchdog,
+ * which joins the thread and starts another in its place.
+ *
+ * Runs when a worker thread is done with upcalls, and also as a cleanup
+ * handler when it is canceled.
+ */
+static void
+upcall_worker_exit(void *arg)
+{
+	struct upcall_thread_info *tinfo = arg;
+
+	pthread_mutex_lock(&active_thread_list_lock);
+	tinfo->flags |= UPCALL_THREAD_EXITING;
+	pthread_cond_signal(&watchdog_cond);
+	pthread_mutex_unlock(&active_thread_list_lock);
+}
+
+/*
+ * upcall_worker_replace:
+ *
+ * Start the worker that takes this one's place while this one still
+ * has gssd's own credentials, rather than leave the pool short until
+ * the watchdog has joined it.  At most upcall_threads workers can be
+ * on their last upcall like that, so the number of threads stays
+ * bounded; beyond that the watchdog replaces them as they exit.
+ */
+static void
+upcall_worker_replace(struct upcall_thread_info *tinfo)
+{
+	pthread_mutex_lock(&active_thread_list_lock);
+	if (retiring_workers < upcall_threads && start_upcall_worker() == 0) {
+		tinfo->flags |= UPCALL_THREAD_REPLACED;
+		retiring_workers++;
+	}
+	pthread_mutex_unlock(&active_thread_list_lock);
+}
+
+/*
+ * upcall_worker_fn:
+ *
+ * Handle upcalls until one takes on a user's identity, or is canceled
+ * by the watchdog.  Outside of process_krb5_upcall() the thread cannot
+ * be canceled.
+ */
+static void *
+upcall_worker_fn(void *UNUSED(arg))
+{
+	struct clnt_upcall_info *info;
+	struct upcall_thread_info *tinfo = NULL;
+	bool done = false;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	while (!done) {
+		info = dequeue_upcall(&tinfo);
+		if (!info)
+			continue;
+		done = upcall_changes_identity(info);
+		if (done)
+			upcall_worker_replace(tinfo);
+
+		pthread_cleanup_push(upcall_worker_exit, tinfo);
+		gssd_work_thread_fn(info);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		pthread_cleanup_pop(0);
+
+		pthread_mutex_lock(&active_thread_list_lock);
+		/* A cancel that came too late to act on is still pending */
+		if (tinfo->flags & UPCALL_THREAD_CANCELED)
+			done = true;
+		if (!done) {
+			TAILQ_REMOVE(&active_thread_list, tinfo, list);
+			free(tinfo);
+		}
+		pthread_mutex_unlock(&active_thread_list_lock);
+	}
+	upcall_worker_exit(tinfo);
+	return NULL;
+}
+
+/*
+ * start_upcall_worker:
+ *
+ * Start one worker thread.  Each takes on the credentials of the thread
+ * that starts it, so this must only be called from threads that still
+ * have gssd's own: the main thread, the watchdog, and a worker that has
+ * yet to take on a user's identity.
+ */
+int
+start_upcall_worker(void)
+{
+	pthread_attr_t attr;
+	pthread_t th;
+	int ret;
 
 	ret = pthread_attr_init(&attr);
 	if (ret != 0) {
 		printerr(0, "ERROR: failed to init pthread attr: ret %d: %s\n",
 			 ret, strerror(errno));
-		free(tinfo);
 		return ret;
 	}
 
-	ret = pthread_create(&th, &attr, (void *)func, (void *)info);
+	ret = pthread_create(&th, &attr, upcall_worker_fn, NULL);
 	if (ret != 0) {
 		printerr(0, "ERROR: pthread_create failed: ret %d: %s\n",
 			 ret, strerror(errno));
-		free(tinfo);
 		return ret;
 	}
-	printerr(2, "start_upcall_thread(0x%lx): created thread id 0x%lx\n", 
-		tid, th);
+	printerr(2, "start_upcall_worker: created thread id 0x%lx\n", th);
+	return 0;
+}
 
-	tinfo->tid = th;
-	pthread_mutex_lock(&active_thread_list_lock);
-	clock_gettime(CLOCK_MONOTONIC, &tinfo->timeout);
-	tinfo->timeout.tv_sec += upcall_timeout;
-	TAILQ_INSERT_TAIL(&active_thread_list, tinfo, list);
-	pthread_mutex_unlock(&active_thread_list_lock);
+/*
+ * start_upcall_workers:
+ *
+ * Start the pool of upcall_threads worker threads.
+ */
+int
+start_upcall_workers(void)
+{
+	int i, ret;
 
-	return ret;
+	for (i = 0; i < upcall_threads; i++) {
+		ret = start_upcall_worker();
+		if (ret != 0)
+			return ret;
+	}
+	return 0;
 }
 
 void
@@ -984,15 +1692,15 @@ handle_krb5_upcall(struct clnt_info *clp)
 	}
 	printerr(2, "\n%s: uid %d (%s)\n", __func__, uid, clp->relpath);
 
-	info = alloc_upcall_info(clp, uid, clp->krb5_fd, NULL, NULL, NULL);
+	info = alloc_upcall_info(clp, uid, clp->krb5_fd, NULL, NULL, NULL, NULL);
 	if (info == NULL) {
 		printerr(0, "%s: failed to allocate clnt_upcall_info\n", __func__);
 		do_error_downcall(clp->krb5_fd, uid, -EACCES);
 		return;
 	}
-	err = start_upcall_thread(gssd_work_thread_fn, info);
+	err = queue_upcall(info);
 	if (err != 0) {
-		do_error_downcall(clp->krb5_fd, uid, -EACCES);
+		do_error_downcall(clp->krb5_fd, uid, err);
 		free_upcall_info(info);
 	}
 }
@@ -1089,15 +1797,16 @@ handle_gssd_upcall(struct clnt_info *clp)
 	}
 
 	if (strcmp(mech, "krb5") == 0 && clp->servername) {
-		info = alloc_upcall_info(clp, uid, clp->gssd_fd, srchost, target, service);
+		info = alloc_upcall_info(clp, uid, clp->gssd_fd, srchost, target,
+					 service, enctypes);
 		if (info == NULL) {
 			printerr(0, "%s: failed to allocate clnt_upcall_info\n", __func__);
 			do_error_downcall(clp->gssd_fd, uid, -EACCES);
 			return;
 		}
-		err = start_upcall_thread(gssd_work_thread_fn, info);
+		err = queue_upcall(info);
 		if (err != 0) {
-			do_error_downcall(clp->gssd_fd, uid, -EACCES);
+			do_error_downcall(clp->gssd_fd, uid, err);
 			free_upcall_info(info);
 		}
 	} else {
@@ -102,6 +102,7 @@
 #include <sys/param.h>
 #include <rpc/rpc.h>
 #include <sys/stat.h>
+#include <sys/inotify.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 
@@ -138,21 +139,56 @@
  */
 struct gssd_k5_kt_princ {
 	struct gssd_k5_kt_princ *next;
-	// Only protect against deletion, not modification
+	// In ple_hash[], by unparsed principal name
+	struct gssd_k5_kt_princ *hash_next;
+	// Only protect against deletion, not modification; atomic
 	int refcount;
 	// Only set during creation in new_ple()
 	krb5_principal princ;
 	char *realm;
+	// Protects the fields below; held while getting a TGT
+	pthread_mutex_t lock;
 	// Modified during usage by gssd_get_single_krb5_cred()
 	char *ccname;
 	krb5_timestamp endtime;
+	// Asked for since the TGT was got; see machine_cred_refresh_fn()
+	bool used;
 };
 
+#define PLE_HASH_SIZE	64
 
 /* Global list of principals/cache file names for machine credentials */
 static struct gssd_k5_kt_princ *gssd_k5_kt_princ_list = NULL;
-/* This mutex protects list modification & ple->ccname */
-static pthread_mutex_t ple_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct gssd_k5_kt_princ *ple_hash[PLE_HASH_SIZE];
+/* This lock protects the list and hash; lookups take it shared */
+static pthread_rwlock_t ple_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/*
+ * The principal find_keytab_entry() chose for each host, service and
+ * source host seen, so that machine credential upcalls need not read
+ * the keytab again.  Each holds a reference to its ple.  All of them
+ * are forgotten when the keytab file changes.
+ */
+#define KT_CHOICE_HASH_SIZE	256
+
+struct kt_choice {
+	struct kt_choice	*next;
+	struct gssd_k5_kt_princ	*ple;
+	char			key[];
+};
+
+static pthread_mutex_t kt_choice_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct kt_choice *kt_choices[KT_CHOICE_HASH_SIZE];
+/* The keytab file the choices were made from */
+static struct stat kt_choice_stat;
+
+/*
+ * Machine TGTs that have been used are got again this long before
+ * they would be thought too old to use, every MACHINE_CRED_REFRESH_POLL
+ * seconds.
+ */
+#define MACHINE_CRED_REFRESH_AHEAD	600
+#define MACHINE_CRED_REFRESH_POLL	60
 
 #ifdef HAVE_SET_ALLOWABLE_ENCTYPES
 int limit_to_legacy_enctypes = 0;
@@ -166,34 +202,42 @@ int num_allowed_enctypes = 0;
 
 static int select_krb5_ccache(const struct dirent *d);
 static int gssd_find_existing_krb5_ccache(uid_t uid, char *dirname,
-		const char **cctype, struct dirent **d);
+		const char **cctype, char **ccname);
 static int gssd_get_single_krb5_cred(krb5_context context,
 		krb5_keytab kt, struct gssd_k5_kt_princ *ple, int force_renew,
 		krb5_ccache ccache);
 static int query_krb5_ccache(const char* cred_cache, char **ret_princname,
-		char **ret_realm);
+		char **ret_realm, time_t *ret_endtime);
+
+static void get_ple(struct gssd_k5_kt_princ *ple)
+{
+	__atomic_add_fetch(&ple->refcount, 1, __ATOMIC_RELAXED);
+}
 
-static void release_ple_locked(krb5_context context,
-			       struct gssd_k5_kt_princ *ple)
+/*
+ * "context" may be NULL; one is made if the last reference goes,
+ * which only happens once the ple is off the list.
+ */
+static void release_ple(krb5_context context, struct gssd_k5_kt_princ *ple)
 {
-	if (--ple->refcount)
+	krb5_context ctx = context;
+
+	if (__atomic_sub_fetch(&ple->refcount, 1, __ATOMIC_ACQ_REL))
 		return;
 
 	printerr(3, "freeing cached principal (ccname=%s, realm=%s)\n",
 		 ple->ccname, ple->realm);
-	krb5_free_principal(context, ple->princ);
+	if (ctx || krb5_init_context(&ctx) == 0) {
+		krb5_free_principal(ctx, ple->princ);
+		if (!context)
+			krb5_free_context(ctx);
+	}
+	pthread_mutex_destroy(&ple->lock);
 	free(ple->ccname);
 	free(ple->realm);
 	free(ple);
 }
 
-static void release_ple(krb5_context context, struct gssd_k5_kt_princ *ple)
-{
-	pthread_mutex_lock(&ple_lock);
-	release_ple_locked(context, ple);
-	pthread_mutex_unlock(&ple_lock);
-}
-
 
 /*
  * Called from the scandir function to weed out potential krb5
@@ -222,14 +266,14 @@ select_krb5_ccache(const struct dirent *d)
  * are Kerberos Credential Cache files for a given UID.
  *
  * Returns 0 if a valid-looking entry is found.  "*cctype" is
- * set to the name of the cache type.  A pointer to the dirent
- * is planted in "*d".  Caller must free "*d" with free(3).
+ * set to the name of the cache type.  The name of the file
+ * is planted in "*ccname".  Caller must free "*ccname" with free(3).
  *
  * Otherwise, a negative errno is returned.
  */
 static int
-gssd_find_existing_krb5_ccache(uid_t uid, char *dirname,
-			       const char **cctype, struct dirent **d)
+gssd_scan_krb5_ccache(uid_t uid, char *dirname,
+		      const char **cctype, char **ccname)
 {
 	struct dirent **namelist;
 	int n;
@@ -245,7 +289,7 @@ gssd_find_existing_krb5_ccache(uid_t uid, char *dirname,
 
 	memset(&best_match_stat, 0, sizeof(best_match_stat));
 	*cctype = NULL;
-	*d = NULL;
+	*ccname = NULL;
 	n = scandir(dirname, &namelist, select_krb5_ccache, 0);
 	if (n < 0) {
 		printerr(1, "Error doing scandir on directory '%s': %s\n",
@@ -294,7 +338,7 @@ gssd_find_existing_krb5_ccache(uid_t uid, char *dirname,
 			}
 			snprintf(buf, sizeof(buf), "%s:%s/%s", *cctype,
 				 dirname, namelist[i]->d_name);
-			if (!query_krb5_ccache(buf, &princname, &realm)) {
+			if (!query_krb5_ccache(buf, &princname, &realm, NULL)) {
 				printerr(3, "CC '%s' is expired or corrupt\n",
 					 buf);
 				free(namelist[i]);
@@ -356,10 +400,478 @@ gssd_find_existing_krb5_ccache(uid_t uid, char *dirname,
 		free(namelist);
 	}
 	if (found) {
-		*d = best_match_dir;
-		return 0;
+		*ccname = strdup(best_match_dir->d_name);
+		free(best_match_dir);
+		return *ccname ? 0 : -ENOMEM;
+	}
+
+	return err;
+}
+
+/*
+ * Index of the credentials cache files in the ccache directories, kept
+ * up to date with inotify, so that finding a user's caches does not
+ * mean reading and stat'ing every file in a busy /tmp.  A directory is
+ * read once, the first time it is searched; after that, the changes
+ * queued on the inotify fd are applied before each search.  What a
+ * cache holds (principal, realm, TGT expiry) is read the first time it
+ * is considered for its owner, and again only once the file changes.
+ * DIR type caches are always read, as files inside them can change
+ * without notice.  The watched directories are hashed both by path,
+ * for searches, and by watch descriptor, for events.
+ *
+ * A directory that cannot be watched is searched with
+ * gssd_scan_krb5_ccache() instead.
+ */
+#define CCACHE_HASH_SIZE	1024
+#define CCACHE_DIR_HASH_SIZE	64
+#define CCACHE_WATCH_MASK	(IN_CREATE | IN_DELETE | \
+				 IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_FROM | \
+				 IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+struct ccache_dir {
+	struct ccache_dir	*path_next;	/* in ccache_dir_by_path[] */
+	struct ccache_dir	*wd_next;	/* in ccache_dir_by_wd[] */
+	char			*path;
+	int			wd;
+};
+
+struct ccache_ent {
+	struct ccache_ent	*uid_next;	/* in ccache_by_uid[] */
+	struct ccache_ent	*name_next;	/* in ccache_by_name[] */
+	struct ccache_dir	*dir;
+	uid_t			uid;
+	const char		*cctype;	/* "FILE", "DIR", or NULL */
+	time_t			mtime;
+	unsigned long		gen;		/* changes when the file does */
+	bool			valid;		/* princname...endtime are current */
+	char			*princname;
+	char			*realm;
+	time_t			endtime;	/* of the TGT, 0 if none */
+	char			name[];
+};
+
+/* A copy of an entry, taken to read the cache without ccache_lock held */
+struct ccache_cand {
+	char			*name;
+	const char		*cctype;
+	time_t			mtime;
+	unsigned long		gen;
+	bool			valid;
+	bool			queried;
+	char			*princname;
+	char			*realm;
+	time_t			endtime;
+};
+
+/* Protects everything below */
+static pthread_mutex_t ccache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ccache_dir *ccache_dir_by_path[CCACHE_DIR_HASH_SIZE];
+static struct ccache_dir *ccache_dir_by_wd[CCACHE_DIR_HASH_SIZE];
+static struct ccache_ent *ccache_by_uid[CCACHE_HASH_SIZE];
+static struct ccache_ent *ccache_by_name[CCACHE_HASH_SIZE];
+static unsigned long ccache_gen;
+static int ccache_inotify_fd = -1;
+static bool ccache_inotify_failed;
+
+static unsigned int
+ccache_dir_hash(const char *path)
+{
+	unsigned long h = 0;
+
+	while (*path)
+		h = h * 31 + (unsigned char)*path++;
+	return h % CCACHE_DIR_HASH_SIZE;
+}
+
+static struct ccache_dir *
+ccache_dir_find(const char *path)
+{
+	struct ccache_dir *dir;
+
+	for (dir = ccache_dir_by_path[ccache_dir_hash(path)]; dir;
+	     dir = dir->path_next)
+		if (strcmp(dir->path, path) == 0)
+			break;
+	return dir;
+}
+
+static struct ccache_dir *
+ccache_dir_find_wd(int wd)
+{
+	struct ccache_dir *dir;
+
+	for (dir = ccache_dir_by_wd[wd % CCACHE_DIR_HASH_SIZE]; dir;
+	     dir = dir->wd_next)
+		if (dir->wd == wd)
+			break;
+	return dir;
+}
+
+static unsigned int
+ccache_name_hash(const struct ccache_dir *dir, const char *name)
+{
+	unsigned long h = (unsigned long)dir;
+
+	while (*name)
+		h = h * 31 + (unsigned char)*name++;
+	return h % CCACHE_HASH_SIZE;
+}
+
+static struct ccache_ent **
+ccache_find(const struct ccache_dir *dir, const char *name)
+{
+	struct ccache_ent **pp;
+
+	pp = &ccache_by_name[ccache_name_hash(dir, name)];
+	for (; *pp; pp = &(*pp)->name_next)
+		if ((*pp)->dir == dir && strcmp((*pp)->name, name) == 0)
+			break;
+	return pp;
+}
+
+static void
+ccache_ent_free(struct ccache_ent **pp)
+{
+	struct ccache_ent *e = *pp, **up;
+
+	*pp = e->name_next;
+	up = &ccache_by_uid[e->uid % CCACHE_HASH_SIZE];
+	while (*up != e)
+		up = &(*up)->uid_next;
+	*up = e->uid_next;
+	free(e->princname);
+	free(e->realm);
+	free(e);
+}
+
+/* Note what "name" in "dir" is now, or forget it if it has gone */
+static void
+ccache_update(struct ccache_dir *dir, const char *name)
+{
+	char buf[PATH_MAX];
+	struct ccache_ent **pp, *e;
+	struct stat st;
+
+	pp = ccache_find(dir, name);
+	e = *pp;
+	snprintf(buf, sizeof(buf), "%s/%s", dir->path, name);
+	if (lstat(buf, &st) != 0) {
+		if (e)
+			ccache_ent_free(pp);
+		return;
+	}
+	/* Entries are hashed by owner */
+	if (e && e->uid != st.st_uid) {
+		ccache_ent_free(pp);
+		e = NULL;
+	}
+	if (!e) {
+		e = calloc(1, sizeof(*e) + strlen(name) + 1);
+		if (!e)
+			return;
+		strcpy(e->name, name);
+		e->dir = dir;
+		e->uid = st.st_uid;
+		pp = &ccache_by_name[ccache_name_hash(dir, name)];
+		e->name_next = *pp;
+		*pp = e;
+		pp = &ccache_by_uid[e->uid % CCACHE_HASH_SIZE];
+		e->uid_next = *pp;
+		*pp = e;
+	}
+	e->cctype = S_ISDIR(st.st_mode) ? "DIR" :
+		    S_ISREG(st.st_mode) ? "FILE" : NULL;
+	e->mtime = st.st_mtime;
+	e->gen = ++ccache_gen;
+	e->valid = false;
+}
+
+/* "watched" is false if the kernel has dropped the watch itself */
+static void
+ccache_dir_drop(struct ccache_dir *dir, bool watched)
+{
+	struct ccache_dir **dp;
+	struct ccache_ent **pp;
+	int i;
+
+	for (i = 0; i < CCACHE_HASH_SIZE; i++)
+		for (pp = &ccache_by_name[i]; *pp; )
+			if ((*pp)->dir == dir)
+				ccache_ent_free(pp);
+			else
+				pp = &(*pp)->name_next;
+	for (dp = &ccache_dir_by_path[ccache_dir_hash(dir->path)]; *dp != dir;
+	     dp = &(*dp)->path_next)
+		;
+	*dp = dir->path_next;
+	for (dp = &ccache_dir_by_wd[dir->wd % CCACHE_DIR_HASH_SIZE]; *dp != dir;
+	     dp = &(*dp)->wd_next)
+		;
+	*dp = dir->wd_next;
+	if (watched)
+		inotify_rm_watch(ccache_inotify_fd, dir->wd);
+	free(dir->path);
+	free(dir);
+}
+
+/* Apply the changes queued since the index was last searched */
+static void
+ccache_read_events(void)
+{
+	bool overflow = false;
+	struct ccache_dir *dir;
+	int i;
+
+	while (true) {
+		char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+		const struct inotify_event *ev;
+		ssize_t len;
+		char *ptr;
+
+		len = read(ccache_inotify_fd, buf, sizeof(buf));
+		if (len == -1 && errno == EINTR)
+			continue;
+
+		if (len <= 0)
+			break;
+
+		for (ptr = buf; ptr < buf + len;
+		     ptr += sizeof(struct inotify_event) + ev->len) {
+			ev = (const struct inotify_event *)ptr;
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				overflow = true;
+				continue;
+			}
+			dir = ccache_dir_find_wd(ev->wd);
+			if (!dir)
+				continue;
+			if (ev->mask & (IN_IGNORED | IN_DELETE_SELF |
+					IN_MOVE_SELF | IN_UNMOUNT))
+				ccache_dir_drop(dir, !(ev->mask & IN_IGNORED));
+			else if (ev->len > 0 &&
+				   strstr(ev->name, GSSD_DEFAULT_CRED_PREFIX))
+				ccache_update(dir, ev->name);
+		}
+	}
+
+	if (overflow) {
+		printerr(1, "WARNING: ccache directory inotify queue "
+			 "overflow, reading the directories again\n");
+		for (i = 0; i < CCACHE_DIR_HASH_SIZE; i++)
+			while (ccache_dir_by_path[i])
+				ccache_dir_drop(ccache_dir_by_path[i], true);
+	}
+}
+
+/*
+ * Return the index of "dirname", first reading the directory if it is
+ * not being watched yet.  NULL means it cannot be watched.
+ */
+static struct ccache_dir *
+ccache_get_dir(const char *dirname)
+{
+	struct ccache_dir *dir, **dp;
+	struct dirent **namelist;
+	int i, n;
+
+	if (ccache_inotify_fd < 0) {
+		if (ccache_inotify_failed)
+			return NULL;
+		ccache_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (ccache_inotify_fd < 0) {
+			printerr(1, "WARNING: %s: inotify_init1 failed, "
+				 "ccache directories will be read on every "
+				 "upcall: %s\n", __func__, strerror(errno));
+			ccache_inotify_failed = true;
+			return NULL;
+		}
+	}
+
+	ccache_read_events();
+	dir = ccache_dir_find(dirname);
+	if (dir)
+		return dir;
+
+	dir = calloc(1, sizeof(*dir));
+	if (!dir)
+		return NULL;
+	dir->path = strdup(dirname);
+	if (!dir->path)
+		goto out_free;
+	/* Watch first, so that nothing that changes while reading is missed */
+	dir->wd = inotify_add_watch(ccache_inotify_fd, dirname,
+				    CCACHE_WATCH_MASK | IN_ONLYDIR);
+	if (dir->wd < 0) {
+		printerr(3, "%s: cannot watch '%s': %s\n", __func__,
+			 dirname, strerror(errno));
+		goto out_free;
+	}
+	/* Another name for a directory already watched */
+	if (ccache_dir_find_wd(dir->wd))
+		goto out_free;
+	n = scandir(dirname, &namelist, select_krb5_ccache, 0);
+	if (n < 0) {
+		inotify_rm_watch(ccache_inotify_fd, dir->wd);
+		goto out_free;
+	}
+	dp = &ccache_dir_by_path[ccache_dir_hash(dir->path)];
+	dir->path_next = *dp;
+	*dp = dir;
+	dp = &ccache_dir_by_wd[dir->wd % CCACHE_DIR_HASH_SIZE];
+	dir->wd_next = *dp;
+	*dp = dir;
+	for (i = 0; i < n; i++) {
+		ccache_update(dir, namelist[i]->d_name);
+		free(namelist[i]);
+	}
+	free(namelist);
+	printerr(2, "watching ccache directory '%s' (%d caches)\n",
+		 dirname, n);
+	return dir;
+
+out_free:
+	free(dir->path);
+	free(dir);
+	return NULL;
+}
+
+static void
+ccache_cand_free(struct ccache_cand *cand, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		free(cand[i].name);
+		free(cand[i].princname);
+		free(cand[i].realm);
+	}
+	free(cand);
+}
+
+/*
+ * Like gssd_scan_krb5_ccache(), but take the caches owned by "uid"
+ * from the index of "dirname" when it can be watched.
+ */
+static int
+gssd_find_existing_krb5_ccache(uid_t uid, char *dirname,
+			       const char **cctype, char **ccname)
+{
+	/* dirname + cctype + d_name + NULL */
+	char buf[PATH_MAX+5+256+1];
+	struct ccache_dir *dir;
+	struct ccache_ent *e, **pp;
+	struct ccache_cand *cand = NULL, *c, *best = NULL;
+	int i, n = 0, score, best_score = 0, err = -EACCES;
+	time_t now = time(NULL);
+
+	*cctype = NULL;
+	*ccname = NULL;
+
+	pthread_mutex_lock(&ccache_lock);
+	dir = ccache_get_dir(dirname);
+	if (!dir) {
+		pthread_mutex_unlock(&ccache_lock);
+		return gssd_scan_krb5_ccache(uid, dirname, cctype, ccname);
+	}
+	for (e = ccache_by_uid[uid % CCACHE_HASH_SIZE]; e; e = e->uid_next)
+		if (e->dir == dir && e->uid == uid)
+			n++;
+	if (n > 0)
+		cand = calloc(n, sizeof(*cand));
+	n = 0;
+	for (e = ccache_by_uid[uid % CCACHE_HASH_SIZE]; cand && e;
+	     e = e->uid_next) {
+		if (e->dir != dir || e->uid != uid)
+			continue;
+		if (!e->cctype) {
+			printerr(3, "CC '%s/%s' is not a regular "
+				 "file or directory\n", dirname, e->name);
+			continue;
+		}
+		if (uid == 0 && !root_uses_machine_creds &&
+		    strstr(e->name, "machine_")) {
+			printerr(3, "CC '%s/%s' not available to root\n",
+				 dirname, e->name);
+			continue;
+		}
+		c = &cand[n];
+		c->name = strdup(e->name);
+		if (!c->name)
+			continue;
+		c->cctype = e->cctype;
+		c->mtime = e->mtime;
+		c->gen = e->gen;
+		c->valid = e->valid && strcmp(e->cctype, "DIR") != 0;
+		if (c->valid) {
+			c->endtime = e->endtime;
+			if (e->princname)
+				c->princname = strdup(e->princname);
+			if (e->realm)
+				c->realm = strdup(e->realm);
+		}
+		n++;
 	}
+	pthread_mutex_unlock(&ccache_lock);
+
+	for (i = 0; i < n; i++) {
+		c = &cand[i];
+		snprintf(buf, sizeof(buf), "%s:%s/%s", c->cctype,
+			 dirname, c->name);
+		if (!c->valid) {
+			c->queried = true;
+			if (!query_krb5_ccache(buf, &c->princname, &c->realm,
+					       &c->endtime))
+				c->endtime = 0;
+		}
+		if (c->endtime <= now || !c->princname || !c->realm) {
+			printerr(3, "CC '%s' is expired or corrupt\n", buf);
+			err = -EKEYEXPIRED;
+			continue;
+		}
 
+		score = 0;
+		if (preferred_realm && strcmp(c->realm, preferred_realm) == 0)
+			score++;
+		printerr(3, "CC '%s'(%s@%s) passed all checks and"
+			    " has mtime of %llu\n", buf, c->princname,
+			 c->realm, (long long unsigned)c->mtime);
+		/* The highest score, then the latest mtime, wins */
+		if (!best || best_score < score ||
+		    (best_score == score && c->mtime > best->mtime)) {
+			best = c;
+			best_score = score;
+		}
+	}
+
+	/* Keep what was read, unless the file has changed since */
+	pthread_mutex_lock(&ccache_lock);
+	dir = ccache_dir_find(dirname);
+	for (i = 0; dir && i < n; i++) {
+		c = &cand[i];
+		if (!c->queried)
+			continue;
+		pp = ccache_find(dir, c->name);
+		if (!*pp || (*pp)->gen != c->gen)
+			continue;
+		e = *pp;
+		free(e->princname);
+		free(e->realm);
+		e->princname = c->princname ? strdup(c->princname) : NULL;
+		e->realm = c->realm ? strdup(c->realm) : NULL;
+		e->endtime = c->endtime;
+		e->valid = true;
+	}
+	pthread_mutex_unlock(&ccache_lock);
+
+	if (best) {
+		*cctype = best->cctype;
+		*ccname = best->name;
+		best->name = NULL;
+		err = 0;
+	}
+	ccache_cand_free(cand, n);
 	return err;
 }
 
@@ -382,6 +894,21 @@ gssd_check_if_cc_exists(struct gssd_k5_kt_princ *ple)
 	return 0;
 }
 
+/*
+ * Whether the machine credentials of "ple" will do for a while yet.
+ * Called with ple->lock held.
+ */
+static int
+ple_creds_fresh(struct gssd_k5_kt_princ *ple)
+{
+	/*
+	 * Workaround for clock skew among NFS server, NFS client and KDC
+	 * 300 because clock skew must be within 300sec for kerberos
+	 */
+	return ple->ccname && ple->endtime > time(0) + 300 &&
+	       (use_memcache || !gssd_check_if_cc_exists(ple));
+}
+
 /*
  * Obtain credentials via a key in the keytab given
  * a keytab handle and a gssd_k5_kt_princ structure.
@@ -403,30 +930,20 @@ gssd_get_single_krb5_cred(krb5_context context,
 	krb5_creds my_creds;
 	char kt_name[BUFSIZ];
 	int code;
-	time_t now = time(0);
 	char *pname = NULL;
 	char *k5err = NULL;
-	int nocache = 0;
 	pthread_t tid = pthread_self();
 
 	memset(&my_creds, 0, sizeof(my_creds));
 
-	if (!use_memcache)
-		nocache = gssd_check_if_cc_exists(ple);
-	/*
-	 * Workaround for clock skew among NFS server, NFS client and KDC
-	 * 300 because clock skew must be within 300sec for kerberos
-	 */
-	now += 300;
-	pthread_mutex_lock(&ple_lock);
-	if (ple->ccname && ple->endtime > now && !nocache && !force_renew) {
+	/* Whoever waits here finds the TGT the holder got */
+	pthread_mutex_lock(&ple->lock);
+	if (!force_renew && ple_creds_fresh(ple)) {
 		printerr(3, "%s(0x%lx): Credentials in CC '%s' are good until %s",
 			 __func__, tid, ple->ccname, ctime((time_t *)&ple->endtime));
 		code = 0;
-		pthread_mutex_unlock(&ple_lock);
 		goto out;
 	}
-	pthread_mutex_unlock(&ple_lock);
 
 	if ((code = krb5_kt_get_name(context, kt, kt_name, BUFSIZ))) {
 		printerr(0, "ERROR: Unable to get keytab name in "
@@ -473,14 +990,14 @@ gssd_get_single_krb5_cred(krb5_context context,
 		goto out;
 	}
 
-	pthread_mutex_lock(&ple_lock);
 	ple->endtime = my_creds.times.endtime;
-	pthread_mutex_unlock(&ple_lock);
+	ple->used = false;
 
 	code = 0;
 	printerr(2, "%s(0x%lx): principal '%s' ccache:'%s'\n",
 		__func__, tid, pname, ple->ccname);
   out:
+	pthread_mutex_unlock(&ple->lock);
 	if (opts)
 		krb5_get_init_creds_opt_free(context, opts);
 	if (pname)
@@ -490,16 +1007,34 @@ gssd_get_single_krb5_cred(krb5_context context,
 	return (code);
 }
 
+/*
+ * Which ple_hash[] chain a principal is on
+ */
+static unsigned int
+ple_hash_princ(krb5_context context, krb5_principal princ)
+{
+	unsigned int h = 0;
+	char *pname, *p;
+
+	if (krb5_unparse_name(context, princ, &pname))
+		return 0;
+	for (p = pname; *p; p++)
+		h = h * 31 + (unsigned char)*p;
+	k5_free_unparsed_name(context, pname);
+	return h % PLE_HASH_SIZE;
+}
+
 /*
  * Given a principal, find a matching ple structure
- * Called with mutex held
+ * Called with lock held
  */
 static struct gssd_k5_kt_princ *
-find_ple_by_princ(krb5_context context, krb5_principal princ)
+find_ple_by_princ(krb5_context context, krb5_principal princ,
+		  unsigned int hash)
 {
 	struct gssd_k5_kt_princ *ple;
 
-	for (ple = gssd_k5_kt_princ_list; ple != NULL; ple = ple->next) {
+	for (ple = ple_hash[hash]; ple != NULL; ple = ple->hash_next) {
 		if (krb5_principal_compare(context, ple->princ, princ))
 			return ple;
 	}
@@ -509,10 +1044,10 @@ find_ple_by_princ(krb5_context context, krb5_principal princ)
 
 /*
  * Create, initialize, and add a new ple structure to the global list
- * Called with mutex held
+ * Called with lock held for writing
  */
 static struct gssd_k5_kt_princ *
-new_ple(krb5_context context, krb5_principal princ)
+new_ple(krb5_context context, krb5_principal princ, unsigned int hash)
 {
 	struct gssd_k5_kt_princ *ple = NULL, *p;
 	krb5_error_code code;
@@ -523,6 +1058,7 @@ new_ple(krb5_context context, krb5_principal princ)
 	if (ple == NULL)
 		goto outerr;
 	memset(ple, 0, sizeof(*ple));
+	pthread_mutex_init(&ple->lock, NULL);
 
 #ifdef HAVE_KRB5
 	ple->realm = strndup(princ->realm.data,
@@ -560,6 +1096,8 @@ new_ple(krb5_context context, krb5_principal princ)
 		else
 			p->next = ple;
 	}
+	ple->hash_next = ple_hash[hash];
+	ple_hash[hash] = ple;
 
 	ple->refcount = 1;
 	return ple;
@@ -579,20 +1117,145 @@ static struct gssd_k5_kt_princ *
 get_ple_by_princ(krb5_context context, krb5_principal princ)
 {
 	struct gssd_k5_kt_princ *ple;
-
-	pthread_mutex_lock(&ple_lock);
-	ple = find_ple_by_princ(context, princ);
+	unsigned int hash = ple_hash_princ(context, princ);
+
+	pthread_rwlock_rdlock(&ple_lock);
+	ple = find_ple_by_princ(context, princ, hash);
+	if (ple != NULL)
+		get_ple(ple);
+	pthread_rwlock_unlock(&ple_lock);
+	if (ple != NULL)
+		return ple;
+
+	pthread_rwlock_wrlock(&ple_lock);
+	ple = find_ple_by_princ(context, princ, hash);
 	if (ple == NULL) {
-		ple = new_ple(context, princ);
+		ple = new_ple(context, princ, hash);
 	}
 	if (ple != NULL) {
-		ple->refcount++;
+		get_ple(ple);
+	}
+	pthread_rwlock_unlock(&ple_lock);
+
+	return ple;
+}
+
+/*
+ * Return the file behind keytabfile, or NULL if it is not a file
+ */
+static const char *
+keytab_path(void)
+{
+	if (strncmp(keytabfile, "FILE:", 5) == 0)
+		return keytabfile + 5;
+	if (strncmp(keytabfile, "WRFILE:", 7) == 0)
+		return keytabfile + 7;
+	if (strchr(keytabfile, ':') == NULL)
+		return keytabfile;
+	return NULL;
+}
+
+static int
+same_keytab(const struct stat *a, const struct stat *b)
+{
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+	       a->st_size == b->st_size &&
+	       a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+	       a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+static unsigned int
+kt_choice_hash(const char *key)
+{
+	unsigned int h = 0;
+
+	while (*key)
+		h = h * 31 + (unsigned char)*key++;
+	return h % KT_CHOICE_HASH_SIZE;
+}
+
+/* Called with kt_choice_lock held */
+static void
+kt_choice_flush(krb5_context context)
+{
+	struct kt_choice *c;
+	int i;
+
+	for (i = 0; i < KT_CHOICE_HASH_SIZE; i++)
+		while ((c = kt_choices[i]) != NULL) {
+			kt_choices[i] = c->next;
+			release_ple(context, c->ple);
+			free(c);
+		}
+}
+
+/*
+ * Return, with a reference held, the ple chosen before for "key", or
+ * NULL if the keytab has to be searched.  "*st" is set to what the
+ * keytab file is now; st->st_nlink is zero if it cannot be looked at,
+ * and then the choice should not be kept.
+ */
+static struct gssd_k5_kt_princ *
+kt_choice_find(const char *key, struct stat *st)
+{
+	const char *path = keytab_path();
+	struct gssd_k5_kt_princ *ple = NULL;
+	struct kt_choice *c;
+
+	memset(st, 0, sizeof(*st));
+	if (path == NULL || stat(path, st) != 0) {
+		st->st_nlink = 0;
+		return NULL;
 	}
-	pthread_mutex_unlock(&ple_lock);
 
+	pthread_mutex_lock(&kt_choice_lock);
+	if (!same_keytab(st, &kt_choice_stat)) {
+		printerr(3, "keytab '%s' changed, forgetting principals "
+			 "chosen from it\n", path);
+		kt_choice_flush(NULL);
+		kt_choice_stat = *st;
+	}
+	for (c = kt_choices[kt_choice_hash(key)]; c; c = c->next)
+		if (strcmp(c->key, key) == 0) {
+			ple = c->ple;
+			get_ple(ple);
+			break;
+		}
+	pthread_mutex_unlock(&kt_choice_lock);
 	return ple;
 }
 
+/*
+ * Remember that "ple" was chosen for "key", unless the keytab has
+ * changed since "st" was taken
+ */
+static void
+kt_choice_add(const char *key, struct gssd_k5_kt_princ *ple,
+	      const struct stat *st)
+{
+	struct kt_choice *c;
+	unsigned int hash = kt_choice_hash(key);
+
+	if (st->st_nlink == 0)
+		return;
+	pthread_mutex_lock(&kt_choice_lock);
+	if (!same_keytab(st, &kt_choice_stat))
+		goto out;
+	for (c = kt_choices[hash]; c; c = c->next)
+		if (strcmp(c->key, key) == 0)
+			goto out;
+	c = malloc(sizeof(*c) + strlen(key) + 1);
+	if (c == NULL)
+		goto out;
+	strcpy(c->key, key);
+	c->ple = ple;
+	get_ple(ple);
+	c->next = kt_choices[hash];
+	kt_choices[hash] = c;
+out:
+	pthread_mutex_unlock(&kt_choice_lock);
+}
+
 /*
  * Given a (possibly unqualified) hostname,
  * return the fully qualified (lower-case!) hostname
@@ -1013,21 +1676,26 @@ static inline int data_is_equal(krb5_data d1, krb5_data d2)
 		&& memcmp(d1.data, d2.data, d1.length) == 0);
 }
 
+/*
+ * Returns 1 if "ccache" holds an unexpired TGT for the realm of
+ * "principal", and plants the time the last of them expires in
+ * "*endtime".
+ */
 static int
 check_for_tgt(krb5_context context, krb5_ccache ccache,
-	      krb5_principal principal)
+	      krb5_principal principal, time_t *endtime)
 {
 	krb5_error_code ret;
 	krb5_creds creds;
 	krb5_cc_cursor cur;
-	int found = 0;
+	time_t now = time(NULL);
 
+	*endtime = 0;
 	ret = krb5_cc_start_seq_get(context, ccache, &cur);
 	if (ret) 
 		return 0;
 
-	while (!found &&
-		(ret = krb5_cc_next_cred(context, ccache, &cur, &creds)) == 0) {
+	while ((ret = krb5_cc_next_cred(context, ccache, &cur, &creds)) == 0) {
 		if (creds.server->length == 2 &&
 				data_is_equal(creds.server->realm,
 					      principal->realm) &&
@@ -1036,18 +1704,19 @@ check_for_tgt(krb5_context context, krb5_ccache ccache,
 						"krbtgt", 6) == 0 &&
 				data_is_equal(creds.server->data[1],
 					      principal->realm) &&
-				creds.times.endtime > time(NULL))
-			found = 1;
+				creds.times.endtime > now &&
+				creds.times.endtime > *endtime)
+			*endtime = creds.times.endtime;
 		krb5_free_cred_contents(context, &creds);
 	}
 	krb5_cc_end_seq_get(context, ccache, &cur);
 
-	return found;
+	return *endtime != 0;
 }
 
 static int
 query_krb5_ccache(const char* cred_cache, char **ret_princname,
-		  char **ret_realm)
+		  char **ret_realm, time_t *ret_endtime)
 {
 	krb5_error_code ret;
 	krb5_context context;
@@ -1056,6 +1725,7 @@ query_krb5_ccache(const char* cred_cache, char **ret_princname,
 	int found = 0;
 	char *str = NULL;
 	char *princstring;
+	time_t endtime;
 
 	*ret_princname = *ret_realm = NULL;
 
@@ -1073,8 +1743,10 @@ query_krb5_ccache(const char* cred_cache, char **ret_princname,
 	if (ret) 
 		goto err_princ;
 
-	found = check_for_tgt(context, ccache, principal);
+	found = check_for_tgt(context, ccache, principal, &endtime);
 	if (found) {
+		if (ret_endtime)
+			*ret_endtime = endtime;
 		ret = krb5_unparse_name(context, principal, &princstring);
 		if (ret == 0) {
 		    if ((str = strchr(princstring, '@')) != NULL) {
@@ -1114,10 +1786,13 @@ gssd_refresh_krb5_machine_credential_internal(char *hostname,
 	krb5_context context;
 	krb5_keytab kt = NULL;
 	krb5_ccache ccache = NULL;
-	int retval = 0;
+	int retval = 0, fresh;
+	bool chosen = false;
 	char *k5err = NULL, *cache_type;
 	const char *svcnames[] = { "$", "root", "nfs", "host", NULL };
 	char cc_name[BUFSIZ];
+	char kt_key[3 * NI_MAXHOST];
+	struct stat kt_st;
 
 	/*
 	 * If a specific service name was specified, use it.
@@ -1131,12 +1806,38 @@ gssd_refresh_krb5_machine_credential_internal(char *hostname,
 		printerr(0, "ERROR: %s: Invalid args\n", __func__);
 		return EINVAL;
 	}
+
+	kt_st.st_nlink = 0;
+	if (ple == NULL && snprintf(kt_key, sizeof(kt_key), "%s %s %s",
+				    hostname, svcnames[1] ? "*" : svcnames[0],
+				    srchost ? srchost : "-") < (int)sizeof(kt_key)) {
+		ple = kt_choice_find(kt_key, &kt_st);
+		chosen = ple != NULL;
+	}
+	/* Most of the time there is no need even for a krb5 context */
+	if (ple != NULL) {
+		pthread_mutex_lock(&ple->lock);
+		/* Only upcalls for a host keep its TGT refreshed */
+		if (chosen)
+			ple->used = true;
+		fresh = !force_renew && ple_creds_fresh(ple);
+		pthread_mutex_unlock(&ple->lock);
+		if (fresh) {
+			printerr(3, "%s: credentials for realm %s are good\n",
+				 __func__, ple->realm);
+			release_ple(NULL, ple);
+			return 0;
+		}
+	}
+
 	code = krb5_init_context(&context);
 	if (code) {
 		k5err = gssd_k5_err_msg(NULL, code);
 		printerr(0, "ERROR: %s: %s while initializing krb5 context\n",
 			 __func__, k5err);
 		retval = code;
+		if (ple)
+			release_ple(NULL, ple);
 		goto out;
 	}
 
@@ -1162,6 +1863,12 @@ gssd_refresh_krb5_machine_credential_internal(char *hostname,
 
 		ple = get_ple_by_princ(context, kte.principal);
 		k5_free_kt_entry(context, &kte);
+		if (ple != NULL) {
+			kt_choice_add(kt_key, ple, &kt_st);
+			pthread_mutex_lock(&ple->lock);
+			ple->used = true;
+			pthread_mutex_unlock(&ple->lock);
+		}
 		if (ple == NULL) {
 			char *pname;
 			if ((krb5_unparse_name(context, kte.principal, &pname))) {
@@ -1186,7 +1893,7 @@ gssd_refresh_krb5_machine_credential_internal(char *hostname,
 		 ccachesearch[0], GSSD_DEFAULT_CRED_PREFIX,
 		 GSSD_DEFAULT_MACHINE_CRED_SUFFIX, ple->realm);
 
-	pthread_mutex_lock(&ple_lock);
+	pthread_mutex_lock(&ple->lock);
 	if (ple->ccname == NULL || strcmp(ple->ccname, cc_name) != 0) {
 		free(ple->ccname);
 		ple->ccname = strdup(cc_name);
@@ -1194,11 +1901,11 @@ gssd_refresh_krb5_machine_credential_internal(char *hostname,
 			printerr(0, "ERROR: no storage to duplicate credentials "
 				    "cache name '%s'\n", cc_name);
 			code = ENOMEM;
-			pthread_mutex_unlock(&ple_lock);
+			pthread_mutex_unlock(&ple->lock);
 			goto out_free_kt;
 		}
 	}
-	pthread_mutex_unlock(&ple_lock);
+	pthread_mutex_unlock(&ple->lock);
 	if ((code = krb5_cc_resolve(context, cc_name, &ccache))) {
 		k5err = gssd_k5_err_msg(context, code);
 		printerr(0, "ERROR: %s while opening credential cache '%s'\n",
@@ -1236,7 +1943,7 @@ gssd_setup_krb5_user_gss_ccache(uid_t uid, char *servername, char *dirpattern)
 				/* dirname + cctype + d_name + NULL */
 	char			buf[PATH_MAX+5+256+1], dirname[PATH_MAX];
 	const char		*cctype;
-	struct dirent		*d;
+	char			*ccname;
 	int			err, i, j;
 	u_int			maj_stat, min_stat;
 
@@ -1265,12 +1972,12 @@ gssd_setup_krb5_user_gss_ccache(uid_t uid, char *servername, char *dirpattern)
 	}
 	dirname[j] = '\0';
 
-	err = gssd_find_existing_krb5_ccache(uid, dirname, &cctype, &d);
+	err = gssd_find_existing_krb5_ccache(uid, dirname, &cctype, &ccname);
 	if (err)
 		return err;
 
-	snprintf(buf, sizeof(buf), "%s:%s/%s", cctype, dirname, d->d_name);
-	free(d);
+	snprintf(buf, sizeof(buf), "%s:%s/%s", cctype, dirname, ccname);
+	free(ccname);
 
 	printerr(2, "using %s as credentials cache for client with "
 		    "uid %u for server %s\n", buf, uid, servername);
@@ -1303,6 +2010,7 @@ gssd_get_krb5_machine_cred_list(char ***list)
 	int i = 0;
 	int retval;
 	struct gssd_k5_kt_princ *ple;
+	char *ccname;
 
 	/* Assume failure */
 	retval = -1;
@@ -1313,9 +2021,12 @@ gssd_get_krb5_machine_cred_list(char ***list)
 		goto out;
 	}
 
-	pthread_mutex_lock(&ple_lock);
+	pthread_rwlock_rdlock(&ple_lock);
 	for (ple = gssd_k5_kt_princ_list; ple; ple = ple->next) {
-		if (!ple->ccname)
+		pthread_mutex_lock(&ple->lock);
+		ccname = ple->ccname;
+		pthread_mutex_unlock(&ple->lock);
+		if (!ccname)
 			continue;
 
 		/* Take advantage of the fact we only remove the ple
@@ -1326,12 +2037,12 @@ gssd_get_krb5_machine_cred_list(char ***list)
 		 * gssd_refresh_krb5_machine_credential_internal() will
 		 * release the ple refcount
 		 */
-		ple->refcount++;
-		pthread_mutex_unlock(&ple_lock);
+		get_ple(ple);
+		pthread_rwlock_unlock(&ple_lock);
 		/* Make sure cred is up-to-date before returning it */
 		retval = gssd_refresh_krb5_machine_credential_internal(NULL, ple,
 								       NULL, NULL, 0);
-		pthread_mutex_lock(&ple_lock);
+		pthread_rwlock_rdlock(&ple_lock);
 		if (gssd_k5_kt_princ_list == NULL) {
 			/* Looks like we did shutdown... abort */
 			l[i] = NULL;
@@ -1353,7 +2064,10 @@ gssd_get_krb5_machine_cred_list(char ***list)
 			}
 			l = tmplist;
 		}
-		if ((l[i++] = strdup(ple->ccname)) == NULL) {
+		pthread_mutex_lock(&ple->lock);
+		l[i] = strdup(ple->ccname);
+		pthread_mutex_unlock(&ple->lock);
+		if (l[i++] == NULL) {
 			gssd_free_krb5_machine_cred_list(l);
 			retval = ENOMEM;
 			goto out_lock;
@@ -1366,7 +2080,7 @@ gssd_get_krb5_machine_cred_list(char ***list)
 	} else
 		free((void *)l);
 out_lock:
-	pthread_mutex_unlock(&ple_lock);
+	pthread_rwlock_unlock(&ple_lock);
   out:
 	return retval;
 }
@@ -1407,7 +2121,12 @@ gssd_destroy_krb5_principals(int destroy_machine_creds)
 		return;
 	}
 
-	pthread_mutex_lock(&ple_lock);
+	pthread_mutex_lock(&kt_choice_lock);
+	kt_choice_flush(context);
+	pthread_mutex_unlock(&kt_choice_lock);
+
+	pthread_rwlock_wrlock(&ple_lock);
+	memset(ple_hash, 0, sizeof(ple_hash));
 	while (gssd_k5_kt_princ_list) {
 		ple = gssd_k5_kt_princ_list;
 		gssd_k5_kt_princ_list = ple->next;
@@ -1431,12 +2150,72 @@ gssd_destroy_krb5_principals(int destroy_machine_creds)
 			}
 		}
 
-		release_ple_locked(context, ple);
+		release_ple(context, ple);
 	}
-	pthread_mutex_unlock(&ple_lock);
+	pthread_rwlock_unlock(&ple_lock);
 	krb5_free_context(context);
 }
 
+/*
+ * Get again the machine TGTs that upcalls have asked for since they were
+ * last got, shortly before they would be too old to use, so that those
+ * upcalls do not wait for the KDC.  TGTs nobody asks for are left to
+ * expire.
+ */
+static void *
+machine_cred_refresh_fn(void *UNUSED(arg))
+{
+	struct gssd_k5_kt_princ *ple;
+	time_t soon;
+	int due;
+
+	for (;;) {
+		sleep(MACHINE_CRED_REFRESH_POLL);
+		soon = time(0) + 300 + MACHINE_CRED_REFRESH_AHEAD;
+		pthread_rwlock_rdlock(&ple_lock);
+		for (ple = gssd_k5_kt_princ_list; ple; ple = ple->next) {
+			pthread_mutex_lock(&ple->lock);
+			due = ple->used && ple->ccname && ple->endtime <= soon;
+			pthread_mutex_unlock(&ple->lock);
+			if (!due)
+				continue;
+
+			/* As in gssd_get_krb5_machine_cred_list() */
+			get_ple(ple);
+			pthread_rwlock_unlock(&ple_lock);
+			printerr(2, "refreshing machine credentials for "
+				 "realm %s\n", ple->realm);
+			gssd_refresh_krb5_machine_credential_internal(NULL,
+							ple, NULL, NULL, 1);
+			pthread_rwlock_rdlock(&ple_lock);
+			if (gssd_k5_kt_princ_list == NULL)
+				break;
+		}
+		pthread_rwlock_unlock(&ple_lock);
+	}
+	return NULL;
+}
+
+/*
+ * Start the thread that refreshes machine credentials in the background
+ */
+int
+gssd_start_machine_cred_refresh(void)
+{
+	pthread_attr_t attr;
+	pthread_t th;
+	int ret;
+
+	ret = pthread_attr_init(&attr);
+	if (ret != 0)
+		return ret;
+	ret = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (ret == 0)
+		ret = pthread_create(&th, &attr, machine_cred_refresh_fn, NULL);
+	pthread_attr_destroy(&attr);
+	return ret;
+}
+
 /*
  * Obtain (or refresh if necessary) Kerberos machine credentials
  */
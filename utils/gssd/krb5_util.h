@@ -15,6 +15,7 @@ int gssd_setup_krb5_user_gss_ccache(uid_t uid, char *servername,
 int  gssd_get_krb5_machine_cred_list(char ***list);
 void gssd_free_krb5_machine_cred_list(char **list);
 void gssd_destroy_krb5_principals(int destroy_machine_creds);
+int  gssd_start_machine_cred_refresh(void);
 int  gssd_refresh_krb5_machine_credential(char *hostname,
 					  char *service, char *srchost,
 					  int force_renew);
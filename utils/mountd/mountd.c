@@ -53,6 +53,10 @@ char *ha_callout_prog = NULL;
 static int num_threads = 1;
 /* Arbitrary limit on number of threads */
 #define MAX_THREADS 64
+/* Run the workers as threads sharing one export table,
+ * rather than as separate processes. */
+static int thread_pool = 0;
+static int warm_cache = 0;
 
 static struct option longopts[] =
 {
@@ -125,7 +129,7 @@ static void
 killer (int sig)
 {
 	unregister_services();
-	if (num_threads > 1) {
+	if (num_threads > 1 && !thread_pool) {
 		/* play Kronos and eat our children */
 		kill(0, SIGTERM);
 		cache_wait_for_workers("mountd");
@@ -606,6 +610,17 @@ read_mountd_conf(char **argv)
 	descriptors = conf_get_num("mountd", "descriptors", descriptors);
 	port = conf_get_num("mountd", "port", port);
 	num_threads = conf_get_num("mountd", "threads", num_threads);
+	thread_pool = conf_get_bool("mountd", "thread-pool", thread_pool);
+	warm_cache = conf_get_bool("mountd", "warm-cache", warm_cache);
+	gidcache_size = conf_get_num("mountd", "gid-cache-size", gidcache_size);
+	gidcache_negative_ttl = conf_get_num("mountd", "gid-cache-negative-ttl",
+					     gidcache_negative_ttl);
+	cachestats_enable(conf_get_str("mountd", "stats-file"),
+			  conf_get_num("mountd", "stats-interval", 10));
+	cache_trace_enable(conf_get_str("mountd", "trace-file"));
+	hostcache_ttl = conf_get_num("mountd", "resolver-cache-ttl", hostcache_ttl);
+	hostcache_negative_ttl = conf_get_num("mountd", "resolver-cache-negative-ttl",
+					      hostcache_negative_ttl);
 	reverse_resolve = conf_get_bool("mountd", "reverse-lookup", reverse_resolve);
 	ha_callout_prog = conf_get_str("mountd", "ha-callout");
 	if (conf_get_bool("mountd", "cache-use-ipaddr", 0))
@@ -835,7 +850,7 @@ main(int argc, char **argv)
 	}
 
 	/* silently bounds check num_threads */
-	if (foreground)
+	if (foreground && !thread_pool)
 		num_threads = 1;
 	else if (num_threads < 1)
 		num_threads = 1;
@@ -847,8 +862,13 @@ main(int argc, char **argv)
 	 * read and write.
 	 */
 	cache_open();
+	if (warm_cache)
+		cache_warm_enable(mountlist_clients);
 
-	if (cache_fork_workers("mountd", num_threads) == 0) {
+	if (thread_pool && cache_start_threads(num_threads) < 0)
+		thread_pool = 0;
+
+	if (!thread_pool && cache_fork_workers("mountd", num_threads) == 0) {
 		/* We forked, waited, and now need to clean up */
 		unregister_services();
 		cleanup_lockfiles();
@@ -50,5 +50,6 @@ void		mountlist_add(char *host, const char *path);
 void		mountlist_del(char *host, const char *path);
 void		mountlist_del_all(const struct sockaddr *sap);
 mountlist	mountlist_list(void);
+char **		mountlist_clients(void);
 
 #endif /* MOUNTD_H */
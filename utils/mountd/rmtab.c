@@ -51,82 +51,365 @@ slink_safe_rename(const char * oldpath, const char * newpath)
 	return rename(oldpath, real_newpath);
 }
 
+/*
+ * The mount list is kept in memory, in a hash table.  Each change is
+ * appended to rmtab.journal, next to rmtab, as an rmtab line giving the
+ * new count for that client and path; a count of 0 means the entry is
+ * gone.  Once the journal is as long as the table, rmtab is rewritten
+ * from memory and the journal emptied.  A MNT or UMNT thus costs a hash
+ * lookup and one short append, rather than a scan or a rewrite of the
+ * whole file.
+ *
+ * Forked workers share the files, under the rmtab lock.  Each replays
+ * what the others have appended before using its table, and reloads
+ * everything if another has rewritten rmtab in the meantime.
+ */
+#define RMTAB_COMPACT_MIN	1024
+
+struct mount_ent {
+	struct mount_ent	*next;
+	unsigned int		hash;
+	int			count;
+	char			*path;
+	char			client[];
+};
+
+static struct {
+	struct mount_ent	**buckets;
+	unsigned int		size;		/* number of buckets */
+	unsigned int		count;		/* number of entries */
+	unsigned int		generation;	/* bumped on every change */
+	int			valid;
+	struct stat		loaded;		/* rmtab as last read */
+	char			*journalfn;
+	FILE			*journal;	/* for appending */
+	pid_t			journal_pid;
+	long			offset;		/* journal read up to here */
+	unsigned int		records;	/* lines in the journal */
+} mounts;
+
+static unsigned int
+mount_hash(const char *client, const char *path)
+{
+	unsigned int h = 2166136261u;
+
+	while (*client) {
+		h ^= (unsigned char)*client++;
+		h *= 16777619u;
+	}
+	h ^= ':';
+	h *= 16777619u;
+	while (*path) {
+		h ^= (unsigned char)*path++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static struct mount_ent **
+mount_find(const char *client, const char *path, unsigned int hash)
+{
+	struct mount_ent **mp, *m;
+
+	if (mounts.size == 0)
+		return NULL;
+	for (mp = &mounts.buckets[hash % mounts.size]; (m = *mp) != NULL;
+	     mp = &m->next)
+		if (m->hash == hash && strcmp(m->client, client) == 0 &&
+		    strcmp(m->path, path) == 0)
+			return mp;
+	return NULL;
+}
+
+static void
+mount_grow(void)
+{
+	struct mount_ent **buckets, *m;
+	unsigned int size, i;
+
+	size = mounts.size ? mounts.size * 2 : 256;
+	buckets = calloc(size, sizeof(*buckets));
+	if (buckets == NULL)
+		return;
+	for (i = 0; i < mounts.size; i++)
+		while ((m = mounts.buckets[i]) != NULL) {
+			mounts.buckets[i] = m->next;
+			m->next = buckets[m->hash % size];
+			buckets[m->hash % size] = m;
+		}
+	free(mounts.buckets);
+	mounts.buckets = buckets;
+	mounts.size = size;
+}
+
+/*
+ * Set the count for @client and @path, removing the entry if @count
+ * is 0.  Returns the entry, or NULL if there is none.
+ */
+static struct mount_ent *
+mount_set(const char *client, const char *path, int count)
+{
+	unsigned int hash = mount_hash(client, path);
+	size_t clen = strlen(client) + 1;
+	struct mount_ent **mp, *m;
+
+	mounts.generation++;
+	mp = mount_find(client, path, hash);
+	if (mp) {
+		m = *mp;
+		if (count > 0) {
+			m->count = count;
+			return m;
+		}
+		*mp = m->next;
+		free(m);
+		mounts.count--;
+		return NULL;
+	}
+	if (count <= 0)
+		return NULL;
+
+	if (mounts.count >= mounts.size)
+		mount_grow();
+	if (mounts.size == 0)
+		return NULL;
+	m = malloc(sizeof(*m) + clen + strlen(path) + 1);
+	if (m == NULL) {
+		xlog(L_ERROR, "%s: memory allocation failed", __func__);
+		return NULL;
+	}
+	m->hash = hash;
+	m->count = count;
+	memcpy(m->client, client, clen);
+	m->path = m->client + clen;
+	strcpy(m->path, path);
+	m->next = mounts.buckets[hash % mounts.size];
+	mounts.buckets[hash % mounts.size] = m;
+	mounts.count++;
+	return m;
+}
+
+static void
+mount_clear(void)
+{
+	struct mount_ent *m;
+	unsigned int i;
+
+	for (i = 0; i < mounts.size; i++)
+		while ((m = mounts.buckets[i]) != NULL) {
+			mounts.buckets[i] = m->next;
+			free(m);
+		}
+	mounts.count = 0;
+	mounts.generation++;
+}
+
+/* Apply every line of @fp; returns the number of lines read */
+static unsigned int
+mount_replay(FILE *fp)
+{
+	struct rmtabent *rep;
+	unsigned int n = 0;
+
+	while ((rep = fgetrmtabent(fp, 1, NULL)) != NULL) {
+		mount_set(rep->r_client, rep->r_path, rep->r_count);
+		n++;
+	}
+	return n;
+}
+
+static int
+same_file(const struct stat *a, const struct stat *b)
+{
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+	       a->st_size == b->st_size &&
+	       a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+	       a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/*
+ * Bring the table up to date with rmtab and the journal.  Must be
+ * called with the rmtab lock held.  Returns 0 on success.
+ */
+static int
+mount_sync(void)
+{
+	struct stat st;
+	FILE *fp;
+
+	if (mounts.journalfn == NULL &&
+	    asprintf(&mounts.journalfn, "%s.journal", rmtab.statefn) < 0) {
+		mounts.journalfn = NULL;
+		return -1;
+	}
+
+	if (stat(rmtab.statefn, &st) < 0) {
+		if (errno != ENOENT) {
+			xlog(L_ERROR, "can't stat %s: %s",
+					rmtab.statefn, strerror(errno));
+			return -1;
+		}
+		memset(&st, 0, sizeof(st));
+	}
+	if (!mounts.valid || !same_file(&st, &mounts.loaded)) {
+		mount_clear();
+		if (st.st_ino && (fp = fsetrmtabent(rmtab.statefn, "r")) != NULL) {
+			mount_replay(fp);
+			fendrmtabent(fp);
+		}
+		mounts.loaded = st;
+		mounts.offset = 0;
+		mounts.records = 0;
+		mounts.valid = 1;
+	}
+
+	fp = fopen(mounts.journalfn, "r");
+	if (fp == NULL)
+		return 0;
+	if (fseek(fp, 0, SEEK_END) == 0 && ftell(fp) < mounts.offset) {
+		/* emptied behind our back; start again */
+		fclose(fp);
+		mounts.valid = 0;
+		return mount_sync();
+	}
+	if (fseek(fp, mounts.offset, SEEK_SET) == 0) {
+		mounts.records += mount_replay(fp);
+		mounts.offset = ftell(fp);
+	}
+	fclose(fp);
+	return 0;
+}
+
+/* Rewrite rmtab from the table and empty the journal */
+static void
+mount_compact(void)
+{
+	struct mount_ent *m;
+	struct rmtabent re;
+	unsigned int i;
+	FILE *fp;
+
+	if (!(fp = fsetrmtabent(rmtab.tmpfn, "w")))
+		return;
+	for (i = 0; i < mounts.size; i++)
+		for (m = mounts.buckets[i]; m; m = m->next) {
+			strncpy(re.r_client, m->client, sizeof(re.r_client) - 1);
+			re.r_client[sizeof(re.r_client) - 1] = '\0';
+			strncpy(re.r_path, m->path, sizeof(re.r_path) - 1);
+			re.r_path[sizeof(re.r_path) - 1] = '\0';
+			re.r_count = m->count;
+			fputrmtabent(fp, &re, NULL);
+		}
+	if (fflush(fp) != 0 || ferror(fp)) {
+		xlog(L_ERROR, "couldn't write %s", rmtab.tmpfn);
+		fendrmtabent(fp);
+		unlink(rmtab.tmpfn);
+		return;
+	}
+	fendrmtabent(fp);
+	if (slink_safe_rename(rmtab.tmpfn, rmtab.statefn) < 0) {
+		xlog(L_ERROR, "couldn't rename %s to %s",
+				rmtab.tmpfn, rmtab.statefn);
+		return;
+	}
+	if (truncate(mounts.journalfn, 0) < 0 && errno != ENOENT)
+		xlog(L_ERROR, "couldn't truncate %s: %s",
+				mounts.journalfn, strerror(errno));
+	if (stat(rmtab.statefn, &mounts.loaded) < 0)
+		mounts.valid = 0;
+	mounts.offset = 0;
+	mounts.records = 0;
+}
+
+/*
+ * Record the new count for @client and @path.  Must be called with
+ * the rmtab write lock held, after mount_sync().
+ */
+static void
+mount_log(const char *client, const char *path, int count)
+{
+	struct rmtabent re;
+
+	/* a stream opened before fork() is not ours to use */
+	if (mounts.journal && mounts.journal_pid != getpid()) {
+		fclose(mounts.journal);
+		mounts.journal = NULL;
+	}
+	if (mounts.journal == NULL) {
+		mounts.journal = fsetrmtabent(mounts.journalfn, "a");
+		mounts.journal_pid = getpid();
+		if (mounts.journal == NULL)
+			return;
+	}
+
+	strncpy(re.r_client, client, sizeof(re.r_client) - 1);
+	re.r_client[sizeof(re.r_client) - 1] = '\0';
+	strncpy(re.r_path, path, sizeof(re.r_path) - 1);
+	re.r_path[sizeof(re.r_path) - 1] = '\0';
+	re.r_count = count;
+	fputrmtabent(mounts.journal, &re, NULL);
+	if (fflush(mounts.journal) != 0) {
+		xlog(L_ERROR, "couldn't append to %s", mounts.journalfn);
+		return;
+	}
+	mounts.offset = ftell(mounts.journal);
+	mounts.records++;
+}
+
+/* Fold the journal into rmtab once it is as long as the table */
+static void
+mount_maybe_compact(void)
+{
+	if (mounts.records >= RMTAB_COMPACT_MIN &&
+	    mounts.records >= mounts.count)
+		mount_compact();
+}
+
 void
 mountlist_add(char *host, const char *path)
 {
-	struct rmtabent	xe;
-	struct rmtabent	*rep;
+	struct mount_ent **mp, *m;
 	int		lockid;
-	long		pos;
+	int		count;
 
 	if ((lockid = xflock(rmtab.lockfn, "a")) < 0)
 		return;
-	setrmtabent("r+");
-	while ((rep = getrmtabent(1, &pos)) != NULL) {
-		if (strcmp (rep->r_client,
-			    host) == 0
-		    && strcmp(rep->r_path, path) == 0) {
-			rep->r_count++;
-			/* PRC: do the HA callout: */
-			ha_callout("mount", rep->r_client, rep->r_path, rep->r_count);
-			putrmtabent(rep, &pos);
-			endrmtabent();
-			xfunlock(lockid);
-			return;
-		}
-	}
-	endrmtabent();
-	strncpy(xe.r_client, host,
-		sizeof (xe.r_client) - 1);
-	xe.r_client [sizeof (xe.r_client) - 1] = '\0';
-	strncpy(xe.r_path, path, sizeof (xe.r_path) - 1);
-	xe.r_path [sizeof (xe.r_path) - 1] = '\0';
-	xe.r_count = 1;
-	if (setrmtabent("a")) {
+	if (mount_sync() < 0)
+		goto out;
+	mp = mount_find(host, path, mount_hash(host, path));
+	count = mp ? (*mp)->count + 1 : 1;
+	m = mount_set(host, path, count);
+	if (m) {
 		/* PRC: do the HA callout: */
-		ha_callout("mount", xe.r_client, xe.r_path, xe.r_count);
-		putrmtabent(&xe, NULL);
-		endrmtabent();
+		ha_callout("mount", m->client, m->path, m->count);
+		mount_log(m->client, m->path, m->count);
+		mount_maybe_compact();
 	}
+out:
 	xfunlock(lockid);
 }
 
 void
 mountlist_del(char *hname, const char *path)
 {
-	struct rmtabent	*rep;
-	FILE		*fp;
+	struct mount_ent **mp;
 	int		lockid;
-	int		match;
+	int		count;
 
 	if ((lockid = xflock(rmtab.lockfn, "w")) < 0)
 		return;
-	if (!setrmtabent("r")) {
-		xfunlock(lockid);
-		return;
-	}
-	if (!(fp = fsetrmtabent(rmtab.tmpfn, "w"))) {
-		endrmtabent();
-		xfunlock(lockid);
-		return;
-	}
-	while ((rep = getrmtabent(1, NULL)) != NULL) {
-		match = !strcmp (rep->r_client, hname)
-			&& !strcmp(rep->r_path, path);
-		if (match) {
-			rep->r_count--;
-			/* PRC: do the HA callout: */
-			ha_callout("unmount", rep->r_client, rep->r_path, rep->r_count);
-		}
-		if (!match || rep->r_count)
-			fputrmtabent(fp, rep, NULL);
-	}
-	if (slink_safe_rename(rmtab.tmpfn, rmtab.statefn) < 0) {
-		xlog(L_ERROR, "couldn't rename %s to %s",
-				rmtab.tmpfn, rmtab.statefn);
+	if (mount_sync() < 0)
+		goto out;
+	mp = mount_find(hname, path, mount_hash(hname, path));
+	if (mp) {
+		count = (*mp)->count - 1;
+		/* PRC: do the HA callout: */
+		ha_callout("unmount", hname, (char *)path, count);
+		mount_set(hname, path, count);
+		mount_log(hname, path, count);
+		mount_maybe_compact();
 	}
-	endrmtabent();	/* close & unlink */
-	fendrmtabent(fp);
+out:
 	xfunlock(lockid);
 }
 
@@ -134,8 +417,8 @@ void
 mountlist_del_all(const struct sockaddr *sap)
 {
 	char		*hostname;
-	struct rmtabent	*rep;
-	FILE		*fp;
+	struct mount_ent *m, *next;
+	unsigned int	i;
 	int		lockid;
 
 	if ((lockid = xflock(rmtab.lockfn, "w")) < 0)
@@ -148,25 +431,19 @@ mountlist_del_all(const struct sockaddr *sap)
 		goto out_unlock;
 	}
 
-	if (!setrmtabent("r"))
+	if (mount_sync() < 0)
 		goto out_free;
 
-	if (!(fp = fsetrmtabent(rmtab.tmpfn, "w")))
-		goto out_close;
-
-	while ((rep = getrmtabent(1, NULL)) != NULL) {
-		if (strcmp(rep->r_client, hostname) == 0 &&
-		    auth_authenticate("umountall", sap, rep->r_path) != NULL)
-			continue;
-		fputrmtabent(fp, rep, NULL);
-	}
-	if (slink_safe_rename(rmtab.tmpfn, rmtab.statefn) < 0) {
-		xlog(L_ERROR, "couldn't rename %s to %s",
-				rmtab.tmpfn, rmtab.statefn);
-	}
-	fendrmtabent(fp);
-out_close:
-	endrmtabent();	/* close & unlink */
+	for (i = 0; i < mounts.size; i++)
+		for (m = mounts.buckets[i]; m; m = next) {
+			next = m->next;
+			if (strcmp(m->client, hostname) != 0 ||
+			    auth_authenticate("umountall", sap, m->path) == NULL)
+				continue;
+			mount_log(m->client, m->path, 0);
+			mount_set(m->client, m->path, 0);
+		}
+	mount_maybe_compact();
 out_free:
 	free(hostname);
 out_unlock:
@@ -185,70 +462,120 @@ mountlist_freeall(mountlist list)
 	}
 }
 
+static mountlist
+mountlist_entry(const struct mount_ent *me)
+{
+	mountlist		m;
+
+	m = calloc(1, sizeof(*m));
+	if (m == NULL)
+		return NULL;
+
+	if (reverse_resolve) {
+		struct addrinfo *ai;
+		ai = host_pton(me->client);
+		if (ai != NULL) {
+			m->ml_hostname = host_canonname(ai->ai_addr);
+			nfs_freeaddrinfo(ai);
+		}
+	}
+	if (m->ml_hostname == NULL)
+		m->ml_hostname = strdup(me->client);
+
+	m->ml_directory = strdup(me->path);
+
+	if (m->ml_hostname == NULL || m->ml_directory == NULL) {
+		free(m->ml_hostname);
+		free(m->ml_directory);
+		free(m);
+		return NULL;
+	}
+	return m;
+}
+
 mountlist
 mountlist_list(void)
 {
 	static mountlist	mlist = NULL;
-	static time_t		last_mtime = 0;
+	static unsigned int	last_generation = 0;
+	static int		have_list = 0;
 	mountlist		m;
-	struct rmtabent		*rep;
-	struct stat		stb;
+	struct mount_ent	*me;
+	unsigned int		i;
 	int			lockid;
 
 	if ((lockid = xflock(rmtab.lockfn, "r")) < 0)
 		return NULL;
-	if (stat(rmtab.statefn, &stb) < 0) {
-		xlog(L_ERROR, "can't stat %s: %s",
-				rmtab.statefn, strerror(errno));
+	if (mount_sync() < 0) {
 		xfunlock(lockid);
 		return NULL;
 	}
-	if (stb.st_mtime != last_mtime) {
+	if (!have_list || mounts.generation != last_generation) {
 		mountlist_freeall(mlist);
 		mlist = NULL;
-		last_mtime = stb.st_mtime;
-
-		setrmtabent("r");
-		while ((rep = getrmtabent(1, NULL)) != NULL) {
-			m = calloc(1, sizeof(*m));
-			if (m == NULL) {
-				mountlist_freeall(mlist);
-				mlist = NULL;
-				xlog(L_ERROR, "%s: memory allocation failed",
-						__func__);
-				break;
-			}
+		last_generation = mounts.generation;
+		have_list = 1;
 
-			if (reverse_resolve) {
-				struct addrinfo *ai;
-				ai = host_pton(rep->r_client);
-				if (ai != NULL) {
-					m->ml_hostname = host_canonname(ai->ai_addr);
-					nfs_freeaddrinfo(ai);
+		for (i = 0; i < mounts.size; i++)
+			for (me = mounts.buckets[i]; me; me = me->next) {
+				m = mountlist_entry(me);
+				if (m == NULL) {
+					mountlist_freeall(mlist);
+					mlist = NULL;
+					have_list = 0;
+					xlog(L_ERROR, "%s: memory allocation failed",
+							__func__);
+					goto out;
 				}
+				m->ml_next = mlist;
+				mlist = m;
 			}
-			if (m->ml_hostname == NULL)
-				m->ml_hostname = strdup(rep->r_client);
-
-			m->ml_directory = strdup(rep->r_path);
-
-			if (m->ml_hostname == NULL || m->ml_directory == NULL) {
-				free(m->ml_hostname);
-				free(m->ml_directory);
-				free(m);
-				mountlist_freeall(mlist);
-				mlist = NULL;
-				xlog(L_ERROR, "%s: memory allocation failed",
-						__func__);
-				break;
-			}
-
-			m->ml_next = mlist;
-			mlist = m;
-		}
-		endrmtabent();
 	}
+out:
 	xfunlock(lockid);
 
 	return mlist;
 }
+
+static int
+client_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * Addresses of the clients recorded in rmtab, each listed once, as a
+ * NULL-terminated array for cache_warm_enable().
+ */
+char **
+mountlist_clients(void)
+{
+	struct mount_ent	*m;
+	char			**list = NULL;
+	size_t			count = 0, i, j;
+	int			lockid;
+
+	if ((lockid = xflock(rmtab.lockfn, "r")) < 0)
+		return NULL;
+	if (mount_sync() < 0 || mounts.count == 0)
+		goto out;
+	list = calloc(mounts.count + 1, sizeof(*list));
+	if (list == NULL)
+		goto out;
+	for (i = 0; i < mounts.size; i++)
+		for (m = mounts.buckets[i]; m; m = m->next)
+			list[count++] = m->client;
+	qsort(list, count, sizeof(*list), client_cmp);
+	for (i = j = 0; i < count; i++) {
+		if (j && strcmp(list[j - 1], list[i]) == 0)
+			continue;
+		list[j] = strdup(list[i]);
+		if (list[j] == NULL)
+			break;
+		j++;
+	}
+	list[j] = NULL;
+out:
+	xfunlock(lockid);
+	return list;
+}
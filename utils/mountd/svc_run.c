@@ -103,7 +103,10 @@ my_svc_run(void)
 			xlog(L_ERROR, "my_svc_run() - select: %m");
 			return;
 		}
-		if (selret)
+		if (selret) {
+			cache_lock_exports();
 			svc_getreqset(&readfds);
+			cache_unlock_exports();
+		}
 	}
 }